@@ -2,49 +2,560 @@
 #include <archiver.h>
 #include <iostream>
 
+#include <QElapsedTimer>
+#include <QFile>
 #include <QTextStream>
 #include <QCommandLineParser>
 #include <QCommandLineOption>
 
 const QString CommandLineManager::inputOption = QString("input");
 const QString CommandLineManager::outputOption = QString("output");
+const QString CommandLineManager::pathOption = QString("path");
+const QString CommandLineManager::readersOption = QString("readers");
+const QString CommandLineManager::workersOption = QString("workers");
+const QString CommandLineManager::pipelineStatsOption = QString("pipeline-stats");
+const QString CommandLineManager::queueDepthOption = QString("queue-depth");
+const QString CommandLineManager::inlineThresholdOption = QString("inline-threshold");
+const QString CommandLineManager::physicalOrderOption = QString("physical-order");
+const QString CommandLineManager::readaheadOption = QString("readahead");
+const QString CommandLineManager::noDedupOption = QString("no-dedup");
+const QString CommandLineManager::rateLimitOption = QString("rate-limit");
+const QString CommandLineManager::iopsLimitOption = QString("iops-limit");
+const QString CommandLineManager::ioClassOption = QString("io-class");
+const QString CommandLineManager::niceOption = QString("nice");
+const QString CommandLineManager::durabilityOption = QString("durability");
+const QString CommandLineManager::checkpointIntervalOption = QString("checkpoint-interval");
+const QString CommandLineManager::resumeOption = QString("resume");
+const QString CommandLineManager::jobsOption = QString("jobs");
+const QString CommandLineManager::nameOption = QString("name");
+const QString CommandLineManager::typeOption = QString("type");
+const QString CommandLineManager::minSizeOption = QString("min-size");
+const QString CommandLineManager::maxSizeOption = QString("max-size");
+const QString CommandLineManager::newerOption = QString("newer");
+const QString CommandLineManager::olderOption = QString("older");
+const QString CommandLineManager::duOption = QString("du");
+const QString CommandLineManager::sortOption = QString("sort");
+const QString CommandLineManager::reverseOption = QString("reverse");
+const QString CommandLineManager::limitOption = QString("limit");
+const QString CommandLineManager::baseOption = QString("base");
+const QString CommandLineManager::signatureThresholdOption = QString("signature-threshold");
+const QString CommandLineManager::keyFileOption = QString("key-file");
+const QString CommandLineManager::cipherOption = QString("cipher");
+const QString CommandLineManager::statsOption = QString("stats");
+const QString CommandLineManager::statsJsonOption = QString("stats-json");
+const QString CommandLineManager::progressOption = QString("progress");
 
 CommandLineManager::CommandLineManager(QCoreApplication &app, QObject *parent) : QObject(parent) {
     parser.setApplicationDescription("Command line archiver provide function to pack, unpack and list archive content\n"
                                      "Examples of usage:\n"
                                      "\"pack -i sourcePath -o outputFileArchive\" to pack sourcePath to outputFileArchive\n"
+                                     "\"pack-batch -i manifest\" to pack every \"sourcePath<TAB>outputFileArchive\" line of manifest\n"
                                      "\"unpack -i inputFileArchive -o outputPath\" to unpack inputFileArchive to outputPath\n"
-                                     "\"list -i ArchiveFile\" to check list fs_tree of archive data.");
+                                     "\"unpack-batch -i manifest\" to unpack every \"inputFileArchive<TAB>outputPath[<TAB>baseArchive]\" line of manifest\n"
+                                     "\"extract -i inputFileArchive -p pathInArchive -o outputPath\" to unpack one file or directory\n"
+                                     "\"list -i ArchiveFile\" to check list fs_tree of archive data.\n"
+                                     "\"list -i ArchiveFile --name '*.log' --min-size 1048576 --sort size\" to query entries of archive.\n"
+                                     "\"verify -i ArchiveFile\" to check integrity of archive without unpacking.\n"
+                                     "\"compare -i oldArchiveFile -i newArchiveFile\" to show what changed between two archives.");
     parser.addHelpOption();
     parser.addVersionOption();
     parser.addPositionalArgument("action", "The action to be performed");
 
     parser.addOption(QCommandLineOption({"i", "input"}, "Input directory or archive (depends from action).", "PATH"));
     parser.addOption(QCommandLineOption({"o", "output"}, "Output directory or archive (depends from action).", "PATH"));
+    parser.addOption(QCommandLineOption({"p", "path"}, "Path in archive for extract, as printed by list. Glob of paths for list, * does not match /.", "PATH"));
+    parser.addOption(QCommandLineOption(readersOption, "Number of reader threads for pack.", "N"));
+    parser.addOption(QCommandLineOption(workersOption, "Number of compression (pack) or hashing (verify) threads.", "N"));
+    parser.addOption(QCommandLineOption(queueDepthOption, "Number of archive reads in flight for verify.", "N"));
+    parser.addOption(QCommandLineOption(inlineThresholdOption, "Files up to this size in bytes are stored in meta by pack, 0 disables.", "BYTES"));
+    parser.addOption(QCommandLineOption(physicalOrderOption, "Read files for pack in the order of their location on disk."));
+    parser.addOption(QCommandLineOption(readaheadOption, "Number of files ahead to prefetch during pack, 0 disables.", "N"));
+    parser.addOption(QCommandLineOption(noDedupOption, "Store identical files separately instead of sharing their content."));
+    parser.addOption(QCommandLineOption(rateLimitOption, "Limit of pack/unpack i/o in bytes per second.", "BYTES"));
+    parser.addOption(QCommandLineOption(iopsLimitOption, "Limit of pack/unpack i/o operations per second.", "N"));
+    parser.addOption(QCommandLineOption(ioClassOption, "I/O priority class of pack/unpack: best-effort or idle.", "CLASS"));
+    parser.addOption(QCommandLineOption(niceOption, "Increment of the nice value of pack/unpack threads.", "N"));
+    parser.addOption(QCommandLineOption(durabilityOption, "Make unpack/extract durable before they finish: syncfs or fsync.", "MODE"));
+    parser.addOption(QCommandLineOption(checkpointIntervalOption, "Write a pack checkpoint after every BYTES of content.", "BYTES"));
+    parser.addOption(QCommandLineOption(resumeOption, "Continue an interrupted pack from its last checkpoint."));
+    parser.addOption(QCommandLineOption(jobsOption, "Number of sources (pack-batch) or archives (unpack-batch) processed at the same time.", "N"));
+    parser.addOption(QCommandLineOption(nameOption, "Glob of entry names for list.", "GLOB"));
+    parser.addOption(QCommandLineOption(typeOption, "Type of entries for list: f (files) or d (directories).", "TYPE"));
+    parser.addOption(QCommandLineOption(minSizeOption, "Minimal size of entries for list.", "BYTES"));
+    parser.addOption(QCommandLineOption(maxSizeOption, "Maximal size of entries for list.", "BYTES"));
+    parser.addOption(QCommandLineOption(newerOption, "List entries modified at or after this time.", "EPOCH"));
+    parser.addOption(QCommandLineOption(olderOption, "List entries modified at or before this time.", "EPOCH"));
+    parser.addOption(QCommandLineOption(duOption, "Sizes of directories in list are the sums of their content."));
+    parser.addOption(QCommandLineOption(sortOption, "Sort list by path, size or mtime.", "KEY"));
+    parser.addOption(QCommandLineOption(reverseOption, "Sort list in descending order."));
+    parser.addOption(QCommandLineOption(limitOption, "Print at most N entries in list.", "N"));
+    parser.addOption(QCommandLineOption(baseOption, "Archive that pack encodes large changed files against, and unpack/extract rebuild them from.", "PATH"));
+    parser.addOption(QCommandLineOption(signatureThresholdOption, "Files from this size in bytes get a delta signature in pack, 0 disables.", "BYTES"));
+    parser.addOption(QCommandLineOption(keyFileOption, "File with the 32 byte key (raw or hex) content is encrypted with.", "PATH"));
+    parser.addOption(QCommandLineOption(cipherOption, "Cipher of encrypted pack: aes-256-gcm (default) or chacha20-poly1305.", "NAME"));
+    parser.addOption(QCommandLineOption(pipelineStatsOption, "Print utilization of pack pipeline stages."));
+    parser.addOption(QCommandLineOption(statsOption, "Print time of phases, i/o, memory and counts of the action to stderr."));
+    parser.addOption(QCommandLineOption(statsJsonOption, "Write the stats of the action as JSON to PATH, - for stdout.", "PATH"));
+    parser.addOption(QCommandLineOption(progressOption, "Print progress of pack/unpack to stderr."));
     parser.process(app);
 }
 
-void CommandLineManager::process() {
-    if (parser.positionalArguments().at(0) == QString("pack")) {
-        if (parser.isSet(inputOption) && parser.isSet(outputOption))
-            Archiver::pack(parser.value(inputOption), parser.value(outputOption));
-        else
+int CommandLineManager::process() {
+    if (parser.positionalArguments().isEmpty()) {
+        std::cerr << "Missing action." << std::endl;
+        return 1;
+    }
+
+    int result = 1;
+    try {
+        result = runAction(parser.positionalArguments().at(0));
+    } catch (Archiver::ArchiverException & e) {
+        std::cerr << e.whatQMsg().toStdString() << std::endl;
+    }
+    // a failed action reports the stats of what it did up to the error as well
+    try {
+        emitOperationStats();
+    } catch (Archiver::ArchiverException & e) {
+        std::cerr << e.whatQMsg().toStdString() << std::endl;
+        return 1;
+    }
+    return result;
+}
+
+int CommandLineManager::runAction(const QString & action) {
+    if (action == QString("pack")) {
+        if (parser.isSet(inputOption) && parser.isSet(outputOption)) {
+            Archiver::PipelineStats stats;
+            Archiver::PackOptions options = packOptions();
+            runJob([&](Archiver::JobControl & control) {
+                options.io.control = &control;
+                Archiver::pack(parser.value(inputOption), parser.value(outputOption), options, &stats, &operationStats);
+            });
+            if (parser.isSet(pipelineStatsOption))
+                printPipelineStats(stats);
+        } else {
             std::cerr << "Too few options with pack action." << std::endl;
-    } else
-        if (parser.positionalArguments().at(0) == QString("unpack")) {
-            if (parser.isSet(inputOption) && parser.isSet(outputOption))
-                Archiver::unpack(parser.value(inputOption), parser.value(outputOption));
+            return 1;
+        }
+    } else if (action == QString("pack-batch")) {
+        if (parser.isSet(inputOption) && !parser.isSet(outputOption))
+            return packBatch();
+        std::cerr << "Wrong options with pack-batch action." << std::endl;
+        return 1;
+    } else if (action == QString("unpack-batch")) {
+        if (parser.isSet(inputOption) && !parser.isSet(outputOption))
+            return unpackBatch();
+        std::cerr << "Wrong options with unpack-batch action." << std::endl;
+        return 1;
+    } else if (action == QString("unpack")) {
+        if (parser.isSet(inputOption) && parser.isSet(outputOption)) {
+            Archiver::IoOptions io = ioOptions();
+            runJob([&](Archiver::JobControl & control) {
+                io.control = &control;
+                Archiver::unpack(parser.value(inputOption), parser.value(outputOption), io, parser.value(baseOption),
+                                 &operationStats);
+            });
+        } else {
+            std::cerr << "Too few options with unpack action." << std::endl;
+            return 1;
+        }
+    } else if (action == QString("extract")) {
+        if (parser.isSet(inputOption) && parser.isSet(pathOption) && parser.isSet(outputOption))
+            Archiver::extract(parser.value(inputOption), parser.value(pathOption), parser.value(outputOption), ioOptions(),
+                              parser.value(baseOption), &operationStats);
+        else {
+            std::cerr << "Too few options with extract action." << std::endl;
+            return 1;
+        }
+    } else if (action == QString("list")) {
+        if (parser.isSet(inputOption) && !parser.isSet(outputOption)) {
+            QTextStream qTextStream(stdout);
+            if (isQuery())
+                Archiver::queryArchive(parser.value(inputOption), listQuery(), qTextStream, &operationStats);
             else
-                std::cerr << "Too few options with unpack action." << std::endl;
-        } else
-            if (parser.positionalArguments().at(0) == QString("list")) {
-                if (parser.isSet(inputOption) && !parser.isSet(outputOption)) {
-                    QTextStream qTextStream(stdout);
-                    Archiver::printArchiveFsTree(parser.value(inputOption), qTextStream);
-                } else
-                    std::cerr << "Wrong options with list action." << std::endl;
-            } else {
-                std::cerr << "Unexpected action." << std::endl;
-            }
+                Archiver::printArchiveFsTree(parser.value(inputOption), qTextStream, &operationStats);
+        } else {
+            std::cerr << "Wrong options with list action." << std::endl;
+            return 1;
+        }
+    } else if (action == QString("compare")) {
+        if (parser.values(inputOption).size() == 2 && !parser.isSet(outputOption))
+            return compare();
+        std::cerr << "Wrong options with compare action." << std::endl;
+        return 1;
+    } else if (action == QString("verify")) {
+        if (parser.isSet(inputOption) && !parser.isSet(outputOption))
+            return verify();
+        std::cerr << "Wrong options with verify action." << std::endl;
+        return 1;
+    } else {
+        std::cerr << "Unexpected action." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int CommandLineManager::verify() {
+    Archiver::VerifyOptions options;
+    if (parser.isSet(workersOption))
+        options.threads = parser.value(workersOption).toUInt();
+    if (parser.isSet(queueDepthOption))
+        options.queueDepth = parser.value(queueDepthOption).toUInt();
+    options.encryptionKey = encryptionKey();
+
+    QTextStream qTextStream(stdout);
+    Archiver::VerifyReport report;
+    try {
+        report = Archiver::verify(parser.value(inputOption), options, &operationStats);
+    } catch (Archiver::ArchiverException & e) {
+        qTextStream << "Archive is broken: " << e.whatQMsg() << "\n";
+        return 2;
+    }
+
+    const double megabyte = 1 << 20;
+    double seconds = report.wallNs / 1e9;
+    qTextStream << "Verified " << report.files << " files, " << report.blocks << " blocks, "
+                << QString::number(report.storedBytes / megabyte, 'f', 1) << " MB stored ("
+                << QString::number(report.rawBytes / megabyte, 'f', 1) << " MB raw) in "
+                << QString::number(seconds, 'f', 3) << " s, "
+                << QString::number(seconds > 0 ? report.storedBytes / megabyte / seconds : 0, 'f', 1) << " MB/s\n";
+
+    for (size_t i = 0; i < report.badEntries.size(); ++i)
+        qTextStream << "BAD " << report.badEntries[i].path << ": " << report.badEntries[i].reason << "\n";
+
+    if (!report.badEntries.empty()) {
+        qTextStream << report.badEntries.size() << " bad entries.\n";
+        return 2;
+    }
+    qTextStream << "Archive is OK.\n";
+    return 0;
+}
+
+int CommandLineManager::compare() {
+    QStringList inputs = parser.values(inputOption);
+    Archiver::CompareReport report = Archiver::compare(inputs[0], inputs[1], &operationStats);
+
+    QTextStream qTextStream(stdout);
+    for (std::size_t i = 0; i < report.differences.size(); ++i) {
+        const Archiver::Difference & difference = report.differences[i];
+        if (difference.kinds & Archiver::Difference::Added) {
+            qTextStream << "+ " << difference.path << "\n";
+            continue;
+        }
+        if (difference.kinds & Archiver::Difference::Removed) {
+            qTextStream << "- " << difference.path << "\n";
+            continue;
+        }
+        QStringList details;
+        if (difference.kinds & Archiver::Difference::TypeChanged)
+            details << "type";
+        if (difference.kinds & Archiver::Difference::Resized)
+            details << "size " + QString::number(difference.oldSize) + " -> " + QString::number(difference.newSize);
+        if (difference.kinds & Archiver::Difference::Retouched)
+            details << "mtime " + QString::number(difference.oldMtime) + " -> " + QString::number(difference.newMtime);
+        if (difference.kinds & Archiver::Difference::ContentChanged)
+            details << "content";
+        if (difference.kinds & Archiver::Difference::AttributesChanged)
+            details << "attributes";
+        qTextStream << "~ " << difference.path << ": " << details.join(", ") << "\n";
+    }
+    qTextStream << report.added << " added, " << report.removed << " removed, " << report.changed << " changed, "
+                << report.unchanged << " unchanged.\n";
+    return 0;
+}
+
+int CommandLineManager::packBatch() {
+    QFile manifest(parser.value(inputOption));
+    if (!manifest.open(QIODevice::ReadOnly))
+        throw Archiver::ArchiverException("Error with opening " + parser.value(inputOption));
+
+    std::vector<Archiver::BatchJob> jobs;
+    QStringList lines = QString::fromLocal8Bit(manifest.readAll()).split('\n');
+    for (int lineNumber = 1; lineNumber <= lines.size(); ++lineNumber) {
+        const QString & line = lines[lineNumber - 1];
+        if (line.trimmed().isEmpty() || line.startsWith('#'))
+            continue;
+        QStringList fields = line.split('\t');
+        if (fields.size() != 2 || fields[0].isEmpty() || fields[1].isEmpty())
+            throw Archiver::ArchiverException("Expected \"sourcePath<TAB>outputFileArchive\" in line "
+                                              + QString::number(lineNumber) + " of manifest");
+        jobs.push_back(Archiver::BatchJob(fields[0], fields[1]));
+    }
+
+    Archiver::BatchOptions options;
+    options.pack = packOptions();
+    if (parser.isSet(jobsOption))
+        options.concurrentJobs = parser.value(jobsOption).toUInt();
+
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<Archiver::BatchJobResult> results = Archiver::packBatch(jobs, options, &operationStats);
+    double seconds = timer.nsecsElapsed() / 1e9;
+
+    QTextStream qTextStream(stdout);
+    const double megabyte = 1 << 20;
+    std::uint64_t rawBytes = 0;
+    std::uint64_t storedBytes = 0;
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Archiver::BatchJobResult & result = results[i];
+        if (!result.error.isEmpty()) {
+            ++failed;
+            qTextStream << "FAILED " << result.job.srcPath << ": " << result.error << "\n";
+            continue;
+        }
+        double jobSeconds = result.wallNs / 1e9;
+        rawBytes += result.stats.rawBytes;
+        storedBytes += result.stats.storedBytes;
+        qTextStream << "OK " << result.job.srcPath << " -> " << result.job.dstArchivePath << ": "
+                    << QString::number(result.stats.rawBytes / megabyte, 'f', 1) << " MB ("
+                    << QString::number(result.stats.storedBytes / megabyte, 'f', 1) << " MB stored) in "
+                    << QString::number(jobSeconds, 'f', 3) << " s, "
+                    << QString::number(jobSeconds > 0 ? result.stats.rawBytes / megabyte / jobSeconds : 0, 'f', 1) << " MB/s\n";
+    }
+    qTextStream << results.size() << " jobs, " << failed << " failed, "
+                << QString::number(rawBytes / megabyte, 'f', 1) << " MB ("
+                << QString::number(storedBytes / megabyte, 'f', 1) << " MB stored) in "
+                << QString::number(seconds, 'f', 3) << " s, "
+                << QString::number(seconds > 0 ? rawBytes / megabyte / seconds : 0, 'f', 1) << " MB/s\n";
+    return failed ? 1 : 0;
+}
+
+int CommandLineManager::unpackBatch() {
+    QFile manifest(parser.value(inputOption));
+    if (!manifest.open(QIODevice::ReadOnly))
+        throw Archiver::ArchiverException("Error with opening " + parser.value(inputOption));
+
+    std::vector<Archiver::UnpackBatchJob> jobs;
+    QStringList lines = QString::fromLocal8Bit(manifest.readAll()).split('\n');
+    for (int lineNumber = 1; lineNumber <= lines.size(); ++lineNumber) {
+        const QString & line = lines[lineNumber - 1];
+        if (line.trimmed().isEmpty() || line.startsWith('#'))
+            continue;
+        QStringList fields = line.split('\t');
+        if (fields.size() < 2 || fields.size() > 3 || fields[0].isEmpty() || fields[1].isEmpty())
+            throw Archiver::ArchiverException("Expected \"inputFileArchive<TAB>outputPath[<TAB>baseArchive]\" in line "
+                                              + QString::number(lineNumber) + " of manifest");
+        jobs.push_back(Archiver::UnpackBatchJob(fields[0], fields[1], fields.size() == 3 ? fields[2] : QString()));
+    }
+
+    Archiver::UnpackBatchOptions options;
+    options.io = ioOptions();
+    if (parser.isSet(jobsOption))
+        options.concurrentJobs = parser.value(jobsOption).toUInt();
+
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<Archiver::UnpackBatchJobResult> results = Archiver::unpackBatch(jobs, options, &operationStats);
+    double seconds = timer.nsecsElapsed() / 1e9;
+
+    QTextStream qTextStream(stdout);
+    const double megabyte = 1 << 20;
+    std::uint64_t rawBytes = 0;
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Archiver::UnpackBatchJobResult & result = results[i];
+        if (!result.error.isEmpty()) {
+            ++failed;
+            qTextStream << "FAILED " << result.job.srcArchivePath << ": " << result.error << "\n";
+            continue;
+        }
+        double jobSeconds = result.wallNs / 1e9;
+        rawBytes += result.stats.rawBytes;
+        qTextStream << "OK " << result.job.srcArchivePath << " -> " << result.job.dstPath << ": "
+                    << QString::number(result.stats.rawBytes / megabyte, 'f', 1) << " MB in "
+                    << QString::number(jobSeconds, 'f', 3) << " s, "
+                    << QString::number(jobSeconds > 0 ? result.stats.rawBytes / megabyte / jobSeconds : 0, 'f', 1)
+                    << " MB/s, ready after " << QString::number(result.finishedNs / 1e9, 'f', 3) << " s\n";
+    }
+    qTextStream << results.size() << " jobs, " << failed << " failed, "
+                << QString::number(rawBytes / megabyte, 'f', 1) << " MB in "
+                << QString::number(seconds, 'f', 3) << " s, "
+                << QString::number(seconds > 0 ? rawBytes / megabyte / seconds : 0, 'f', 1) << " MB/s\n";
+    return failed ? 1 : 0;
+}
+
+bool CommandLineManager::isQuery() {
+    const QString* queryOptions[] = {&pathOption, &nameOption, &typeOption, &minSizeOption, &maxSizeOption,
+                                     &newerOption, &olderOption, &duOption, &sortOption, &reverseOption, &limitOption};
+    for (std::size_t i = 0; i < sizeof(queryOptions) / sizeof(queryOptions[0]); ++i) {
+        if (parser.isSet(*queryOptions[i]))
+            return true;
+    }
+    return false;
+}
+
+Archiver::ListQuery CommandLineManager::listQuery() {
+    Archiver::ListQuery query;
+    query.pathGlob = parser.value(pathOption);
+    query.nameGlob = parser.value(nameOption);
+    if (parser.isSet(typeOption)) {
+        QString type = parser.value(typeOption);
+        if (type == QString("f"))
+            query.type = Archiver::ListQuery::FilesOnly;
+        else if (type == QString("d"))
+            query.type = Archiver::ListQuery::DirsOnly;
+        else
+            throw Archiver::ArchiverException("Unknown entry type: " + type);
+    }
+    if (parser.isSet(minSizeOption))
+        query.minSize = parser.value(minSizeOption).toULongLong();
+    if (parser.isSet(maxSizeOption))
+        query.maxSize = parser.value(maxSizeOption).toULongLong();
+    if (parser.isSet(newerOption))
+        query.minMtime = parser.value(newerOption).toULongLong();
+    if (parser.isSet(olderOption))
+        query.maxMtime = parser.value(olderOption).toULongLong();
+    if (parser.isSet(duOption))
+        query.du = true;
+    if (parser.isSet(sortOption)) {
+        QString key = parser.value(sortOption);
+        if (key == QString("path"))
+            query.sortKey = Archiver::ListQuery::SortPath;
+        else if (key == QString("size"))
+            query.sortKey = Archiver::ListQuery::SortSize;
+        else if (key == QString("mtime"))
+            query.sortKey = Archiver::ListQuery::SortMtime;
+        else
+            throw Archiver::ArchiverException("Unknown sort key: " + key);
+    }
+    if (parser.isSet(reverseOption))
+        query.descending = true;
+    if (parser.isSet(limitOption))
+        query.limit = parser.value(limitOption).toULongLong();
+    return query;
+}
+
+Archiver::PackOptions CommandLineManager::packOptions() {
+    Archiver::PackOptions options;
+    if (parser.isSet(readersOption))
+        options.readerThreads = parser.value(readersOption).toUInt();
+    if (parser.isSet(workersOption))
+        options.workerThreads = parser.value(workersOption).toUInt();
+    if (parser.isSet(inlineThresholdOption))
+        options.inlineThreshold = parser.value(inlineThresholdOption).toULongLong();
+    if (parser.isSet(physicalOrderOption))
+        options.physicalOrder = true;
+    if (parser.isSet(readaheadOption))
+        options.readaheadFiles = parser.value(readaheadOption).toUInt();
+    if (parser.isSet(noDedupOption))
+        options.dedup = false;
+    if (parser.isSet(checkpointIntervalOption))
+        options.checkpointInterval = parser.value(checkpointIntervalOption).toULongLong();
+    if (parser.isSet(resumeOption))
+        options.resume = true;
+    if (parser.isSet(signatureThresholdOption))
+        options.signatureThreshold = parser.value(signatureThresholdOption).toULongLong();
+    if (parser.isSet(baseOption))
+        options.baseArchivePath = parser.value(baseOption);
+    options.io = ioOptions();
+    if (!options.io.encryptionKey.isEmpty()) {
+        QString cipher = parser.isSet(cipherOption) ? parser.value(cipherOption) : QString("aes-256-gcm");
+        if (cipher == QString("aes-256-gcm"))
+            options.cipher = Archiver::CipherAes256Gcm;
+        else if (cipher == QString("chacha20-poly1305"))
+            options.cipher = Archiver::CipherChaCha20Poly1305;
+        else
+            throw Archiver::ArchiverException("Unknown cipher: " + cipher);
+    } else if (parser.isSet(cipherOption)) {
+        throw Archiver::ArchiverException("Cipher needs a key file");
+    }
+    return options;
 }
 
+Archiver::IoOptions CommandLineManager::ioOptions() {
+    Archiver::IoOptions io;
+    if (parser.isSet(rateLimitOption) || parser.isSet(iopsLimitOption)) {
+        ioLimiter.setLimits(parser.value(rateLimitOption).toULongLong(), parser.value(iopsLimitOption).toULongLong());
+        io.limiter = &ioLimiter;
+    }
+    if (parser.isSet(ioClassOption)) {
+        QString ioClass = parser.value(ioClassOption);
+        if (ioClass == QString("best-effort"))
+            io.priorityClass = Archiver::IoPriorityBestEffort;
+        else if (ioClass == QString("idle"))
+            io.priorityClass = Archiver::IoPriorityIdle;
+        else
+            throw Archiver::ArchiverException("Unknown i/o class: " + ioClass);
+    }
+    if (parser.isSet(niceOption))
+        io.niceIncrement = parser.value(niceOption).toInt();
+    if (parser.isSet(durabilityOption)) {
+        QString durability = parser.value(durabilityOption);
+        if (durability == QString("syncfs"))
+            io.durability = Archiver::DurabilitySyncFs;
+        else if (durability == QString("fsync"))
+            io.durability = Archiver::DurabilitySyncFiles;
+        else if (durability != QString("none"))
+            throw Archiver::ArchiverException("Unknown durability: " + durability);
+    }
+    io.encryptionKey = encryptionKey();
+    return io;
+}
+
+QByteArray CommandLineManager::encryptionKey() {
+    if (!parser.isSet(keyFileOption))
+        return QByteArray();
+    QFile keyFile(parser.value(keyFileOption));
+    if (!keyFile.open(QIODevice::ReadOnly))
+        throw Archiver::ArchiverException("Error with opening " + parser.value(keyFileOption));
+    const int keySize = 32;
+    QByteArray key = keyFile.readAll();
+    if (key.size() != keySize)
+        key = QByteArray::fromHex(key.trimmed());
+    if (key.size() != keySize)
+        throw Archiver::ArchiverException("Key file must hold 32 bytes or 64 hex digits: " + parser.value(keyFileOption));
+    return key;
+}
+
+// Runs work on a job that reports progress with --progress, in the calling thread otherwise.
+void CommandLineManager::runJob(const std::function<void(Archiver::JobControl &)> & work) {
+    if (!parser.isSet(progressOption)) {
+        Archiver::JobControl control;
+        work(control);
+        return;
+    }
+    Archiver::Job job(work, printProgress, 500);
+    job.wait();
+}
+
+void CommandLineManager::printProgress(const Archiver::Progress & progress) {
+    const double megabyte = 1 << 20;
+    std::cerr << "\r" << progress.entriesDone << "/" << progress.entriesTotal << " files, "
+              << QString::number(progress.bytesDone / megabyte, 'f', 1).toStdString() << "/"
+              << QString::number(progress.bytesTotal / megabyte, 'f', 1).toStdString() << " MB, "
+              << QString::number(progress.bytesPerSecond / megabyte, 'f', 1).toStdString() << " MB/s, eta "
+              << progress.etaNs / 1000000000 << " s   ";
+    if (progress.state != Archiver::Progress::Running)
+        std::cerr << std::endl;
+}
+
+// Stats of an action that ran, after its own output or error.
+void CommandLineManager::emitOperationStats() {
+    if (operationStats.operation.isEmpty())
+        return;
+    if (parser.isSet(statsOption))
+        std::cerr << operationStats.toText().toStdString();
+    if (parser.isSet(statsJsonOption)) {
+        QString path = parser.value(statsJsonOption);
+        if (path == QString("-")) {
+            QTextStream(stdout) << operationStats.toJson() << "\n";
+            return;
+        }
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+                || file.write((operationStats.toJson() + "\n").toUtf8()) == -1)
+            throw Archiver::ArchiverException("Error with writing stats to " + path);
+    }
+}
+
+void CommandLineManager::printPipelineStats(const Archiver::PipelineStats & stats) {
+    QTextStream qTextStream(stdout);
+    qTextStream << "pipeline wall time: " << stats.wallNs / 1000000 << " ms\n";
+    const Archiver::PipelineStageStats* stages[] = {&stats.reader, &stats.worker, &stats.writer};
+    const char* names[] = {"read", "hash/compress", "write"};
+    for (int i = 0; i < 3; ++i) {
+        qTextStream << names[i] << ": " << stages[i]->threads << " threads, utilization "
+                    << QString::number(stages[i]->utilization(stats.wallNs) * 100, 'f', 1) << "%\n";
+    }
+}
@@ -6,21 +6,74 @@
 #include <QObject>
 #include <QString>
 
+#include <archiver.h>
+
 class CommandLineManager : public QObject
 {
     Q_OBJECT
 public:
     explicit CommandLineManager(QCoreApplication &app, QObject *parent = 0);
-    void process();
+    int process();
 
 signals:
 
 public slots:
 
 private:
+    int runAction(const QString & action);
+    int verify();
+    int packBatch();
+    int unpackBatch();
+    int compare();
+    bool isQuery();
+    Archiver::ListQuery listQuery();
+    Archiver::PackOptions packOptions();
+    Archiver::IoOptions ioOptions();
+    QByteArray encryptionKey();
+    void printPipelineStats(const Archiver::PipelineStats & stats);
+    void emitOperationStats();
+    void runJob(const std::function<void(Archiver::JobControl &)> & work);
+    static void printProgress(const Archiver::Progress & progress);
+
     QCommandLineParser parser;
+    Archiver::IoLimiter ioLimiter;
+    Archiver::OperationStats operationStats;
     static const QString inputOption;
     static const QString outputOption;
+    static const QString pathOption;
+    static const QString readersOption;
+    static const QString workersOption;
+    static const QString pipelineStatsOption;
+    static const QString queueDepthOption;
+    static const QString inlineThresholdOption;
+    static const QString physicalOrderOption;
+    static const QString readaheadOption;
+    static const QString noDedupOption;
+    static const QString rateLimitOption;
+    static const QString iopsLimitOption;
+    static const QString ioClassOption;
+    static const QString niceOption;
+    static const QString durabilityOption;
+    static const QString checkpointIntervalOption;
+    static const QString resumeOption;
+    static const QString jobsOption;
+    static const QString nameOption;
+    static const QString typeOption;
+    static const QString minSizeOption;
+    static const QString maxSizeOption;
+    static const QString newerOption;
+    static const QString olderOption;
+    static const QString duOption;
+    static const QString sortOption;
+    static const QString reverseOption;
+    static const QString limitOption;
+    static const QString baseOption;
+    static const QString signatureThresholdOption;
+    static const QString keyFileOption;
+    static const QString cipherOption;
+    static const QString statsOption;
+    static const QString statsJsonOption;
+    static const QString progressOption;
 
 };
 
@@ -11,9 +11,9 @@ int main(int argc, char *argv[]) {
     QCoreApplication::setApplicationVersion("1.0");
 
     CommandLineManager commandLineManager(app, &app);
-    commandLineManager.process();
+    int result = commandLineManager.process();
 
     google::protobuf::ShutdownProtobufLibrary();
 
-    return 0;
+    return result;
 }
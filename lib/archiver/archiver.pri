@@ -4,16 +4,56 @@ system($$PWD/gen.sh)
     error( "Couldn't find the fs_tree.pri file!" )
 }
 
-LIBS += -L/usr/local/lib -lprotobuf
+LIBS += -L/usr/local/lib -lprotobuf -llz4 -lzstd -lcrypto
 
 SOURCES += $$PWD/src/archiver.cpp \
+           $$PWD/src/archiver_job.cpp \
+           $$PWD/src/archive_compare.cpp \
+           $$PWD/src/archive_index.cpp \
+           $$PWD/src/archive_query.cpp \
+           $$PWD/src/archive_verifier.cpp \
+           $$PWD/src/checksum.cpp \
+           $$PWD/src/content_cipher.cpp \
+           $$PWD/src/content_codec.cpp \
+           $$PWD/src/content_dedup.cpp \
+           $$PWD/src/content_delta.cpp \
+           $$PWD/src/io_control.cpp \
+           $$PWD/src/meta_codec.cpp \
+           $$PWD/src/pack_batch.cpp \
+           $$PWD/src/pack_checkpoint.cpp \
+           $$PWD/src/pack_delta.cpp \
+           $$PWD/src/pack_pipeline.cpp \
+           $$PWD/src/physical_order.cpp \
+           $$PWD/src/restore_sync.cpp \
+           $$PWD/src/stats_recorder.cpp \
+           $$PWD/src/thread_shares.cpp \
+           $$PWD/src/unpack_batch.cpp \
            $$PWD/gen/struct_serialization.pb.cc
 
 HEADERS += $$PWD/src/archiver.h \
            $$PWD/gen/struct_serialization.pb.h \
+           $$PWD/src/meta_codec.h \
            $$PWD/src/meta_pack.h \
            $$PWD/src/archiver_utils.h \
-           $$PWD/src/archiver_structs.h
+           $$PWD/src/archiver_structs.h \
+           $$PWD/src/archive_compare.h \
+           $$PWD/src/archive_index.h \
+           $$PWD/src/archive_query.h \
+           $$PWD/src/archive_verifier.h \
+           $$PWD/src/checksum.h \
+           $$PWD/src/content_cipher.h \
+           $$PWD/src/content_codec.h \
+           $$PWD/src/content_dedup.h \
+           $$PWD/src/content_delta.h \
+           $$PWD/src/io_control.h \
+           $$PWD/src/bounded_queue.h \
+           $$PWD/src/pack_checkpoint.h \
+           $$PWD/src/pack_delta.h \
+           $$PWD/src/pack_pipeline.h \
+           $$PWD/src/physical_order.h \
+           $$PWD/src/restore_sync.h \
+           $$PWD/src/stats_recorder.h \
+           $$PWD/src/thread_shares.h
 
 INCLUDEPATH += $$PWD/gen \
                $$PWD/src
@@ -0,0 +1,625 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QTextStream>
+#include <QDebug>
+#include <archiver.h>
+
+#include "struct_serialization.pb.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+// Benchmark of pack, unpack, list (printArchiveFsTree) and getArchiveWithoutContent on generated datasets.
+// Datasets are generated from fixed seeds, so every build is measured on the same bytes and names.
+// Throughput of every operation is the content (MB/s) and files (files/s) of the whole dataset per second
+// of the median repetition. Results go to a JSON file with one result per line, which --baseline reads back.
+
+namespace {
+    // bumped whenever a generator changes, so datasets left by an older harness are made again
+    const int datasetVersion = 1;
+    const time_t datasetMtime = 1500000000;
+    const std::uint64_t megabyte = 1 << 20;
+
+    // splitmix64, the same sequence on every platform unlike the distributions of <random>
+    class Generator {
+    public:
+        explicit Generator(std::uint64_t seed) : state(seed) {}
+        std::uint64_t next() {
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+        std::uint64_t below(std::uint64_t bound) { return bound ? next() % bound : 0; }
+    private:
+        std::uint64_t state;
+    };
+
+    enum ContentKind {
+        TextContent,
+        RandomContent,
+        // alternating megabytes of text and random bytes, like disk images and databases
+        MixedContent
+    };
+
+    // text that compresses like source code: identifiers, punctuation and indentation
+    void fillText(Generator & generator, char* data, std::uint64_t size) {
+        static const char* words[] = {"int", "return", "const", "std::uint64_t", "if", "else", "for", "while",
+                                      "archive", "content", "block", "size", "offset", "path", "meta", "index",
+                                      "(", ")", "{", "}", ";", "=", "+", "->", "::", ",", "0", "1", "NULL",
+                                      "\n", "\n    ", "\n        "};
+        const std::uint64_t wordCount = sizeof(words) / sizeof(words[0]);
+        std::uint64_t position = 0;
+        while (position < size) {
+            const char* word = words[generator.below(wordCount)];
+            std::uint64_t length = std::min<std::uint64_t>(strlen(word), size - position);
+            memcpy(data + position, word, length);
+            position += length;
+            if (position < size)
+                data[position++] = ' ';
+        }
+    }
+
+    void fillRandom(Generator & generator, char* data, std::uint64_t size) {
+        for (std::uint64_t position = 0; position < size; position += sizeof(std::uint64_t)) {
+            std::uint64_t value = generator.next();
+            memcpy(data + position, &value, std::min<std::uint64_t>(sizeof(value), size - position));
+        }
+    }
+
+    void fail(const std::string & message) {
+        throw Archiver::ArchiverException(QString::fromStdString(message + ": " + strerror(errno)));
+    }
+
+    struct DatasetInfo {
+        std::uint64_t files;
+        std::uint64_t bytes;
+        DatasetInfo() : files(0), bytes(0) {}
+    };
+
+    class DatasetWriter {
+    public:
+        DatasetWriter(const std::string & root, std::uint64_t seed)
+            :root(root), generator(seed), buffer(megabyte) {
+            makeDir("");
+        }
+
+        Generator & random() { return generator; }
+        const DatasetInfo & info() const { return datasetInfo; }
+
+        void makeDir(const std::string & path) {
+            std::string fullPath = root + "/" + path;
+            if (mkdir(fullPath.c_str(), 0755) == -1 && errno != EEXIST)
+                fail("Cannot create " + fullPath);
+        }
+
+        void writeFile(const std::string & path, std::uint64_t size, ContentKind kind) {
+            int fd = openFile(path);
+            for (std::uint64_t offset = 0; offset < size; offset += megabyte) {
+                std::uint64_t chunk = std::min(megabyte, size - offset);
+                bool text = kind == TextContent || (kind == MixedContent && (offset / megabyte) % 2 == 0);
+                if (text)
+                    fillText(generator, buffer.data(), chunk);
+                else
+                    fillRandom(generator, buffer.data(), chunk);
+                writeAt(fd, offset, chunk, path);
+            }
+            closeFile(fd, path, size);
+        }
+
+        // dataSize bytes of random content at every dataStride bytes, holes in between
+        void writeSparseFile(const std::string & path, std::uint64_t size, std::uint64_t dataStride, std::uint64_t dataSize) {
+            int fd = openFile(path);
+            if (ftruncate(fd, size) == -1)
+                fail("Cannot resize " + path);
+            for (std::uint64_t offset = 0; offset < size; offset += dataStride) {
+                for (std::uint64_t done = 0; done < dataSize && offset + done < size; done += megabyte) {
+                    std::uint64_t chunk = std::min(std::min(megabyte, dataSize - done), size - offset - done);
+                    fillRandom(generator, buffer.data(), chunk);
+                    writeAt(fd, offset + done, chunk, path);
+                }
+            }
+            closeFile(fd, path, size);
+        }
+
+    private:
+        int openFile(const std::string & path) {
+            std::string fullPath = root + "/" + path;
+            int fd = open(fullPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+                fail("Cannot create " + fullPath);
+            return fd;
+        }
+
+        void writeAt(int fd, std::uint64_t offset, std::uint64_t size, const std::string & path) {
+            if (pwrite(fd, buffer.data(), size, offset) != (ssize_t)size)
+                fail("Cannot write " + path);
+        }
+
+        void closeFile(int fd, const std::string & path, std::uint64_t size) {
+            if (close(fd) == -1)
+                fail("Cannot write " + path);
+            ++datasetInfo.files;
+            datasetInfo.bytes += size;
+        }
+
+        std::string root;
+        Generator generator;
+        std::vector<char> buffer;
+        DatasetInfo datasetInfo;
+    };
+
+    std::uint64_t scaled(std::uint64_t value, double scale) {
+        return std::max<std::uint64_t>(1, (std::uint64_t)(value * scale));
+    }
+
+    // many tiny files in a flat layout, the meta and per-file costs dominate
+    void generateTiny(DatasetWriter & writer, double scale) {
+        const std::uint64_t dirs = 200;
+        std::uint64_t files = scaled(20000, scale);
+        for (std::uint64_t i = 0; i < dirs; ++i)
+            writer.makeDir("d" + std::to_string(i));
+        for (std::uint64_t i = 0; i < files; ++i) {
+            std::uint64_t size = writer.random().below(513);
+            writer.writeFile("d" + std::to_string(i % dirs) + "/f" + std::to_string(i), size,
+                             i % 4 == 0 ? RandomContent : TextContent);
+        }
+    }
+
+    // source tree: modules of nested packages with text files of 256 bytes to 64 kB and a few binary assets
+    void generateSource(DatasetWriter & writer, double scale) {
+        std::uint64_t modules = scaled(20, scale);
+        for (std::uint64_t module = 0; module < modules; ++module) {
+            std::string modulePath = "module" + std::to_string(module);
+            writer.makeDir(modulePath);
+            writer.makeDir(modulePath + "/assets");
+            for (int asset = 0; asset < 2; ++asset)
+                writer.writeFile(modulePath + "/assets/asset" + std::to_string(asset) + ".bin",
+                                 (256 << 10) + writer.random().below(768 << 10), RandomContent);
+            for (int package = 0; package < 10; ++package) {
+                std::string packagePath = modulePath + "/pkg" + std::to_string(package);
+                writer.makeDir(packagePath);
+                writer.makeDir(packagePath + "/impl");
+                for (int file = 0; file < 15; ++file) {
+                    std::string dir = file % 3 == 0 ? packagePath + "/impl" : packagePath;
+                    std::uint64_t size = (256ULL << writer.random().below(9)) + writer.random().below(256);
+                    writer.writeFile(dir + "/file" + std::to_string(file) + (file % 2 ? ".cpp" : ".h"), size, TextContent);
+                }
+            }
+        }
+    }
+
+    // few huge files, the content pipeline and i/o dominate
+    void generateHuge(DatasetWriter & writer, double scale) {
+        writer.writeFile("disk.img", scaled(256, scale) * megabyte, MixedContent);
+        writer.writeFile("video.bin", scaled(256, scale) * megabyte, RandomContent);
+    }
+
+    // large files that are mostly holes, read back as zeros
+    void generateSparse(DatasetWriter & writer, double scale) {
+        for (int i = 0; i < 4; ++i)
+            writer.writeSparseFile("sparse" + std::to_string(i) + ".img", scaled(256, scale) * megabyte, 32 * megabyte, megabyte);
+    }
+
+    // one long chain of directories with a few files and a side directory on every level
+    void generateDeep(DatasetWriter & writer, double scale) {
+        std::uint64_t depth = std::min<std::uint64_t>(scaled(256, scale), 1000);
+        std::string path;
+        for (std::uint64_t level = 0; level < depth; ++level) {
+            path += (level ? "/d" : "d");
+            writer.makeDir(path);
+            writer.makeDir(path + "/side");
+            for (int file = 0; file < 2; ++file)
+                writer.writeFile(path + "/f" + std::to_string(file), 1024 + writer.random().below(3072), TextContent);
+            writer.writeFile(path + "/side/s", 512 + writer.random().below(512), TextContent);
+        }
+    }
+
+    struct Profile {
+        const char* name;
+        std::uint64_t seed;
+        void (*generate)(DatasetWriter &, double);
+    };
+
+    const Profile profiles[] = {
+        {"tiny", 1, generateTiny},
+        {"source", 2, generateSource},
+        {"huge", 3, generateHuge},
+        {"sparse", 4, generateSparse},
+        {"deep", 5, generateDeep}
+    };
+
+    int setDatasetMtime(const char* path, const struct stat*, int, struct FTW*) {
+        timeval times[2];
+        times[0].tv_sec = times[1].tv_sec = datasetMtime;
+        times[0].tv_usec = times[1].tv_usec = 0;
+        utimes(path, times);
+        return 0;
+    }
+
+    int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+        remove(path);
+        return 0;
+    }
+
+    void removeTree(const std::string & path) {
+        nftw(path.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // A dataset is made once per version and scale, later runs reuse it.
+    DatasetInfo prepareDataset(const Profile & profile, const std::string & datasetsDir, double scale) {
+        std::string root = datasetsDir + "/" + profile.name;
+        std::string marker = datasetsDir + "/" + profile.name + ".done";
+        std::string expected = std::to_string(datasetVersion) + " " + std::to_string(scale);
+        DatasetInfo info;
+
+        FILE* markerFile = fopen(marker.c_str(), "r");
+        if (markerFile) {
+            char version[128] = {0};
+            unsigned long long files = 0;
+            unsigned long long bytes = 0;
+            bool matches = fgets(version, sizeof(version), markerFile) && std::string(version) == expected + "\n"
+                    && fscanf(markerFile, "%llu %llu", &files, &bytes) == 2;
+            fclose(markerFile);
+            if (matches) {
+                info.files = files;
+                info.bytes = bytes;
+                return info;
+            }
+        }
+
+        std::cout << "generating " << profile.name << " dataset..." << std::endl;
+        removeTree(root);
+        DatasetWriter writer(root, profile.seed);
+        profile.generate(writer, scale);
+        nftw(root.c_str(), setDatasetMtime, 64, FTW_DEPTH | FTW_PHYS);
+        info = writer.info();
+
+        markerFile = fopen(marker.c_str(), "w");
+        if (markerFile == NULL)
+            fail("Cannot create " + marker);
+        fprintf(markerFile, "%s\n%llu %llu\n", expected.c_str(), (unsigned long long)info.files, (unsigned long long)info.bytes);
+        fclose(markerFile);
+        return info;
+    }
+
+    // nftw callbacks take no user data
+    std::uint64_t residentPages = 0;
+    std::uint64_t totalPages = 0;
+
+    int countResidentPages(const char* path, const struct stat* status, int type, struct FTW*) {
+        if (type != FTW_F || status->st_size == 0)
+            return 0;
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return 0;
+        void* mapping = mmap(NULL, status->st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return 0;
+        std::uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        std::uint64_t pages = (status->st_size + pageSize - 1) / pageSize;
+        std::vector<unsigned char> residency(pages);
+        if (mincore(mapping, status->st_size, residency.data()) == 0) {
+            for (std::uint64_t i = 0; i < pages; ++i)
+                residentPages += residency[i] & 1;
+            totalPages += pages;
+        }
+        munmap(mapping, status->st_size);
+        return 0;
+    }
+
+    // Part of the pages of the files under path that are in the page cache.
+    double cachedFraction(const std::string & path) {
+        residentPages = 0;
+        totalPages = 0;
+        nftw(path.c_str(), countResidentPages, 64, FTW_PHYS);
+        return totalPages ? (double)residentPages / totalPages : 1.0;
+    }
+
+    int dropFileFromCache(const char* path, const struct stat*, int type, struct FTW*) {
+        if (type != FTW_F)
+            return 0;
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return 0;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        return 0;
+    }
+
+    // Evicts the files under path without root rights: dirty pages are written back first,
+    // clean ones are dropped by fadvise. Directory and inode caches stay warm.
+    void dropFromCache(const std::string & path) {
+        sync();
+        nftw(path.c_str(), dropFileFromCache, 64, FTW_PHYS);
+    }
+
+    // Resets the peak RSS of the process (Linux 4.0+), so VmHWM covers one operation only.
+    bool resetPeakRss() {
+        int fd = open("/proc/self/clear_refs", O_WRONLY);
+        if (fd == -1)
+            return false;
+        bool reset = write(fd, "5", 1) == 1;
+        close(fd);
+        return reset;
+    }
+
+    struct BenchOptions {
+        unsigned warmup;
+        unsigned repetitions;
+        bool cold;
+        BenchOptions() : warmup(1), repetitions(3), cold(false) {}
+    };
+
+    struct Result {
+        std::string profile;
+        std::string operation;
+        DatasetInfo dataset;
+        std::uint64_t minNs;
+        std::uint64_t medianNs;
+        std::uint64_t maxNs;
+        std::uint64_t medianCpuNs;
+        std::uint64_t peakRssBytes;
+        std::uint64_t storageReadBytes;
+        std::uint64_t storageWriteBytes;
+        std::uint64_t majorFaults;
+        double inputCached;
+
+        double seconds() const { return medianNs / 1e9; }
+        double mbPerSecond() const { return medianNs ? dataset.bytes / (double)megabyte / seconds() : 0; }
+        double filesPerSecond() const { return medianNs ? dataset.files / seconds() : 0; }
+
+        QJsonObject toJson() const {
+            QJsonObject json;
+            json.insert("profile", QString::fromStdString(profile));
+            json.insert("operation", QString::fromStdString(operation));
+            json.insert("files", qint64(dataset.files));
+            json.insert("bytes", qint64(dataset.bytes));
+            json.insert("minNs", qint64(minNs));
+            json.insert("medianNs", qint64(medianNs));
+            json.insert("maxNs", qint64(maxNs));
+            json.insert("medianCpuNs", qint64(medianCpuNs));
+            json.insert("mbPerSecond", std::round(mbPerSecond() * 10) / 10);
+            json.insert("filesPerSecond", std::round(filesPerSecond() * 10) / 10);
+            json.insert("peakRssBytes", qint64(peakRssBytes));
+            json.insert("storageReadBytes", qint64(storageReadBytes));
+            json.insert("storageWriteBytes", qint64(storageWriteBytes));
+            json.insert("majorFaults", qint64(majorFaults));
+            json.insert("inputCached", std::round(inputCached * 1000) / 1000);
+            return json;
+        }
+    };
+
+    std::uint64_t median(std::vector<std::uint64_t> values) {
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    // Runs operation warmup + repetitions times, prepare runs before each of them outside of the measurement.
+    Result measure(const std::string & profile, const std::string & operation, const DatasetInfo & dataset,
+                   const std::string & input, const BenchOptions & options,
+                   const std::function<void()> & prepare,
+                   const std::function<void(Archiver::OperationStats *)> & run) {
+        Result result;
+        result.profile = profile;
+        result.operation = operation;
+        result.dataset = dataset;
+        result.peakRssBytes = 0;
+        result.inputCached = 0;
+
+        std::vector<std::uint64_t> wallNs;
+        std::vector<std::uint64_t> cpuNs;
+        std::vector<std::uint64_t> storageReadBytes;
+        std::vector<std::uint64_t> storageWriteBytes;
+        std::vector<std::uint64_t> majorFaults;
+        for (unsigned repetition = 0; repetition < options.warmup + options.repetitions; ++repetition) {
+            prepare();
+            if (options.cold)
+                dropFromCache(input);
+            double cached = cachedFraction(input);
+            resetPeakRss();
+
+            Archiver::OperationStats stats;
+            run(&stats);
+            if (repetition < options.warmup)
+                continue;
+            wallNs.push_back(stats.wallNs);
+            cpuNs.push_back(stats.cpuNs);
+            storageReadBytes.push_back(stats.storageReadBytes);
+            storageWriteBytes.push_back(stats.storageWriteBytes);
+            majorFaults.push_back(stats.majorFaults);
+            result.peakRssBytes = std::max(result.peakRssBytes, stats.peakRssBytes);
+            result.inputCached += cached / options.repetitions;
+        }
+
+        result.minNs = *std::min_element(wallNs.begin(), wallNs.end());
+        result.maxNs = *std::max_element(wallNs.begin(), wallNs.end());
+        result.medianNs = median(wallNs);
+        result.medianCpuNs = median(cpuNs);
+        result.storageReadBytes = median(storageReadBytes);
+        result.storageWriteBytes = median(storageWriteBytes);
+        result.majorFaults = median(majorFaults);
+
+        printf("%-8s %-16s %10.3f ms %10.1f MB/s %12.0f files/s %8llu MB rss %5.0f%% cached\n",
+               profile.c_str(), operation.c_str(), result.medianNs / 1e6, result.mbPerSecond(), result.filesPerSecond(),
+               (unsigned long long)(result.peakRssBytes / megabyte), result.inputCached * 100);
+        fflush(stdout);
+        return result;
+    }
+
+    void benchProfile(const Profile & profile, const std::string & workDir, double scale, const BenchOptions & options,
+                      std::vector<Result> & results) {
+        DatasetInfo dataset = prepareDataset(profile, workDir + "/datasets", scale);
+        QString datasetPath = QString::fromStdString(workDir + "/datasets/" + profile.name);
+        std::string archive = workDir + "/" + profile.name + ".pck";
+        QString archivePath = QString::fromStdString(archive);
+        std::string unpacked = workDir + "/unpacked";
+        QString unpackedPath = QString::fromStdString(unpacked + "/");
+
+        results.push_back(measure(profile.name, "pack", dataset, datasetPath.toStdString(), options,
+                                  [&]() { remove(archive.c_str()); },
+                                  [&](Archiver::OperationStats * stats) {
+            Archiver::pack(datasetPath, archivePath, Archiver::PackOptions(), NULL, stats);
+        }));
+
+        results.push_back(measure(profile.name, "unpack", dataset, archive, options,
+                                  [&]() {
+            removeTree(unpacked);
+            if (mkdir(unpacked.c_str(), 0755) == -1)
+                fail("Cannot create " + unpacked);
+        },
+                                  [&](Archiver::OperationStats * stats) {
+            Archiver::unpack(archivePath, unpackedPath, Archiver::IoOptions(), QString(), stats);
+        }));
+        removeTree(unpacked);
+
+        QFile devNull("/dev/null");
+        if (!devNull.open(QIODevice::WriteOnly))
+            fail("Cannot open /dev/null");
+        results.push_back(measure(profile.name, "list", dataset, archive, options, []() {},
+                                  [&](Archiver::OperationStats * stats) {
+            QTextStream qTextStream(&devNull);
+            Archiver::printArchiveFsTree(archivePath, qTextStream, stats);
+        }));
+
+        results.push_back(measure(profile.name, "without-content", dataset, archive, options, []() {},
+                                  [&](Archiver::OperationStats * stats) {
+            Archiver::getArchiveWithoutContent(archivePath, stats);
+        }));
+        remove(archive.c_str());
+    }
+
+    void writeResults(const QString & path, const std::vector<Result> & results, double scale,
+                      const BenchOptions & options, bool peakRssPerOperation) {
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            throw Archiver::ArchiverException("Error with opening " + path);
+        QJsonArray resultArray;
+        for (std::size_t i = 0; i < results.size(); ++i)
+            resultArray.append(results[i].toJson());
+        QJsonObject json;
+        json.insert("datasetVersion", datasetVersion);
+        json.insert("scale", scale);
+        json.insert("warmup", int(options.warmup));
+        json.insert("repetitions", int(options.repetitions));
+        json.insert("cold", options.cold);
+        json.insert("peakRssPerOperation", peakRssPerOperation);
+        json.insert("results", resultArray);
+        if (file.write(QJsonDocument(json).toJson()) == -1)
+            throw Archiver::ArchiverException("Error with writing " + path);
+    }
+
+    // Compares median times with a results file of an earlier run and returns the number of regressions.
+    int compareWithBaseline(const QString & path, const std::vector<Result> & results, double tolerancePercent) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            throw Archiver::ArchiverException("Error with opening " + path);
+        QJsonParseError error;
+        QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+        if (!document.isObject())
+            throw Archiver::ArchiverException("Error with parsing " + path + ": " + error.errorString());
+
+        std::map<std::string, std::uint64_t> baseline;
+        QJsonArray baselineResults = document.object().value("results").toArray();
+        for (int i = 0; i < baselineResults.size(); ++i) {
+            QJsonObject result = baselineResults.at(i).toObject();
+            baseline[result.value("profile").toString().toStdString() + " "
+                     + result.value("operation").toString().toStdString()] = result.value("medianNs").toDouble();
+        }
+
+        int regressions = 0;
+        std::cout << "\nagainst " << path.toStdString() << ":\n";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            std::string key = results[i].profile + " " + results[i].operation;
+            std::map<std::string, std::uint64_t>::const_iterator old = baseline.find(key);
+            if (old == baseline.end() || old->second == 0)
+                continue;
+            double change = ((double)results[i].medianNs / old->second - 1) * 100;
+            bool regressed = change > tolerancePercent;
+            regressions += regressed;
+            printf("%-25s %+7.1f%%%s\n", key.c_str(), change, regressed ? "  REGRESSION" : "");
+        }
+        return regressions;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark of archiver pack, unpack, list and getArchiveWithoutContent "
+                                     "on generated datasets: tiny, source, huge, sparse and deep.");
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption({"p", "profile"}, "Dataset profile to run, all of them by default. Repeatable.", "NAME"));
+    parser.addOption(QCommandLineOption({"w", "work"}, "Directory of datasets, archives and unpacked trees.", "PATH", "bench_work"));
+    parser.addOption(QCommandLineOption({"o", "output"}, "JSON file of results.", "PATH", "bench_results.json"));
+    parser.addOption(QCommandLineOption("scale", "Multiplier of dataset sizes and counts.", "FACTOR", "1"));
+    parser.addOption(QCommandLineOption("warmup", "Unmeasured runs before the measured ones.", "N", "1"));
+    parser.addOption(QCommandLineOption("repeat", "Measured runs of every operation.", "N", "3"));
+    parser.addOption(QCommandLineOption("cold", "Evict the input of every run from the page cache first."));
+    parser.addOption(QCommandLineOption("baseline", "Results of an earlier run to compare median times with.", "PATH"));
+    parser.addOption(QCommandLineOption("tolerance", "Slowdown in percent reported as a regression.", "PERCENT", "10"));
+    parser.process(app);
+
+    BenchOptions options;
+    options.warmup = parser.value("warmup").toUInt();
+    options.repetitions = std::max(1u, parser.value("repeat").toUInt());
+    options.cold = parser.isSet("cold");
+    double scale = parser.value("scale").toDouble();
+    std::string workDir = parser.value("work").toStdString();
+    QStringList selected = parser.values("profile");
+
+    int exitCode = 0;
+    try {
+        if (scale <= 0)
+            throw Archiver::ArchiverException("Scale must be positive");
+        if ((mkdir(workDir.c_str(), 0755) == -1 && errno != EEXIST)
+                || (mkdir((workDir + "/datasets").c_str(), 0755) == -1 && errno != EEXIST))
+            fail("Cannot create " + workDir);
+
+        bool peakRssPerOperation = resetPeakRss();
+        if (!peakRssPerOperation)
+            std::cerr << "Peak RSS cannot be reset, it is reported for the whole process." << std::endl;
+
+        std::vector<Result> results;
+        for (std::size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+            if (selected.isEmpty() || selected.contains(profiles[i].name))
+                benchProfile(profiles[i], workDir, scale, options, results);
+        }
+        if (results.empty())
+            throw Archiver::ArchiverException("No such profile");
+
+        writeResults(parser.value("output"), results, scale, options, peakRssPerOperation);
+        if (parser.isSet("baseline") && compareWithBaseline(parser.value("baseline"), results,
+                                                            parser.value("tolerance").toDouble()) > 0)
+            exitCode = 2;
+    } catch (Archiver::ArchiverException & e) {
+        qCritical() << e.whatQMsg() << '\n';
+        exitCode = 1;
+    }
+
+    google::protobuf::ShutdownProtobufLibrary();
+    return exitCode;
+}
@@ -0,0 +1,138 @@
+#include "archive_compare.h"
+
+#include <limits>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+    const std::uint64_t noEntry = std::numeric_limits<std::uint64_t>::max();
+
+    struct Pair {
+        std::uint64_t oldIndex;
+        std::uint64_t newIndex;
+        std::size_t parentPathSize;
+        Pair(std::uint64_t oldIndex, std::uint64_t newIndex, std::size_t parentPathSize)
+            :oldIndex(oldIndex), newIndex(newIndex), parentPathSize(parentPathSize) {}
+    };
+
+    std::uint64_t entrySize(const ArchiveIndex::Entry & entry) {
+        return entry.isRegularFile() ? entry.contentSize : 0;
+    }
+
+    unsigned differenceKinds(const ArchiveIndex::Entry & oldEntry, const ArchiveIndex::Entry & newEntry) {
+        if ((oldEntry.mode & S_IFMT) != (newEntry.mode & S_IFMT))
+            return Archiver::Difference::TypeChanged;
+
+        unsigned kinds = 0;
+        if (entrySize(oldEntry) != entrySize(newEntry))
+            kinds |= Archiver::Difference::Resized;
+        if (oldEntry.mtime != newEntry.mtime)
+            kinds |= Archiver::Difference::Retouched;
+        if ((oldEntry.flags & ArchiveIndex::HasChecksum) && (newEntry.flags & ArchiveIndex::HasChecksum)
+                && oldEntry.checksum != newEntry.checksum)
+            kinds |= Archiver::Difference::ContentChanged;
+        if (oldEntry.mode != newEntry.mode || oldEntry.uid != newEntry.uid || oldEntry.gid != newEntry.gid)
+            kinds |= Archiver::Difference::AttributesChanged;
+        return kinds;
+    }
+
+    // Pushes the children of both directories merged by name, the first name ends up on top of stack.
+    // A missing directory is noEntry, its counterpart's children are then paired with nothing.
+    void pushChildren(const ArchiveIndex::Reader & oldIndex, std::uint64_t oldDir,
+                      const ArchiveIndex::Reader & newIndex, std::uint64_t newDir,
+                      std::size_t pathSize, std::vector<Pair> & merged, std::vector<Pair> & stack) {
+        merged.clear();
+        const ArchiveIndex::Entry* oldEntry = oldDir == noEntry ? NULL : &oldIndex.entry(oldDir);
+        const ArchiveIndex::Entry* newEntry = newDir == noEntry ? NULL : &newIndex.entry(newDir);
+        std::uint64_t oldCount = oldEntry && S_ISDIR(oldEntry->mode) ? oldEntry->childCount : 0;
+        std::uint64_t newCount = newEntry && S_ISDIR(newEntry->mode) ? newEntry->childCount : 0;
+
+        std::uint64_t i = 0;
+        std::uint64_t j = 0;
+        while (i < oldCount || j < newCount) {
+            std::uint64_t oldChild = i < oldCount ? oldIndex.sortedChild(*oldEntry, i) : noEntry;
+            std::uint64_t newChild = j < newCount ? newIndex.sortedChild(*newEntry, j) : noEntry;
+            int comparison;
+            if (oldChild == noEntry) {
+                comparison = 1;
+            } else if (newChild == noEntry) {
+                comparison = -1;
+            } else {
+                const ArchiveIndex::Entry & oldChildEntry = oldIndex.entry(oldChild);
+                const ArchiveIndex::Entry & newChildEntry = newIndex.entry(newChild);
+                comparison = ArchiveIndex::compareNames(oldIndex.nameData(oldChildEntry), oldChildEntry.nameSize,
+                                                        newIndex.nameData(newChildEntry), newChildEntry.nameSize);
+            }
+
+            if (comparison < 0) {
+                merged.push_back(Pair(oldChild, noEntry, pathSize));
+                ++i;
+            } else if (comparison > 0) {
+                merged.push_back(Pair(noEntry, newChild, pathSize));
+                ++j;
+            } else {
+                merged.push_back(Pair(oldChild, newChild, pathSize));
+                ++i;
+                ++j;
+            }
+        }
+        stack.insert(stack.end(), merged.rbegin(), merged.rend());
+    }
+}
+
+void ArchiveCompare::run(const ArchiveIndex::Reader & oldIndex, const ArchiveIndex::Reader & newIndex,
+                         Archiver::CompareReport & report) {
+    report.oldEntries = oldIndex.entryCount();
+    report.newEntries = newIndex.entryCount();
+    if (report.oldEntries == 0 && report.newEntries == 0)
+        return;
+
+    std::uint64_t visited = 0;
+    std::string path;
+    std::vector<Pair> merged;
+    std::vector<Pair> stack(1, Pair(report.oldEntries ? 0 : noEntry, report.newEntries ? 0 : noEntry, 0));
+    while (!stack.empty()) {
+        Pair current = stack.back();
+        stack.pop_back();
+        if (++visited > report.oldEntries + report.newEntries)
+            throw Archiver::ArchiverException("Cycle of directories in archive");
+
+        const ArchiveIndex::Reader & nameIndex = current.newIndex != noEntry ? newIndex : oldIndex;
+        const ArchiveIndex::Entry & nameEntry = nameIndex.entry(current.newIndex != noEntry ? current.newIndex : current.oldIndex);
+        path.resize(current.parentPathSize);
+        if (!path.empty())
+            path += '/';
+        path.append(nameIndex.nameData(nameEntry), nameEntry.nameSize);
+
+        unsigned kinds;
+        if (current.oldIndex == noEntry) {
+            kinds = Archiver::Difference::Added;
+            ++report.added;
+        } else if (current.newIndex == noEntry) {
+            kinds = Archiver::Difference::Removed;
+            ++report.removed;
+        } else {
+            kinds = differenceKinds(oldIndex.entry(current.oldIndex), newIndex.entry(current.newIndex));
+            if (kinds)
+                ++report.changed;
+            else
+                ++report.unchanged;
+        }
+
+        if (kinds) {
+            Archiver::Difference difference(QString::fromUtf8(path.data(), path.size()), kinds);
+            if (current.oldIndex != noEntry) {
+                difference.oldSize = entrySize(oldIndex.entry(current.oldIndex));
+                difference.oldMtime = oldIndex.entry(current.oldIndex).mtime;
+            }
+            if (current.newIndex != noEntry) {
+                difference.newSize = entrySize(newIndex.entry(current.newIndex));
+                difference.newMtime = newIndex.entry(current.newIndex).mtime;
+            }
+            report.differences.push_back(difference);
+        }
+
+        pushChildren(oldIndex, current.oldIndex, newIndex, current.newIndex, path.size(), merged, stack);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef ARCHIVE_COMPARE_H
+#define ARCHIVE_COMPARE_H
+
+#include "archive_index.h"
+#include "archiver.h"
+
+namespace ArchiveCompare {
+    // Walks both indexes at once, merging the children of every directory pair by name
+    // through the sorted children section, so the time is linear in the number of entries.
+    // The roots are paired whatever their names are. Every entry of an added or removed subtree is reported.
+    void run(const ArchiveIndex::Reader & oldIndex, const ArchiveIndex::Reader & newIndex, Archiver::CompareReport & report);
+}
+
+#endif // ARCHIVE_COMPARE_H
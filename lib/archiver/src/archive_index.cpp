@@ -0,0 +1,483 @@
+#include "archive_index.h"
+#include "archiver.h"
+#include "archiver_utils.h"
+#include "content_cipher.h"
+#include "meta_codec.h"
+#include "stats_recorder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <sys/stat.h>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    const char indexMagic[8] = {'A', 'R', 'C', 'I', 'N', 'D', 'E', 'X'};
+    const char trailerMagic[8] = {'I', 'D', 'X', 'T', 'R', 'A', 'I', 'L'};
+    const std::uint64_t alignment = 8;
+    const std::uint64_t fileOutputBufferSize = 1 << 20;
+
+    class Output {
+    public:
+        virtual ~Output() {}
+        virtual void write(const char* data, std::uint64_t size) = 0;
+    };
+
+    class FileOutput : public Output {
+    public:
+        explicit FileOutput(QFile * file)
+            :file(file) {
+            buffer.reserve(fileOutputBufferSize);
+        }
+        void write(const char* data, std::uint64_t size) {
+            if (buffer.size() + size > fileOutputBufferSize)
+                flush();
+            if (size > fileOutputBufferSize)
+                writeToFile(data, size);
+            else
+                buffer.insert(buffer.end(), data, data + size);
+        }
+        void flush() {
+            writeToFile(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    private:
+        void writeToFile(const char* data, std::uint64_t size) {
+            if ((std::uint64_t)file->write(data, size) < size)
+                throw Archiver::ArchiverException("Failed to write index of " + file->fileName());
+        }
+        QFile * file;
+        std::vector<char> buffer;
+    };
+
+    class BufferOutput : public Output {
+    public:
+        explicit BufferOutput(std::vector<char> & buffer)
+            :buffer(buffer) {}
+        void write(const char* data, std::uint64_t size) {
+            buffer.insert(buffer.end(), data, data + size);
+        }
+    private:
+        std::vector<char> & buffer;
+    };
+
+    std::uint64_t alignUp(std::uint64_t value) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    struct NameLess {
+        const apb::PBArchiveMetaData & metaArchive;
+        explicit NameLess(const apb::PBArchiveMetaData & metaArchive)
+            :metaArchive(metaArchive) {}
+        bool operator()(std::uint64_t first, std::uint64_t second) const {
+            const std::string & firstName = metaArchive.pbdirentmetadata(first).name();
+            const std::string & secondName = metaArchive.pbdirentmetadata(second).name();
+            return ArchiveIndex::compareNames(firstName.data(), firstName.size(), secondName.data(), secondName.size()) < 0;
+        }
+    };
+
+    std::uint64_t serialize(const apb::PBArchiveMetaData & metaArchive, Output & out) {
+        std::uint64_t entryCount = metaArchive.pbdirentmetadata_size();
+        std::uint64_t blockCount = 0;
+        std::uint64_t stringsSize = 0;
+        std::string encryption;
+        if (metaArchive.has_encryption() && !metaArchive.encryption().SerializeToString(&encryption))
+            throw Archiver::ArchiverException("Cannot serialize encryption of archive");
+        // meta is in bfs order and pack_dir_inode adds all children of a directory at once,
+        // so a child range is the first child and the number of children
+        std::vector<std::uint64_t> firstChild(entryCount, 0);
+        std::vector<std::uint64_t> childCount(entryCount, 0);
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+            if (dirent.has_pbregfilemetadata()) {
+                blockCount += dirent.pbregfilemetadata().blocks_size();
+                stringsSize += dirent.pbregfilemetadata().inlinedata().size();
+            }
+            stringsSize += dirent.name().size();
+            std::uint64_t parent = dirent.parentix();
+            if (parent != i && parent < entryCount) {
+                if (childCount[parent]++ == 0)
+                    firstChild[parent] = i;
+                else if (firstChild[parent] + childCount[parent] - 1 != i)
+                    throw Archiver::ArchiverException("Children of a directory are not contiguous in meta");
+            }
+        }
+
+        ArchiveIndex::Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, indexMagic, sizeof(header.magic));
+        header.version = ArchiveIndex::version;
+        header.entrySize = sizeof(ArchiveIndex::Entry);
+        header.entryCount = entryCount;
+        header.blockCount = blockCount;
+        header.stringsSize = stringsSize;
+        header.entriesOffset = sizeof(ArchiveIndex::Header);
+        header.blocksOffset = header.entriesOffset + entryCount * sizeof(ArchiveIndex::Entry);
+        header.sortedOffset = header.blocksOffset + blockCount * sizeof(ArchiveIndex::Block);
+        header.stringsOffset = header.sortedOffset + entryCount * sizeof(std::uint64_t);
+        header.encryptionOffset = stringsSize;
+        header.encryptionSize = encryption.size();
+        header.stringsSize += encryption.size();
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::uint64_t nameOffset = 0;
+        std::uint64_t blockIndex = 0;
+        std::uint64_t inlineOffset = 0;
+        for (std::uint64_t i = 0; i < entryCount; ++i)
+            inlineOffset += metaArchive.pbdirentmetadata(i).name().size();
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+            ArchiveIndex::Entry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.parent = dirent.parentix();
+            entry.firstChild = firstChild[i];
+            entry.childCount = childCount[i];
+            entry.nameOffset = nameOffset;
+            entry.nameSize = dirent.name().size();
+            entry.mode = dirent.mode();
+            entry.uid = dirent.uid();
+            entry.gid = dirent.gid();
+            entry.mtime = dirent.mtime();
+            entry.atime = dirent.atime();
+            if (dirent.has_pbregfilemetadata()) {
+                const apb::PBRegFileMetaData & fileMeta = dirent.pbregfilemetadata();
+                entry.flags |= ArchiveIndex::RegularFile;
+                entry.contentOffset = fileMeta.contentoffset();
+                if (fileMeta.has_inlinedata()) {
+                    entry.flags |= ArchiveIndex::InlineContent;
+                    entry.contentOffset = inlineOffset;
+                    inlineOffset += fileMeta.inlinedata().size();
+                }
+                entry.contentSize = fileMeta.contentsize();
+                entry.firstBlock = blockIndex;
+                entry.blockCount = fileMeta.blocks_size();
+                entry.blockSize = fileMeta.blocksize();
+                if (fileMeta.has_checksum()) {
+                    entry.flags |= ArchiveIndex::HasChecksum;
+                    entry.checksum = fileMeta.checksum();
+                }
+                if (fileMeta.blocks_size() > 0 && fileMeta.blocks(0).has_checksum())
+                    entry.flags |= ArchiveIndex::HasBlockChecksums;
+                if (fileMeta.has_delta())
+                    entry.flags |= ArchiveIndex::DeltaContent;
+                blockIndex += fileMeta.blocks_size();
+            }
+            nameOffset += entry.nameSize;
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        }
+
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+            if (!dirent.has_pbregfilemetadata())
+                continue;
+            const apb::PBRegFileMetaData & fileMeta = dirent.pbregfilemetadata();
+            for (int j = 0; j < fileMeta.blocks_size(); ++j) {
+                ArchiveIndex::Block block;
+                memset(&block, 0, sizeof(block));
+                block.storedSize = fileMeta.blocks(j).storedsize();
+                block.codec = fileMeta.blocks(j).codec();
+                block.checksum = fileMeta.blocks(j).checksum();
+                out.write(reinterpret_cast<const char*>(&block), sizeof(block));
+            }
+        }
+
+        std::vector<std::uint64_t> sortedChildren(entryCount, 0);
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            if (childCount[i] == 0)
+                continue;
+            std::vector<std::uint64_t>::iterator first = sortedChildren.begin() + firstChild[i];
+            std::vector<std::uint64_t>::iterator last = first + childCount[i];
+            for (std::uint64_t j = 0; j < childCount[i]; ++j)
+                first[j] = firstChild[i] + j;
+            std::sort(first, last, NameLess(metaArchive));
+        }
+        out.write(reinterpret_cast<const char*>(sortedChildren.data()), entryCount * sizeof(std::uint64_t));
+
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            const std::string & name = metaArchive.pbdirentmetadata(i).name();
+            out.write(name.data(), name.size());
+        }
+        for (std::uint64_t i = 0; i < entryCount; ++i) {
+            const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+            if (dirent.has_pbregfilemetadata() && dirent.pbregfilemetadata().has_inlinedata())
+                out.write(dirent.pbregfilemetadata().inlinedata().data(), dirent.pbregfilemetadata().inlinedata().size());
+        }
+        out.write(encryption.data(), encryption.size());
+
+        std::uint64_t size = header.stringsOffset + header.stringsSize;
+        const char padding[alignment] = {0};
+        out.write(padding, alignUp(size) - size);
+        return alignUp(size);
+    }
+}
+
+void ArchiveIndex::write(const apb::PBArchiveMetaData & metaArchive, QFile * archive) {
+    FileOutput out(archive);
+    const char padding[alignment] = {0};
+    out.write(padding, alignUp(archive->pos()) - archive->pos());
+
+    Trailer trailer;
+    trailer.indexSize = serialize(metaArchive, out);
+    memcpy(trailer.magic, trailerMagic, sizeof(trailer.magic));
+    out.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    out.flush();
+}
+
+std::uint64_t ArchiveIndex::tailSize(QFile & archive, std::uint64_t endOfMeta) {
+    std::uint64_t fileSize = archive.size();
+    if (fileSize <= endOfMeta)
+        return 0;
+    if (fileSize - endOfMeta < sizeof(Trailer) || !archive.seek(fileSize - sizeof(Trailer)))
+        throw Archiver::ArchiverException("Unexpected data after meta of " + archive.fileName());
+
+    Trailer trailer;
+    if ((std::uint64_t)archive.read(reinterpret_cast<char*>(&trailer), sizeof(trailer)) < sizeof(trailer)
+            || memcmp(trailer.magic, trailerMagic, sizeof(trailer.magic)) != 0)
+        throw Archiver::ArchiverException("Unexpected data after meta of " + archive.fileName());
+
+    std::uint64_t tail = fileSize - endOfMeta;
+    if (trailer.indexSize > tail || tail - trailer.indexSize != sizeof(Trailer) + alignUp(endOfMeta) - endOfMeta)
+        throw Archiver::ArchiverException("Broken index of " + archive.fileName());
+    return tail;
+}
+
+ArchiveIndex::Reader::Reader(QFile & archive, std::uint64_t metaSize, std::uint64_t contentSize)
+    :archive(archive)
+    ,metaSize(metaSize)
+    ,contentSize(contentSize)
+    ,mapping(NULL)
+    ,header(NULL)
+    ,entries(NULL)
+    ,blocks(NULL)
+    ,sortedChildren(NULL)
+    ,strings(NULL) {
+    std::uint64_t endOfMeta = ArchiverUtils::contentOffsetInArchive + contentSize + metaSize;
+    std::uint64_t tail = tailSize(archive, endOfMeta);
+    if (tail != 0) {
+        std::uint64_t indexSize = tail - sizeof(Trailer) - (alignUp(endOfMeta) - endOfMeta);
+        mapping = archive.map(alignUp(endOfMeta), indexSize);
+        if (mapping == NULL)
+            throw Archiver::ArchiverException("Cannot map index of " + archive.fileName());
+        StatsRecorder::countMapping();
+        if (attach(reinterpret_cast<const char*>(mapping), indexSize))
+            return;
+        // written by another version, the meta is still readable
+        archive.unmap(mapping);
+        mapping = NULL;
+    }
+    buildFromMeta();
+}
+
+ArchiveIndex::Reader::~Reader() {
+    if (mapping != NULL)
+        archive.unmap(mapping);
+}
+
+void ArchiveIndex::Reader::parseMeta(apb::PBArchiveMetaData & metaArchive) const {
+    MetaCodec::parse(archive, ArchiverUtils::contentOffsetInArchive + contentSize, metaSize, metaArchive);
+}
+
+void ArchiveIndex::Reader::authenticate(const ContentCipher & cipher) {
+    google::protobuf::Arena arena(ArchiverUtils::metaArenaOptions());
+    apb::PBArchiveMetaData & metaArchive = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&arena);
+    parseMeta(metaArchive);
+    if (!metaArchive.has_encryption() || !cipher.metaTagMatches(metaArchive))
+        throw Archiver::ArchiverException("Meta of encrypted archive " + archive.fileName() + " was altered");
+
+    if (mapping != NULL) {
+        archive.unmap(mapping);
+        mapping = NULL;
+    }
+    ownedIndex.clear();
+    BufferOutput out(ownedIndex);
+    serialize(metaArchive, out);
+    if (!attach(ownedIndex.data(), ownedIndex.size()))
+        throw Archiver::ArchiverException("Cannot build index of " + archive.fileName());
+}
+
+void ArchiveIndex::Reader::buildFromMeta() {
+    google::protobuf::Arena arena(ArchiverUtils::metaArenaOptions());
+    apb::PBArchiveMetaData & metaArchive = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&arena);
+    parseMeta(metaArchive);
+
+    BufferOutput out(ownedIndex);
+    serialize(metaArchive, out);
+    if (!attach(ownedIndex.data(), ownedIndex.size()))
+        throw Archiver::ArchiverException("Cannot build index of " + archive.fileName());
+}
+
+// Returns false if the index has another version.
+bool ArchiveIndex::Reader::attach(const char* data, std::uint64_t size) {
+    if (size < sizeof(Header))
+        throw Archiver::ArchiverException("Broken index of " + archive.fileName());
+    header = reinterpret_cast<const Header*>(data);
+    if (memcmp(header->magic, indexMagic, sizeof(header->magic)) != 0)
+        throw Archiver::ArchiverException("Broken index of " + archive.fileName());
+    if (header->version != version || header->entrySize != sizeof(Entry))
+        return false;
+    if (header->entryCount == 0)
+        throw Archiver::ArchiverException("Broken index of " + archive.fileName());
+
+    if (header->entriesOffset % alignment != 0 || header->blocksOffset % alignment != 0 || header->sortedOffset % alignment != 0
+            || header->entriesOffset > size || header->entryCount > (size - header->entriesOffset) / sizeof(Entry)
+            || header->blocksOffset > size || header->blockCount > (size - header->blocksOffset) / sizeof(Block)
+            || header->sortedOffset > size || header->entryCount > (size - header->sortedOffset) / sizeof(std::uint64_t)
+            || header->stringsOffset > size || header->stringsSize > size - header->stringsOffset)
+        throw Archiver::ArchiverException("Broken index of " + archive.fileName());
+
+    entries = reinterpret_cast<const Entry*>(data + header->entriesOffset);
+    blocks = reinterpret_cast<const Block*>(data + header->blocksOffset);
+    sortedChildren = reinterpret_cast<const std::uint64_t*>(data + header->sortedOffset);
+    strings = data + header->stringsOffset;
+    return true;
+}
+
+int ArchiveIndex::compareNames(const char* first, std::uint64_t firstSize, const char* second, std::uint64_t secondSize) {
+    int result = memcmp(first, second, std::min(firstSize, secondSize));
+    if (result != 0)
+        return result;
+    return firstSize < secondSize ? -1 : (firstSize > secondSize ? 1 : 0);
+}
+
+const ArchiveIndex::Entry & ArchiveIndex::Reader::entry(std::uint64_t index) const {
+    if (index >= header->entryCount)
+        throw Archiver::ArchiverException("Entry index is out of index of " + archive.fileName());
+    return entries[index];
+}
+
+const ArchiveIndex::Block & ArchiveIndex::Reader::block(const Entry & fileEntry, std::uint32_t index) const {
+    if (index >= fileEntry.blockCount || fileEntry.firstBlock + index >= header->blockCount)
+        throw Archiver::ArchiverException("Block index is out of index of " + archive.fileName());
+    return blocks[fileEntry.firstBlock + index];
+}
+
+QString ArchiveIndex::Reader::name(const Entry & entry) const {
+    return QString::fromUtf8(nameData(entry), entry.nameSize);
+}
+
+const char* ArchiveIndex::Reader::nameData(const Entry & entry) const {
+    if (entry.nameOffset > header->stringsSize || entry.nameSize > header->stringsSize - entry.nameOffset)
+        throw Archiver::ArchiverException("Name is out of index of " + archive.fileName());
+    return strings + entry.nameOffset;
+}
+
+const char* ArchiveIndex::Reader::inlineContent(const Entry & fileEntry) const {
+    if (!(fileEntry.flags & InlineContent) || fileEntry.contentOffset > header->stringsSize
+            || fileEntry.contentSize > header->stringsSize - fileEntry.contentOffset)
+        throw Archiver::ArchiverException("Inline content is out of index of " + archive.fileName());
+    return strings + fileEntry.contentOffset;
+}
+
+bool ArchiveIndex::Reader::encryption(apb::PBEncryption * record) const {
+    if (header->encryptionSize == 0)
+        return false;
+    if (header->encryptionOffset > header->stringsSize || header->encryptionSize > header->stringsSize - header->encryptionOffset
+            || !record->ParseFromArray(strings + header->encryptionOffset, header->encryptionSize))
+        throw Archiver::ArchiverException("Broken encryption record in index of " + archive.fileName());
+    return true;
+}
+
+QString ArchiveIndex::Reader::path(std::uint64_t index) const {
+    QString result = name(entry(index));
+    for (std::uint64_t depth = 0; entry(index).parent != index; ++depth) {
+        if (depth >= header->entryCount)
+            throw Archiver::ArchiverException("Cycle of parents in index of " + archive.fileName());
+        index = entry(index).parent;
+        result = name(entry(index)) + '/' + result;
+    }
+    return result;
+}
+
+std::uint64_t ArchiveIndex::Reader::find(const QString & pathInArchive) const {
+    QByteArray path = pathInArchive.toUtf8();
+    const char* position = path.constData();
+    const char* end = position + path.size();
+    std::uint64_t current = header->entryCount;
+
+    while (position != end) {
+        const char* separator = std::find(position, end, '/');
+        std::uint64_t componentSize = separator - position;
+        if (componentSize != 0 && !(componentSize == 1 && *position == '.')) {
+            if (current == header->entryCount) {
+                const Entry & root = entry(0);
+                if (root.nameOffset > header->stringsSize || root.nameSize > header->stringsSize - root.nameOffset
+                        || compareNames(strings + root.nameOffset, root.nameSize, position, componentSize) != 0)
+                    return header->entryCount;
+                current = 0;
+            } else {
+                current = findChild(entry(current), position, componentSize);
+                if (current == header->entryCount)
+                    return current;
+            }
+        }
+        position = separator == end ? end : separator + 1;
+    }
+    return current;
+}
+
+std::uint64_t ArchiveIndex::Reader::sortedChild(const Entry & dir, std::uint64_t position) const {
+    if (!S_ISDIR(dir.mode) || position >= dir.childCount || dir.firstChild > header->entryCount
+            || dir.childCount > header->entryCount - dir.firstChild)
+        throw Archiver::ArchiverException("Child index is out of index of " + archive.fileName());
+    return sortedChildren[dir.firstChild + position];
+}
+
+std::uint64_t ArchiveIndex::Reader::findChild(const Entry & dir, const char* name, std::uint64_t nameSize) const {
+    if (!S_ISDIR(dir.mode) || dir.firstChild > header->entryCount || dir.childCount > header->entryCount - dir.firstChild)
+        return header->entryCount;
+
+    const std::uint64_t* first = sortedChildren + dir.firstChild;
+    std::uint64_t count = dir.childCount;
+    while (count > 0) {
+        std::uint64_t half = count / 2;
+        const Entry & child = entry(first[half]);
+        if (child.nameOffset > header->stringsSize || child.nameSize > header->stringsSize - child.nameOffset)
+            throw Archiver::ArchiverException("Name is out of index of " + archive.fileName());
+        int comparison = compareNames(strings + child.nameOffset, child.nameSize, name, nameSize);
+        if (comparison == 0)
+            return first[half];
+        if (comparison < 0) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    return header->entryCount;
+}
+
+void ArchiveIndex::Reader::toDirent(std::uint64_t index, apb::PBDirEntMetaData * dirent) const {
+    const Entry & current = entry(index);
+    dirent->set_parentix(current.parent);
+    dirent->set_uid(current.uid);
+    dirent->set_gid(current.gid);
+    dirent->set_mtime(current.mtime);
+    dirent->set_atime(current.atime);
+    dirent->set_mode(current.mode);
+    dirent->set_name(name(current).toStdString());
+    if (!current.isRegularFile()) {
+        dirent->mutable_pbdirmetadata();
+        return;
+    }
+
+    apb::PBRegFileMetaData * fileMeta = dirent->mutable_pbregfilemetadata();
+    fileMeta->set_contentsize(current.contentSize);
+    if (current.flags & InlineContent) {
+        fileMeta->set_contentoffset(0);
+        fileMeta->set_inlinedata(inlineContent(current), current.contentSize);
+    } else {
+        fileMeta->set_contentoffset(current.contentOffset);
+    }
+    fileMeta->set_blocksize(current.blockSize);
+    if (current.flags & HasChecksum)
+        fileMeta->set_checksum(current.checksum);
+    for (std::uint32_t i = 0; i < current.blockCount; ++i) {
+        const Block & stored = block(current, i);
+        apb::PBContentBlock * fileBlock = fileMeta->add_blocks();
+        fileBlock->set_storedsize(stored.storedSize);
+        fileBlock->set_codec(apb::PBCodec_IsValid(stored.codec) ? (apb::PBCodec)stored.codec : apb::CODEC_RAW);
+        if (current.flags & HasBlockChecksums)
+            fileBlock->set_checksum(stored.checksum);
+    }
+}
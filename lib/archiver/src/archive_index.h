@@ -0,0 +1,144 @@
+#ifndef ARCHIVE_INDEX_H
+#define ARCHIVE_INDEX_H
+
+#include <struct_serialization.pb.h>
+
+#include <QFile>
+#include <QString>
+#include <cstdint>
+#include <vector>
+
+class ContentCipher;
+
+// Fixed-width index of the archive meta that is used straight from an mmap, without parsing.
+// It is appended after the protobuf meta and is found through the trailer at the very end of the archive:
+//   [meta][padding to 8][Header][Entry x entryCount][Block x blockCount][sorted children][strings][Trailer]
+// Entries are in meta order (bfs), so the children of a directory are a contiguous range.
+// Content of inlined tiny files is kept in the strings section, pointed to by contentOffset,
+// followed by the serialized PBEncryption of an encrypted archive.
+// The sorted children section holds the same ranges with entry indexes ordered by name,
+// so a path is looked up with a binary search per component.
+namespace ArchiveIndex {
+    const std::uint32_t version = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entrySize;
+        std::uint64_t entryCount;
+        std::uint64_t blockCount;
+        std::uint64_t stringsSize;
+        // offsets are relative to the beginning of the header
+        std::uint64_t entriesOffset;
+        std::uint64_t blocksOffset;
+        std::uint64_t stringsOffset;
+        std::uint64_t sortedOffset;
+        // relative to the strings section, encryptionSize is 0 for plain content
+        std::uint64_t encryptionOffset;
+        std::uint64_t encryptionSize;
+    };
+
+    enum EntryFlags {
+        RegularFile = 1,
+        HasChecksum = 2,
+        HasBlockChecksums = 4,
+        InlineContent = 8,
+        // blocks hold the literal bytes of a delta against the base archive, see PBDelta
+        DeltaContent = 16
+    };
+
+    struct Entry {
+        std::uint64_t parent;
+        std::uint64_t firstChild;
+        std::uint64_t childCount;
+        std::uint64_t nameOffset;
+        std::uint32_t nameSize;
+        std::uint32_t mode;
+        std::uint32_t uid;
+        std::uint32_t gid;
+        std::uint64_t mtime;
+        std::uint64_t atime;
+        std::uint64_t contentOffset;
+        std::uint64_t contentSize;
+        std::uint64_t firstBlock;
+        std::uint32_t blockCount;
+        std::uint32_t blockSize;
+        std::uint32_t checksum;
+        std::uint32_t flags;
+
+        bool isRegularFile() const { return flags & RegularFile; }
+    };
+
+    struct Block {
+        std::uint64_t storedSize;
+        std::uint32_t codec;
+        std::uint32_t checksum;
+    };
+
+    struct Trailer {
+        std::uint64_t indexSize;
+        char magic[8];
+    };
+
+    // Order of names in the sorted children section, bytewise like memcmp.
+    int compareNames(const char* first, std::uint64_t firstSize, const char* second, std::uint64_t secondSize);
+
+    // Appends the index of metaArchive and the trailer at the current position of archive.
+    void write(const ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive, QFile * archive);
+
+    // Number of bytes after the end of the meta taken by the index, 0 if the archive has none.
+    std::uint64_t tailSize(QFile & archive, std::uint64_t endOfMeta);
+
+    class Reader {
+    public:
+        // Maps the index of the archive. Archives without one (older or meta only archives)
+        // get an index built in memory from the protobuf meta.
+        Reader(QFile & archive, std::uint64_t metaSize, std::uint64_t contentSize);
+        ~Reader();
+
+        bool isMapped() const { return mapping != NULL; }
+        std::uint64_t entryCount() const { return header->entryCount; }
+        const Entry & entry(std::uint64_t index) const;
+        const Block & block(const Entry & fileEntry, std::uint32_t index) const;
+        QString name(const Entry & entry) const;
+        // Raw utf-8 name of entry, nameSize bytes without a terminating zero.
+        const char* nameData(const Entry & entry) const;
+        const char* inlineContent(const Entry & fileEntry) const;
+        // Fills record and returns true if the content of the archive is encrypted.
+        bool encryption(ArchiverUtils::protobufStructs::PBEncryption * record) const;
+        QString path(std::uint64_t index) const;
+        // Finds an entry by its path in the archive (as printed by list, starting with the root name).
+        // Returns entryCount() if there is no such entry.
+        std::uint64_t find(const QString & pathInArchive) const;
+        // Index of the child of dir at position in the order of names.
+        std::uint64_t sortedChild(const Entry & dir, std::uint64_t position) const;
+        void toDirent(std::uint64_t index, ArchiverUtils::protobufStructs::PBDirEntMetaData * dirent) const;
+        // The stored index of an encrypted archive is not covered by the tag of its meta:
+        // parses the meta, checks its tag with cipher and serves the entries built from it instead.
+        // Throws ArchiverException if the meta was altered.
+        void authenticate(const ContentCipher & cipher);
+        // Parses the protobuf meta the index was built from, for what the index does not hold (deltas).
+        void parseMeta(ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive) const;
+
+    private:
+        Reader(const Reader &);
+        Reader & operator=(const Reader &);
+
+        bool attach(const char* data, std::uint64_t size);
+        void buildFromMeta();
+        std::uint64_t findChild(const Entry & dir, const char* name, std::uint64_t nameSize) const;
+
+        QFile & archive;
+        const std::uint64_t metaSize;
+        const std::uint64_t contentSize;
+        uchar* mapping;
+        std::vector<char> ownedIndex;
+        const Header* header;
+        const Entry* entries;
+        const Block* blocks;
+        const std::uint64_t* sortedChildren;
+        const char* strings;
+    };
+}
+
+#endif // ARCHIVE_INDEX_H
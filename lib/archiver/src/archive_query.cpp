@@ -0,0 +1,177 @@
+#include "archive_query.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fnmatch.h>
+#include <limits>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+Archiver::ListQuery::ListQuery()
+    :type(AnyEntry)
+    ,minSize(0)
+    ,maxSize(std::numeric_limits<std::uint64_t>::max())
+    ,minMtime(0)
+    ,maxMtime(std::numeric_limits<std::uint64_t>::max())
+    ,du(false)
+    ,sortKey(SortNone)
+    ,descending(false)
+    ,limit(0) {}
+
+namespace {
+    const std::size_t outputChunkSize = 64 << 10;
+
+    struct Match {
+        std::string path;
+        std::uint64_t size;
+        std::uint64_t mtime;
+        bool isDir;
+        Match(const std::string & path, std::uint64_t size, std::uint64_t mtime, bool isDir)
+            :path(path), size(size), mtime(mtime), isDir(isDir) {}
+    };
+
+    class MatchOrder {
+    public:
+        MatchOrder(Archiver::ListQuery::SortKey sortKey, bool descending)
+            :sortKey(sortKey), descending(descending) {}
+        bool operator()(const Match & first, const Match & second) const {
+            return descending ? less(second, first) : less(first, second);
+        }
+
+    private:
+        bool less(const Match & first, const Match & second) const {
+            if (sortKey == Archiver::ListQuery::SortSize && first.size != second.size)
+                return first.size < second.size;
+            if (sortKey == Archiver::ListQuery::SortMtime && first.mtime != second.mtime)
+                return first.mtime < second.mtime;
+            return first.path < second.path;
+        }
+
+        Archiver::ListQuery::SortKey sortKey;
+        bool descending;
+    };
+
+    // Collects lines into chunks before handing them to the stream, a conversion per line is the slow part.
+    class LineWriter {
+    public:
+        explicit LineWriter(QTextStream & qTextStream)
+            :qTextStream(qTextStream) {
+            buffer.reserve(outputChunkSize + 4096);
+        }
+        ~LineWriter() {
+            flush();
+        }
+
+        void write(const Match & match) {
+            char line[64];
+            time_t mtime = match.mtime;
+            struct tm mtimeTm;
+            gmtime_r(&mtime, &mtimeTm);
+            int size = snprintf(line, sizeof(line), "%llu\t", (unsigned long long)match.size);
+            size += strftime(line + size, sizeof(line) - size, "%Y-%m-%d %H:%M:%S\t", &mtimeTm);
+            buffer.append(line, size);
+            buffer += match.path;
+            if (match.isDir)
+                buffer += '/';
+            buffer += '\n';
+            if (buffer.size() >= outputChunkSize)
+                flush();
+        }
+
+        void flush() {
+            if (buffer.empty())
+                return;
+            qTextStream << QString::fromUtf8(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+
+    private:
+        QTextStream & qTextStream;
+        std::string buffer;
+    };
+
+    // Entries are in bfs order, every child comes after its parent, so one backward pass sums all subtrees.
+    std::vector<std::uint64_t> subtreeSizes(const ArchiveIndex::Reader & index) {
+        std::vector<std::uint64_t> sizes(index.entryCount(), 0);
+        for (std::uint64_t i = index.entryCount(); i > 0; --i) {
+            const ArchiveIndex::Entry & entry = index.entry(i - 1);
+            if (entry.isRegularFile())
+                sizes[i - 1] += entry.contentSize;
+            if (entry.parent < i - 1)
+                sizes[entry.parent] += sizes[i - 1];
+        }
+        return sizes;
+    }
+}
+
+void ArchiveQuery::run(const ArchiveIndex::Reader & index, const Archiver::ListQuery & query, QTextStream & qTextStream) {
+    if (index.entryCount() == 0)
+        return;
+
+    QByteArray pathPattern = query.pathGlob.toUtf8();
+    QByteArray namePattern = query.nameGlob.toUtf8();
+    std::vector<std::uint64_t> sizes;
+    if (query.du)
+        sizes = subtreeSizes(index);
+    bool sorted = query.sortKey != Archiver::ListQuery::SortNone;
+
+    LineWriter writer(qTextStream);
+    std::vector<Match> matches;
+    std::uint64_t printed = 0;
+    std::uint64_t visited = 0;
+
+    // the path of the current entry is extended and cut back while walking,
+    // the stack keeps the length of the parent path of every pending entry
+    std::string path;
+    std::vector<std::pair<std::uint64_t, std::size_t> > stack(1, std::make_pair((std::uint64_t)0, (std::size_t)0));
+    while (!stack.empty()) {
+        std::uint64_t entryIndex = stack.back().first;
+        std::size_t parentPathSize = stack.back().second;
+        stack.pop_back();
+        if (++visited > index.entryCount()) {
+            throw Archiver::ArchiverException("Cycle of directories in archive");
+        }
+
+        const ArchiveIndex::Entry & entry = index.entry(entryIndex);
+        path.resize(parentPathSize);
+        if (entryIndex != 0)
+            path += '/';
+        std::size_t nameStart = path.size();
+        path.append(index.nameData(entry), entry.nameSize);
+
+        bool isDir = S_ISDIR(entry.mode);
+        std::uint64_t size = query.du ? sizes[entryIndex] : (entry.isRegularFile() ? entry.contentSize : 0);
+        bool matching = (query.type == Archiver::ListQuery::AnyEntry || isDir == (query.type == Archiver::ListQuery::DirsOnly))
+                && size >= query.minSize && size <= query.maxSize
+                && entry.mtime >= query.minMtime && entry.mtime <= query.maxMtime
+                && (pathPattern.isEmpty() || fnmatch(pathPattern.constData(), path.c_str(), FNM_PATHNAME) == 0)
+                && (namePattern.isEmpty() || fnmatch(namePattern.constData(), path.c_str() + nameStart, 0) == 0);
+        if (matching) {
+            if (sorted) {
+                matches.push_back(Match(path, size, entry.mtime, isDir));
+            } else {
+                writer.write(Match(path, size, entry.mtime, isDir));
+                if (++printed == query.limit)
+                    return;
+            }
+        }
+
+        if (isDir) {
+            for (std::uint64_t i = entry.childCount; i > 0; --i) {
+                stack.push_back(std::make_pair(entry.firstChild + i - 1, path.size()));
+            }
+        }
+    }
+
+    std::size_t count = matches.size();
+    if (query.limit != 0 && query.limit < count) {
+        count = query.limit;
+        std::partial_sort(matches.begin(), matches.begin() + count, matches.end(), MatchOrder(query.sortKey, query.descending));
+    } else {
+        std::sort(matches.begin(), matches.end(), MatchOrder(query.sortKey, query.descending));
+    }
+    for (std::size_t i = 0; i < count; ++i)
+        writer.write(matches[i]);
+}
@@ -0,0 +1,16 @@
+#ifndef ARCHIVE_QUERY_H
+#define ARCHIVE_QUERY_H
+
+#include "archive_index.h"
+#include "archiver.h"
+
+#include <QTextStream>
+
+namespace ArchiveQuery {
+    // Walks the index depth first and prints "size<TAB>mtime<TAB>path" of every entry passing the filters
+    // of query, directories with a trailing '/'. Paths are built while walking, no tree is built.
+    // Directory sizes are the sums of their subtrees when query.du is set, 0 otherwise.
+    void run(const ArchiveIndex::Reader & index, const Archiver::ListQuery & query, QTextStream & qTextStream);
+}
+
+#endif // ARCHIVE_QUERY_H
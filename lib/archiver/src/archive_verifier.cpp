@@ -0,0 +1,273 @@
+#include "archive_verifier.h"
+#include "archiver_utils.h"
+#include "checksum.h"
+#include "content_cipher.h"
+#include "content_codec.h"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+
+namespace apb = ArchiverUtils::protobufStructs;
+using ArchiverUtils::nowNs;
+
+namespace {
+    // Larger blocks in the meta are treated as corruption rather than allocated.
+    const std::uint64_t maxBlockSize = 64 << 20;
+}
+
+Archiver::VerifyOptions::VerifyOptions()
+    :threads(std::max(1u, std::thread::hardware_concurrency()))
+    ,queueDepth(4) {}
+
+struct ArchiveVerifier::Slot {
+    std::vector<char> stored;
+    std::vector<char> raw;
+    std::vector<char> scratch;
+    BlockTask* block;
+    Slot(std::uint64_t storedCapacity, std::uint64_t rawCapacity)
+        :stored(storedCapacity), raw(rawCapacity), block(NULL) {}
+};
+
+ArchiveVerifier::ArchiveVerifier(const std::vector<VerifyFileTask> & tasks, std::uint64_t contentSize,
+                                 const Archiver::VerifyOptions & options, const ContentCipher * cipher)
+    :tasks(tasks)
+    ,contentSize(contentSize)
+    ,cipher(cipher)
+    ,hasherThreads(std::max(1u, options.threads))
+    ,readerThreads(std::max(1u, options.queueDepth))
+    ,archiveFd(-1)
+    ,nextBlock(0)
+    ,slotCount(2 * (hasherThreads + readerThreads))
+    ,freeSlots(slotCount)
+    ,hashQueue(slotCount)
+    ,activeReaders(readerThreads)
+    ,abort(false) {}
+
+ArchiveVerifier::~ArchiveVerifier() {}
+
+std::vector<ArchiveVerifier::Problem> ArchiveVerifier::run(QFile * archive, Archiver::VerifyReport & report) {
+    std::uint64_t startNs = nowNs();
+    archiveFd = archive->handle();
+    archivePath = archive->fileName();
+
+    std::vector<Problem> problems;
+    planBlocks(problems);
+
+    std::uint64_t maxStoredSize = 0;
+    std::uint64_t maxRawSize = 0;
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        maxStoredSize = std::max(maxStoredSize, blocks[i].storedSize);
+        maxRawSize = std::max(maxRawSize, blocks[i].rawSize);
+    }
+    for (unsigned i = 0; i < slotCount; ++i) {
+        slotPool.push_back(std::unique_ptr<Slot>(new Slot(maxStoredSize, maxRawSize)));
+        freeSlots.tryPush(slotPool.back().get());
+    }
+
+    std::vector<std::thread> threads;
+    try {
+        for (unsigned i = 0; i < readerThreads; ++i)
+            threads.push_back(std::thread(&ArchiveVerifier::readerLoop, this));
+        for (unsigned i = 0; i < hasherThreads; ++i)
+            threads.push_back(std::thread(&ArchiveVerifier::hasherLoop, this));
+    } catch (...) {
+        fail();
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    for (std::size_t taskIndex = 0; taskIndex < taskBlocks.size(); ++taskIndex) {
+        std::size_t first = taskBlocks[taskIndex].first;
+        std::size_t count = taskBlocks[taskIndex].second;
+        if (count == 0)
+            continue; // empty, inlined or already rejected by planBlocks
+
+        const apb::PBRegFileMetaData & fileMeta = *tasks[taskIndex].fileMeta;
+        std::uint32_t fileChecksum = 0;
+        QString problem;
+        for (std::size_t i = 0; i < count && problem.isEmpty(); ++i) {
+            const BlockTask & block = blocks[first + i];
+            if (!block.problem.isEmpty()) {
+                problem = QString("block ") + QString::number((unsigned long long)i) + ": " + block.problem;
+                break;
+            }
+            if (fileMeta.blocks(i).has_checksum() && fileMeta.blocks(i).checksum() != block.checksum)
+                problem = QString("checksum mismatch in block ") + QString::number((unsigned long long)i);
+            fileChecksum = i == 0 ? block.checksum : Checksum::crc32cCombine(fileChecksum, block.checksum, block.rawSize);
+        }
+        // the checksum of a delta encoded file covers the rebuilt file, not its literal bytes
+        if (problem.isEmpty() && fileMeta.has_checksum() && !fileMeta.has_delta() && fileMeta.checksum() != fileChecksum)
+            problem = "checksum mismatch of file";
+        if (!problem.isEmpty())
+            problems.push_back(Problem(taskIndex, problem));
+    }
+
+    report.files += tasks.size();
+    report.blocks += blocks.size();
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        report.storedBytes += blocks[i].storedSize;
+        report.rawBytes += blocks[i].rawSize;
+    }
+    report.wallNs += nowNs() - startNs;
+
+    std::sort(problems.begin(), problems.end());
+    return problems;
+}
+
+// Checks block layout of every file against the content region and flattens all blocks
+// into one list, so the readers can spread even a single big file over all threads.
+void ArchiveVerifier::planBlocks(std::vector<Problem> & problems) {
+    // deduplicated files share one content range, its blocks are read only once
+    std::map<std::uint64_t, std::size_t> taskByContentOffset;
+    for (std::size_t taskIndex = 0; taskIndex < tasks.size(); ++taskIndex) {
+        const apb::PBRegFileMetaData & fileMeta = *tasks[taskIndex].fileMeta;
+        // blocks of a delta encoded file hold only its literal bytes
+        std::uint64_t size = fileMeta.has_delta() ? fileMeta.delta().literalsize() : fileMeta.contentsize();
+        std::uint64_t blockSize = fileMeta.blocksize();
+        QString problem;
+
+        if (fileMeta.has_delta() && !deltaCoversFile(fileMeta)) {
+            problem = "delta does not cover file";
+        } else if (fileMeta.has_inlinedata()) {
+            if (fileMeta.blocks_size() != 0)
+                problem = "inlined file with content blocks";
+            else if (fileMeta.inlinedata().size() != size)
+                problem = "inline data does not match size of file";
+            else if (fileMeta.has_checksum() && fileMeta.checksum() != Checksum::crc32c(0, fileMeta.inlinedata().data(), size))
+                problem = "checksum mismatch of file";
+        } else if (size == 0) {
+            if (fileMeta.blocks_size() != 0)
+                problem = "empty file with content blocks";
+            else if (fileMeta.has_checksum() && !fileMeta.has_delta() && fileMeta.checksum() != 0)
+                problem = "checksum mismatch of file";
+        } else if (blockSize == 0 || blockSize > maxBlockSize) {
+            problem = "bad block size";
+        } else if ((std::uint64_t)fileMeta.blocks_size() != (size + blockSize - 1) / blockSize) {
+            problem = "blocks do not cover file";
+        } else {
+            // sealed blocks carry the nonce and tag of the cipher
+            std::uint64_t overhead = cipher ? ContentCipher::overhead : 0;
+            std::uint64_t storedTotal = 0;
+            for (int i = 0; i < fileMeta.blocks_size() && problem.isEmpty(); ++i) {
+                std::uint64_t rawSize = std::min(blockSize, size - i * blockSize);
+                std::uint64_t storedSize = fileMeta.blocks(i).storedsize();
+                if (storedSize <= overhead || storedSize > ContentCodec::compressBound(blockSize) + overhead
+                        || (fileMeta.blocks(i).codec() == apb::CODEC_RAW && storedSize != rawSize + overhead))
+                    problem = QString("bad stored size of block ") + QString::number(i);
+                storedTotal += storedSize;
+            }
+            if (problem.isEmpty() && (fileMeta.contentoffset() > contentSize
+                                      || storedTotal > contentSize - fileMeta.contentoffset()))
+                problem = "content range is out of archive";
+        }
+
+        if (!problem.isEmpty() || size == 0 || fileMeta.has_inlinedata()) {
+            if (!problem.isEmpty())
+                problems.push_back(Problem(taskIndex, problem));
+            taskBlocks.push_back(std::make_pair(blocks.size(), (std::size_t)0));
+            continue;
+        }
+
+        std::map<std::uint64_t, std::size_t>::const_iterator shared = taskByContentOffset.find(fileMeta.contentoffset());
+        if (shared != taskByContentOffset.end() && sameBlocks(*tasks[shared->second].fileMeta, fileMeta)) {
+            taskBlocks.push_back(taskBlocks[shared->second]);
+            continue;
+        }
+        taskByContentOffset[fileMeta.contentoffset()] = taskIndex;
+
+        taskBlocks.push_back(std::make_pair(blocks.size(), (std::size_t)fileMeta.blocks_size()));
+        std::uint64_t archiveOffset = ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset();
+        for (int i = 0; i < fileMeta.blocks_size(); ++i) {
+            std::uint64_t rawSize = std::min(blockSize, size - i * blockSize);
+            blocks.push_back(BlockTask(taskIndex, fileMeta.blocks(i).codec(), archiveOffset,
+                                       fileMeta.blocks(i).storedsize(), rawSize));
+            archiveOffset += fileMeta.blocks(i).storedsize();
+        }
+    }
+}
+
+bool ArchiveVerifier::deltaCoversFile(const apb::PBRegFileMetaData & fileMeta) {
+    const apb::PBDelta & delta = fileMeta.delta();
+    if (fileMeta.has_inlinedata())
+        return false;
+    std::uint64_t total = 0;
+    std::uint64_t literal = 0;
+    for (int i = 0; i < delta.ops_size(); ++i) {
+        total += delta.ops(i).size();
+        if (!delta.ops(i).has_baseoffset())
+            literal += delta.ops(i).size();
+    }
+    return total == fileMeta.contentsize() && literal == delta.literalsize();
+}
+
+bool ArchiveVerifier::sameBlocks(const apb::PBRegFileMetaData & first, const apb::PBRegFileMetaData & second) {
+    if (first.contentsize() != second.contentsize() || first.blocksize() != second.blocksize()
+            || first.blocks_size() != second.blocks_size())
+        return false;
+    for (int i = 0; i < first.blocks_size(); ++i) {
+        if (first.blocks(i).storedsize() != second.blocks(i).storedsize() || first.blocks(i).codec() != second.blocks(i).codec())
+            return false;
+    }
+    return true;
+}
+
+void ArchiveVerifier::readerLoop() {
+    try {
+        for (;;) {
+            Slot* slot;
+            if (!freeSlots.pop(slot, abort))
+                break;
+            std::size_t blockIndex = nextBlock++;
+            if (blockIndex >= blocks.size()) {
+                freeSlots.tryPush(slot);
+                break;
+            }
+            slot->block = &blocks[blockIndex];
+            ArchiverUtils::readFully(archiveFd, slot->stored.data(), slot->block->storedSize,
+                                     slot->block->archiveOffset, archivePath);
+            if (!hashQueue.push(slot, abort))
+                break;
+        }
+    } catch (...) {
+        fail();
+    }
+
+    if (--activeReaders == 0)
+        hashQueue.close();
+}
+
+void ArchiveVerifier::hasherLoop() {
+    try {
+        Slot* slot;
+        while (hashQueue.pop(slot, abort)) {
+            BlockTask & block = *slot->block;
+            const char* raw = slot->stored.data();
+            try {
+                if (block.codec != apb::CODEC_RAW || cipher) {
+                    ContentCipher::decodeBlock(cipher, block.codec,
+                                               block.archiveOffset - ArchiverUtils::contentOffsetInArchive,
+                                               slot->stored.data(), block.storedSize,
+                                               slot->raw.data(), block.rawSize, slot->scratch);
+                    raw = slot->raw.data();
+                }
+                block.checksum = Checksum::crc32c(0, raw, block.rawSize);
+            } catch (Archiver::ArchiverException & e) {
+                block.problem = e.whatQMsg();
+            }
+            freeSlots.tryPush(slot);
+        }
+    } catch (...) {
+        fail();
+    }
+}
+
+void ArchiveVerifier::fail() {
+    std::lock_guard<std::mutex> lock(errorMutex);
+    if (!error)
+        error = std::current_exception();
+    abort = true;
+}
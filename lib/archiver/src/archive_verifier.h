@@ -0,0 +1,88 @@
+#ifndef ARCHIVE_VERIFIER_H
+#define ARCHIVE_VERIFIER_H
+
+#include "archiver.h"
+#include "bounded_queue.h"
+#include <struct_serialization.pb.h>
+
+#include <QFile>
+#include <QString>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class ContentCipher;
+
+struct VerifyFileTask {
+    std::uint64_t direntIndex;
+    const ArchiverUtils::protobufStructs::PBRegFileMetaData* fileMeta;
+    VerifyFileTask(std::uint64_t direntIndex, const ArchiverUtils::protobufStructs::PBRegFileMetaData* fileMeta)
+        :direntIndex(direntIndex), fileMeta(fileMeta) {}
+};
+
+// Re-reads every content block of the archive and checks it against the stored checksums.
+// queueDepth reader threads keep that many reads in flight, threads workers decompress
+// and hash the blocks (opening them first with cipher if it is not NULL); nothing is written to disk.
+class ArchiveVerifier {
+public:
+    typedef std::pair<std::size_t, QString> Problem;
+
+    ArchiveVerifier(const std::vector<VerifyFileTask> & tasks, std::uint64_t contentSize,
+                    const Archiver::VerifyOptions & options, const ContentCipher * cipher = NULL);
+    ~ArchiveVerifier();
+
+    // Fills counters of report and returns problems as (task index, reason).
+    std::vector<Problem> run(QFile * archive, Archiver::VerifyReport & report);
+
+private:
+    struct BlockTask {
+        std::size_t taskIndex;
+        ArchiverUtils::protobufStructs::PBCodec codec;
+        std::uint64_t archiveOffset;
+        std::uint64_t storedSize;
+        std::uint64_t rawSize;
+        std::uint32_t checksum;
+        QString problem;
+        BlockTask(std::size_t taskIndex, ArchiverUtils::protobufStructs::PBCodec codec,
+                  std::uint64_t archiveOffset, std::uint64_t storedSize, std::uint64_t rawSize)
+            :taskIndex(taskIndex), codec(codec), archiveOffset(archiveOffset)
+            ,storedSize(storedSize), rawSize(rawSize), checksum(0) {}
+    };
+    struct Slot;
+
+    void planBlocks(std::vector<Problem> & problems);
+    static bool deltaCoversFile(const ArchiverUtils::protobufStructs::PBRegFileMetaData & fileMeta);
+    static bool sameBlocks(const ArchiverUtils::protobufStructs::PBRegFileMetaData & first,
+                           const ArchiverUtils::protobufStructs::PBRegFileMetaData & second);
+    void readerLoop();
+    void hasherLoop();
+    void fail();
+
+    const std::vector<VerifyFileTask> & tasks;
+    const std::uint64_t contentSize;
+    const ContentCipher * cipher;
+    unsigned hasherThreads;
+    unsigned readerThreads;
+    int archiveFd;
+    QString archivePath;
+
+    std::vector<BlockTask> blocks;
+    std::vector<std::pair<std::size_t, std::size_t> > taskBlocks;
+    std::vector<std::unique_ptr<Slot> > slotPool;
+    std::atomic<std::size_t> nextBlock;
+
+    unsigned slotCount;
+    BoundedQueue<Slot*> freeSlots;
+    BoundedQueue<Slot*> hashQueue;
+    std::atomic<unsigned> activeReaders;
+    std::atomic<bool> abort;
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+#endif // ARCHIVE_VERIFIER_H
@@ -1,18 +1,44 @@
 #include "archiver.h"
+#include "archive_compare.h"
+#include "archive_index.h"
+#include "archive_query.h"
+#include "archive_verifier.h"
+#include "meta_codec.h"
 #include "meta_pack.h"
 #include "archiver_structs.h"
 #include "archiver_utils.h"
+#include "checksum.h"
+#include "content_cipher.h"
+#include "content_codec.h"
+#include "content_delta.h"
+#include "content_dedup.h"
+#include "io_control.h"
+#include "pack_checkpoint.h"
+#include "pack_delta.h"
+#include "pack_pipeline.h"
+#include "physical_order.h"
+#include "restore_sync.h"
+#include "stats_recorder.h"
 #include <fs_tree.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <struct_serialization.pb.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <linux/fs.h>
+#include <map>
 #include <memory>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -40,104 +66,229 @@ public:
     }
 };
 
+class QFileOutputStream : public google::protobuf::io::CopyingOutputStream {
+public:
+    explicit QFileOutputStream(QFile * file) : file(file) {}
+    bool Write(const void* buffer, int size) {
+        return file->write(static_cast<const char*>(buffer), size) == size;
+    }
+
+private:
+    QFile * file;
+};
+
+
+// base archives a delta encoded file is rebuilt through, guards against a cycle of archives
+const unsigned maxBaseChain = 64;
 
 //all new functions
 int addInodeToArchive(struct inode* inode, void* pointerToAps);
-void buildFsTree(std::unique_ptr<fs_tree, fs_treeDeleter> & fsTree, apb::PBArchiveMetaData & metaArchive,
-                 std::vector<std::uint64_t> & numberDirChildren);
-void calcNumberDirChildren(apb::PBArchiveMetaData & metaArchive, std::vector<std::uint64_t> & numberDirChildren);
-void checkArchiveSizes(std::uint64_t metaSize, std::uint64_t contentSize, std::uint64_t inputFileSize);
-int computeArchiveSize(struct inode* inode, void* pointerToArchiveInfo);
-apb::PBArchiveMetaData getMetaDataFromArchive(QFile & input, std::uint64_t metaSize);
+void checkArchiveSizes(QFile & input, std::uint64_t metaSize, std::uint64_t contentSize);
+void fillHeader(char* header, std::uint64_t metaSize, std::uint64_t contentSize);
+void countEntries(const apb::PBArchiveMetaData & metaArchive, Archiver::OperationStats * operationStats);
+void countIndexEntries(const ArchiveIndex::Reader & index, Archiver::OperationStats * operationStats);
+void getMetaDataFromArchive(QFile & input, std::uint64_t metaSize, apb::PBArchiveMetaData & metaArchive,
+                            const Archiver::JobControl* control = NULL);
+int isJobCancelled(void* control);
+uchar* mapStoredContent(QFile * archive, const apb::PBRegFileMetaData & fileMeta, std::uint64_t & storedSize,
+                        const QString & path);
+void openBaseArchive(BaseArchive & base);
+void seekToMeta(QFile & input, std::uint64_t contentSize);
 QString getPathInArchive(const apb::PBArchiveMetaData & archiveMeta, int index);
-QString getPathInArchive(struct inode* inode);
-std::uint64_t getSize(QFile & input);
-void printInodeToQTextStream(struct inode* inode, QTextStream & qTextStream, std::uint64_t spaceCount);
-void restoreDirsTime(const std::vector<DirTimeSetTask> & dirsQueue);
-void updateDirentInPBArchiveMetaData(std::uint64_t & direntIndexInPBArchiveMetaData, APS* aps, apb::PBDirEntMetaData& tempMeta);
-void unpackDirFromArchive(struct inode * inode, AUS* aus, const apb::PBDirEntMetaData & curDirent, QString & path);
-int unpackInodeFromArchive(struct inode* inode, void* pointerToAus);
-void unpackRegfileFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, QString & path);
+void printIndexEntries(const ArchiveIndex::Reader & index, QTextStream & qTextStream);
+void readHeader(QFile & input, std::uint64_t & metaSize, std::uint64_t & contentSize);
+void restoreDirsTime(const std::vector<DirTimeSetTask> & dirsQueue, RestoreSync & sync);
+void extractArchive(const QString & srcArchivePath, const QString & pathInArchive, const QString & dstPath,
+                    const Archiver::IoOptions & io, const QString & baseArchivePath,
+                    Archiver::OperationStats * operationStats);
+void extractEntries(const ArchiveIndex::Reader & index, std::uint64_t entryIndex, AUS* aus);
+void takeDeltaFromMeta(const ArchiveIndex::Reader & index, std::uint64_t entryIndex, AUS* aus,
+                       apb::PBDirEntMetaData* dirent);
+void packArchive(const QString & srcPath, const QString & dstArchiverPath,
+                 const Archiver::PackOptions & options, Archiver::PipelineStats * pipelineStats,
+                 Archiver::OperationStats * operationStats);
+void unpackArchive(const QString & srcArchivePath, const QString & dstPath, const Archiver::IoOptions & io,
+                   const QString & baseArchivePath, Archiver::OperationStats * operationStats);
+int unpackDirFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, const QString & path,
+                         int dirFd, const std::string & name);
+void unpackEntries(AUS* aus);
+void unpackRegfileFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, const QString & path,
+                              int dirFd, const std::string & name);
 void writeDirentIndexInPBArchiveMetaData(std::uint64_t & direntIndexInPBArchiveMetaData, struct inode* inode, APS* aps);
-void writeOneFileToArcive(QString path, std::uint64_t contentOffset, QFile * archive, std::uint64_t size);
-void readOneFileFromArcive(QString path, std::uint64_t contentOffset, QFile * archive, std::uint64_t size);
-void writeContentToArchive(const QString & srcPath , const apb::PBArchiveMetaData & metaArchive, const std::uint64_t contentOffset, QFile * archive);
+void readOneFileFromArcive(int fileDescriptor, const QString & path, const apb::PBRegFileMetaData & fileMeta,
+                           QFile * archive, const ContentCipher * cipher, const Archiver::IoOptions & io);
+char* mapRestoredFile(int fileDescriptor, std::uint64_t size, const QString & path);
+void unmapRestoredFile(char* content, std::uint64_t size, const QString & path);
+ContentCipher* openContentCipher(const apb::PBEncryption & record, const QByteArray & key, const QString & archivePath);
+ContentCipher* openContentCipher(const apb::PBArchiveMetaData & metaArchive, const QByteArray & key,
+                                 const QString & archivePath);
+apb::PBCipher toPBCipher(Archiver::Cipher cipher);
+void restoreDeltaFile(AUS* aus, const apb::PBRegFileMetaData & fileMeta, int fileDescriptor, const QString & path);
+void rebuildDeltaFile(QFile * archive, BaseArchive & base, const apb::PBRegFileMetaData & fileMeta, char* content,
+                      const QString & path, const Archiver::IoOptions & io, unsigned depth);
+std::unique_ptr<BaseArchive> openRecordedBase(const apb::PBBaseArchive & record, const QString & overridePath);
+// Parses the meta of base on first use.
+const apb::PBArchiveMetaData & baseArchiveMeta(BaseArchive & base);
+void copyRestoredFile(const QString & srcPath, int dstFileDescriptor, const QString & dstPath, std::uint64_t size,
+                      const Archiver::IoOptions & io);
+std::vector<PackFileTask> inlineTinyFiles(const std::vector<PackFileTask> & tasks, std::uint64_t inlineThreshold);
+void writeInlineFile(int fileDescriptor, const std::string & data, const QString & path);
+std::uint64_t writeContentToArchive(const QString & srcPath , apb::PBArchiveMetaData & metaArchive, QFile * archive,
+                                    const Archiver::PackOptions & options, Archiver::PipelineStats * pipelineStats,
+                                    PackCheckpoint & checkpoint, const ContentCipher * cipher);
 void writeEmptyContent(QFile * file, std::uint64_t size);
 
 ///////////////////////////////////////////
 ///////////////// PACK ////////////////////
 ///////////////////////////////////////////
 
-void Archiver::pack(const QString &srcPath, const QString &dstArchiverPath) {
-    QByteArray srcPathByteArray = srcPath.toLatin1();
-    std::unique_ptr<fs_tree, fs_treeDeleter> tree(fs_tree_collect(srcPathByteArray.data()));
+void Archiver::pack(const QString &srcPath, const QString &dstArchiverPath,
+                    const PackOptions & options, PipelineStats * pipelineStats, OperationStats * operationStats) {
+    IoControl::runWithPriority(options.io, [&]() {
+        packArchive(srcPath, dstArchiverPath, options, pipelineStats, operationStats);
+    });
+}
 
-    ArchiveInfo archiveInfo;
-    fs_tree_bfs(tree.get(), computeArchiveSize, static_cast<void*>(&archiveInfo));
+void packArchive(const QString & srcPath, const QString & dstArchiverPath,
+                 const Archiver::PackOptions & options, Archiver::PipelineStats * pipelineStats,
+                 Archiver::OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "pack");
+    recorder.phase("collect");
+    QByteArray srcPathByteArray = srcPath.toLatin1();
+    std::unique_ptr<fs_tree, fs_treeDeleter> tree(options.io.control
+            ? fs_tree_collect_cancellable(srcPathByteArray.data(), isJobCancelled, options.io.control)
+            : fs_tree_collect(srcPathByteArray.data()));
+    if (!tree) {
+        if (options.io.control)
+            options.io.control->checkCancelled();
+        throw Archiver::ArchiverException("Cannot read source " + srcPath + ": " + strerror(errno));
+    }
 
-    //std::unique_ptr<char[],std::default_delete<char[]> > filesContent(new char [archiveInfo.contentSize]);
+    recorder.phase("meta");
     APS aps(ArchiverUtils::getDirAbsPath(srcPath));
 
     fs_tree_bfs(tree.get(), addInodeToArchive, static_cast<void*>(&aps));
 
-    QFile output(dstArchiverPath);
-    std::uint64_t metaSize = aps.metaArchive.ByteSize();
-    std::unique_ptr<char[],std::default_delete<char[]> > meta(new char [metaSize]);
-    output.open(QIODevice::ReadWrite);
-
-    if (!aps.metaArchive.SerializeToArray(meta.get(), metaSize))
-        throw Archiver::ArchiverException("Failed to serialize meta info of" + srcPath);
+    recorder.phase("content");
+    QByteArray encryptionKey;
+    if (options.cipher != Archiver::CipherNone) {
+        if (options.io.encryptionKey.isEmpty())
+            throw Archiver::ArchiverException("No key to encrypt " + dstArchiverPath);
+        if (!options.baseArchivePath.isEmpty())
+            throw Archiver::ArchiverException("Encrypted archive cannot be packed against a base archive");
+        encryptionKey = options.io.encryptionKey;
+    }
 
-    if ((size_t)output.write((char*)&metaSize, ArchiverUtils::byteSizeOfNumber) < ArchiverUtils::byteSizeOfNumber)
-        throw Archiver::ArchiverException("Failed to write metaSize of" + srcPath);
+    PackCheckpoint checkpoint(dstArchiverPath, options.checkpointInterval);
+    bool resumed = options.resume && checkpoint.load(aps.dirAbsPath, encryptionKey);
 
-    if ((size_t)output.write((char*)&archiveInfo.contentSize, ArchiverUtils::byteSizeOfNumber) < ArchiverUtils::byteSizeOfNumber)
-        throw Archiver::ArchiverException("Failed to write contentSize of " + srcPath);
+    // a continued pack keeps sealing with the salt its content is sealed with
+    std::unique_ptr<ContentCipher> cipher;
+    QFile output(dstArchiverPath);
+    if (resumed) {
+        if (options.cipher != Archiver::CipherNone) {
+            apb::PBEncryption* encryption = aps.metaArchive.mutable_encryption();
+            encryption->CopyFrom(*checkpoint.encryption());
+            cipher.reset(new ContentCipher(*encryption, encryptionKey));
+        }
+        if (!output.open(QIODevice::ReadWrite))
+            throw Archiver::ArchiverException("Error with opening " + dstArchiverPath);
+        // an archive the log does not describe is packed again from the start
+        if (!checkpoint.validate(&output, cipher.get())) {
+            checkpoint.discard();
+            cipher.reset();
+            output.close();
+            resumed = false;
+        }
+    }
+    if (resumed) {
+        // content after the last checkpoint, the meta and the header are written again
+        if (!output.resize(ArchiverUtils::contentOffsetInArchive + checkpoint.contentEnd()) || !output.seek(0))
+            throw Archiver::ArchiverException("Failed to truncate " + dstArchiverPath);
+    } else {
+        if (options.cipher != Archiver::CipherNone) {
+            apb::PBEncryption* encryption = aps.metaArchive.mutable_encryption();
+            ContentCipher::createRecord(toPBCipher(options.cipher), encryptionKey, encryption);
+            cipher.reset(new ContentCipher(*encryption, encryptionKey));
+        }
+        // a log left by an earlier pack would describe content this one overwrites
+        checkpoint.remove();
+        if (!output.open(QIODevice::ReadWrite | QIODevice::Truncate))
+            throw Archiver::ArchiverException("Error with opening " + dstArchiverPath);
+    }
 
-    if ((size_t)output.write(meta.get(), metaSize) < metaSize)
-        throw Archiver::ArchiverException("Failed to write meta of " + srcPath);
+    // Compressed sizes are known only after the content is written,
+    // so the content goes right after the header and the meta is appended after it.
+    writeEmptyContent(&output, ArchiverUtils::contentOffsetInArchive);
+    if (resumed && !output.seek(ArchiverUtils::contentOffsetInArchive + checkpoint.contentEnd()))
+        throw Archiver::ArchiverException("Failed to seek to end of content of " + dstArchiverPath);
+    checkpoint.start(aps.dirAbsPath, aps.metaArchive.has_encryption() ? &aps.metaArchive.encryption() : NULL);
+    std::uint64_t contentSize = writeContentToArchive(aps.dirAbsPath, aps.metaArchive, &output, options, pipelineStats,
+                                                      checkpoint, cipher.get());
+
+    // the meta is serialized straight into the archive, a big meta is never held twice in memory
+    recorder.phase("serialize");
+    if (cipher)
+        aps.metaArchive.mutable_encryption()->set_metatag(cipher->metaTag(aps.metaArchive));
+    std::uint64_t metaSize = aps.metaArchive.ByteSizeLong();
+    {
+        QFileOutputStream metaStream(&output);
+        google::protobuf::io::CopyingOutputStreamAdaptor metaOutput(&metaStream, 1 << 20);
+        {
+            google::protobuf::io::CodedOutputStream codedOutput(&metaOutput);
+            aps.metaArchive.SerializeWithCachedSizes(&codedOutput);
+            if (codedOutput.HadError())
+                throw Archiver::ArchiverException("Failed to write meta of " + srcPath);
+        }
+        if (!metaOutput.Flush())
+            throw Archiver::ArchiverException("Failed to write meta of " + srcPath);
+    }
 
-    //writeEmptyContent(&output, archiveInfo.contentSize);
-    output.resize(ArchiverUtils::byteSizeOfNumber * 2 + metaSize + archiveInfo.contentSize);
+    recorder.phase("index");
+    ArchiveIndex::write(aps.metaArchive, &output);
 
-    writeContentToArchive(aps.dirAbsPath, aps.metaArchive, ArchiverUtils::byteSizeOfNumber * 2 + metaSize, &output);
+    recorder.phase("header");
+    if (!output.seek(0))
+        throw Archiver::ArchiverException("Failed to seek to header of " + dstArchiverPath);
 
-//    if ((size_t)output.write(filesContent.get(), archiveInfo.contentSize) < archiveInfo.contentSize)
-//        throw Archiver::ArchiverException("Failed to write filesContent of " + srcPath);
-}
+    char header[ArchiverUtils::archiveHeaderSize];
+    fillHeader(header, metaSize, contentSize);
+    if ((size_t)output.write(header, sizeof(header)) < sizeof(header))
+        throw Archiver::ArchiverException("Failed to write header of " + srcPath);
 
-int computeArchiveSize(struct inode* inode, void* pointerToArchiveInfo) {
-    if ((inode->type != INODE_REG_FILE) && (inode->type != INODE_DIR))
-        throw Archiver::ArchiverException(QString("Unexpected type of file. File: ") + inode->name);
-    LOG("computeArchiveSize: %s\n", inode->name);
+    // the checkpoint goes away only once the complete archive is on disk
+    if ((checkpoint.isActive() || checkpoint.isLoaded()) && (!output.flush() || fdatasync(output.handle()) == -1))
+        throw Archiver::ArchiverException("Failed to sync " + dstArchiverPath);
+    checkpoint.remove();
 
-    ArchiveInfo* archiveInfo = static_cast<ArchiveInfo*>(pointerToArchiveInfo);
-    if (inode->type == INODE_REG_FILE)
-        archiveInfo->contentSize += inode->attrs.st_size;
-    return 1;
+    countEntries(aps.metaArchive, recorder.stats());
+    if (recorder.stats())
+        recorder.stats()->storedBytes = contentSize;
+    recorder.finish();
 }
 
 int addInodeToArchive(struct inode* inode, void* pointerToAps) {
     APS* aps = static_cast<APS*>(pointerToAps);
 
-    apb::PBDirEntMetaData tempMeta;
-
     std::uint64_t direntIndexInPBArchiveMetaData = 0;
     writeDirentIndexInPBArchiveMetaData(direntIndexInPBArchiveMetaData, inode, aps);
 
+    // filled in place, elements of a repeated field stay where they are when it grows
+    apb::PBDirEntMetaData* dirent = aps->metaArchive.mutable_pbdirentmetadata(direntIndexInPBArchiveMetaData);
+    if (!dirent->has_parentix())
+        dirent->set_parentix(direntIndexInPBArchiveMetaData);
+
     switch (inode->type) {
     case INODE_REG_FILE:
-        pack_regfile_inode(reinterpret_cast<regular_file_inode*>(inode), &tempMeta, aps->contentFreePosition);
+        pack_regfile_inode(reinterpret_cast<regular_file_inode*>(inode), dirent);
         break;
     case INODE_DIR:
-        pack_dir_inode(reinterpret_cast<dir_inode*>(inode), &tempMeta, &(aps->metaArchive), direntIndexInPBArchiveMetaData);
+        pack_dir_inode(reinterpret_cast<dir_inode*>(inode), dirent, &(aps->metaArchive), direntIndexInPBArchiveMetaData);
         break;
     default:
         break;
     }
 
-    updateDirentInPBArchiveMetaData(direntIndexInPBArchiveMetaData, aps, tempMeta);
-
     return 1;
 }
 
@@ -150,65 +301,130 @@ void writeDirentIndexInPBArchiveMetaData(std::uint64_t & direntIndexInPBArchiveM
     }
 }
 
-void updateDirentInPBArchiveMetaData(std::uint64_t & direntIndexInPBArchiveMetaData, APS* aps, apb::PBDirEntMetaData& tempMeta) {
-    if (aps->metaArchive.pbdirentmetadata().Get(direntIndexInPBArchiveMetaData).has_parentix()) {
-        tempMeta.set_parentix(aps->metaArchive.pbdirentmetadata().Get(direntIndexInPBArchiveMetaData).parentix());
-    } else {
-        tempMeta.set_parentix(direntIndexInPBArchiveMetaData);
-    }
-    aps->metaArchive.mutable_pbdirentmetadata()->Mutable(direntIndexInPBArchiveMetaData)->Swap(&tempMeta);
-}
 
-void writeContentToArchive(const QString & srcPath , const apb::PBArchiveMetaData & metaArchive, const std::uint64_t contentOffset, QFile * archive) {
+std::uint64_t writeContentToArchive(const QString & srcPath , apb::PBArchiveMetaData & metaArchive, QFile * archive,
+                                    const Archiver::PackOptions & options, Archiver::PipelineStats * pipelineStats,
+                                    PackCheckpoint & checkpoint, const ContentCipher * cipher) {
+    std::vector<PackFileTask> tasks;
+    std::uint64_t totalBytes = 0;
     for (int i = 0; i < metaArchive.pbdirentmetadata_size(); ++i) {
         if (metaArchive.pbdirentmetadata(i).has_pbregfilemetadata()) {
             QString path = srcPath + getPathInArchive(metaArchive, i);
-            std::uint64_t offsetToFile = metaArchive.pbdirentmetadata(i).pbregfilemetadata().contentoffset();
-            std::uint64_t sizeOfFile = metaArchive.pbdirentmetadata(i).pbregfilemetadata().contentsize();
-            writeOneFileToArcive(path, contentOffset + offsetToFile, archive, sizeOfFile);
+            tasks.push_back(PackFileTask(path, metaArchive.mutable_pbdirentmetadata(i)->mutable_pbregfilemetadata(),
+                                         metaArchive.pbdirentmetadata(i).mtime()));
+            totalBytes += tasks.back().fileMeta->contentsize();
         }
     }
-}
-
-void writeEmptyContent(QFile * file, std::uint64_t size) {
-    while (size > 0) {
-        int temp = 0;
-        std::uint64_t actualSize = std::min(sizeof(temp), size);
-        file->write((char*)&temp, actualSize);
-        size -= actualSize;
+    std::uint64_t fileCount = tasks.size();
+    if (options.io.control)
+        options.io.control->setTotals(fileCount, totalBytes);
+
+    // inlined content and signatures would be left in the plain text meta
+    Archiver::PackOptions contentOptions = options;
+    if (cipher) {
+        contentOptions.inlineThreshold = 0;
+        contentOptions.signatureThreshold = 0;
     }
-}
 
-void writeOneFileToArcive(QString path, std::uint64_t contentOffset, QFile * archive, std::uint64_t size) {
-    QFile file(path);
-    if (!file.open(QIODevice::ReadOnly)) {
-        throw Archiver::ArchiverException(QString("Cannot open file: ") + path);
-    }
+    tasks = inlineTinyFiles(tasks, contentOptions.inlineThreshold);
 
-    archive->size();
-
-    if (size == 0) {
-        return;
+    std::vector<std::size_t> originals;
+    if (options.dedup) {
+        originals = ContentDedup::findDuplicates(tasks, options.io);
+    } else {
+        for (size_t i = 0; i < tasks.size(); ++i)
+            originals.push_back(i);
     }
-
-    uchar* mmap = file.map(0, size);
-    if (mmap == NULL) {
-        throw Archiver::ArchiverException(QString("Cannot mapped file: ") + path);
+    std::vector<PackFileTask> uniqueTasks;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        // files committed by an interrupted pack keep their content, unless they changed since
+        if (originals[i] == i && !(checkpoint.isLoaded() && checkpoint.restore(tasks[i])))
+            uniqueTasks.push_back(tasks[i]);
     }
-    uchar* archiveMmap = archive->map(contentOffset, size);
-    if (archiveMmap == NULL) {
-        throw Archiver::ArchiverException(QString("Cannot mapped archive with file: ") + path);
+    // inlined, duplicate and already committed files are done before any content is written
+    std::uint64_t pendingBytes = 0;
+    for (size_t i = 0; i < uniqueTasks.size(); ++i)
+        pendingBytes += uniqueTasks[i].fileMeta->contentsize();
+    IoControl::advance(options.io, fileCount - uniqueTasks.size(), totalBytes - pendingBytes);
+
+    // large files with a signed counterpart in the base archive are written as deltas after the rest
+    std::unique_ptr<BaseArchive> base;
+    google::protobuf::Arena baseArena(ArchiverUtils::metaArenaOptions());
+    std::unique_ptr<PackDelta> packDelta;
+    if (!options.baseArchivePath.isEmpty()) {
+        base.reset(new BaseArchive(options.baseArchivePath));
+        openBaseArchive(*base);
+        apb::PBArchiveMetaData & baseMeta = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&baseArena);
+        MetaCodec::parse(base->file, ArchiverUtils::contentOffsetInArchive + base->contentSize, base->metaSize, baseMeta,
+                         options.io.control);
+        packDelta.reset(new PackDelta(baseMeta, *base->index, srcPath, options));
+        packDelta->takeTasks(uniqueTasks);
+
+        apb::PBBaseArchive* baseRecord = metaArchive.mutable_basearchive();
+        baseRecord->set_path(QFileInfo(options.baseArchivePath).absoluteFilePath().toStdString());
+        baseRecord->set_metasize(base->metaSize);
+        baseRecord->set_contentsize(base->contentSize);
     }
 
-    memcpy(archiveMmap, mmap, size);
+    // only the content layout follows the read order, the meta order stays as is
+    if (options.physicalOrder)
+        PhysicalOrder::sortByDiskLocation(uniqueTasks);
 
-    if (!file.unmap(mmap)) {
-        throw Archiver::ArchiverException(QString("Cannot unmapped file: ") + path);
-    }
-    if (!archive->unmap(archiveMmap)) {
-        throw Archiver::ArchiverException(QString("Cannot unmapped archive with file: ") + path);
+    PackPipeline pipeline(uniqueTasks, contentOptions, cipher);
+    std::uint64_t contentSize = pipeline.run(archive, checkpoint.contentEnd(), checkpoint.isActive() ? &checkpoint : NULL);
+    Archiver::PipelineStats stats = pipeline.stats();
+    if (packDelta)
+        contentSize = packDelta->write(archive, contentSize, checkpoint.isActive() ? &checkpoint : NULL, stats);
+    if (pipelineStats)
+        *pipelineStats = stats;
+
+    ContentDedup::shareContent(tasks, originals);
+    return contentSize;
+}
+
+// Reads tiny files into their meta records one after another and returns the rest of tasks.
+std::vector<PackFileTask> inlineTinyFiles(const std::vector<PackFileTask> & tasks, std::uint64_t inlineThreshold) {
+    std::vector<PackFileTask> rest;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        apb::PBRegFileMetaData* fileMeta = tasks[i].fileMeta;
+        std::uint64_t size = fileMeta->contentsize();
+        if (size > inlineThreshold) {
+            rest.push_back(tasks[i]);
+            continue;
+        }
+
+        fileMeta->set_contentoffset(0);
+        fileMeta->clear_blocks();
+        if (size == 0) {
+            fileMeta->set_checksum(0);
+            continue;
+        }
+
+        QByteArray pathByteArray = tasks[i].path.toLocal8Bit();
+        int fileDescriptor = open(pathByteArray.data(), O_RDONLY);
+        if (fileDescriptor == -1)
+            throw Archiver::ArchiverException(QString("Cannot open file: ") + tasks[i].path);
+        std::string* data = fileMeta->mutable_inlinedata();
+        data->resize(size);
+        try {
+            ArchiverUtils::readFully(fileDescriptor, &(*data)[0], size, 0, tasks[i].path);
+        } catch (...) {
+            close(fileDescriptor);
+            throw;
+        }
+        close(fileDescriptor);
+        fileMeta->set_checksum(Checksum::crc32c(0, data->data(), size));
     }
+    return rest;
+}
 
+void writeEmptyContent(QFile * file, std::uint64_t size) {
+    while (size > 0) {
+        int temp = 0;
+        std::uint64_t actualSize = std::min(sizeof(temp), size);
+        file->write((char*)&temp, actualSize);
+        size -= actualSize;
+    }
 }
 
 
@@ -216,63 +432,163 @@ void writeOneFileToArcive(QString path, std::uint64_t contentOffset, QFile * arc
 //////////////// UNPACK ///////////////////
 ///////////////////////////////////////////
 
-void Archiver::unpack(const QString &srcArchivePath, const QString &dstPath) {
+void Archiver::unpack(const QString &srcArchivePath, const QString &dstPath, const IoOptions & io,
+                      const QString & baseArchivePath, OperationStats * operationStats) {
+    IoControl::runWithPriority(io, [&]() {
+        unpackArchive(srcArchivePath, dstPath, io, baseArchivePath, operationStats);
+    });
+}
+
+void unpackArchive(const QString & srcArchivePath, const QString & dstPath, const Archiver::IoOptions & io,
+                   const QString & baseArchivePath, Archiver::OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "unpack");
+    recorder.phase("meta");
     QFile input(srcArchivePath);
     if (!input.open(QIODevice::ReadOnly))
-        throw ArchiverException("Error with opening " + srcArchivePath);
+        throw Archiver::ArchiverException("Error with opening " + srcArchivePath);
 
-    std::uint64_t metaSize = getSize(input);
-    std::uint64_t contentSize = getSize(input);
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
 
-    checkArchiveSizes(metaSize, contentSize, input.size());
+    checkArchiveSizes(input, metaSize, contentSize);
 
-    apb::PBArchiveMetaData metaArchive = getMetaDataFromArchive(input, metaSize);
+    seekToMeta(input, contentSize);
+    google::protobuf::Arena arena(ArchiverUtils::metaArenaOptions());
+    apb::PBArchiveMetaData & metaArchive = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&arena);
+    getMetaDataFromArchive(input, metaSize, metaArchive, io.control);
 
-    std::vector<std::uint64_t> numberDirChildren(metaArchive.pbdirentmetadata_size());
-    calcNumberDirChildren(metaArchive, numberDirChildren);
+    recorder.phase("restore");
+    AUS aus(&input, ArchiverUtils::getDirAbsPath(dstPath), &metaArchive);
+    RestoreSync sync(io.durability, io.syncThreads, aus.dirAbsPath);
+    aus.sync = &sync;
+    aus.io = io;
+    aus.baseArchivePath = baseArchivePath;
+    if (io.control) {
+        std::uint64_t files = 0;
+        std::uint64_t bytes = 0;
+        for (int i = 0; i < metaArchive.pbdirentmetadata_size(); ++i) {
+            if (metaArchive.pbdirentmetadata(i).has_pbregfilemetadata()) {
+                ++files;
+                bytes += metaArchive.pbdirentmetadata(i).pbregfilemetadata().contentsize();
+            }
+        }
+        io.control->setTotals(files, bytes);
+    }
+    if (metaArchive.has_encryption())
+        aus.cipher.reset(openContentCipher(metaArchive, io.encryptionKey, srcArchivePath));
+    unpackEntries(&aus);
 
-    std::unique_ptr<fs_tree, fs_treeDeleter> fsTree(create_fs_tree());
-    buildFsTree(fsTree, metaArchive, numberDirChildren);
+    recorder.phase("dir times");
+    restoreDirsTime(aus.dirsQueue, sync);
 
-    AUS aus(&input, ArchiverUtils::getDirAbsPath(dstPath), &metaArchive);
-    fs_tree_bfs(fsTree.get(), unpackInodeFromArchive, static_cast<void*>(&aus));
+    recorder.phase("sync");
+    sync.finish();
 
-    restoreDirsTime(aus.dirsQueue);
+    countEntries(metaArchive, recorder.stats());
+    if (recorder.stats())
+        recorder.stats()->storedBytes = contentSize;
+    recorder.finish();
 }
 
-int unpackInodeFromArchive(struct inode* inode, void* pointerToAus) {
-    AUS* aus = static_cast<AUS*>(pointerToAus);
-    const apb::PBDirEntMetaData& curDirent = aus->metaArchive->pbdirentmetadata((std::uint64_t)inode->user_data);
-    QString path = aus->dirAbsPath + getPathInArchive(inode);
+// The meta lists every directory before its entries, so they are restored in the order of the meta
+// relative to the descriptor of their directory, which stays open until restoreDirsTime.
+void unpackEntries(AUS* aus) {
+    const apb::PBArchiveMetaData & metaArchive = *aus->metaArchive;
+    std::uint64_t entryCount = metaArchive.pbdirentmetadata_size();
+    // descriptor and path of every restored directory by entry index
+    std::vector<int> dirFds(entryCount, -1);
+    std::vector<QString> dirPaths(entryCount);
+
+    for (std::uint64_t i = 0; i < entryCount; ++i) {
+        const apb::PBDirEntMetaData & curDirent = metaArchive.pbdirentmetadata(i);
+        std::uint64_t parent = curDirent.parentix();
+        QString path;
+        int dirFd = AT_FDCWD;
+        std::string name;
+        if (i == 0) {
+            if (parent != 0)
+                throw Archiver::ArchiverException("Broken meta: no root directory");
+            path = aus->dirAbsPath + ArchiverUtils::getDirentName(QString::fromStdString(curDirent.name()));
+            name = path.toStdString();
+        } else {
+            if (parent >= i || !S_ISDIR(metaArchive.pbdirentmetadata(parent).mode()))
+                throw Archiver::ArchiverException("Broken meta: entry " + QString::number(i) + " is not after its directory");
+            name = curDirent.name();
+            path = dirPaths[parent] + QDir::separator() + QString::fromStdString(name);
+            dirFd = dirFds[parent];
+        }
 
-    switch (inode->type) {
-    case INODE_REG_FILE:
-        unpackRegfileFromArchive(aus, curDirent, path);
-        break;
-    case INODE_DIR:
-        unpackDirFromArchive(inode, aus, curDirent, path);
-        break;
-    default:
-        break;
+        if (curDirent.has_pbregfilemetadata()) {
+            unpackRegfileFromArchive(aus, curDirent, path, dirFd, name);
+        } else if (S_ISDIR(curDirent.mode())) {
+            dirFds[i] = unpackDirFromArchive(aus, curDirent, path, dirFd, name);
+            dirPaths[i] = path;
+        }
     }
-
-    return 1;
 }
 
-void unpackRegfileFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, QString & path) {
-    readOneFileFromArcive(path, ArchiverUtils::byteSizeOfNumber * 2 + aus->metaArchive->ByteSize() + curDirent.pbregfilemetadata().contentoffset(), aus->archive, curDirent.pbregfilemetadata().contentsize());
-
-    std::string pathStdString = path.toStdString();
-    int fileDescriptor;
+// The file is name relative to dirFd, path is the same file for the content and messages.
+void unpackRegfileFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, const QString & path,
+                              int dirFd, const std::string & name) {
+    const apb::PBRegFileMetaData & fileMeta = curDirent.pbregfilemetadata();
+    bool inlined = fileMeta.has_inlinedata() || fileMeta.contentsize() == 0;
     timeval time[2];
-    fileDescriptor = open(pathStdString.c_str(), O_WRONLY | O_CREAT, curDirent.mode());
+    std::uint64_t reportedBytes = 0;
+
+    // tiny files are written straight from the meta, the archive is not touched;
+    // like content decoded from the archive, the data is checked before anything is written
+    if (inlined && fileMeta.inlinedata().size() != fileMeta.contentsize()) {
+        throw Archiver::ArchiverException(QString("Inline data does not match size of file: ") + path);
+    }
+    if (inlined && fileMeta.has_checksum()
+            && fileMeta.checksum() != Checksum::crc32c(0, fileMeta.inlinedata().data(), fileMeta.inlinedata().size())) {
+        throw Archiver::ArchiverException(QString("Checksum mismatch in file: ") + path);
+    }
+
+    // the file is opened once by its name in the restored directory, every writer works on this descriptor
+    mode_t mode = curDirent.mode() & 07777;
+    bool created = true;
+    int fileDescriptor = openat(dirFd, name.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fileDescriptor == -1 && errno == EEXIST) {
+        created = false;
+        fileDescriptor = openat(dirFd, name.c_str(), O_RDWR | O_TRUNC);
+    }
     if (fileDescriptor == -1) {
-        qCritical() << "Error in opening " << path << '\n';
-        return ;
+        throw Archiver::ArchiverException(QString("Cannot open file: ") + path);
+    }
+    try {
+        if (inlined) {
+            IoControl::acquire(aus->io, fileMeta.inlinedata().size());
+            writeInlineFile(fileDescriptor, fileMeta.inlinedata(), path);
+        } else {
+            // identical files share one content range, it is decoded only for the first of them
+            std::map<std::uint64_t, RestoredContent>::const_iterator restored = aus->restoredContent.find(fileMeta.contentoffset());
+            if (restored != aus->restoredContent.end() && restored->second.size == fileMeta.contentsize()
+                    && restored->second.checksum == fileMeta.checksum()) {
+                copyRestoredFile(restored->second.path, fileDescriptor, path, fileMeta.contentsize(), aus->io);
+            } else {
+                if (fileMeta.has_delta()) {
+                    restoreDeltaFile(aus, fileMeta, fileDescriptor, path);
+                } else {
+                    // it reports the bytes of every block as soon as the block is written
+                    readOneFileFromArcive(fileDescriptor, path, fileMeta, aus->archive, aus->cipher.get(), aus->io);
+                    reportedBytes = fileMeta.contentsize();
+                }
+                aus->restoredContent[fileMeta.contentoffset()] = RestoredContent(path, fileMeta.contentsize(), fileMeta.checksum());
+            }
+        }
+    } catch (...) {
+        close(fileDescriptor);
+        throw;
     }
+    IoControl::advance(aus->io, 1, fileMeta.contentsize() - reportedBytes);
 
     if (fchown(fileDescriptor, curDirent.uid(), curDirent.gid()))
         qCritical() << "Error in chowning " << path << '\n';
+    // open applies the mode only to a new file and without the bits of the umask, chown clears set-id bits
+    if ((!created || (mode & aus->creationMask) || (mode & (S_ISUID | S_ISGID))) && fchmod(fileDescriptor, mode))
+        qCritical() << "Error in changing mode " << path << '\n';
 
     time[0].tv_sec = curDirent.atime();
     time[0].tv_usec = 0;
@@ -281,23 +597,28 @@ void unpackRegfileFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent,
     if (futimes(fileDescriptor, time))
         qCritical() << "Error in changing time " << path << '\n';
 
+    aus->sync->fileRestored(fileDescriptor, path);
     close(fileDescriptor);
 }
 
-void unpackDirFromArchive(struct inode * inode, AUS* aus, const apb::PBDirEntMetaData & curDirent, QString & path) {
-    std::string pathStdString = path.toStdString();
+// Returns the descriptor of the directory, -1 if it cannot be opened.
+int unpackDirFromArchive(AUS* aus, const apb::PBDirEntMetaData & curDirent, const QString & path,
+                         int dirFd, const std::string & name) {
     int fileDescriptor;
-    mkdir(pathStdString.c_str(), inode->attrs.st_mode);
-    fileDescriptor = open(pathStdString.c_str(), O_RDONLY | O_DIRECTORY);
+    mkdirat(dirFd, name.c_str(), curDirent.mode());
+    fileDescriptor = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY);
     if (fileDescriptor == -1) {
         qCritical() << "Error in opening " << path << '\n';
-        return ;
+        return -1;
     }
     fchown(fileDescriptor, curDirent.uid(), curDirent.gid());
     aus->dirsQueue.push_back(DirTimeSetTask(fileDescriptor, curDirent.atime(), curDirent.mtime()));
+    return fileDescriptor;
 }
 
-void restoreDirsTime(const std::vector<DirTimeSetTask> & dirsQueue) {
+void restoreDirsTime(const std::vector<DirTimeSetTask> & dirsQueue, RestoreSync & sync) {
+    std::vector<int> dirFds;
+    dirFds.reserve(dirsQueue.size());
     for (int i = dirsQueue.size()-1; i >= 0; --i) {
         timeval time[2];
         time[0].tv_sec = dirsQueue[i].atime;
@@ -306,47 +627,402 @@ void restoreDirsTime(const std::vector<DirTimeSetTask> & dirsQueue) {
         time[1].tv_usec = 0;
         if (futimes(dirsQueue[i].fd, time))
             qCritical() << "Error in changing time." << '\n';
-        close(dirsQueue[i].fd);
+        dirFds.push_back(dirsQueue[i].fd);
     }
+    // the entries and times of directories are synced before their descriptors are closed
+    sync.dirsRestored(dirFds);
+    for (std::size_t i = 0; i < dirFds.size(); ++i)
+        close(dirFds[i]);
 }
 
-void readOneFileFromArcive(QString path, std::uint64_t contentOffset, QFile * archive, std::uint64_t size) {
-    QFile file(path);
-    if (!file.open(QIODevice::ReadWrite)) {
-        throw Archiver::ArchiverException(QString("Cannot open file: ") + path);
-    }
-
-    file.resize(size);
-    file.size();
+void readOneFileFromArcive(int fileDescriptor, const QString & path, const apb::PBRegFileMetaData & fileMeta,
+                           QFile * archive, const ContentCipher * cipher, const Archiver::IoOptions & io) {
+    std::uint64_t size = fileMeta.contentsize();
     if (size == 0) {
         return;
     }
 
-    uchar* mmap = file.map(0, size);
-    if (mmap == NULL) {
-        throw Archiver::ArchiverException(QString("Cannot mapped file: ") + path);
+    std::uint64_t storedSize = 0;
+    for (int i = 0; i < fileMeta.blocks_size(); ++i)
+        storedSize += fileMeta.blocks(i).storedsize();
+    if (fileMeta.blocksize() == 0 || storedSize == 0) {
+        throw Archiver::ArchiverException(QString("Broken blocks meta of file: ") + path);
+    }
+    std::uint64_t archiveSize = archive->size();
+    if (ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset() > archiveSize
+            || storedSize > archiveSize - ArchiverUtils::contentOffsetInArchive - fileMeta.contentoffset()) {
+        throw Archiver::ArchiverException(QString("Content of file is out of archive: ") + path);
     }
-    uchar* archiveMmap = archive->map(contentOffset, size);
+
+    char* mmap = mapRestoredFile(fileDescriptor, size, path);
+    uchar* archiveMmap = archive->map(ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset(), storedSize);
     if (archiveMmap == NULL) {
+        unmapRestoredFile(mmap, size, path);
         throw Archiver::ArchiverException(QString("Cannot mapped archive with file: ") + path);
     }
+    StatsRecorder::countMapping();
+
+    // a file left mapped would stay in the address space of the process
+    try {
+        std::uint64_t rawOffset = 0;
+        std::uint64_t storedOffset = 0;
+        std::uint32_t fileChecksum = 0;
+        std::vector<char> scratch;
+        for (int i = 0; i < fileMeta.blocks_size(); ++i) {
+            if (rawOffset >= size) {
+                throw Archiver::ArchiverException(QString("Too many blocks in file: ") + path);
+            }
+            const apb::PBContentBlock & block = fileMeta.blocks(i);
+            std::uint64_t rawSize = std::min(fileMeta.blocksize(), size - rawOffset);
+            char* rawBlock = mmap + rawOffset;
+            // one operation for the block read from the archive and one for the block written to the file
+            IoControl::acquire(io, block.storedsize());
+            IoControl::acquire(io, rawSize);
+            ContentCipher::decodeBlock(cipher, block.codec(), fileMeta.contentoffset() + storedOffset,
+                                       reinterpret_cast<const char*>(archiveMmap) + storedOffset,
+                                       block.storedsize(), rawBlock, rawSize, scratch);
+
+            std::uint32_t blockChecksum = Checksum::crc32c(0, rawBlock, rawSize);
+            if (block.has_checksum() && block.checksum() != blockChecksum) {
+                throw Archiver::ArchiverException(QString("Checksum mismatch in block ") + QString::number(i) + " of file: " + path);
+            }
+            fileChecksum = i == 0 ? blockChecksum : Checksum::crc32cCombine(fileChecksum, blockChecksum, rawSize);
+            IoControl::advance(io, 0, rawSize);
+
+            rawOffset += rawSize;
+            storedOffset += block.storedsize();
+        }
+        if (rawOffset != size) {
+            throw Archiver::ArchiverException(QString("Blocks do not cover file: ") + path);
+        }
+        if (fileMeta.has_checksum() && fileMeta.checksum() != fileChecksum) {
+            throw Archiver::ArchiverException(QString("Checksum mismatch in file: ") + path);
+        }
+    } catch (...) {
+        munmap(mmap, size);
+        archive->unmap(archiveMmap);
+        throw;
+    }
 
-    memcpy(mmap, archiveMmap, size);
+    unmapRestoredFile(mmap, size, path);
+    if (!archive->unmap(archiveMmap)) {
+        throw Archiver::ArchiverException(QString("Cannot unmapped archive with file: ") + path);
+    }
+
+}
+
+// Rebuilds a delta encoded file from its literal bytes and the file it was encoded against in the base archive.
+void restoreDeltaFile(AUS* aus, const apb::PBRegFileMetaData & fileMeta, int fileDescriptor, const QString & path) {
+    if (!aus->baseArchive) {
+        if (aus->metaArchive == NULL || !aus->metaArchive->has_basearchive())
+            throw Archiver::ArchiverException(QString("No base archive for delta encoded file: ") + path);
+        aus->baseArchive = openRecordedBase(aus->metaArchive->basearchive(), aus->baseArchivePath);
+    }
 
-    if (!file.unmap(mmap)) {
+    std::uint64_t size = fileMeta.contentsize();
+    char* mmap = mapRestoredFile(fileDescriptor, size, path);
+    try {
+        rebuildDeltaFile(aus->archive, *aus->baseArchive, fileMeta, mmap, path, aus->io, 0);
+    } catch (...) {
+        munmap(mmap, size);
+        throw;
+    }
+    unmapRestoredFile(mmap, size, path);
+}
+
+// Sizes the restored file to size and maps it for writing.
+char* mapRestoredFile(int fileDescriptor, std::uint64_t size, const QString & path) {
+    if (ftruncate(fileDescriptor, size) == -1) {
+        throw Archiver::ArchiverException(QString("Cannot resize file: ") + path);
+    }
+    void* content = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+    if (content == MAP_FAILED) {
+        throw Archiver::ArchiverException(QString("Cannot mapped file: ") + path);
+    }
+    StatsRecorder::countMapping();
+    return static_cast<char*>(content);
+}
+
+void unmapRestoredFile(char* content, std::uint64_t size, const QString & path) {
+    if (munmap(content, size) == -1) {
         throw Archiver::ArchiverException(QString("Cannot unmapped file: ") + path);
     }
-    if (!archive->unmap(archiveMmap)) {
+}
+
+// Rebuilds the content of a delta encoded file of archive into content. A base file that is delta encoded
+// itself is rebuilt in memory from the base of base first, depth counts the base archives passed.
+void rebuildDeltaFile(QFile * archive, BaseArchive & base, const apb::PBRegFileMetaData & fileMeta, char* content,
+                      const QString & path, const Archiver::IoOptions & io, unsigned depth) {
+    if (depth >= maxBaseChain)
+        throw Archiver::ArchiverException(QString("Too long chain of base archives for delta encoded file: ") + path);
+    const apb::PBDelta & delta = fileMeta.delta();
+    std::uint64_t baseEntry = base.index->find(QString::fromUtf8(delta.basepath().data(), delta.basepath().size()));
+    if (baseEntry == base.index->entryCount() || !base.index->entry(baseEntry).isRegularFile()
+            || (base.index->entry(baseEntry).flags & ArchiveIndex::InlineContent))
+        throw Archiver::ArchiverException(QString("No base in base archive for delta encoded file: ") + path);
+    apb::PBDirEntMetaData baseDirent;
+    const apb::PBRegFileMetaData* baseFileMeta = NULL;
+    if (base.index->entry(baseEntry).flags & ArchiveIndex::DeltaContent) {
+        const apb::PBArchiveMetaData & baseMeta = baseArchiveMeta(base);
+        if (baseEntry >= (std::uint64_t)baseMeta.pbdirentmetadata_size()
+                || !baseMeta.pbdirentmetadata(baseEntry).pbregfilemetadata().has_delta())
+            throw Archiver::ArchiverException("Index does not match meta of base archive " + base.file.fileName());
+        baseFileMeta = &baseMeta.pbdirentmetadata(baseEntry).pbregfilemetadata();
+    } else {
+        base.index->toDirent(baseEntry, &baseDirent);
+        baseFileMeta = &baseDirent.pbregfilemetadata();
+    }
+
+    std::uint64_t size = fileMeta.contentsize();
+    // only the restored file itself is written out, bases of bases are rebuilt in memory
+    Archiver::IoOptions writeIo = io;
+    if (depth > 0)
+        writeIo.limiter = NULL;
+    std::uint64_t literalStoredSize = 0;
+    uchar* literalMmap = mapStoredContent(archive, fileMeta, literalStoredSize, path);
+    ContentDelta::BlockReader literals(fileMeta, delta.literalsize(), reinterpret_cast<const char*>(literalMmap),
+                                       literalStoredSize, path, io);
+    if (baseFileMeta->has_delta()) {
+        if (!base.base) {
+            const apb::PBArchiveMetaData & baseMeta = baseArchiveMeta(base);
+            if (!baseMeta.has_basearchive())
+                throw Archiver::ArchiverException("No base archive of base archive " + base.file.fileName());
+            base.base = openRecordedBase(baseMeta.basearchive(), QString());
+        }
+        std::vector<char> baseContent(baseFileMeta->contentsize());
+        rebuildDeltaFile(&base.file, *base.base, *baseFileMeta, baseContent.data(), base.file.fileName(), io, depth + 1);
+        ContentDelta::MemoryReader baseReader(baseContent.data(), baseContent.size(), base.file.fileName());
+        ContentDelta::apply(delta, baseReader, literals, content, size, path, writeIo);
+    } else {
+        std::uint64_t baseStoredSize = 0;
+        uchar* baseMmap = mapStoredContent(&base.file, *baseFileMeta, baseStoredSize, path);
+        ContentDelta::BlockReader baseReader(*baseFileMeta, baseFileMeta->contentsize(),
+                                             reinterpret_cast<const char*>(baseMmap), baseStoredSize,
+                                             base.file.fileName(), io);
+        ContentDelta::apply(delta, baseReader, literals, content, size, path, writeIo);
+        if (baseMmap != NULL && !base.file.unmap(baseMmap)) {
+            throw Archiver::ArchiverException(QString("Cannot unmapped base archive with file: ") + path);
+        }
+    }
+    if (fileMeta.has_checksum() && fileMeta.checksum() != Checksum::crc32c(0, content, size)) {
+        throw Archiver::ArchiverException(QString("Checksum mismatch in file: ") + path);
+    }
+    if (literalMmap != NULL && !archive->unmap(literalMmap)) {
         throw Archiver::ArchiverException(QString("Cannot unmapped archive with file: ") + path);
     }
+}
+
+// Opens the base archive of record, from overridePath if it is not empty, and checks it is the one
+// the delta encoded files were packed against.
+std::unique_ptr<BaseArchive> openRecordedBase(const apb::PBBaseArchive & record, const QString & overridePath) {
+    QString path = overridePath.isEmpty() ? QString::fromStdString(record.path()) : overridePath;
+    std::unique_ptr<BaseArchive> base(new BaseArchive(path));
+    openBaseArchive(*base);
+    if (base->metaSize != record.metasize() || base->contentSize != record.contentsize())
+        throw Archiver::ArchiverException("Archive was not packed against base archive " + path);
+    return base;
+}
+
+const apb::PBArchiveMetaData & baseArchiveMeta(BaseArchive & base) {
+    if (base.meta == NULL) {
+        base.metaArena.reset(new google::protobuf::Arena(ArchiverUtils::metaArenaOptions()));
+        base.meta = google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(base.metaArena.get());
+        MetaCodec::parse(base.file, ArchiverUtils::contentOffsetInArchive + base.contentSize, base.metaSize, *base.meta);
+    }
+    return *base.meta;
+}
+
+// Maps the blocks of fileMeta from archive, NULL if it has none.
+uchar* mapStoredContent(QFile * archive, const apb::PBRegFileMetaData & fileMeta, std::uint64_t & storedSize,
+                        const QString & path) {
+    storedSize = 0;
+    for (int i = 0; i < fileMeta.blocks_size(); ++i)
+        storedSize += fileMeta.blocks(i).storedsize();
+    if (storedSize == 0)
+        return NULL;
+    std::uint64_t archiveSize = archive->size();
+    if (ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset() > archiveSize
+            || storedSize > archiveSize - ArchiverUtils::contentOffsetInArchive - fileMeta.contentoffset()) {
+        throw Archiver::ArchiverException(QString("Content of file is out of archive: ") + path);
+    }
+    uchar* mmap = archive->map(ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset(), storedSize);
+    if (mmap == NULL) {
+        throw Archiver::ArchiverException(QString("Cannot mapped archive with file: ") + path);
+    }
+    StatsRecorder::countMapping();
+    return mmap;
+}
+
+void writeInlineFile(int fileDescriptor, const std::string & data, const QString & path) {
+    std::uint64_t done = 0;
+    while (done < data.size()) {
+        ssize_t result = write(fileDescriptor, data.data() + done, data.size() - done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            throw Archiver::ArchiverException(QString("Cannot write file: ") + path);
+        done += result;
+    }
+}
+
+// The copy shares the blocks of the restored file where the file system can reflink them,
+// otherwise the kernel copies them and nothing of the content passes through the process.
+void copyRestoredFile(const QString & srcPath, int dstFileDescriptor, const QString & dstPath, std::uint64_t size,
+                      const Archiver::IoOptions & io) {
+    QFile src(srcPath);
+    if (!src.open(QIODevice::ReadOnly)) {
+        throw Archiver::ArchiverException(QString("Cannot open file: ") + srcPath);
+    }
+    if (io.control)
+        io.control->checkCancelled();
+    if (ioctl(dstFileDescriptor, FICLONE, src.handle()) == 0)
+        return;
 
+    bool kernelCopy = true;
+    std::vector<char> buffer;
+    for (std::uint64_t offset = 0; offset < size; offset += ContentCodec::defaultBlockSize) {
+        std::uint64_t chunkSize = std::min(ContentCodec::defaultBlockSize, size - offset);
+        IoControl::acquire(io, chunkSize);
+        std::uint64_t done = 0;
+        while (kernelCopy && done < chunkSize) {
+            loff_t srcOffset = offset + done;
+            loff_t dstOffset = offset + done;
+            ssize_t result = copy_file_range(src.handle(), &srcOffset, dstFileDescriptor, &dstOffset, chunkSize - done, 0);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                kernelCopy = false;
+            else if (result <= 0)
+                throw Archiver::ArchiverException(QString("Cannot copy restored file to: ") + dstPath);
+            else
+                done += result;
+        }
+        // without a kernel copy between these files the rest goes through a buffer
+        if (done < chunkSize) {
+            buffer.resize(chunkSize - done);
+            ArchiverUtils::readFully(src.handle(), buffer.data(), buffer.size(), offset + done, srcPath);
+            ArchiverUtils::writeFully(dstFileDescriptor, buffer.data(), buffer.size(), offset + done, dstPath);
+        }
+    }
 }
 
+///////////////////////////////////////////
+//////////////// EXTRACT //////////////////
+///////////////////////////////////////////
+
+void Archiver::extract(const QString & srcArchivePath, const QString & pathInArchive, const QString & dstPath,
+                       const IoOptions & io, const QString & baseArchivePath, OperationStats * operationStats) {
+    IoControl::runWithPriority(io, [&]() {
+        extractArchive(srcArchivePath, pathInArchive, dstPath, io, baseArchivePath, operationStats);
+    });
+}
+
+void extractArchive(const QString & srcArchivePath, const QString & pathInArchive, const QString & dstPath,
+                    const Archiver::IoOptions & io, const QString & baseArchivePath,
+                    Archiver::OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "extract");
+    recorder.phase("index");
+    QFile input(srcArchivePath);
+    if (!input.open(QIODevice::ReadOnly)) {
+        throw Archiver::ArchiverException("Error with opening " + srcArchivePath);
+    }
+
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
+
+    checkArchiveSizes(input, metaSize, contentSize);
+
+    ArchiveIndex::Reader index(input, metaSize, contentSize);
+    std::unique_ptr<ContentCipher> cipher;
+    apb::PBEncryption encryption;
+    if (index.encryption(&encryption)) {
+        cipher.reset(openContentCipher(encryption, io.encryptionKey, srcArchivePath));
+        index.authenticate(*cipher);
+    }
+    std::uint64_t entryIndex = index.find(pathInArchive);
+    if (entryIndex == index.entryCount()) {
+        throw Archiver::ArchiverException("No such path in archive: " + pathInArchive);
+    }
+
+    recorder.phase("restore");
+    AUS aus(&input, ArchiverUtils::getDirAbsPath(dstPath), NULL);
+    RestoreSync sync(io.durability, io.syncThreads, aus.dirAbsPath);
+    aus.sync = &sync;
+    aus.io = io;
+    aus.baseArchivePath = baseArchivePath;
+    aus.stats = recorder.stats();
+    aus.cipher = std::move(cipher);
+    extractEntries(index, entryIndex, &aus);
+
+    recorder.phase("dir times");
+    restoreDirsTime(aus.dirsQueue, sync);
+
+    recorder.phase("sync");
+    sync.finish();
+    recorder.finish();
+}
+
+// Restores the subtree of entryIndex in bfs order, touching only its entries of the index.
+void extractEntries(const ArchiveIndex::Reader & index, std::uint64_t entryIndex, AUS* aus) {
+    std::vector<std::pair<std::uint64_t, QString> > queue;
+    queue.push_back(std::make_pair(entryIndex, aus->dirAbsPath + index.name(index.entry(entryIndex))));
+
+    for (std::size_t i = 0; i < queue.size(); ++i) {
+        if (queue.size() > index.entryCount()) {
+            throw Archiver::ArchiverException("Cycle of directories in archive");
+        }
+        apb::PBDirEntMetaData curDirent;
+        index.toDirent(queue[i].first, &curDirent);
+        QString path = queue[i].second;
+
+        if (curDirent.has_pbregfilemetadata()) {
+            if (index.entry(queue[i].first).flags & ArchiveIndex::DeltaContent)
+                takeDeltaFromMeta(index, queue[i].first, aus, &curDirent);
+            unpackRegfileFromArchive(aus, curDirent, path, AT_FDCWD, path.toStdString());
+            if (aus->stats) {
+                const apb::PBRegFileMetaData & fileMeta = curDirent.pbregfilemetadata();
+                ++aus->stats->files;
+                aus->stats->rawBytes += fileMeta.contentsize();
+                for (int block = 0; block < fileMeta.blocks_size(); ++block)
+                    aus->stats->storedBytes += fileMeta.blocks(block).storedsize();
+            }
+        } else if (S_ISDIR(curDirent.mode())) {
+            unpackDirFromArchive(aus, curDirent, path, AT_FDCWD, path.toStdString());
+            if (aus->stats)
+                ++aus->stats->dirs;
+            const ArchiveIndex::Entry & dir = index.entry(queue[i].first);
+            for (std::uint64_t child = 0; child < dir.childCount; ++child) {
+                const ArchiveIndex::Entry & childEntry = index.entry(dir.firstChild + child);
+                queue.push_back(std::make_pair(dir.firstChild + child, path + QDir::separator() + index.name(childEntry)));
+            }
+        }
+    }
+}
+
+// The index holds no deltas, the meta is parsed at the first delta encoded file and kept for the rest.
+void takeDeltaFromMeta(const ArchiveIndex::Reader & index, std::uint64_t entryIndex, AUS* aus,
+                       apb::PBDirEntMetaData* dirent) {
+    if (aus->metaArchive == NULL) {
+        aus->metaArena.reset(new google::protobuf::Arena(ArchiverUtils::metaArenaOptions()));
+        aus->metaArchive = google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(aus->metaArena.get());
+        index.parseMeta(*aus->metaArchive);
+    }
+    const apb::PBArchiveMetaData & metaArchive = *aus->metaArchive;
+    if (entryIndex >= (std::uint64_t)metaArchive.pbdirentmetadata_size()
+            || !metaArchive.pbdirentmetadata(entryIndex).pbregfilemetadata().has_delta())
+        throw Archiver::ArchiverException("Index does not match meta of " + aus->archive->fileName());
+    dirent->mutable_pbregfilemetadata()->CopyFrom(metaArchive.pbdirentmetadata(entryIndex).pbregfilemetadata());
+}
+
+
 ///////////////////////////////////////////
 /////// GET_ARCHIVE_WITHOUT_CONTENT ///////
 ///////////////////////////////////////////
 
-QByteArray Archiver::getArchiveWithoutContent(const QString & srcArchivePath) {
+QByteArray Archiver::getArchiveWithoutContent(const QString & srcArchivePath, OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "without-content");
+    recorder.phase("read");
     QByteArray archiveWithoutContent;
 
     QFile input(srcArchivePath);
@@ -354,70 +1030,212 @@ QByteArray Archiver::getArchiveWithoutContent(const QString & srcArchivePath) {
         throw ArchiverException("Error with opening " + srcArchivePath);
     }
 
-    std::uint64_t metaSize = getSize(input);
-    std::uint64_t contentSize = getSize(input);
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
 
-    checkArchiveSizes(metaSize, contentSize, input.size());
+    checkArchiveSizes(input, metaSize, contentSize);
 
+    seekToMeta(input, contentSize);
     std::unique_ptr<char[],std::default_delete<char[]> > bufferForMeta(new char [metaSize]);
     if ((std::uint64_t)input.read(bufferForMeta.get(), metaSize) < metaSize) {
         throw ArchiverException("Error with reading meta");
     }
 
-    archiveWithoutContent.resize(metaSize + 2 * ArchiverUtils::byteSizeOfNumber);
+    // meta without content is shipped to clients, so it goes in the compact encoding
+    recorder.phase("encode");
+    QByteArray compactMeta;
+    if (MetaCodec::isCompact(bufferForMeta.get(), metaSize)) {
+        compactMeta = QByteArray(bufferForMeta.get(), metaSize);
+    } else {
+        google::protobuf::Arena arena(ArchiverUtils::metaArenaOptions());
+        apb::PBArchiveMetaData & metaArchive = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&arena);
+        MetaCodec::parse(bufferForMeta.get(), metaSize, metaArchive);
+        // content of inlined files is content too
+        for (int i = 0; i < metaArchive.pbdirentmetadata_size(); ++i) {
+            if (metaArchive.pbdirentmetadata(i).has_pbregfilemetadata())
+                metaArchive.mutable_pbdirentmetadata(i)->mutable_pbregfilemetadata()->clear_inlinedata();
+        }
+        compactMeta = MetaCodec::encode(metaArchive);
+    }
+    metaSize = compactMeta.size();
+
+    archiveWithoutContent.resize(metaSize + ArchiverUtils::archiveHeaderSize);
 
-    contentSize = 0;
-    memcpy(archiveWithoutContent.data(), &metaSize, ArchiverUtils::byteSizeOfNumber);
-    memcpy(archiveWithoutContent.data() + ArchiverUtils::byteSizeOfNumber,
-           &contentSize, ArchiverUtils::byteSizeOfNumber);
-    memcpy(archiveWithoutContent.data() + 2 * ArchiverUtils::byteSizeOfNumber,
-           bufferForMeta.get(), metaSize);
+    fillHeader(archiveWithoutContent.data(), metaSize, 0);
+    memcpy(archiveWithoutContent.data() + ArchiverUtils::archiveHeaderSize, compactMeta.constData(), metaSize);
 
+    recorder.finish();
     return archiveWithoutContent;
 }
 
 
 ///////////////////////////////////////////
-////////// PRINT_ARCHIVE_FS_TREE //////////
+//////////////// VERIFY ///////////////////
 ///////////////////////////////////////////
 
-void Archiver::printArchiveFsTree(const QString &srcArchivePath, QTextStream & qTextStream) {
+Archiver::VerifyReport Archiver::verify(const QString & srcArchivePath, const VerifyOptions & options,
+                                        OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "verify");
+    recorder.phase("meta");
     QFile input(srcArchivePath);
     if (!input.open(QIODevice::ReadOnly)) {
         throw ArchiverException("Error with opening " + srcArchivePath);
     }
 
-    std::uint64_t metaSize = getSize(input);
-    std::uint64_t contentSize = getSize(input);
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
 
-    checkArchiveSizes(metaSize, contentSize, input.size());
+    checkArchiveSizes(input, metaSize, contentSize);
 
-    apb::PBArchiveMetaData metaArchive = getMetaDataFromArchive(input, metaSize);
+    seekToMeta(input, contentSize);
+    google::protobuf::Arena arena(ArchiverUtils::metaArenaOptions());
+    apb::PBArchiveMetaData & metaArchive = *google::protobuf::Arena::CreateMessage<apb::PBArchiveMetaData>(&arena);
+    getMetaDataFromArchive(input, metaSize, metaArchive);
 
-    std::vector<std::uint64_t> numberDirChildren(metaArchive.pbdirentmetadata_size());
-    calcNumberDirChildren(metaArchive, numberDirChildren);
+    VerifyReport report;
+    std::vector<VerifyFileTask> tasks;
+    bool treeIsValid = true;
+    for (std::uint64_t i = 0; i < (std::uint64_t)metaArchive.pbdirentmetadata_size(); ++i) {
+        const apb::PBDirEntMetaData & curDirent = metaArchive.pbdirentmetadata(i);
+        // entries are in bfs order, so a parent always precedes its children
+        std::uint64_t parentIx = curDirent.parentix();
+        if ((i == 0 && parentIx != 0) || (i != 0 && (parentIx >= i || !S_ISDIR(metaArchive.pbdirentmetadata(parentIx).mode())))) {
+            report.badEntries.push_back(BadEntry(QString("#") + QString::number((unsigned long long)i) + " "
+                                                 + QString::fromStdString(curDirent.name()), "bad parent index"));
+            treeIsValid = false;
+            continue;
+        }
+        if (curDirent.has_pbregfilemetadata())
+            tasks.push_back(VerifyFileTask(i, &curDirent.pbregfilemetadata()));
+    }
+    if (!treeIsValid) {
+        recorder.finish();
+        return report;
+    }
 
-    std::unique_ptr<fs_tree, fs_treeDeleter> fsTree(create_fs_tree());
-    buildFsTree(fsTree, metaArchive, numberDirChildren);
+    recorder.phase("content");
+    std::unique_ptr<ContentCipher> cipher;
+    if (metaArchive.has_encryption())
+        cipher.reset(openContentCipher(metaArchive, options.encryptionKey, srcArchivePath));
+    ArchiveVerifier verifier(tasks, contentSize, options, cipher.get());
+    std::vector<ArchiveVerifier::Problem> problems = verifier.run(&input, report);
+    for (size_t i = 0; i < problems.size(); ++i) {
+        report.badEntries.push_back(BadEntry(getPathInArchive(metaArchive, tasks[problems[i].first].direntIndex),
+                                             problems[i].second));
+    }
 
-    printInodeToQTextStream(fsTree.get()->head, qTextStream, 0);
+    countEntries(metaArchive, recorder.stats());
+    if (recorder.stats())
+        recorder.stats()->storedBytes = report.storedBytes;
+    recorder.finish();
+    return report;
 }
 
-void printInodeToQTextStream(struct inode* inode, QTextStream & qTextStream, std::uint64_t spaceCount) {
-    LOG("visit %s\n", inode->name);
-    for (std::uint64_t i = 0; i < spaceCount; ++i)
-        qTextStream << " ";
 
-    qTextStream << inode->name << "\n";
+///////////////////////////////////////////
+////////// PRINT_ARCHIVE_FS_TREE //////////
+///////////////////////////////////////////
 
-    if (qTextStream.status() == QTextStream::WriteFailed) {
-        qCritical() << "Error in writing " << inode->name << " in qTextStream" << '\n';
+void Archiver::printArchiveFsTree(const QString &srcArchivePath, QTextStream & qTextStream,
+                                  OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "list");
+    recorder.phase("index");
+    QFile input(srcArchivePath);
+    if (!input.open(QIODevice::ReadOnly)) {
+        throw ArchiverException("Error with opening " + srcArchivePath);
     }
 
-    if (inode->type == INODE_DIR) {
-        dir_inode* dir = (dir_inode*)inode;
-        for (size_t i = 0; i < dir->num_children; ++i) {
-            printInodeToQTextStream(dir->children[i], qTextStream, spaceCount + 1);
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
+
+    checkArchiveSizes(input, metaSize, contentSize);
+
+    ArchiveIndex::Reader index(input, metaSize, contentSize);
+    recorder.phase("print");
+    printIndexEntries(index, qTextStream);
+    countIndexEntries(index, recorder.stats());
+    recorder.finish();
+}
+
+void Archiver::queryArchive(const QString & srcArchivePath, const ListQuery & query, QTextStream & qTextStream,
+                            OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "query");
+    recorder.phase("index");
+    QFile input(srcArchivePath);
+    if (!input.open(QIODevice::ReadOnly)) {
+        throw ArchiverException("Error with opening " + srcArchivePath);
+    }
+
+    std::uint64_t metaSize = 0;
+    std::uint64_t contentSize = 0;
+    readHeader(input, metaSize, contentSize);
+
+    checkArchiveSizes(input, metaSize, contentSize);
+
+    ArchiveIndex::Reader index(input, metaSize, contentSize);
+    recorder.phase("query");
+    ArchiveQuery::run(index, query, qTextStream);
+    countIndexEntries(index, recorder.stats());
+    recorder.finish();
+}
+
+Archiver::CompareReport Archiver::compare(const QString & oldArchivePath, const QString & newArchivePath,
+                                          OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "compare");
+    recorder.phase("index");
+    QFile oldInput(oldArchivePath);
+    if (!oldInput.open(QIODevice::ReadOnly)) {
+        throw ArchiverException("Error with opening " + oldArchivePath);
+    }
+    QFile newInput(newArchivePath);
+    if (!newInput.open(QIODevice::ReadOnly)) {
+        throw ArchiverException("Error with opening " + newArchivePath);
+    }
+
+    std::uint64_t oldMetaSize = 0;
+    std::uint64_t oldContentSize = 0;
+    readHeader(oldInput, oldMetaSize, oldContentSize);
+    checkArchiveSizes(oldInput, oldMetaSize, oldContentSize);
+    std::uint64_t newMetaSize = 0;
+    std::uint64_t newContentSize = 0;
+    readHeader(newInput, newMetaSize, newContentSize);
+    checkArchiveSizes(newInput, newMetaSize, newContentSize);
+
+    ArchiveIndex::Reader oldIndex(oldInput, oldMetaSize, oldContentSize);
+    ArchiveIndex::Reader newIndex(newInput, newMetaSize, newContentSize);
+    recorder.phase("compare");
+    CompareReport report;
+    ArchiveCompare::run(oldIndex, newIndex, report);
+    countIndexEntries(newIndex, recorder.stats());
+    recorder.finish();
+    return report;
+}
+
+// Depth-first walk over the child ranges of the index, only touched entries are paged in.
+void printIndexEntries(const ArchiveIndex::Reader & index, QTextStream & qTextStream) {
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > stack(1, std::make_pair((std::uint64_t)0, (std::uint64_t)0));
+    while (!stack.empty()) {
+        std::uint64_t entryIndex = stack.back().first;
+        std::uint64_t spaceCount = stack.back().second;
+        stack.pop_back();
+        if (spaceCount > index.entryCount()) {
+            throw Archiver::ArchiverException("Cycle of directories in archive");
+        }
+
+        const ArchiveIndex::Entry & entry = index.entry(entryIndex);
+        qTextStream << QString(spaceCount, ' ') << index.name(entry) << "\n";
+
+        if (qTextStream.status() == QTextStream::WriteFailed) {
+            qCritical() << "Error in writing " << index.name(entry) << " in qTextStream" << '\n';
+        }
+
+        if (S_ISDIR(entry.mode)) {
+            for (std::uint64_t i = entry.childCount; i > 0; --i) {
+                stack.push_back(std::make_pair(entry.firstChild + i - 1, spaceCount + 1));
+            }
         }
     }
 }
@@ -437,6 +1255,54 @@ QString ArchiverUtils::getDirAbsPath(const QString & path) {
     return fileInfo.absoluteDir().absolutePath() + QDir::separator();
 }
 
+mode_t ArchiverUtils::fileCreationMask() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "Umask:") == 0)
+            return strtoul(line.c_str() + 6, NULL, 8) & 07777;
+    }
+    return 07777;
+}
+
+google::protobuf::ArenaOptions ArchiverUtils::metaArenaOptions() {
+    google::protobuf::ArenaOptions options;
+    options.start_block_size = 64 << 10;
+    options.max_block_size = 4 << 20;
+    return options;
+}
+
+std::uint64_t ArchiverUtils::nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ArchiverUtils::readFully(int fd, char* buffer, std::uint64_t size, std::uint64_t offset, const QString & path) {
+    std::uint64_t done = 0;
+    while (done < size) {
+        ssize_t result = pread(fd, buffer + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            throw Archiver::ArchiverException(QString("Cannot read file: ") + path);
+        if (result == 0)
+            throw Archiver::ArchiverException(QString("Unexpected end of file: ") + path);
+        done += result;
+    }
+}
+
+void ArchiverUtils::writeFully(int fd, const char* buffer, std::uint64_t size, std::uint64_t offset, const QString & path) {
+    std::uint64_t done = 0;
+    while (done < size) {
+        ssize_t result = pwrite(fd, buffer + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            throw Archiver::ArchiverException(QString("Cannot write file: ") + path);
+        done += result;
+    }
+}
+
 
 ///////////////////////////////////////////
 ///////// Support Functions ///////////////
@@ -450,82 +1316,138 @@ QString getPathInArchive(const apb::PBArchiveMetaData & archiveMeta, int index)
                 + QDir::separator() + QString::fromStdString(archiveMeta.pbdirentmetadata(index).name());
 }
 
-QString getPathInArchive(struct inode* inode) {
-    if (inode->parent == NULL)
-        return ArchiverUtils::getDirentName(inode->name);
-    else
-        return getPathInArchive(inode->parent)
-                + QDir::separator() + inode->name;
+void fillHeader(char* header, std::uint64_t metaSize, std::uint64_t contentSize) {
+    memcpy(header, ArchiverUtils::archiveMagic, sizeof(ArchiverUtils::archiveMagic));
+    memcpy(header + sizeof(ArchiverUtils::archiveMagic), &ArchiverUtils::archiveFormatVersion,
+           sizeof(ArchiverUtils::archiveFormatVersion));
+    memcpy(header + ArchiverUtils::archiveHeaderSize - 2 * ArchiverUtils::byteSizeOfNumber, &metaSize,
+           ArchiverUtils::byteSizeOfNumber);
+    memcpy(header + ArchiverUtils::archiveHeaderSize - ArchiverUtils::byteSizeOfNumber, &contentSize,
+           ArchiverUtils::byteSizeOfNumber);
 }
 
-void calcNumberDirChildren(apb::PBArchiveMetaData & metaArchive, std::vector<std::uint64_t> & numberDirChildren) {
-    for (std::uint64_t i = 0; i < (std::uint64_t)metaArchive.pbdirentmetadata_size(); ++i) {
-        if (i == metaArchive.pbdirentmetadata(i).parentix())
-            continue;
-        ++numberDirChildren[metaArchive.pbdirentmetadata(i).parentix()];
+void readHeader(QFile & input, std::uint64_t & metaSize, std::uint64_t & contentSize) {
+    char header[ArchiverUtils::archiveHeaderSize];
+    if (!input.seek(0) || (std::uint64_t)input.read(header, sizeof(header)) < sizeof(header)) {
+        throw Archiver::ArchiverException("Error with reading header of " + input.fileName());
     }
-}
 
-void buildFsTree(std::unique_ptr<fs_tree, fs_treeDeleter> & fsTree, apb::PBArchiveMetaData & metaArchive,
-                 std::vector<std::uint64_t> & numberDirChildren) {
-    std::vector<std::uint64_t> curDirChildren(metaArchive.pbdirentmetadata_size());
-    std::vector<inode*> indexToInodePointer(metaArchive.pbdirentmetadata_size());
+    if (memcmp(header, ArchiverUtils::archiveMagic, sizeof(ArchiverUtils::archiveMagic)) != 0) {
+        // the layout before the format had a version: [metaSize][contentSize][meta][content]
+        std::uint64_t oldMetaSize = 0;
+        std::uint64_t oldContentSize = 0;
+        memcpy(&oldMetaSize, header, ArchiverUtils::byteSizeOfNumber);
+        memcpy(&oldContentSize, header + ArchiverUtils::byteSizeOfNumber, ArchiverUtils::byteSizeOfNumber);
+        std::uint64_t fileSize = input.size() - 2 * ArchiverUtils::byteSizeOfNumber;
+        if (oldMetaSize <= fileSize && oldContentSize == fileSize - oldMetaSize) {
+            throw Archiver::ArchiverException(input.fileName() + " was packed in the layout without a format version, "
+                                              "which is no longer read. Unpack it with the archiver it was packed with "
+                                              "and pack it again.");
+        }
+        throw Archiver::ArchiverException(input.fileName() + " is not an archive");
+    }
 
-    for (std::uint64_t i = 0; i < (std::uint64_t)metaArchive.pbdirentmetadata_size(); ++i) {
-        const apb::PBDirEntMetaData& curDirent = metaArchive.pbdirentmetadata(i);
-        inode* curInode;
-
-        if (S_ISDIR(curDirent.mode())) {
-            dir_inode* curDirInode = create_dir_inode();
-            unpack_dir_inode(&curDirent, curDirInode, indexToInodePointer, numberDirChildren[i], i);
-            curInode = reinterpret_cast<inode*>(curDirInode);
-        } else
-            if (S_ISREG(curDirent.mode())) {
-                regular_file_inode* curRegFileInode = create_regular_file_inode();
-                unpack_regfile_inode(&curDirent, curRegFileInode, indexToInodePointer, i);
-                curInode = reinterpret_cast<inode*>(curRegFileInode);
-            }
+    std::uint32_t version = 0;
+    memcpy(&version, header + sizeof(ArchiverUtils::archiveMagic), sizeof(version));
+    if (version != ArchiverUtils::archiveFormatVersion) {
+        throw Archiver::ArchiverException("Unsupported archive format version " + QString::number(version)
+                                          + " of " + input.fileName());
+    }
 
-        LOG("buildFsTree on %s\n", curInode->name);
+    memcpy(&metaSize, header + ArchiverUtils::archiveHeaderSize - 2 * ArchiverUtils::byteSizeOfNumber,
+           ArchiverUtils::byteSizeOfNumber);
+    memcpy(&contentSize, header + ArchiverUtils::archiveHeaderSize - ArchiverUtils::byteSizeOfNumber,
+           ArchiverUtils::byteSizeOfNumber);
+}
 
-        if (curDirent.parentix() != i) {
-            reinterpret_cast<dir_inode*>(indexToInodePointer[curDirent.parentix()])->children[curDirChildren[curDirent.parentix()]++] = curInode;
-        }
+void checkArchiveSizes(QFile & input, std::uint64_t metaSize, std::uint64_t contentSize) {
+    std::uint64_t inputFileSize = input.size();
+    std::uint64_t endOfMeta = metaSize + contentSize + ArchiverUtils::contentOffsetInArchive;
+    if (endOfMeta > inputFileSize || endOfMeta + ArchiveIndex::tailSize(input, endOfMeta) != inputFileSize) {
+        throw Archiver::ArchiverException(QString("Error with size of file.\nExpecting: ")
+                                + QString::number((unsigned long long)endOfMeta)
+                                + QString(". Got: ") + QString::number((unsigned long long)inputFileSize));
+    }
+}
 
-        if (!i) {
-            init_fs_tree_from_head(fsTree.get(), curInode);
-        }
+void seekToMeta(QFile & input, std::uint64_t contentSize) {
+    if (!input.seek(ArchiverUtils::contentOffsetInArchive + contentSize)) {
+        throw Archiver::ArchiverException("Error with seeking to meta");
     }
 }
 
-std::uint64_t getSize(QFile & input) {
-    std::unique_ptr<char[],std::default_delete<char[]> > bufferForNumber(new char [ArchiverUtils::byteSizeOfNumber]);
+// Files, directories and raw content of the whole meta, for the stats of operations over all of it.
+void countEntries(const apb::PBArchiveMetaData & metaArchive, Archiver::OperationStats * operationStats) {
+    if (operationStats == NULL)
+        return;
+    for (int i = 0; i < metaArchive.pbdirentmetadata_size(); ++i) {
+        const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+        if (dirent.has_pbregfilemetadata()) {
+            ++operationStats->files;
+            operationStats->rawBytes += dirent.pbregfilemetadata().contentsize();
+        } else if (S_ISDIR(dirent.mode())) {
+            ++operationStats->dirs;
+        }
+    }
+}
 
-    if ((size_t)input.read(bufferForNumber.get(), ArchiverUtils::byteSizeOfNumber) < ArchiverUtils::byteSizeOfNumber) {
-        throw Archiver::ArchiverException("Error with reading size.");
+void countIndexEntries(const ArchiveIndex::Reader & index, Archiver::OperationStats * operationStats) {
+    if (operationStats == NULL)
+        return;
+    for (std::uint64_t i = 0; i < index.entryCount(); ++i) {
+        const ArchiveIndex::Entry & entry = index.entry(i);
+        if (entry.isRegularFile()) {
+            ++operationStats->files;
+            operationStats->rawBytes += entry.contentSize;
+        } else if (S_ISDIR(entry.mode)) {
+            ++operationStats->dirs;
+        }
     }
+}
 
-    return *((std::uint64_t*)bufferForNumber.get());
+ContentCipher* openContentCipher(const apb::PBEncryption & record, const QByteArray & key, const QString & archivePath) {
+    if (key.isEmpty())
+        throw Archiver::ArchiverException("Content of " + archivePath + " is encrypted, a key is needed");
+    if (!ContentCipher::keyMatches(record, key))
+        throw Archiver::ArchiverException("Wrong key of encrypted archive " + archivePath);
+    return new ContentCipher(record, key);
 }
 
-void checkArchiveSizes(std::uint64_t metaSize, std::uint64_t contentSize, std::uint64_t inputFileSize) {
-    if (metaSize + contentSize + 2 * ArchiverUtils::byteSizeOfNumber != inputFileSize) {
-        throw Archiver::ArchiverException(QString("Error with size of file.\nExpecting: ")
-                                + (metaSize + contentSize + 2 * ArchiverUtils::byteSizeOfNumber)
-                                + QString(". Got: ") + inputFileSize);
-    }
+// Opens the cipher of an encrypted archive and checks that its meta was not altered.
+ContentCipher* openContentCipher(const apb::PBArchiveMetaData & metaArchive, const QByteArray & key,
+                                 const QString & archivePath) {
+    std::unique_ptr<ContentCipher> cipher(openContentCipher(metaArchive.encryption(), key, archivePath));
+    if (!cipher->metaTagMatches(metaArchive))
+        throw Archiver::ArchiverException("Meta of encrypted archive " + archivePath + " was altered");
+    return cipher.release();
 }
 
-apb::PBArchiveMetaData getMetaDataFromArchive(QFile & input, std::uint64_t metaSize) {
-    std::unique_ptr<char[],std::default_delete<char[]> > bufferForMeta(new char [metaSize]);
-    if ((std::uint64_t)input.read(bufferForMeta.get(), metaSize) < metaSize) {
-        throw Archiver::ArchiverException("Error with reading meta");
+apb::PBCipher toPBCipher(Archiver::Cipher cipher) {
+    switch (cipher) {
+    case Archiver::CipherAes256Gcm:
+        return apb::CIPHER_AES_256_GCM;
+    case Archiver::CipherChaCha20Poly1305:
+        return apb::CIPHER_CHACHA20_POLY1305;
+    default:
+        throw Archiver::ArchiverException("Unknown cipher");
     }
+}
 
-    apb::PBArchiveMetaData metaArchive;
-    if (!metaArchive.ParseFromArray(bufferForMeta.get(), metaSize)) {
-        throw Archiver::ArchiverException("Error with parse meta");
-    }
+void openBaseArchive(BaseArchive & base) {
+    if (!base.file.open(QIODevice::ReadOnly))
+        throw Archiver::ArchiverException("Error with opening base archive " + base.file.fileName());
+    readHeader(base.file, base.metaSize, base.contentSize);
+    checkArchiveSizes(base.file, base.metaSize, base.contentSize);
+    base.index.reset(new ArchiveIndex::Reader(base.file, base.metaSize, base.contentSize));
+}
+
+// Parses the meta at the current position of input.
+void getMetaDataFromArchive(QFile & input, std::uint64_t metaSize, apb::PBArchiveMetaData & metaArchive,
+                            const Archiver::JobControl* control) {
+    MetaCodec::parse(input, input.pos(), metaSize, metaArchive, control);
+}
 
-    return metaArchive;
+// Cancel check of fs_tree for the JobControl passed as its data.
+int isJobCancelled(void* control) {
+    return static_cast<Archiver::JobControl*>(control)->isCancelled();
 }
@@ -1,16 +1,444 @@
 #ifndef ARCHIVER_H
 #define ARCHIVER_H
 
+#include <QByteArray>
 #include <QTextStream>
 #include <QString>
 #include <QException>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 class Archiver {
 public:
-    static void pack(const QString & srcPath, const QString & dstArchivePath);
-    static void unpack(const QString & srcArchivePath, const QString & dstPath);
-    static void printArchiveFsTree(const QString & srcArchivePath, QTextStream & qTextStream);
-    static QByteArray getArchiveWithoutContent(const QString & srcArchivePath);
+    // Token bucket limit of archive i/o in bytes and operations per second, 0 means unlimited.
+    // One limiter is shared by all threads of a pack or unpack, its limits can be changed
+    // from another thread while the operation runs.
+    class IoLimiter {
+    public:
+        explicit IoLimiter(std::uint64_t bytesPerSecond = 0, std::uint64_t opsPerSecond = 0);
+        void setLimits(std::uint64_t bytesPerSecond, std::uint64_t opsPerSecond);
+        // Accounts one operation of size bytes, sleeping as long as the limits require.
+        void acquire(std::uint64_t bytes);
+
+    private:
+        IoLimiter(const IoLimiter &);
+        IoLimiter & operator=(const IoLimiter &);
+
+        std::mutex mutex;
+        std::uint64_t bytesPerSecond;
+        std::uint64_t opsPerSecond;
+        double byteTokens;
+        double opTokens;
+        std::uint64_t lastRefillNs;
+    };
+
+    // Progress counters and cancel flag shared by a running operation and whoever watches it.
+    // Operations check the flag between reads and writes of content, so cancel takes effect within one block.
+    class JobControl {
+    public:
+        JobControl();
+        void cancel() { cancelled = true; }
+        bool isCancelled() const { return cancelled; }
+        // Throws CancelledException if the operation was cancelled.
+        void checkCancelled() const;
+        // Set by the operation once it knows the amount of work, entries are regular files.
+        void setTotals(std::uint64_t entries, std::uint64_t bytes);
+        void advance(std::uint64_t entries, std::uint64_t bytes);
+        std::uint64_t entriesDone() const { return doneEntries; }
+        std::uint64_t entriesTotal() const { return totalEntries; }
+        std::uint64_t bytesDone() const { return doneBytes; }
+        std::uint64_t bytesTotal() const { return totalBytes; }
+
+    private:
+        JobControl(const JobControl &);
+        JobControl & operator=(const JobControl &);
+
+        std::atomic<bool> cancelled;
+        std::atomic<std::uint64_t> doneEntries;
+        std::atomic<std::uint64_t> totalEntries;
+        std::atomic<std::uint64_t> doneBytes;
+        std::atomic<std::uint64_t> totalBytes;
+    };
+
+    enum IoPriorityClass {
+        IoPriorityDefault,
+        IoPriorityBestEffort,
+        IoPriorityIdle
+    };
+
+    enum Durability {
+        DurabilityNone,
+        // one syncfs of the file system of the target once everything is restored
+        DurabilitySyncFs,
+        // fsync of every restored file and directory, in parallel groups
+        DurabilitySyncFiles
+    };
+
+    enum Cipher {
+        CipherNone,
+        CipherAes256Gcm,
+        CipherChaCha20Poly1305
+    };
+
+    struct IoOptions {
+        // not owned, NULL disables limiting
+        IoLimiter* limiter;
+        // applied to the threads doing the i/o of the operation
+        IoPriorityClass priorityClass;
+        // added to the nice value of those threads, 0 keeps it
+        int niceIncrement;
+        // 32 byte key the content is encrypted with by pack (see PackOptions::cipher) and decrypted with by unpack and extract
+        QByteArray encryptionKey;
+        // not owned, NULL if the operation reports no progress and cannot be cancelled
+        JobControl* control;
+        // how unpack and extract make the restored entries durable before they return
+        Durability durability;
+        // threads waiting for fsyncs at the same time with DurabilitySyncFiles, the calling one included
+        unsigned syncThreads;
+        IoOptions();
+    };
+
+    struct PackOptions {
+        unsigned readerThreads;
+        unsigned workerThreads;
+        unsigned bufferCount;
+        // files up to this size are stored inside their meta record, 0 disables it
+        std::uint64_t inlineThreshold;
+        // read files in the order of their location on disk instead of the meta order
+        bool physicalOrder;
+        // number of files ahead of the readers to ask the kernel to prefetch, 0 disables it
+        unsigned readaheadFiles;
+        // identical files share one content range, found by hashing every file whose size is not unique
+        bool dedup;
+        IoOptions io;
+        // content written between two checkpoints of an unfinished pack, 0 disables them
+        std::uint64_t checkpointInterval;
+        // continue an interrupted pack from its last checkpoint if there is one and the archive matches it,
+        // the pack starts over otherwise
+        bool resume;
+        // files of at least this size get a delta signature, 0 disables them
+        std::uint64_t signatureThreshold;
+        // archive to pack large changed files against as deltas, empty packs everything whole
+        QString baseArchivePath;
+        // encrypts every content block with io.encryptionKey, inlining and delta signatures are then disabled
+        // as they would keep content (or hashes of it) in the plain text meta
+        Cipher cipher;
+        PackOptions();
+    };
+
+    struct PipelineStageStats {
+        unsigned threads;
+        std::uint64_t busyNs;
+        std::uint64_t waitNs;
+        PipelineStageStats()
+            :threads(0), busyNs(0), waitNs(0) {}
+        double utilization(std::uint64_t wallNs) const {
+            return (threads == 0 || wallNs == 0) ? 0 : (double)busyNs / ((double)wallNs * threads);
+        }
+    };
+
+    struct PipelineStats {
+        std::uint64_t wallNs;
+        // content that went through the pipeline, before and after compression
+        std::uint64_t rawBytes;
+        std::uint64_t storedBytes;
+        PipelineStageStats reader;
+        PipelineStageStats worker;
+        PipelineStageStats writer;
+        PipelineStats()
+            :wallNs(0), rawBytes(0), storedBytes(0) {}
+    };
+
+    struct PhaseStats {
+        QString name;
+        std::uint64_t wallNs;
+        // of the whole process, so it includes the worker threads of the phase
+        std::uint64_t cpuNs;
+        explicit PhaseStats(const QString & name)
+            :name(name), wallNs(0), cpuNs(0) {}
+    };
+
+    // Measurements of one operation, phases are in the order they ran. Call, byte, fault and mapping
+    // counters are deltas of counters of the whole process (/proc/self/io, getrusage), so operations
+    // running at the same time in one process add up.
+    struct OperationStats {
+        QString operation;
+        std::vector<PhaseStats> phases;
+        std::uint64_t wallNs;
+        std::uint64_t cpuNs;
+        std::uint64_t files;
+        std::uint64_t dirs;
+        // content of the files the operation went through, as in the files and as stored in the archive
+        std::uint64_t rawBytes;
+        std::uint64_t storedBytes;
+        // bytes passed to read and write calls and bytes that really were read from and written to storage
+        std::uint64_t readCallBytes;
+        std::uint64_t writeCallBytes;
+        std::uint64_t storageReadBytes;
+        std::uint64_t storageWriteBytes;
+        std::uint64_t readCalls;
+        std::uint64_t writeCalls;
+        // files mapped into memory by the archiver
+        std::uint64_t mappings;
+        std::uint64_t minorFaults;
+        std::uint64_t majorFaults;
+        // high water mark of resident memory of the process
+        std::uint64_t peakRssBytes;
+        OperationStats();
+        QString toText() const;
+        QString toJson() const;
+    };
+
+    struct Progress {
+        enum State {
+            Running,
+            Finished,
+            Failed,
+            Cancelled
+        };
+        State state;
+        std::uint64_t entriesDone;
+        std::uint64_t entriesTotal;
+        std::uint64_t bytesDone;
+        std::uint64_t bytesTotal;
+        // smoothed over the last reports, 0 until there are two of them
+        double bytesPerSecond;
+        // estimated time left, 0 while the rate is unknown
+        std::uint64_t etaNs;
+        // of a failed job
+        QString error;
+        Progress();
+    };
+    typedef std::function<void(const Progress &)> ProgressCallback;
+
+    // One operation running on its own thread. progressCallback is called from another thread
+    // of the job at most once per progressIntervalMs while it runs, and exactly once more with
+    // the final state when it ends. Destroying a job cancels it and waits for it.
+    class Job {
+    public:
+        // work is run with the control it has to pass in the IoOptions of the operation.
+        Job(const std::function<void(JobControl &)> & work, const ProgressCallback & progressCallback,
+            unsigned progressIntervalMs);
+        ~Job();
+
+        // Asks the operation to stop, it throws out of its next read or write and releases what it holds.
+        void cancel();
+        // Waits for the end of the operation and rethrows its error, if any.
+        void wait();
+        bool isFinished() const;
+        Progress progress() const;
+
+    private:
+        Job(const Job &);
+        Job & operator=(const Job &);
+
+        struct State;
+        std::unique_ptr<State> state;
+    };
+
+    struct BatchJob {
+        QString srcPath;
+        QString dstArchivePath;
+        BatchJob(const QString & srcPath, const QString & dstArchivePath)
+            :srcPath(srcPath), dstArchivePath(dstArchivePath) {}
+    };
+
+    struct BatchJobResult {
+        BatchJob job;
+        // empty if the job succeeded
+        QString error;
+        std::uint64_t wallNs;
+        PipelineStats stats;
+        BatchJobResult(const BatchJob & job)
+            :job(job), wallNs(0) {}
+    };
+
+    struct BatchOptions {
+        // number of sources packed at the same time
+        unsigned concurrentJobs;
+        // readerThreads and workerThreads are totals shared by the running jobs, a job starting
+        // when others have finished gets the threads they left, the limiter of io is shared by all of them
+        PackOptions pack;
+        BatchOptions();
+    };
+
+    struct UnpackBatchJob {
+        QString srcArchivePath;
+        QString dstPath;
+        // base of delta encoded files, empty for the path recorded by pack
+        QString baseArchivePath;
+        UnpackBatchJob(const QString & srcArchivePath, const QString & dstPath, const QString & baseArchivePath = QString())
+            :srcArchivePath(srcArchivePath), dstPath(dstPath), baseArchivePath(baseArchivePath) {}
+    };
+
+    struct UnpackBatchJobResult {
+        UnpackBatchJob job;
+        // empty if the job succeeded
+        QString error;
+        std::uint64_t wallNs;
+        // from the start of the batch to the end of the job, when its target is ready
+        std::uint64_t finishedNs;
+        // counters of the process in it overlap with the jobs running at the same time
+        OperationStats stats;
+        UnpackBatchJobResult(const UnpackBatchJob & job)
+            :job(job), wallNs(0), finishedNs(0) {}
+    };
+
+    struct UnpackBatchOptions {
+        // number of archives restored at the same time, each on one thread doing synchronous i/o,
+        // so it caps both the threads and the i/o in flight of the batch
+        unsigned concurrentJobs;
+        // options of every job, the limiter is shared by all of them, control is not used;
+        // io.syncThreads is the total of the batch, shared by the running jobs like the threads of BatchOptions
+        IoOptions io;
+        UnpackBatchOptions();
+    };
+
+    struct ListQuery {
+        enum EntryType {
+            AnyEntry,
+            FilesOnly,
+            DirsOnly
+        };
+        enum SortKey {
+            SortNone,
+            SortPath,
+            SortSize,
+            SortMtime
+        };
+        // fnmatch(3) patterns for the whole path as printed by list and for the name, empty matches all.
+        // Wildcards of the path pattern do not match '/', every directory level needs its own.
+        QString pathGlob;
+        QString nameGlob;
+        EntryType type;
+        std::uint64_t minSize;
+        std::uint64_t maxSize;
+        std::uint64_t minMtime;
+        std::uint64_t maxMtime;
+        // sizes of directories are the sums of their subtrees
+        bool du;
+        // without sorting entries come in depth-first order
+        SortKey sortKey;
+        bool descending;
+        // 0 prints all matching entries
+        std::uint64_t limit;
+        ListQuery();
+    };
+
+    struct VerifyOptions {
+        unsigned threads;
+        unsigned queueDepth;
+        // needed to check the content of an encrypted archive
+        QByteArray encryptionKey;
+        VerifyOptions();
+    };
+
+    struct BadEntry {
+        QString path;
+        QString reason;
+        BadEntry(const QString & path, const QString & reason)
+            :path(path), reason(reason) {}
+    };
+
+    struct VerifyReport {
+        std::uint64_t files;
+        std::uint64_t blocks;
+        std::uint64_t storedBytes;
+        std::uint64_t rawBytes;
+        std::uint64_t wallNs;
+        std::vector<BadEntry> badEntries;
+        VerifyReport()
+            :files(0), blocks(0), storedBytes(0), rawBytes(0), wallNs(0) {}
+    };
+
+    struct Difference {
+        enum Kind {
+            Added = 1,
+            Removed = 2,
+            TypeChanged = 4,
+            Resized = 8,
+            Retouched = 16,
+            ContentChanged = 32,
+            AttributesChanged = 64
+        };
+        // as printed by list, starting with the root name of the newer archive
+        QString path;
+        // or of Kind values
+        unsigned kinds;
+        std::uint64_t oldSize;
+        std::uint64_t newSize;
+        std::uint64_t oldMtime;
+        std::uint64_t newMtime;
+        Difference(const QString & path, unsigned kinds)
+            :path(path), kinds(kinds), oldSize(0), newSize(0), oldMtime(0), newMtime(0) {}
+    };
+
+    struct CompareReport {
+        std::uint64_t oldEntries;
+        std::uint64_t newEntries;
+        std::uint64_t added;
+        std::uint64_t removed;
+        std::uint64_t changed;
+        std::uint64_t unchanged;
+        // in path order
+        std::vector<Difference> differences;
+        CompareReport()
+            :oldEntries(0), newEntries(0), added(0), removed(0), changed(0), unchanged(0) {}
+    };
+
+    // Every operation fills operationStats if it is not NULL.
+    static void pack(const QString & srcPath, const QString & dstArchivePath,
+                     const PackOptions & options = PackOptions(), PipelineStats * pipelineStats = NULL,
+                     OperationStats * operationStats = NULL);
+    // Asynchronous pack and unpack, the control of options.io (io) is replaced with the one of the job.
+    // A cancelled pack leaves a partial archive, which is resumed like an interrupted one if checkpoints are on.
+    static std::unique_ptr<Job> startPack(const QString & srcPath, const QString & dstArchivePath,
+                                          const PackOptions & options = PackOptions(),
+                                          const ProgressCallback & progressCallback = ProgressCallback(),
+                                          unsigned progressIntervalMs = 200);
+    static std::unique_ptr<Job> startUnpack(const QString & srcArchivePath, const QString & dstPath,
+                                            const IoOptions & io = IoOptions(),
+                                            const ProgressCallback & progressCallback = ProgressCallback(),
+                                            unsigned progressIntervalMs = 200);
+    // Packs every job, up to concurrentJobs at once. A failed job does not stop the others,
+    // results are in the order of jobs. operationStats covers the whole batch.
+    static std::vector<BatchJobResult> packBatch(const std::vector<BatchJob> & jobs,
+                                                 const BatchOptions & options = BatchOptions(),
+                                                 OperationStats * operationStats = NULL);
+    // Unpacks every job, up to concurrentJobs at once, smallest archives first so the first targets are
+    // ready early. A failed job does not stop the others, results are in the order of jobs.
+    // operationStats covers the whole batch.
+    static std::vector<UnpackBatchJobResult> unpackBatch(const std::vector<UnpackBatchJob> & jobs,
+                                                         const UnpackBatchOptions & options = UnpackBatchOptions(),
+                                                         OperationStats * operationStats = NULL);
+    // Delta encoded files are rebuilt from the base archive they were packed against,
+    // found at baseArchivePath or else at the path recorded by pack. The bases of the base archive
+    // are always found at their recorded paths.
+    static void unpack(const QString & srcArchivePath, const QString & dstPath, const IoOptions & io = IoOptions(),
+                       const QString & baseArchivePath = QString(), OperationStats * operationStats = NULL);
+    // Restores one file or directory subtree of the archive into dstPath. pathInArchive is
+    // as printed by list, starting with the archive root name.
+    // Delta encoded files are rebuilt as by unpack.
+    static void extract(const QString & srcArchivePath, const QString & pathInArchive, const QString & dstPath,
+                        const IoOptions & io = IoOptions(), const QString & baseArchivePath = QString(),
+                        OperationStats * operationStats = NULL);
+    static void printArchiveFsTree(const QString & srcArchivePath, QTextStream & qTextStream,
+                                   OperationStats * operationStats = NULL);
+    // Prints the entries of the archive matching query, working on the index of the meta only.
+    static void queryArchive(const QString & srcArchivePath, const ListQuery & query, QTextStream & qTextStream,
+                             OperationStats * operationStats = NULL);
+    static QByteArray getArchiveWithoutContent(const QString & srcArchivePath, OperationStats * operationStats = NULL);
+    // Checks header, meta and checksums of all content without extracting anything.
+    static VerifyReport verify(const QString & srcArchivePath, const VerifyOptions & options = VerifyOptions(),
+                               OperationStats * operationStats = NULL);
+    // Aligns the meta of two archives by path and reports what changed from the old to the new one.
+    // No content is read, content changes are found by size and by checksums when both archives have them.
+    static CompareReport compare(const QString & oldArchivePath, const QString & newArchivePath,
+                                 OperationStats * operationStats = NULL);
 
     class ArchiverException : public QException {
     public:
@@ -25,6 +453,15 @@ public:
 
     };
 
+    // Thrown where an operation stops because its JobControl was cancelled,
+    // so a cancellation is told apart from an error that happened meanwhile.
+    class CancelledException : public ArchiverException {
+    public:
+        void raise() const { throw *this; }
+        CancelledException *clone() const { return new CancelledException(*this); }
+        CancelledException() : ArchiverException("Operation cancelled") {}
+    };
+
 private:
     Archiver() {}
 };
@@ -0,0 +1,213 @@
+#include "archiver.h"
+#include "archiver_utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+
+using ArchiverUtils::nowNs;
+
+namespace {
+    // shortest period the rate is measured over, so back to back reports do not make it jump
+    const std::uint64_t minRateSampleNs = 50000000;
+    // weight of the newest sample in the smoothed rate
+    const double rateSmoothing = 0.3;
+}
+
+Archiver::JobControl::JobControl()
+    :cancelled(false), doneEntries(0), totalEntries(0), doneBytes(0), totalBytes(0) {}
+
+void Archiver::JobControl::checkCancelled() const {
+    if (cancelled)
+        throw CancelledException();
+}
+
+void Archiver::JobControl::setTotals(std::uint64_t entries, std::uint64_t bytes) {
+    totalEntries = entries;
+    totalBytes = bytes;
+}
+
+void Archiver::JobControl::advance(std::uint64_t entries, std::uint64_t bytes) {
+    doneEntries += entries;
+    doneBytes += bytes;
+}
+
+Archiver::Progress::Progress()
+    :state(Running), entriesDone(0), entriesTotal(0), bytesDone(0), bytesTotal(0), bytesPerSecond(0), etaNs(0) {}
+
+struct Archiver::Job::State {
+    JobControl control;
+    ProgressCallback progressCallback;
+    std::uint64_t progressIntervalMs;
+    std::thread worker;
+    std::thread reporter;
+
+    mutable std::mutex mutex;
+    std::condition_variable finishedCondition;
+    bool finished;
+    std::exception_ptr error;
+    QString errorMessage;
+    // the work stopped at a cancel check rather than failing
+    bool cancelled;
+    std::uint64_t sampleNs;
+    std::uint64_t sampleBytes;
+    double bytesPerSecond;
+
+    State(const ProgressCallback & progressCallback, unsigned progressIntervalMs)
+        :progressCallback(progressCallback)
+        ,progressIntervalMs(std::max(1u, progressIntervalMs))
+        ,finished(false)
+        ,cancelled(false)
+        ,sampleNs(nowNs())
+        ,sampleBytes(0)
+        ,bytesPerSecond(0) {}
+
+    void run(const std::function<void(JobControl &)> & work) {
+        std::exception_ptr workError;
+        QString message;
+        bool workCancelled = false;
+        try {
+            work(control);
+        } catch (CancelledException & e) {
+            workError = std::current_exception();
+            message = e.whatQMsg();
+            workCancelled = true;
+        } catch (ArchiverException & e) {
+            workError = std::current_exception();
+            message = e.whatQMsg();
+        } catch (std::exception & e) {
+            workError = std::current_exception();
+            message = QString(e.what());
+        } catch (...) {
+            workError = std::current_exception();
+            message = QString("Unknown error");
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        error = workError;
+        errorMessage = message;
+        cancelled = workCancelled;
+        finishedCondition.notify_all();
+    }
+
+    // The final report is made once the worker is done, so it is the last call of the callback.
+    void report() {
+        bool done = false;
+        while (!done) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done = finishedCondition.wait_for(lock, std::chrono::milliseconds(progressIntervalMs),
+                                                  [this]() { return finished; });
+            }
+            try {
+                progressCallback(snapshot(done));
+            } catch (...) {
+                // a failing callback must not take the job down
+            }
+        }
+    }
+
+    Progress snapshot(bool ended) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Progress progress;
+        progress.entriesDone = control.entriesDone();
+        progress.entriesTotal = control.entriesTotal();
+        progress.bytesDone = control.bytesDone();
+        progress.bytesTotal = control.bytesTotal();
+
+        std::uint64_t now = nowNs();
+        if (now - sampleNs >= minRateSampleNs && progress.bytesDone >= sampleBytes) {
+            double rate = (progress.bytesDone - sampleBytes) * 1e9 / (now - sampleNs);
+            bytesPerSecond = bytesPerSecond > 0 ? (1 - rateSmoothing) * bytesPerSecond + rateSmoothing * rate : rate;
+            sampleNs = now;
+            sampleBytes = progress.bytesDone;
+        }
+        progress.bytesPerSecond = bytesPerSecond;
+        if (bytesPerSecond > 0 && progress.bytesTotal > progress.bytesDone)
+            progress.etaNs = (std::uint64_t)((progress.bytesTotal - progress.bytesDone) * 1e9 / bytesPerSecond);
+
+        if (ended) {
+            if (!error) {
+                progress.state = Progress::Finished;
+                progress.etaNs = 0;
+            } else if (cancelled) {
+                progress.state = Progress::Cancelled;
+            } else {
+                progress.state = Progress::Failed;
+                progress.error = errorMessage;
+            }
+        }
+        return progress;
+    }
+
+    void join() {
+        if (worker.joinable())
+            worker.join();
+        if (reporter.joinable())
+            reporter.join();
+    }
+};
+
+Archiver::Job::Job(const std::function<void(JobControl &)> & work, const ProgressCallback & progressCallback,
+                   unsigned progressIntervalMs)
+    :state(new State(progressCallback, progressIntervalMs)) {
+    State* jobState = state.get();
+    jobState->worker = std::thread([jobState, work]() { jobState->run(work); });
+    if (progressCallback) {
+        try {
+            jobState->reporter = std::thread([jobState]() { jobState->report(); });
+        } catch (...) {
+            jobState->control.cancel();
+            jobState->join();
+            throw;
+        }
+    }
+}
+
+Archiver::Job::~Job() {
+    state->control.cancel();
+    state->join();
+}
+
+void Archiver::Job::cancel() {
+    state->control.cancel();
+}
+
+void Archiver::Job::wait() {
+    state->join();
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
+
+bool Archiver::Job::isFinished() const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->finished;
+}
+
+Archiver::Progress Archiver::Job::progress() const {
+    bool ended = isFinished();
+    return state->snapshot(ended);
+}
+
+std::unique_ptr<Archiver::Job> Archiver::startPack(const QString & srcPath, const QString & dstArchivePath,
+                                                   const PackOptions & options, const ProgressCallback & progressCallback,
+                                                   unsigned progressIntervalMs) {
+    return std::unique_ptr<Job>(new Job([srcPath, dstArchivePath, options](JobControl & control) {
+        PackOptions jobOptions = options;
+        jobOptions.io.control = &control;
+        pack(srcPath, dstArchivePath, jobOptions);
+    }, progressCallback, progressIntervalMs));
+}
+
+std::unique_ptr<Archiver::Job> Archiver::startUnpack(const QString & srcArchivePath, const QString & dstPath,
+                                                     const IoOptions & io, const ProgressCallback & progressCallback,
+                                                     unsigned progressIntervalMs) {
+    return std::unique_ptr<Job>(new Job([srcArchivePath, dstPath, io](JobControl & control) {
+        IoOptions jobIo = io;
+        jobIo.control = &control;
+        unpack(srcArchivePath, dstPath, jobIo);
+    }, progressCallback, progressIntervalMs));
+}
@@ -1,16 +1,19 @@
 #ifndef ARCHIVER_STRUCTS
 #define ARCHIVER_STRUCTS
 
+#include "archive_index.h"
+#include "archiver.h"
+#include "archiver_utils.h"
+#include "content_cipher.h"
+
 #include <QString>
 #include <struct_serialization.pb.h>
+#include <map>
+#include <memory>
 #include <vector>
 #include <QFile>
 
-struct ArchiveInfo {
-    std::uint64_t contentSize;
-    ArchiveInfo()
-        :contentSize(0) {}
-};
+class RestoreSync;
 
 //struct ArchivePackingState {
 //    char* filesContent;
@@ -23,12 +26,13 @@ struct ArchiveInfo {
 //        ,dirAbsPath(dirAbsPath) {}
 //};
 struct ArchivePackingState {
-    std::uint64_t contentFreePosition;
     QString dirAbsPath;
-    ArchiverUtils::protobufStructs::PBArchiveMetaData metaArchive;
+    google::protobuf::Arena arena;
+    ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive;
     ArchivePackingState(const QString & dirAbsPath)
-        :contentFreePosition(0)
-        ,dirAbsPath(dirAbsPath) {}
+        :dirAbsPath(dirAbsPath)
+        ,arena(ArchiverUtils::metaArenaOptions())
+        ,metaArchive(*google::protobuf::Arena::CreateMessage<ArchiverUtils::protobufStructs::PBArchiveMetaData>(&arena)) {}
 };
 
 typedef ArchivePackingState APS;
@@ -52,15 +56,59 @@ struct DirTimeSetTask {
 //        ,dirAbsPath(dirAbsPath) {}
 //};
 
+struct RestoredContent {
+    QString path;
+    std::uint64_t size;
+    std::uint32_t checksum;
+    RestoredContent()
+        :size(0), checksum(0) {}
+    RestoredContent(const QString & path, std::uint64_t size, std::uint32_t checksum)
+        :path(path), size(size), checksum(checksum) {}
+};
+
+// Archive the delta encoded files of another archive are rebuilt from.
+struct BaseArchive {
+    QFile file;
+    std::uint64_t metaSize;
+    std::uint64_t contentSize;
+    std::unique_ptr<ArchiveIndex::Reader> index;
+    // parsed only for a base file that is delta encoded itself, the index does not hold its delta
+    std::unique_ptr<google::protobuf::Arena> metaArena;
+    ArchiverUtils::protobufStructs::PBArchiveMetaData* meta;
+    // the base archive of this one, opened at its first delta encoded file
+    std::unique_ptr<BaseArchive> base;
+    explicit BaseArchive(const QString & path)
+        :file(path), metaSize(0), contentSize(0), meta(NULL) {}
+};
+
 struct ArchiveUnpackingState {
     QFile *archive;
     QString dirAbsPath;
     ArchiverUtils::protobufStructs::PBArchiveMetaData* metaArchive;
+    // owns metaArchive when it is parsed on demand (extract of delta encoded files)
+    std::unique_ptr<google::protobuf::Arena> metaArena;
     std::vector<DirTimeSetTask> dirsQueue;
+    // already unpacked files by content offset, to copy files sharing content
+    std::map<std::uint64_t, RestoredContent> restoredContent;
+    Archiver::IoOptions io;
+    // overrides the base archive path recorded in the meta, the base is opened at the first delta encoded file
+    QString baseArchivePath;
+    std::unique_ptr<BaseArchive> baseArchive;
+    // NULL for plain content
+    std::unique_ptr<ContentCipher> cipher;
+    // counts restored entries when they are not known up front (extract), NULL if not recorded
+    Archiver::OperationStats* stats;
+    // not owned, syncs the restored files as IoOptions::durability asks
+    RestoreSync* sync;
+    // mode bits that files created by the restore lose, they are set again with fchmod
+    mode_t creationMask;
     ArchiveUnpackingState(QFile *archive, const QString & dirAbsPath, ArchiverUtils::protobufStructs::PBArchiveMetaData* metaArchive)
         :archive(archive)
         ,dirAbsPath(dirAbsPath)
-        ,metaArchive(metaArchive) {}
+        ,metaArchive(metaArchive)
+        ,stats(NULL)
+        ,sync(NULL)
+        ,creationMask(ArchiverUtils::fileCreationMask()) {}
 };
 
 typedef ArchiveUnpackingState AUS;
@@ -1,10 +1,32 @@
 #ifndef ARCHIVER_UTILS_H
 #define ARCHIVER_UTILS_H
 
+#include <QString>
+#include <cstdint>
+#include <sys/types.h>
+#include <google/protobuf/arena.h>
+
 namespace ArchiverUtils {
     QString getDirentName(const QString &path);
     QString getDirAbsPath(const QString &path);
+    std::uint64_t nowNs();
+    // pread loop, throws ArchiverException on error or on end of file before size bytes.
+    void readFully(int fd, char* buffer, std::uint64_t size, std::uint64_t offset, const QString & path);
+    // pwrite loop, throws ArchiverException on error.
+    void writeFully(int fd, const char* buffer, std::uint64_t size, std::uint64_t offset, const QString & path);
+    // umask of the process, read without changing it (umask() would race with threads creating files).
+    // All bits are set if it cannot be read.
+    mode_t fileCreationMask();
+    // Arena for the meta of one archive, big trees make tens of millions of small messages.
+    google::protobuf::ArenaOptions metaArenaOptions();
     const size_t byteSizeOfNumber = sizeof(std::uint64_t);
+    // An archive starts with the magic, the format version, the meta size and the content size,
+    // followed by the content, the meta and the index.
+    // Archives of the earlier [metaSize][contentSize][meta][content] layout have no magic and are rejected.
+    const char archiveMagic[4] = {'\x89', 'P', 'C', 'K'};
+    const std::uint32_t archiveFormatVersion = 1;
+    const std::uint64_t archiveHeaderSize = sizeof(archiveMagic) + sizeof(archiveFormatVersion) + 2 * byteSizeOfNumber;
+    const std::uint64_t contentOffsetInArchive = archiveHeaderSize;
 }
 
 
@@ -0,0 +1,120 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+// Bounded multi-producer multi-consumer lock-free queue (D. Vyukov's ring of sequenced cells).
+// tryPush/tryPop never block; push/pop back off (spin, yield, short sleep) until they succeed,
+// the queue is closed and drained, or the abort flag is raised.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t minCapacity)
+        :mask(roundUpToPowerOfTwo(minCapacity) - 1)
+        ,cells(new Cell[mask + 1])
+        ,enqueuePos(0)
+        ,dequeuePos(0)
+        ,closed(false) {
+        for (std::size_t i = 0; i <= mask; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool tryPush(const T & value) {
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell & cell = cells[pos & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T & value) {
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell & cell = cells[pos & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.data;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool push(const T & value, const std::atomic<bool> & abort) {
+        for (unsigned attempt = 0; !abort.load(std::memory_order_relaxed); ++attempt) {
+            if (tryPush(value))
+                return true;
+            backoff(attempt);
+        }
+        return false;
+    }
+
+    // Returns false once the queue is closed and empty or the abort flag is raised.
+    bool pop(T & value, const std::atomic<bool> & abort) {
+        for (unsigned attempt = 0; !abort.load(std::memory_order_relaxed); ++attempt) {
+            if (tryPop(value))
+                return true;
+            if (closed.load(std::memory_order_acquire))
+                return tryPop(value);
+            backoff(attempt);
+        }
+        return false;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    static std::size_t roundUpToPowerOfTwo(std::size_t value) {
+        std::size_t result = 2;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+    static void backoff(unsigned attempt) {
+        if (attempt < 64)
+            return;
+        if (attempt < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    const std::size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<std::size_t> enqueuePos;
+    alignas(64) std::atomic<std::size_t> dequeuePos;
+    alignas(64) std::atomic<bool> closed;
+};
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,153 @@
+#include "checksum.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CHECKSUM_HAS_SSE42_PATH 1
+#endif
+
+namespace {
+    const std::uint32_t castagnoliPolynomial = 0x82F63B78;
+
+    struct SoftwareTables {
+        std::uint32_t table[8][256];
+        SoftwareTables() {
+            for (std::uint32_t i = 0; i < 256; ++i) {
+                std::uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = (crc >> 1) ^ (castagnoliPolynomial & (0 - (crc & 1)));
+                table[0][i] = crc;
+            }
+            for (std::uint32_t i = 0; i < 256; ++i)
+                for (int slice = 1; slice < 8; ++slice)
+                    table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+        }
+    };
+
+    const SoftwareTables softwareTables;
+
+    std::uint32_t crc32cSoftware(std::uint32_t crc, const unsigned char* data, std::uint64_t size) {
+        const std::uint32_t (*table)[256] = softwareTables.table;
+        while (size >= 8) {
+            std::uint64_t word;
+            memcpy(&word, data, 8);
+            word ^= crc;
+            crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff]
+                ^ table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff]
+                ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff]
+                ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+            data += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+        return crc;
+    }
+
+#ifdef CHECKSUM_HAS_SSE42_PATH
+    __attribute__((target("sse4.2")))
+    std::uint32_t crc32cHardware(std::uint32_t crc, const unsigned char* data, std::uint64_t size) {
+#if defined(__x86_64__)
+        std::uint64_t crc64 = crc;
+        while (size >= 32) {
+            std::uint64_t words[4];
+            memcpy(words, data, 32);
+            crc64 = _mm_crc32_u64(crc64, words[0]);
+            crc64 = _mm_crc32_u64(crc64, words[1]);
+            crc64 = _mm_crc32_u64(crc64, words[2]);
+            crc64 = _mm_crc32_u64(crc64, words[3]);
+            data += 32;
+            size -= 32;
+        }
+        while (size >= 8) {
+            std::uint64_t word;
+            memcpy(&word, data, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+            data += 8;
+            size -= 8;
+        }
+        crc = (std::uint32_t)crc64;
+#endif
+        while (size >= 4) {
+            std::uint32_t word;
+            memcpy(&word, data, 4);
+            crc = _mm_crc32_u32(crc, word);
+            data += 4;
+            size -= 4;
+        }
+        while (size--)
+            crc = _mm_crc32_u8(crc, *data++);
+        return crc;
+    }
+
+    bool cpuHasSse42() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    }
+
+    const bool useHardware = cpuHasSse42();
+#endif
+
+    std::uint32_t gf2MatrixTimes(const std::uint32_t* matrix, std::uint32_t vector) {
+        std::uint32_t sum = 0;
+        while (vector) {
+            if (vector & 1)
+                sum ^= *matrix;
+            vector >>= 1;
+            ++matrix;
+        }
+        return sum;
+    }
+
+    void gf2MatrixSquare(std::uint32_t* square, const std::uint32_t* matrix) {
+        for (int n = 0; n < 32; ++n)
+            square[n] = gf2MatrixTimes(matrix, matrix[n]);
+    }
+}
+
+std::uint32_t Checksum::crc32c(std::uint32_t crc, const char* data, std::uint64_t size) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+#ifdef CHECKSUM_HAS_SSE42_PATH
+    if (useHardware)
+        return ~crc32cHardware(crc, bytes, size);
+#endif
+    return ~crc32cSoftware(crc, bytes, size);
+}
+
+// Same approach as zlib's crc32_combine: apply the operator "append sizeB zero bytes"
+// to crcA by repeated squaring of the one-zero-bit operator.
+std::uint32_t Checksum::crc32cCombine(std::uint32_t crcA, std::uint32_t crcB, std::uint64_t sizeB) {
+    if (sizeB == 0)
+        return crcA;
+
+    std::uint32_t even[32];
+    std::uint32_t odd[32];
+
+    odd[0] = castagnoliPolynomial;
+    std::uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd);
+    gf2MatrixSquare(odd, even);
+
+    do {
+        gf2MatrixSquare(even, odd);
+        if (sizeB & 1)
+            crcA = gf2MatrixTimes(even, crcA);
+        sizeB >>= 1;
+        if (sizeB == 0)
+            break;
+
+        gf2MatrixSquare(odd, even);
+        if (sizeB & 1)
+            crcA = gf2MatrixTimes(odd, crcA);
+        sizeB >>= 1;
+    } while (sizeB != 0);
+
+    return crcA ^ crcB;
+}
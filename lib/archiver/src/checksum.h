@@ -0,0 +1,15 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+
+namespace Checksum {
+    // CRC-32C (Castagnoli). Uses the SSE 4.2 crc32 instruction when the cpu has it.
+    // Pass the previous result as crc to continue a running checksum, 0 to start a new one.
+    std::uint32_t crc32c(std::uint32_t crc, const char* data, std::uint64_t size);
+
+    // Checksum of the concatenation A + B from crc32c(A), crc32c(B) and the length of B.
+    std::uint32_t crc32cCombine(std::uint32_t crcA, std::uint32_t crcB, std::uint64_t sizeB);
+}
+
+#endif // CHECKSUM_H
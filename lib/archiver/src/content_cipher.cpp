@@ -0,0 +1,308 @@
+#include "content_cipher.h"
+#include "archiver.h"
+#include "content_codec.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <cstring>
+#include <limits>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    const std::uint64_t saltSize = 16;
+    const std::uint64_t keyCheckSize = 16;
+    const char contentKeyLabel[] = "archive content key";
+    const char keyCheckLabel[] = "archive key check";
+    const char metaKeyLabel[] = "archive meta key";
+    const std::uint64_t aadSize = 2 * sizeof(std::uint64_t) + sizeof(std::uint32_t);
+
+    class CipherContext {
+    public:
+        CipherContext()
+            :context(EVP_CIPHER_CTX_new()) {
+            if (context == NULL)
+                throw Archiver::ArchiverException("Cannot create cipher context");
+        }
+        ~CipherContext() {
+            EVP_CIPHER_CTX_free(context);
+        }
+        EVP_CIPHER_CTX* get() const { return context; }
+    private:
+        CipherContext(const CipherContext &);
+        CipherContext & operator=(const CipherContext &);
+        EVP_CIPHER_CTX* context;
+    };
+
+    const EVP_CIPHER* evpCipher(apb::PBCipher cipher) {
+        switch (cipher) {
+        case apb::CIPHER_AES_256_GCM:
+            return EVP_aes_256_gcm();
+        case apb::CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        default:
+            throw Archiver::ArchiverException("Unknown cipher of archive");
+        }
+    }
+
+    // HMAC-SHA256 of label and salt under the user key, so the derived values of one key are unrelated.
+    void derive(const QByteArray & key, const char* label, const std::string & salt, unsigned char* out) {
+        std::string message(label);
+        message += salt;
+        unsigned int size = 0;
+        if (HMAC(EVP_sha256(), key.constData(), key.size(), reinterpret_cast<const unsigned char*>(message.data()),
+                 message.size(), out, &size) == NULL || size != ContentCipher::keySize)
+            throw Archiver::ArchiverException("Cannot derive key of archive");
+    }
+
+    void checkKeySize(const QByteArray & key) {
+        if ((std::uint64_t)key.size() != ContentCipher::keySize)
+            throw Archiver::ArchiverException(QString("Key of archive must be ") + QString::number(ContentCipher::keySize)
+                                              + " bytes long");
+    }
+
+    void blockHeader(std::uint64_t contentOffset, std::uint64_t rawSize, apb::PBCodec codec, unsigned char* aad) {
+        std::uint32_t codecValue = codec;
+        memcpy(aad, &contentOffset, sizeof(contentOffset));
+        memcpy(aad + sizeof(contentOffset), &rawSize, sizeof(rawSize));
+        memcpy(aad + 2 * sizeof(std::uint64_t), &codecValue, sizeof(codecValue));
+    }
+
+    // Feeds values to an HMAC, every variable length one after its length so no two metas encode alike.
+    class TagInput {
+    public:
+        explicit TagInput(const unsigned char* key)
+            :context(HMAC_CTX_new()) {
+            if (context == NULL || HMAC_Init_ex(context, key, ContentCipher::keySize, EVP_sha256(), NULL) != 1)
+                fail();
+        }
+        ~TagInput() {
+            HMAC_CTX_free(context);
+        }
+
+        void number(std::uint64_t value) {
+            bytes(&value, sizeof(value));
+        }
+        void flag(bool value) {
+            number(value ? 1 : 0);
+        }
+        void string(const std::string & value) {
+            number(value.size());
+            bytes(value.data(), value.size());
+        }
+        std::string finish() {
+            unsigned char tag[EVP_MAX_MD_SIZE];
+            unsigned int size = 0;
+            if (HMAC_Final(context, tag, &size) != 1)
+                fail();
+            return std::string(reinterpret_cast<const char*>(tag), size);
+        }
+
+    private:
+        TagInput(const TagInput &);
+        TagInput & operator=(const TagInput &);
+
+        void bytes(const void* data, std::size_t size) {
+            if (HMAC_Update(context, static_cast<const unsigned char*>(data), size) != 1)
+                fail();
+        }
+        static void fail() {
+            throw Archiver::ArchiverException("Cannot compute tag of meta");
+        }
+
+        HMAC_CTX* context;
+    };
+
+    void tagFileMeta(TagInput & input, const apb::PBRegFileMetaData & fileMeta) {
+        input.number(fileMeta.contentoffset());
+        input.number(fileMeta.contentsize());
+        input.number(fileMeta.blocksize());
+        input.flag(fileMeta.has_checksum());
+        input.number(fileMeta.checksum());
+        input.flag(fileMeta.has_inlinedata());
+        input.string(fileMeta.inlinedata());
+        input.number(fileMeta.blocks_size());
+        for (int i = 0; i < fileMeta.blocks_size(); ++i) {
+            const apb::PBContentBlock & block = fileMeta.blocks(i);
+            input.number(block.storedsize());
+            input.number(block.codec());
+            input.flag(block.has_checksum());
+            input.number(block.checksum());
+        }
+        input.flag(fileMeta.has_signature());
+        const apb::PBDeltaSignature & signature = fileMeta.signature();
+        input.number(signature.blocksize());
+        input.number(signature.weak_size());
+        for (int i = 0; i < signature.weak_size(); ++i)
+            input.number(signature.weak(i));
+        input.number(signature.strong_size());
+        for (int i = 0; i < signature.strong_size(); ++i)
+            input.number(signature.strong(i));
+        input.flag(fileMeta.has_delta());
+        const apb::PBDelta & delta = fileMeta.delta();
+        input.string(delta.basepath());
+        input.number(delta.literalsize());
+        input.number(delta.ops_size());
+        for (int i = 0; i < delta.ops_size(); ++i) {
+            input.flag(delta.ops(i).has_baseoffset());
+            input.number(delta.ops(i).baseoffset());
+            input.number(delta.ops(i).size());
+        }
+    }
+
+    void checkSize(std::uint64_t size) {
+        if (size > (std::uint64_t)std::numeric_limits<int>::max())
+            throw Archiver::ArchiverException("Block is too large to encrypt");
+    }
+}
+
+const std::uint64_t ContentCipher::keySize;
+const std::uint64_t ContentCipher::nonceSize;
+const std::uint64_t ContentCipher::tagSize;
+const std::uint64_t ContentCipher::overhead;
+
+void ContentCipher::createRecord(apb::PBCipher cipher, const QByteArray & key, apb::PBEncryption * record) {
+    checkKeySize(key);
+    evpCipher(cipher);
+    std::string salt(saltSize, '\0');
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(&salt[0]), saltSize) != 1)
+        throw Archiver::ArchiverException("Cannot generate salt of archive");
+    unsigned char keyCheck[keySize];
+    derive(key, keyCheckLabel, salt, keyCheck);
+
+    record->set_cipher(cipher);
+    record->set_salt(salt);
+    record->set_keycheck(reinterpret_cast<const char*>(keyCheck), keyCheckSize);
+}
+
+bool ContentCipher::keyMatches(const apb::PBEncryption & record, const QByteArray & key) {
+    if ((std::uint64_t)key.size() != keySize || record.keycheck().size() != keyCheckSize)
+        return false;
+    unsigned char keyCheck[keySize];
+    derive(key, keyCheckLabel, record.salt(), keyCheck);
+    return CRYPTO_memcmp(keyCheck, record.keycheck().data(), keyCheckSize) == 0;
+}
+
+ContentCipher::ContentCipher(const apb::PBEncryption & record, const QByteArray & key)
+    :cipher(record.cipher()) {
+    checkKeySize(key);
+    evpCipher(cipher);
+    if (!keyMatches(record, key))
+        throw Archiver::ArchiverException("Wrong key of encrypted archive");
+    derive(key, contentKeyLabel, record.salt(), this->key);
+    derive(key, metaKeyLabel, record.salt(), metaKey);
+}
+
+ContentCipher::~ContentCipher() {
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(metaKey, sizeof(metaKey));
+}
+
+void ContentCipher::seal(const char* src, std::uint64_t size, std::uint64_t rawSize, apb::PBCodec codec,
+                         std::uint64_t contentOffset, char* dst) const {
+    checkSize(size);
+    unsigned char* nonce = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* ciphertext = nonce + nonceSize;
+    unsigned char aad[aadSize];
+    blockHeader(contentOffset, rawSize, codec, aad);
+
+    CipherContext context;
+    int length = 0;
+    int finalLength = 0;
+    if (RAND_bytes(nonce, nonceSize) != 1
+            || EVP_EncryptInit_ex(context.get(), evpCipher(cipher), NULL, NULL, NULL) != 1
+            || EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_SET_IVLEN, nonceSize, NULL) != 1
+            || EVP_EncryptInit_ex(context.get(), NULL, NULL, key, nonce) != 1
+            || EVP_EncryptUpdate(context.get(), NULL, &length, aad, aadSize) != 1
+            || EVP_EncryptUpdate(context.get(), ciphertext, &length, reinterpret_cast<const unsigned char*>(src), size) != 1
+            || EVP_EncryptFinal_ex(context.get(), ciphertext + length, &finalLength) != 1
+            || (std::uint64_t)(length + finalLength) != size
+            || EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_GET_TAG, tagSize, ciphertext + size) != 1)
+        throw Archiver::ArchiverException("Cannot encrypt block");
+}
+
+std::uint64_t ContentCipher::open(const char* src, std::uint64_t storedSize, std::uint64_t rawSize, apb::PBCodec codec,
+                                  std::uint64_t contentOffset, char* dst) const {
+    if (storedSize < overhead)
+        throw Archiver::ArchiverException("Encrypted block is too short");
+    std::uint64_t size = storedSize - overhead;
+    checkSize(size);
+    const unsigned char* nonce = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* ciphertext = nonce + nonceSize;
+    unsigned char tag[tagSize];
+    memcpy(tag, ciphertext + size, tagSize);
+    unsigned char aad[aadSize];
+    blockHeader(contentOffset, rawSize, codec, aad);
+
+    CipherContext context;
+    int length = 0;
+    int finalLength = 0;
+    if (EVP_DecryptInit_ex(context.get(), evpCipher(cipher), NULL, NULL, NULL) != 1
+            || EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_SET_IVLEN, nonceSize, NULL) != 1
+            || EVP_DecryptInit_ex(context.get(), NULL, NULL, key, nonce) != 1
+            || EVP_DecryptUpdate(context.get(), NULL, &length, aad, aadSize) != 1
+            || EVP_DecryptUpdate(context.get(), reinterpret_cast<unsigned char*>(dst), &length, ciphertext, size) != 1
+            || EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_SET_TAG, tagSize, tag) != 1)
+        throw Archiver::ArchiverException("Cannot decrypt block");
+    if (EVP_DecryptFinal_ex(context.get(), reinterpret_cast<unsigned char*>(dst) + length, &finalLength) != 1
+            || (std::uint64_t)(length + finalLength) != size)
+        throw Archiver::ArchiverException("Authentication of encrypted block failed");
+    return size;
+}
+
+void ContentCipher::decodeBlock(const ContentCipher * cipher, apb::PBCodec codec, std::uint64_t contentOffset,
+                                const char* stored, std::uint64_t storedSize, char* dst, std::uint64_t rawSize,
+                                std::vector<char> & scratch) {
+    if (cipher == NULL) {
+        ContentCodec::decompressBlock(codec, stored, storedSize, dst, rawSize);
+        return;
+    }
+    if (storedSize < overhead)
+        throw Archiver::ArchiverException("Encrypted block is too short");
+    // raw blocks are opened right into place
+    if (codec == apb::CODEC_RAW) {
+        if (storedSize - overhead != rawSize)
+            throw Archiver::ArchiverException("Raw block has unexpected size");
+        cipher->open(stored, storedSize, rawSize, codec, contentOffset, dst);
+        return;
+    }
+    if (scratch.size() < storedSize - overhead)
+        scratch.resize(storedSize - overhead);
+    std::uint64_t payloadSize = cipher->open(stored, storedSize, rawSize, codec, contentOffset, scratch.data());
+    ContentCodec::decompressBlock(codec, scratch.data(), payloadSize, dst, rawSize);
+}
+
+std::string ContentCipher::metaTag(const apb::PBArchiveMetaData & meta) const {
+    TagInput input(metaKey);
+    input.number(meta.pbdirentmetadata_size());
+    for (int i = 0; i < meta.pbdirentmetadata_size(); ++i) {
+        const apb::PBDirEntMetaData & dirent = meta.pbdirentmetadata(i);
+        input.number(dirent.uid());
+        input.number(dirent.gid());
+        input.number(dirent.mtime());
+        input.number(dirent.atime());
+        input.number(dirent.mode());
+        input.string(dirent.name());
+        input.number(dirent.parentix());
+        input.flag(dirent.has_pbregfilemetadata());
+        if (dirent.has_pbregfilemetadata())
+            tagFileMeta(input, dirent.pbregfilemetadata());
+    }
+    input.flag(meta.has_basearchive());
+    input.string(meta.basearchive().path());
+    input.number(meta.basearchive().metasize());
+    input.number(meta.basearchive().contentsize());
+    input.number(meta.encryption().cipher());
+    input.string(meta.encryption().salt());
+    input.string(meta.encryption().keycheck());
+    return input.finish();
+}
+
+bool ContentCipher::metaTagMatches(const apb::PBArchiveMetaData & meta) const {
+    std::string tag = metaTag(meta);
+    const std::string & stored = meta.encryption().metatag();
+    return stored.size() == tag.size() && CRYPTO_memcmp(stored.data(), tag.data(), tag.size()) == 0;
+}
@@ -0,0 +1,70 @@
+#ifndef CONTENT_CIPHER_H
+#define CONTENT_CIPHER_H
+
+#include <struct_serialization.pb.h>
+
+#include <QByteArray>
+#include <cstdint>
+#include <vector>
+
+// Authenticated encryption of content blocks with AES-256-GCM or ChaCha20-Poly1305 of libcrypto,
+// which uses AES-NI/AVX2 where the cpu has them. Every stored block is sealed on its own as
+//   [nonce][ciphertext of the compressed block][tag]
+// with a random nonce and the content offset, raw size and codec of the block as associated data,
+// so any block is opened alone (extract, parallel verify) and a block moved to another place
+// of the content, or its header altered, fails to open.
+// Blocks are sealed with a key derived from the user key and a random salt of the archive,
+// so random nonces of all archives packed with one user key never pile up under one key.
+// The meta itself (names, sizes, block tables) stays in plain text but carries a tag under another
+// derived key, so it cannot be altered unnoticed either. It holds nothing computed from the content:
+// no checksums (the tags check the blocks), no inlined files and no delta signatures.
+// Duplicate files still share one content range, so the meta shows which files are identical,
+// unless the archive is packed with PackOptions::dedup off.
+class ContentCipher {
+public:
+    static const std::uint64_t keySize = 32;
+    static const std::uint64_t nonceSize = 12;
+    static const std::uint64_t tagSize = 16;
+    // number of bytes a sealed block is larger than its payload
+    static const std::uint64_t overhead = nonceSize + tagSize;
+
+    // Fills the record of a new archive sealed with cipher and key.
+    static void createRecord(ArchiverUtils::protobufStructs::PBCipher cipher, const QByteArray & key,
+                             ArchiverUtils::protobufStructs::PBEncryption * record);
+    static bool keyMatches(const ArchiverUtils::protobufStructs::PBEncryption & record, const QByteArray & key);
+
+    // Throws ArchiverException if key is not the key of record.
+    ContentCipher(const ArchiverUtils::protobufStructs::PBEncryption & record, const QByteArray & key);
+    ~ContentCipher();
+
+    // Seals size bytes of src into dst, which has room for size + overhead bytes.
+    // contentOffset is where the sealed block goes in the content of the archive.
+    void seal(const char* src, std::uint64_t size, std::uint64_t rawSize, ArchiverUtils::protobufStructs::PBCodec codec,
+              std::uint64_t contentOffset, char* dst) const;
+    // Opens a sealed block into dst, which has room for storedSize - overhead bytes, and returns the size of the payload.
+    // Throws ArchiverException if the block, its header or its place were altered or the key is wrong.
+    std::uint64_t open(const char* src, std::uint64_t storedSize, std::uint64_t rawSize,
+                       ArchiverUtils::protobufStructs::PBCodec codec, std::uint64_t contentOffset, char* dst) const;
+
+    // Decodes a stored block into rawSize bytes at dst: opens it first if cipher is not NULL, then decompresses it.
+    // scratch keeps the opened payload of compressed blocks between calls.
+    static void decodeBlock(const ContentCipher * cipher, ArchiverUtils::protobufStructs::PBCodec codec,
+                            std::uint64_t contentOffset, const char* stored, std::uint64_t storedSize,
+                            char* dst, std::uint64_t rawSize, std::vector<char> & scratch);
+
+    // HMAC-SHA256 of every field of meta but the tag itself, in a fixed encoding of their values,
+    // so a meta decoded from another encoding (MetaCodec) has the same tag.
+    std::string metaTag(const ArchiverUtils::protobufStructs::PBArchiveMetaData & meta) const;
+    // Returns false if the tag of meta is missing or does not match.
+    bool metaTagMatches(const ArchiverUtils::protobufStructs::PBArchiveMetaData & meta) const;
+
+private:
+    ContentCipher(const ContentCipher &);
+    ContentCipher & operator=(const ContentCipher &);
+
+    ArchiverUtils::protobufStructs::PBCipher cipher;
+    unsigned char key[keySize];
+    unsigned char metaKey[keySize];
+};
+
+#endif // CONTENT_CIPHER_H
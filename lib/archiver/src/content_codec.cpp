@@ -0,0 +1,95 @@
+#include "content_codec.h"
+#include "archiver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <lz4.h>
+#include <zstd.h>
+
+namespace {
+    const double rawEntropyThreshold = 7.5;
+    const double lz4EntropyThreshold = 6.0;
+    const double fastZstdEntropyThreshold = 2.0;
+
+    double byteEntropy(const unsigned char* data, std::uint64_t size) {
+        std::uint64_t histogram[256] = {0};
+        for (std::uint64_t i = 0; i < size; ++i)
+            ++histogram[data[i]];
+
+        double entropy = 0;
+        for (int i = 0; i < 256; ++i) {
+            if (histogram[i] == 0)
+                continue;
+            double p = (double)histogram[i] / size;
+            entropy -= p * std::log2(p);
+        }
+        return entropy;
+    }
+}
+
+ContentCodec::CodecChoice ContentCodec::probe(const char* firstBlock, std::uint64_t size) {
+    if (size == 0)
+        return CodecChoice(apb::CODEC_RAW, 0);
+
+    double entropy = byteEntropy(reinterpret_cast<const unsigned char*>(firstBlock), size);
+    if (entropy >= rawEntropyThreshold)
+        return CodecChoice(apb::CODEC_RAW, 0);
+    if (entropy >= lz4EntropyThreshold)
+        return CodecChoice(apb::CODEC_LZ4, 0);
+    if (entropy < fastZstdEntropyThreshold)
+        return CodecChoice(apb::CODEC_ZSTD, 1);
+    return CodecChoice(apb::CODEC_ZSTD, 3);
+}
+
+std::uint64_t ContentCodec::compressBound(std::uint64_t rawSize) {
+    return std::max<std::uint64_t>(ZSTD_compressBound(rawSize), LZ4_compressBound(rawSize));
+}
+
+std::uint64_t ContentCodec::compressBlock(const CodecChoice & choice, const char* src, std::uint64_t rawSize,
+                                          char* dst, std::uint64_t dstCapacity) {
+    std::uint64_t storedSize = 0;
+    switch (choice.codec) {
+    case apb::CODEC_LZ4: {
+        int result = LZ4_compress_default(src, dst, rawSize, dstCapacity);
+        if (result <= 0)
+            throw Archiver::ArchiverException("Error with lz4 compression of block");
+        storedSize = result;
+        break;
+    }
+    case apb::CODEC_ZSTD: {
+        size_t result = ZSTD_compress(dst, dstCapacity, src, rawSize, choice.level);
+        if (ZSTD_isError(result))
+            throw Archiver::ArchiverException(QString("Error with zstd compression of block: ") + ZSTD_getErrorName(result));
+        storedSize = result;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    return storedSize < rawSize ? storedSize : 0;
+}
+
+void ContentCodec::decompressBlock(apb::PBCodec codec, const char* src, std::uint64_t storedSize,
+                                   char* dst, std::uint64_t rawSize) {
+    switch (codec) {
+    case apb::CODEC_RAW:
+        if (storedSize != rawSize)
+            throw Archiver::ArchiverException("Raw block has unexpected size");
+        memcpy(dst, src, rawSize);
+        break;
+    case apb::CODEC_LZ4:
+        if (LZ4_decompress_safe(src, dst, storedSize, rawSize) != (int)rawSize)
+            throw Archiver::ArchiverException("Error with lz4 decompression of block");
+        break;
+    case apb::CODEC_ZSTD: {
+        size_t result = ZSTD_decompress(dst, rawSize, src, storedSize);
+        if (ZSTD_isError(result) || result != rawSize)
+            throw Archiver::ArchiverException("Error with zstd decompression of block");
+        break;
+    }
+    default:
+        throw Archiver::ArchiverException("Unknown codec of block");
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef CONTENT_CODEC_H
+#define CONTENT_CODEC_H
+
+#include <cstdint>
+#include <struct_serialization.pb.h>
+
+namespace ContentCodec {
+    namespace apb = ArchiverUtils::protobufStructs;
+
+    const std::uint64_t defaultBlockSize = 1 << 20;
+    const std::uint64_t probeSize = 64 << 10;
+
+    struct CodecChoice {
+        apb::PBCodec codec;
+        int level;
+        CodecChoice(apb::PBCodec codec, int level)
+            :codec(codec), level(level) {}
+    };
+
+    // Looks at the byte entropy of the first probeSize bytes and picks the codec for the whole file:
+    // raw for already compressed data, lz4 for weakly compressible data, zstd otherwise.
+    CodecChoice probe(const char* firstBlock, std::uint64_t size);
+
+    std::uint64_t compressBound(std::uint64_t rawSize);
+
+    // Returns the number of bytes written to dst or 0 if the block did not shrink
+    // (the caller should store it raw in that case).
+    std::uint64_t compressBlock(const CodecChoice & choice, const char* src, std::uint64_t rawSize,
+                                char* dst, std::uint64_t dstCapacity);
+
+    void decompressBlock(apb::PBCodec codec, const char* src, std::uint64_t storedSize,
+                         char* dst, std::uint64_t rawSize);
+}
+
+#endif // CONTENT_CODEC_H
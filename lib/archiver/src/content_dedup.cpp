@@ -0,0 +1,130 @@
+#include "content_dedup.h"
+#include "archiver_utils.h"
+#include "io_control.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <openssl/evp.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+
+using ArchiverUtils::readFully;
+
+namespace {
+    const std::uint64_t chunkSize = 1 << 20;
+
+    class FileDescriptor {
+    public:
+        explicit FileDescriptor(const QString & path)
+            :fd(-1) {
+            QByteArray pathByteArray = path.toLocal8Bit();
+            fd = ::open(pathByteArray.data(), O_RDONLY);
+            if (fd == -1)
+                throw Archiver::ArchiverException(QString("Cannot open file: ") + path);
+        }
+        ~FileDescriptor() {
+            close(fd);
+        }
+        int get() const { return fd; }
+    private:
+        int fd;
+        FileDescriptor(const FileDescriptor &);
+        FileDescriptor & operator=(const FileDescriptor &);
+    };
+
+    class Digest {
+    public:
+        Digest()
+            :context(EVP_MD_CTX_new()) {
+            if (context == NULL || EVP_DigestInit_ex(context, EVP_sha256(), NULL) != 1)
+                fail();
+        }
+        ~Digest() {
+            EVP_MD_CTX_free(context);
+        }
+        void update(const char* data, std::uint64_t size) {
+            if (EVP_DigestUpdate(context, data, size) != 1)
+                fail();
+        }
+        std::string final() {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned size = 0;
+            if (EVP_DigestFinal_ex(context, digest, &size) != 1)
+                fail();
+            return std::string(reinterpret_cast<const char*>(digest), size);
+        }
+    private:
+        void fail() {
+            EVP_MD_CTX_free(context);
+            context = NULL;
+            throw Archiver::ArchiverException("Failed to hash content for deduplication");
+        }
+        EVP_MD_CTX* context;
+        Digest(const Digest &);
+        Digest & operator=(const Digest &);
+    };
+
+    // A collision of SHA-256 is not a concern, so equal digests stand for equal content
+    // and every file is read once.
+    std::string hashFile(const PackFileTask & task, std::vector<char> & buffer, const Archiver::IoOptions & io) {
+        FileDescriptor file(task.path);
+        Digest digest;
+        std::uint64_t size = task.fileMeta->contentsize();
+        for (std::uint64_t offset = 0; offset < size; offset += chunkSize) {
+            std::uint64_t length = std::min(chunkSize, size - offset);
+            IoControl::acquire(io, length);
+            readFully(file.get(), buffer.data(), length, offset, task.path);
+            digest.update(buffer.data(), length);
+        }
+        return digest.final();
+    }
+}
+
+std::vector<std::size_t> ContentDedup::findDuplicates(const std::vector<PackFileTask> & tasks, const Archiver::IoOptions & io) {
+    std::vector<std::size_t> originals(tasks.size());
+    std::map<std::uint64_t, std::vector<std::size_t> > bySize;
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        originals[i] = i;
+        if (tasks[i].fileMeta->contentsize() > 0)
+            bySize[tasks[i].fileMeta->contentsize()].push_back(i);
+    }
+
+    std::vector<char> buffer(chunkSize);
+    for (std::map<std::uint64_t, std::vector<std::size_t> >::const_iterator it = bySize.begin(); it != bySize.end(); ++it) {
+        const std::vector<std::size_t> & sameSize = it->second;
+        if (sameSize.size() < 2)
+            continue;
+
+        // first task of every distinct content with this size
+        std::map<std::string, std::size_t> byDigest;
+        for (std::size_t i = 0; i < sameSize.size(); ++i) {
+            std::size_t taskIndex = sameSize[i];
+            std::pair<std::map<std::string, std::size_t>::iterator, bool> first =
+                    byDigest.insert(std::make_pair(hashFile(tasks[taskIndex], buffer, io), taskIndex));
+            originals[taskIndex] = first.first->second;
+        }
+    }
+    return originals;
+}
+
+void ContentDedup::shareContent(const std::vector<PackFileTask> & tasks, const std::vector<std::size_t> & originals) {
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        if (originals[i] == i)
+            continue;
+        const ArchiverUtils::protobufStructs::PBRegFileMetaData & original = *tasks[originals[i]].fileMeta;
+        ArchiverUtils::protobufStructs::PBRegFileMetaData* duplicate = tasks[i].fileMeta;
+        duplicate->set_contentoffset(original.contentoffset());
+        duplicate->set_blocksize(original.blocksize());
+        duplicate->mutable_blocks()->CopyFrom(original.blocks());
+        if (original.has_checksum())
+            duplicate->set_checksum(original.checksum());
+        else
+            duplicate->clear_checksum();
+        if (original.has_signature())
+            duplicate->mutable_signature()->CopyFrom(original.signature());
+        if (original.has_delta())
+            duplicate->mutable_delta()->CopyFrom(original.delta());
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef CONTENT_DEDUP_H
+#define CONTENT_DEDUP_H
+
+#include "pack_pipeline.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace ContentDedup {
+    // For every task returns the index of the first task with byte-identical content,
+    // or its own index when the content is unique. Only files sharing a size are hashed,
+    // each of them is read once, under the limiter and the control of io.
+    std::vector<std::size_t> findDuplicates(const std::vector<PackFileTask> & tasks, const Archiver::IoOptions & io);
+
+    // Points meta of every duplicate at the content range written for its original.
+    void shareContent(const std::vector<PackFileTask> & tasks, const std::vector<std::size_t> & originals);
+}
+
+#endif // CONTENT_DEDUP_H
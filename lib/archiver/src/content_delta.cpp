@@ -0,0 +1,292 @@
+#include "content_delta.h"
+#include "checksum.h"
+#include "content_codec.h"
+#include "io_control.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    const std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+
+    // bits of the filter that rejects most windows before the signature table is searched
+    const unsigned filterBits = 20;
+
+    std::uint64_t rotateLeft(std::uint64_t value, unsigned bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    std::uint64_t load64(const char* data) {
+        std::uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    std::uint64_t round(std::uint64_t accumulator, std::uint64_t input) {
+        return rotateLeft(accumulator + input * prime2, 31) * prime1;
+    }
+
+    std::uint32_t filterSlot(std::uint32_t weak) {
+        return (weak * 2654435761u) >> (32 - filterBits);
+    }
+
+    class OpBuilder {
+    public:
+        explicit OpBuilder(apb::PBDelta* delta)
+            :delta(delta), lastCopyEnd(std::numeric_limits<std::uint64_t>::max()) {}
+
+        void copy(std::uint64_t baseOffset, std::uint64_t size) {
+            // consecutive base blocks become one op
+            if (baseOffset == lastCopyEnd) {
+                apb::PBDeltaOp* op = delta->mutable_ops(delta->ops_size() - 1);
+                op->set_size(op->size() + size);
+            } else {
+                apb::PBDeltaOp* op = delta->add_ops();
+                op->set_baseoffset(baseOffset);
+                op->set_size(size);
+            }
+            lastCopyEnd = baseOffset + size;
+        }
+
+        void literal(std::uint64_t size) {
+            if (size == 0)
+                return;
+            delta->add_ops()->set_size(size);
+            delta->set_literalsize(delta->literalsize() + size);
+            lastCopyEnd = std::numeric_limits<std::uint64_t>::max();
+        }
+
+    private:
+        apb::PBDelta* delta;
+        std::uint64_t lastCopyEnd;
+    };
+
+    // Asks the limiter for a pass over size bytes one chunk at a time as the pass reaches it,
+    // so a large file is throttled all along instead of once before it.
+    class ChunkedAcquire {
+    public:
+        ChunkedAcquire(const Archiver::IoOptions & io, std::uint64_t size)
+            :io(io), size(size), acquired(0) {}
+
+        void reach(std::uint64_t end) {
+            while (acquired < end && acquired < size) {
+                std::uint64_t chunk = std::min<std::uint64_t>(ContentCodec::defaultBlockSize, size - acquired);
+                IoControl::acquire(io, chunk);
+                acquired += chunk;
+            }
+        }
+
+    private:
+        const Archiver::IoOptions & io;
+        const std::uint64_t size;
+        std::uint64_t acquired;
+    };
+}
+
+void ContentDelta::RollingChecksum::reset(const char* data, std::uint32_t size) {
+    this->size = size;
+    a = 0;
+    b = 0;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    for (std::uint32_t i = 0; i < size; ++i) {
+        a += bytes[i];
+        b += (size - i) * bytes[i];
+    }
+}
+
+// 64 bit multiply-rotate hash over four lanes, only collisions matter here, not resistance to attacks
+std::uint64_t ContentDelta::strongChecksum(const char* data, std::uint64_t size) {
+    const char* end = data + size;
+    std::uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    for (; end - data >= 32; data += 32) {
+        for (int i = 0; i < 4; ++i)
+            lanes[i] = round(lanes[i], load64(data + 8 * i));
+    }
+    std::uint64_t hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12)
+            + rotateLeft(lanes[3], 18) + size;
+    for (; end - data >= 8; data += 8)
+        hash = rotateLeft(hash ^ round(0, load64(data)), 27) * prime1 + prime3;
+    for (; data < end; ++data)
+        hash = rotateLeft(hash ^ (static_cast<unsigned char>(*data) * prime3), 11) * prime1;
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void ContentDelta::sign(const char* data, std::uint64_t size, std::vector<std::uint32_t> & weak,
+                        std::vector<std::uint64_t> & strong) {
+    RollingChecksum rolling;
+    for (std::uint64_t offset = 0; offset + signatureBlockSize <= size; offset += signatureBlockSize) {
+        rolling.reset(data + offset, signatureBlockSize);
+        weak.push_back(rolling.value());
+        strong.push_back(strongChecksum(data + offset, signatureBlockSize));
+    }
+}
+
+void ContentDelta::encode(const apb::PBDeltaSignature & baseSignature, const char* data, std::uint64_t size,
+                          apb::PBDelta* delta, const std::function<void(const char*, std::uint64_t)> & literal,
+                          const Archiver::IoOptions & io) {
+    const std::uint64_t blockSize = baseSignature.blocksize();
+    const std::uint32_t blockCount = std::min(baseSignature.weak_size(), baseSignature.strong_size());
+    delta->clear_ops();
+    delta->set_literalsize(0);
+    OpBuilder ops(delta);
+    ChunkedAcquire reads(io, size);
+    if (blockSize == 0 || blockCount == 0 || size < blockSize) {
+        reads.reach(size);
+        ops.literal(size);
+        literal(data, size);
+        return;
+    }
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > table(blockCount);
+    std::vector<std::uint64_t> filter((1u << filterBits) / 64, 0);
+    for (std::uint32_t i = 0; i < blockCount; ++i) {
+        table[i] = std::make_pair(baseSignature.weak(i), i);
+        std::uint32_t slot = filterSlot(baseSignature.weak(i));
+        filter[slot / 64] |= 1ULL << (slot % 64);
+    }
+    std::sort(table.begin(), table.end());
+
+    RollingChecksum rolling;
+    rolling.reset(data, blockSize);
+    std::uint64_t position = 0;
+    std::uint64_t literalStart = 0;
+    // the block after the last match is tried first, it is the usual continuation of a copy
+    std::uint64_t expectedBlock = 0;
+    while (position + blockSize <= size) {
+        // the window reads up to one byte past itself when it rolls
+        reads.reach(position + blockSize + 1);
+        std::uint32_t weak = rolling.value();
+        std::uint32_t slot = filterSlot(weak);
+        std::uint64_t matched = blockCount;
+        if (filter[slot / 64] & (1ULL << (slot % 64))) {
+            std::vector<std::pair<std::uint32_t, std::uint32_t> >::const_iterator candidate =
+                    std::lower_bound(table.begin(), table.end(), std::make_pair(weak, (std::uint32_t)0));
+            bool strongKnown = false;
+            std::uint64_t strong = 0;
+            for (; candidate != table.end() && candidate->first == weak; ++candidate) {
+                if (!strongKnown) {
+                    strong = strongChecksum(data + position, blockSize);
+                    strongKnown = true;
+                }
+                if (baseSignature.strong(candidate->second) != strong)
+                    continue;
+                if (matched == blockCount || candidate->second == expectedBlock)
+                    matched = candidate->second;
+                if (matched == expectedBlock)
+                    break;
+            }
+        }
+
+        if (matched != blockCount) {
+            ops.literal(position - literalStart);
+            literal(data + literalStart, position - literalStart);
+            ops.copy(matched * blockSize, blockSize);
+            expectedBlock = matched + 1;
+            position += blockSize;
+            literalStart = position;
+            if (position + blockSize <= size)
+                rolling.reset(data + position, blockSize);
+        } else {
+            if (position + blockSize < size)
+                rolling.roll(data[position], data[position + blockSize]);
+            ++position;
+        }
+    }
+    reads.reach(size);
+    ops.literal(size - literalStart);
+    literal(data + literalStart, size - literalStart);
+}
+
+ContentDelta::BlockReader::BlockReader(const apb::PBRegFileMetaData & fileMeta, std::uint64_t rawSize, const char* stored,
+                                       std::uint64_t storedSize, const QString & path, const Archiver::IoOptions & io)
+    :fileMeta(fileMeta)
+    ,rawSize(rawSize)
+    ,blockSize(fileMeta.blocksize())
+    ,stored(stored)
+    ,path(path)
+    ,io(io)
+    ,loadedBlock(std::numeric_limits<std::uint64_t>::max()) {
+    if (rawSize != 0 && (blockSize == 0 || blockSize > ContentCodec::defaultBlockSize
+                         || (std::uint64_t)fileMeta.blocks_size() != (rawSize + blockSize - 1) / blockSize))
+        throw Archiver::ArchiverException(QString("Broken blocks meta of file: ") + path);
+    std::uint64_t storedOffset = 0;
+    for (int i = 0; i < fileMeta.blocks_size(); ++i) {
+        storedOffsets.push_back(storedOffset);
+        storedOffset += fileMeta.blocks(i).storedsize();
+    }
+    if (storedOffset > storedSize)
+        throw Archiver::ArchiverException(QString("Content of file is out of archive: ") + path);
+    raw.resize(std::min(blockSize, rawSize));
+}
+
+void ContentDelta::BlockReader::read(std::uint64_t offset, std::uint64_t size, char* dst) {
+    if (offset > rawSize || size > rawSize - offset)
+        throw Archiver::ArchiverException(QString("Delta refers past the end of content of file: ") + path);
+    while (size > 0) {
+        load(offset / blockSize);
+        std::uint64_t inBlock = offset % blockSize;
+        std::uint64_t chunk = std::min(size, std::min(blockSize, rawSize - loadedBlock * blockSize) - inBlock);
+        memcpy(dst, raw.data() + inBlock, chunk);
+        dst += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+void ContentDelta::BlockReader::load(std::uint64_t blockIndex) {
+    if (blockIndex == loadedBlock)
+        return;
+    const apb::PBContentBlock & block = fileMeta.blocks(blockIndex);
+    std::uint64_t blockRawSize = std::min(blockSize, rawSize - blockIndex * blockSize);
+    IoControl::acquire(io, block.storedsize());
+    ContentCodec::decompressBlock(block.codec(), stored + storedOffsets[blockIndex], block.storedsize(),
+                                  raw.data(), blockRawSize);
+    if (block.has_checksum() && block.checksum() != Checksum::crc32c(0, raw.data(), blockRawSize))
+        throw Archiver::ArchiverException(QString("Checksum mismatch in block ") + QString::number(blockIndex)
+                                          + " of file: " + path);
+    loadedBlock = blockIndex;
+}
+
+void ContentDelta::MemoryReader::read(std::uint64_t offset, std::uint64_t size, char* dst) {
+    if (offset > this->size || size > this->size - offset)
+        throw Archiver::ArchiverException(QString("Delta refers past the end of content of file: ") + path);
+    memcpy(dst, data + offset, size);
+}
+
+void ContentDelta::apply(const apb::PBDelta & delta, ContentReader & base, ContentReader & literals, char* dst,
+                         std::uint64_t size, const QString & path, const Archiver::IoOptions & io) {
+    ChunkedAcquire writes(io, size);
+    std::uint64_t position = 0;
+    std::uint64_t literalPosition = 0;
+    for (int i = 0; i < delta.ops_size(); ++i) {
+        const apb::PBDeltaOp & op = delta.ops(i);
+        if (op.size() > size - position)
+            throw Archiver::ArchiverException(QString("Delta does not match size of file: ") + path);
+        // a copy may span the whole file, it is done a chunk at a time
+        for (std::uint64_t done = 0; done < op.size();) {
+            std::uint64_t chunk = std::min<std::uint64_t>(ContentCodec::defaultBlockSize, op.size() - done);
+            writes.reach(position + done + chunk);
+            if (op.has_baseoffset())
+                base.read(op.baseoffset() + done, chunk, dst + position + done);
+            else
+                literals.read(literalPosition + done, chunk, dst + position + done);
+            done += chunk;
+        }
+        if (!op.has_baseoffset())
+            literalPosition += op.size();
+        position += op.size();
+    }
+    if (position != size || literalPosition != delta.literalsize())
+        throw Archiver::ArchiverException(QString("Delta does not match size of file: ") + path);
+}
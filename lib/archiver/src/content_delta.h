@@ -0,0 +1,100 @@
+#ifndef CONTENT_DELTA_H
+#define CONTENT_DELTA_H
+
+#include "archiver.h"
+#include <struct_serialization.pb.h>
+
+#include <QString>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// rsync style delta encoding of large files against the signature of their previous version.
+// The signature holds a weak rolling checksum and a strong checksum of every full block of the base.
+// The encoder slides a window over the new content, emits copies of base blocks where both
+// checksums match and literal bytes everywhere else, so inserted and shifted data is found too.
+namespace ContentDelta {
+    namespace apb = ArchiverUtils::protobufStructs;
+
+    // divides ContentCodec::defaultBlockSize, so the pack pipeline signs every content block on its own
+    const std::uint32_t signatureBlockSize = 64 << 10;
+
+    // Adler style checksum of a window of fixed size, moved by one byte in constant time.
+    class RollingChecksum {
+    public:
+        RollingChecksum()
+            :a(0), b(0), size(0) {}
+        void reset(const char* data, std::uint32_t size);
+        void roll(unsigned char out, unsigned char in) {
+            a += in - out;
+            b += a - size * out;
+        }
+        std::uint32_t value() const { return (a & 0xffff) | (b << 16); }
+
+    private:
+        std::uint32_t a;
+        std::uint32_t b;
+        std::uint32_t size;
+    };
+
+    std::uint64_t strongChecksum(const char* data, std::uint64_t size);
+
+    // Appends the checksums of every full signature block of data, which starts at a block boundary.
+    void sign(const char* data, std::uint64_t size, std::vector<std::uint32_t> & weak, std::vector<std::uint64_t> & strong);
+
+    // Matches data against the signature of its base and fills the ops of delta.
+    // Literal bytes are passed to literal in the order the ops take them.
+    // The limiter of io is asked for data a chunk at a time as the matching window reaches it.
+    void encode(const apb::PBDeltaSignature & baseSignature, const char* data, std::uint64_t size,
+                apb::PBDelta* delta, const std::function<void(const char*, std::uint64_t)> & literal,
+                const Archiver::IoOptions & io);
+
+    // Random access to the content a delta takes its bytes from.
+    class ContentReader {
+    public:
+        virtual ~ContentReader() {}
+        virtual void read(std::uint64_t offset, std::uint64_t size, char* dst) = 0;
+    };
+
+    // Random access to content stored in blocks, decoding one block at a time and keeping the last one.
+    class BlockReader : public ContentReader {
+    public:
+        // stored is the mapped content range of fileMeta, rawSize the number of bytes its blocks decode to.
+        BlockReader(const apb::PBRegFileMetaData & fileMeta, std::uint64_t rawSize, const char* stored,
+                    std::uint64_t storedSize, const QString & path, const Archiver::IoOptions & io);
+        void read(std::uint64_t offset, std::uint64_t size, char* dst);
+
+    private:
+        void load(std::uint64_t blockIndex);
+
+        const apb::PBRegFileMetaData & fileMeta;
+        const std::uint64_t rawSize;
+        const std::uint64_t blockSize;
+        const char* stored;
+        const QString path;
+        const Archiver::IoOptions io;
+        std::vector<std::uint64_t> storedOffsets;
+        std::vector<char> raw;
+        std::uint64_t loadedBlock;
+    };
+
+    // Content decoded in memory already, such as a base file rebuilt from a delta itself.
+    class MemoryReader : public ContentReader {
+    public:
+        MemoryReader(const char* data, std::uint64_t size, const QString & path)
+            :data(data), size(size), path(path) {}
+        void read(std::uint64_t offset, std::uint64_t size, char* dst);
+
+    private:
+        const char* data;
+        const std::uint64_t size;
+        const QString path;
+    };
+
+    // Rebuilds size bytes of content from the ops of delta into dst,
+    // asking the limiter of io for the written bytes a chunk at a time.
+    void apply(const apb::PBDelta & delta, ContentReader & base, ContentReader & literals, char* dst, std::uint64_t size,
+               const QString & path, const Archiver::IoOptions & io);
+}
+
+#endif // CONTENT_DELTA_H
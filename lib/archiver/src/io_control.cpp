@@ -0,0 +1,111 @@
+#include "io_control.h"
+#include "archiver_utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+using ArchiverUtils::nowNs;
+
+namespace {
+    // from linux/ioprio.h, which is not installed everywhere
+    const int ioprioWhoProcess = 1;
+    const int ioprioClassShift = 13;
+    const int ioprioClassBestEffort = 2;
+    const int ioprioClassIdle = 3;
+    const int ioprioLowestBestEffortLevel = 7;
+
+    // The bucket holds at most a tenth of a second of the limit, so an idle period
+    // does not turn into a long burst.
+    double capacity(std::uint64_t perSecond) {
+        return std::max(1.0, perSecond / 10.0);
+    }
+}
+
+Archiver::IoOptions::IoOptions()
+    :limiter(NULL)
+    ,priorityClass(IoPriorityDefault)
+    ,niceIncrement(0)
+    ,control(NULL)
+    ,durability(DurabilityNone)
+    ,syncThreads(8) {}
+
+Archiver::IoLimiter::IoLimiter(std::uint64_t bytesPerSecond, std::uint64_t opsPerSecond)
+    :bytesPerSecond(bytesPerSecond)
+    ,opsPerSecond(opsPerSecond)
+    ,byteTokens(capacity(bytesPerSecond))
+    ,opTokens(capacity(opsPerSecond))
+    ,lastRefillNs(nowNs()) {}
+
+void Archiver::IoLimiter::setLimits(std::uint64_t newBytesPerSecond, std::uint64_t newOpsPerSecond) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bytesPerSecond = newBytesPerSecond;
+    opsPerSecond = newOpsPerSecond;
+    byteTokens = std::min(byteTokens, capacity(bytesPerSecond));
+    opTokens = std::min(opTokens, capacity(opsPerSecond));
+}
+
+// Tokens may go below zero, the caller then sleeps off the debt outside the lock.
+// Concurrent callers see the debt of each other and queue up behind it.
+void Archiver::IoLimiter::acquire(std::uint64_t bytes) {
+    double waitSeconds = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint64_t now = nowNs();
+        double elapsedSeconds = (now - lastRefillNs) / 1e9;
+        lastRefillNs = now;
+
+        if (bytesPerSecond) {
+            byteTokens = std::min(capacity(bytesPerSecond), byteTokens + elapsedSeconds * bytesPerSecond) - bytes;
+            if (byteTokens < 0)
+                waitSeconds = std::max(waitSeconds, -byteTokens / bytesPerSecond);
+        }
+        if (opsPerSecond) {
+            opTokens = std::min(capacity(opsPerSecond), opTokens + elapsedSeconds * opsPerSecond) - 1;
+            if (opTokens < 0)
+                waitSeconds = std::max(waitSeconds, -opTokens / opsPerSecond);
+        }
+    }
+    if (waitSeconds > 0)
+        std::this_thread::sleep_for(std::chrono::nanoseconds((std::uint64_t)(waitSeconds * 1e9)));
+}
+
+void IoControl::applyThreadPriority(const Archiver::IoOptions & io) {
+    // on linux both the i/o priority and the nice value of "process" 0 are those of the calling thread
+    if (io.priorityClass == Archiver::IoPriorityBestEffort)
+        syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassBestEffort << ioprioClassShift | ioprioLowestBestEffortLevel);
+    else if (io.priorityClass == Archiver::IoPriorityIdle)
+        syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift);
+
+    if (io.niceIncrement != 0) {
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0)
+            setpriority(PRIO_PROCESS, 0, nice + io.niceIncrement);
+    }
+}
+
+void IoControl::runWithPriority(const Archiver::IoOptions & io, const std::function<void()> & work) {
+    if (io.priorityClass == Archiver::IoPriorityDefault && io.niceIncrement == 0) {
+        work();
+        return;
+    }
+
+    std::exception_ptr error;
+    std::thread thread([&]() {
+        try {
+            applyThreadPriority(io);
+            work();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    });
+    thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,30 @@
+#ifndef IO_CONTROL_H
+#define IO_CONTROL_H
+
+#include "archiver.h"
+
+#include <functional>
+
+namespace IoControl {
+    // Stops a cancelled operation, then waits for the limiter of io if there is one.
+    inline void acquire(const Archiver::IoOptions & io, std::uint64_t bytes) {
+        if (io.control)
+            io.control->checkCancelled();
+        if (io.limiter)
+            io.limiter->acquire(bytes);
+    }
+
+    inline void advance(const Archiver::IoOptions & io, std::uint64_t entries, std::uint64_t bytes) {
+        if (io.control)
+            io.control->advance(entries, bytes);
+    }
+
+    // Sets the i/o priority class and nice value of the calling thread, failures are ignored.
+    void applyThreadPriority(const Archiver::IoOptions & io);
+
+    // Runs work in a separate thread with the priority of io applied, so the caller keeps its own.
+    // Without a priority to apply the work runs in the calling thread. Exceptions are rethrown.
+    void runWithPriority(const Archiver::IoOptions & io, const std::function<void()> & work);
+}
+
+#endif // IO_CONTROL_H
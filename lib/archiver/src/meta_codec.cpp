@@ -0,0 +1,526 @@
+#include "meta_codec.h"
+#include "archiver.h"
+#include "stats_recorder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    // the last byte of the magic is the version of the encoding
+    const char magic[8] = {'C', 'M', 'E', 'T', 'A', 0, 0, 1};
+    const std::uint64_t versionOffset = sizeof(magic) - 1;
+    // entries decoded between two checks of the control
+    const std::uint64_t cancelCheckEntries = 4096;
+
+    enum EntryFlags {
+        RegularFile = 1,
+        HasChecksum = 2,
+        HasBlockChecksums = 4,
+        CustomBlockSize = 8,
+        SingleBlockChecksum = 16,
+        InlineContent = 32,
+        HasSignature = 64,
+        DeltaContent = 128
+    };
+    const int flagBits = 8;
+
+    // records of the archive after the entries
+    enum ArchiveFlags {
+        HasBaseArchive = 1,
+        HasEncryption = 2,
+        HasMetaTag = 4
+    };
+
+    struct AttrTuple {
+        std::uint64_t uid;
+        std::uint64_t gid;
+        std::uint32_t mode;
+        AttrTuple(std::uint64_t uid, std::uint64_t gid, std::uint32_t mode)
+            :uid(uid), gid(gid), mode(mode) {}
+        bool operator<(const AttrTuple & other) const {
+            if (uid != other.uid)
+                return uid < other.uid;
+            if (gid != other.gid)
+                return gid < other.gid;
+            return mode < other.mode;
+        }
+    };
+
+    std::uint64_t zigzag(std::uint64_t value, std::uint64_t base) {
+        std::int64_t delta = (std::int64_t)(value - base);
+        return ((std::uint64_t)delta << 1) ^ (std::uint64_t)(delta >> 63);
+    }
+
+    std::uint64_t unzigzag(std::uint64_t coded, std::uint64_t base) {
+        return base + ((coded >> 1) ^ (0 - (coded & 1)));
+    }
+
+    class Encoder {
+    public:
+        void varint(std::uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back((char)(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back((char)value);
+        }
+        void fixed32(std::uint32_t value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        void fixed64(std::uint64_t value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        void bytes(const char* data, std::uint64_t size) {
+            out.append(data, size);
+        }
+        void string(const std::string & value) {
+            varint(value.size());
+            bytes(value.data(), value.size());
+        }
+        std::string out;
+    };
+
+    class Decoder {
+    public:
+        Decoder(const char* data, std::uint64_t size)
+            :position(data), end(data + size) {}
+        std::uint64_t varint() {
+            std::uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (position == end)
+                    broken();
+                unsigned char byte = *position++;
+                value |= (std::uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+            broken();
+            return 0;
+        }
+        std::uint32_t fixed32() {
+            std::uint32_t value;
+            memcpy(&value, take(sizeof(value)), sizeof(value));
+            return value;
+        }
+        std::uint64_t fixed64() {
+            std::uint64_t value;
+            memcpy(&value, take(sizeof(value)), sizeof(value));
+            return value;
+        }
+        void string(std::string* value) {
+            std::uint64_t size = varint();
+            value->assign(take(size), size);
+        }
+        // Number of items that follow, each taking at least itemSize bytes.
+        std::uint64_t count(std::uint64_t itemSize) {
+            std::uint64_t value = varint();
+            if (value > (std::uint64_t)(end - position) / itemSize)
+                broken();
+            return value;
+        }
+        const char* take(std::uint64_t size) {
+            if (size > (std::uint64_t)(end - position))
+                broken();
+            const char* result = position;
+            position += size;
+            return result;
+        }
+        bool atEnd() const { return position == end; }
+        static void broken() {
+            throw Archiver::ArchiverException("Broken compact meta");
+        }
+    private:
+        const char* position;
+        const char* end;
+    };
+
+    std::uint64_t storedSize(const apb::PBRegFileMetaData & fileMeta) {
+        std::uint64_t size = 0;
+        for (int i = 0; i < fileMeta.blocks_size(); ++i)
+            size += fileMeta.blocks(i).storedsize();
+        return size;
+    }
+
+    std::uint64_t rawBlockSize(std::uint64_t contentSize, std::uint64_t blockSize, std::uint64_t index) {
+        if (blockSize == 0 || index * blockSize >= contentSize)
+            return 0;
+        return std::min(blockSize, contentSize - index * blockSize);
+    }
+
+    bool isSibling(const apb::PBArchiveMetaData & metaArchive, std::uint64_t index) {
+        return index > 1 && metaArchive.pbdirentmetadata(index - 1).parentix() == metaArchive.pbdirentmetadata(index).parentix();
+    }
+
+    void encodeSignature(Encoder & encoder, const apb::PBDeltaSignature & signature) {
+        if (signature.weak_size() != signature.strong_size())
+            throw Archiver::ArchiverException("Broken delta signature, cannot encode meta");
+        encoder.varint(signature.blocksize());
+        encoder.varint(signature.weak_size());
+        for (int i = 0; i < signature.weak_size(); ++i)
+            encoder.fixed32(signature.weak(i));
+        for (int i = 0; i < signature.strong_size(); ++i)
+            encoder.fixed64(signature.strong(i));
+    }
+
+    void decodeSignature(Decoder & decoder, apb::PBDeltaSignature* signature) {
+        signature->set_blocksize(decoder.varint());
+        std::uint64_t count = decoder.count(sizeof(std::uint32_t) + sizeof(std::uint64_t));
+        signature->mutable_weak()->Reserve(count);
+        signature->mutable_strong()->Reserve(count);
+        for (std::uint64_t i = 0; i < count; ++i)
+            signature->add_weak(decoder.fixed32());
+        for (std::uint64_t i = 0; i < count; ++i)
+            signature->add_strong(decoder.fixed64());
+    }
+
+    // copies are zigzag deltas from the end of the previous copy, the usual continuation is 0
+    void encodeDelta(Encoder & encoder, const apb::PBDelta & delta) {
+        encoder.string(delta.basepath());
+        encoder.varint(delta.literalsize());
+        encoder.varint(delta.ops_size());
+        std::uint64_t copyEnd = 0;
+        for (int i = 0; i < delta.ops_size(); ++i) {
+            const apb::PBDeltaOp & op = delta.ops(i);
+            encoder.varint(op.size() << 1 | (op.has_baseoffset() ? 1 : 0));
+            if (op.has_baseoffset()) {
+                encoder.varint(zigzag(op.baseoffset(), copyEnd));
+                copyEnd = op.baseoffset() + op.size();
+            }
+        }
+    }
+
+    void decodeDelta(Decoder & decoder, apb::PBDelta* delta) {
+        decoder.string(delta->mutable_basepath());
+        delta->set_literalsize(decoder.varint());
+        std::uint64_t count = decoder.count(1);
+        delta->mutable_ops()->Reserve(count);
+        std::uint64_t copyEnd = 0;
+        for (std::uint64_t i = 0; i < count; ++i) {
+            std::uint64_t sizeAndKind = decoder.varint();
+            apb::PBDeltaOp* op = delta->add_ops();
+            op->set_size(sizeAndKind >> 1);
+            if (sizeAndKind & 1) {
+                op->set_baseoffset(unzigzag(decoder.varint(), copyEnd));
+                copyEnd = op->baseoffset() + op->size();
+            }
+        }
+    }
+
+    void encodeArchiveRecords(Encoder & encoder, const apb::PBArchiveMetaData & metaArchive) {
+        std::uint64_t flags = 0;
+        if (metaArchive.has_basearchive())
+            flags |= HasBaseArchive;
+        if (metaArchive.has_encryption())
+            flags |= HasEncryption;
+        if (metaArchive.has_encryption() && metaArchive.encryption().has_metatag())
+            flags |= HasMetaTag;
+        encoder.varint(flags);
+        if (flags & HasBaseArchive) {
+            const apb::PBBaseArchive & base = metaArchive.basearchive();
+            encoder.string(base.path());
+            encoder.varint(base.metasize());
+            encoder.varint(base.contentsize());
+        }
+        if (flags & HasEncryption) {
+            const apb::PBEncryption & encryption = metaArchive.encryption();
+            encoder.varint(encryption.cipher());
+            encoder.string(encryption.salt());
+            encoder.string(encryption.keycheck());
+            if (flags & HasMetaTag)
+                encoder.string(encryption.metatag());
+        }
+    }
+
+    void decodeArchiveRecords(Decoder & decoder, apb::PBArchiveMetaData & metaArchive) {
+        std::uint64_t flags = decoder.varint();
+        if (flags & HasBaseArchive) {
+            apb::PBBaseArchive* base = metaArchive.mutable_basearchive();
+            decoder.string(base->mutable_path());
+            base->set_metasize(decoder.varint());
+            base->set_contentsize(decoder.varint());
+        }
+        if (flags & HasEncryption) {
+            apb::PBEncryption* encryption = metaArchive.mutable_encryption();
+            std::uint64_t cipher = decoder.varint();
+            if (cipher > (std::uint64_t)std::numeric_limits<int>::max() || !apb::PBCipher_IsValid(cipher))
+                Decoder::broken();
+            encryption->set_cipher((apb::PBCipher)cipher);
+            decoder.string(encryption->mutable_salt());
+            decoder.string(encryption->mutable_keycheck());
+            if (flags & HasMetaTag)
+                decoder.string(encryption->mutable_metatag());
+        }
+    }
+}
+
+bool MetaCodec::isCompact(const char* data, std::uint64_t size) {
+    return size >= sizeof(magic) && memcmp(data, magic, versionOffset) == 0;
+}
+
+QByteArray MetaCodec::encode(const apb::PBArchiveMetaData & metaArchive) {
+    std::uint64_t entryCount = metaArchive.pbdirentmetadata_size();
+    std::map<AttrTuple, std::uint64_t> tupleIndexes;
+    std::vector<const AttrTuple*> tuples;
+    std::vector<std::uint64_t> entryTuples(entryCount);
+    for (std::uint64_t i = 0; i < entryCount; ++i) {
+        const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+        std::pair<std::map<AttrTuple, std::uint64_t>::iterator, bool> inserted = tupleIndexes.insert(
+                    std::make_pair(AttrTuple(dirent.uid(), dirent.gid(), dirent.mode()), (std::uint64_t)tuples.size()));
+        if (inserted.second)
+            tuples.push_back(&inserted.first->first);
+        entryTuples[i] = inserted.first->second;
+    }
+
+    std::uint64_t defaultBlockSize = 0;
+    for (std::uint64_t i = 0; i < entryCount && defaultBlockSize == 0; ++i) {
+        if (metaArchive.pbdirentmetadata(i).has_pbregfilemetadata())
+            defaultBlockSize = metaArchive.pbdirentmetadata(i).pbregfilemetadata().blocksize();
+    }
+
+    Encoder encoder;
+    encoder.bytes(magic, sizeof(magic));
+    encoder.varint(entryCount);
+    encoder.varint(defaultBlockSize);
+    encoder.varint(tuples.size());
+    for (size_t i = 0; i < tuples.size(); ++i) {
+        encoder.varint(tuples[i]->uid);
+        encoder.varint(tuples[i]->gid);
+        encoder.varint(tuples[i]->mode);
+    }
+
+    std::uint64_t nextContentOffset = 0;
+    for (std::uint64_t i = 0; i < entryCount; ++i) {
+        const apb::PBDirEntMetaData & dirent = metaArchive.pbdirentmetadata(i);
+        std::uint64_t parentIx = dirent.parentix();
+        if (parentIx > i || (parentIx == i && i != 0))
+            throw Archiver::ArchiverException("Meta is not in bfs order, cannot encode it");
+        const apb::PBDirEntMetaData & parent = metaArchive.pbdirentmetadata(parentIx);
+
+        std::uint64_t flags = 0;
+        if (dirent.has_pbregfilemetadata()) {
+            const apb::PBRegFileMetaData & fileMeta = dirent.pbregfilemetadata();
+            flags |= RegularFile;
+            if (fileMeta.has_checksum())
+                flags |= HasChecksum;
+            if (fileMeta.blocks_size() > 0 && fileMeta.blocks(0).has_checksum())
+                flags |= HasBlockChecksums;
+            if (fileMeta.has_inlinedata())
+                flags |= InlineContent;
+            if (fileMeta.has_signature())
+                flags |= HasSignature;
+            if (fileMeta.has_delta())
+                flags |= DeltaContent;
+            // block size 0 stands for a file without one
+            if (!fileMeta.has_blocksize() || fileMeta.blocksize() != defaultBlockSize)
+                flags |= CustomBlockSize;
+            if ((flags & HasChecksum) && (flags & HasBlockChecksums) && fileMeta.blocks_size() == 1
+                    && fileMeta.blocks(0).checksum() == fileMeta.checksum())
+                flags |= SingleBlockChecksum;
+        }
+
+        encoder.varint(i - parentIx);
+        encoder.varint(entryTuples[i] << flagBits | flags);
+        encoder.varint(zigzag(dirent.mtime(), i == 0 ? 0 : parent.mtime()));
+        encoder.varint(zigzag(dirent.atime(), i == 0 ? 0 : parent.atime()));
+
+        const std::string & name = dirent.name();
+        std::uint64_t prefix = 0;
+        if (isSibling(metaArchive, i)) {
+            const std::string & previous = metaArchive.pbdirentmetadata(i - 1).name();
+            while (prefix < name.size() && prefix < previous.size() && name[prefix] == previous[prefix])
+                ++prefix;
+        }
+        encoder.varint(prefix);
+        encoder.varint(name.size() - prefix);
+        encoder.bytes(name.data() + prefix, name.size() - prefix);
+
+        if (!(flags & RegularFile))
+            continue;
+        const apb::PBRegFileMetaData & fileMeta = dirent.pbregfilemetadata();
+        encoder.varint(fileMeta.contentsize());
+        if (flags & CustomBlockSize)
+            encoder.varint(fileMeta.has_blocksize() ? fileMeta.blocksize() : 0);
+        if (flags & InlineContent) {
+            if (flags & (HasSignature | DeltaContent))
+                throw Archiver::ArchiverException("Inlined file with a delta or signature, cannot encode meta");
+            encoder.varint(fileMeta.inlinedata().size());
+            encoder.bytes(fileMeta.inlinedata().data(), fileMeta.inlinedata().size());
+            if (flags & HasChecksum)
+                encoder.fixed32(fileMeta.checksum());
+            continue;
+        }
+        encoder.varint(zigzag(fileMeta.contentoffset(), nextContentOffset));
+        encoder.varint(fileMeta.blocks_size());
+        for (int j = 0; j < fileMeta.blocks_size(); ++j) {
+            const apb::PBContentBlock & block = fileMeta.blocks(j);
+            // a raw block is as large as its part of the file, its size is implied
+            bool impliedSize = block.codec() == apb::CODEC_RAW
+                    && block.storedsize() == rawBlockSize(fileMeta.contentsize(), fileMeta.blocksize(), j);
+            encoder.varint((impliedSize ? 0 : block.storedsize()) << 2 | block.codec());
+            if (flags & HasBlockChecksums)
+                encoder.fixed32(block.checksum());
+        }
+        if ((flags & HasChecksum) && !(flags & SingleBlockChecksum))
+            encoder.fixed32(fileMeta.checksum());
+        if (flags & HasSignature)
+            encodeSignature(encoder, fileMeta.signature());
+        if (flags & DeltaContent)
+            encodeDelta(encoder, fileMeta.delta());
+        nextContentOffset = fileMeta.contentoffset() + storedSize(fileMeta);
+    }
+    encodeArchiveRecords(encoder, metaArchive);
+
+    return QByteArray(encoder.out.data(), encoder.out.size());
+}
+
+void MetaCodec::decode(const char* data, std::uint64_t size, apb::PBArchiveMetaData & metaArchive,
+                       const Archiver::JobControl* control) {
+    if (!isCompact(data, size))
+        Decoder::broken();
+    char version = data[versionOffset];
+    if (version != magic[versionOffset])
+        throw Archiver::ArchiverException("Unsupported version " + QString::number((int)version) + " of compact meta");
+    Decoder decoder(data + sizeof(magic), size - sizeof(magic));
+
+    std::uint64_t entryCount = decoder.varint();
+    std::uint64_t defaultBlockSize = decoder.varint();
+    std::uint64_t tupleCount = decoder.varint();
+    // every entry takes at least a few bytes, so the counts are bounded by the size
+    if (entryCount > size || tupleCount > size)
+        Decoder::broken();
+    std::vector<AttrTuple> tuples;
+    tuples.reserve(tupleCount);
+    for (std::uint64_t i = 0; i < tupleCount; ++i) {
+        std::uint64_t uid = decoder.varint();
+        std::uint64_t gid = decoder.varint();
+        std::uint64_t mode = decoder.varint();
+        tuples.push_back(AttrTuple(uid, gid, mode));
+    }
+
+    metaArchive.Clear();
+    metaArchive.mutable_pbdirentmetadata()->Reserve(entryCount);
+    std::uint64_t nextContentOffset = 0;
+    for (std::uint64_t i = 0; i < entryCount; ++i) {
+        if (control && i % cancelCheckEntries == 0)
+            control->checkCancelled();
+        apb::PBDirEntMetaData* dirent = metaArchive.add_pbdirentmetadata();
+
+        std::uint64_t parentDelta = decoder.varint();
+        if (parentDelta > i || (parentDelta == 0 && i != 0))
+            Decoder::broken();
+        std::uint64_t parentIx = i - parentDelta;
+        const apb::PBDirEntMetaData & parent = metaArchive.pbdirentmetadata(parentIx);
+        dirent->set_parentix(parentIx);
+
+        std::uint64_t tupleAndFlags = decoder.varint();
+        std::uint64_t flags = tupleAndFlags & ((1 << flagBits) - 1);
+        std::uint64_t tupleIndex = tupleAndFlags >> flagBits;
+        if (tupleIndex >= tuples.size())
+            Decoder::broken();
+        dirent->set_uid(tuples[tupleIndex].uid);
+        dirent->set_gid(tuples[tupleIndex].gid);
+        dirent->set_mode(tuples[tupleIndex].mode);
+        dirent->set_mtime(unzigzag(decoder.varint(), i == 0 ? 0 : parent.mtime()));
+        dirent->set_atime(unzigzag(decoder.varint(), i == 0 ? 0 : parent.atime()));
+
+        std::uint64_t prefix = decoder.varint();
+        std::uint64_t suffix = decoder.varint();
+        std::string* name = dirent->mutable_name();
+        if (prefix > 0) {
+            if (!isSibling(metaArchive, i) || prefix > metaArchive.pbdirentmetadata(i - 1).name().size())
+                Decoder::broken();
+            name->assign(metaArchive.pbdirentmetadata(i - 1).name(), 0, prefix);
+        }
+        name->append(decoder.take(suffix), suffix);
+
+        if (!(flags & RegularFile))
+            continue;
+        apb::PBRegFileMetaData* fileMeta = dirent->mutable_pbregfilemetadata();
+        fileMeta->set_contentsize(decoder.varint());
+        std::uint64_t blockSize = (flags & CustomBlockSize) ? decoder.varint() : defaultBlockSize;
+        if (blockSize != 0)
+            fileMeta->set_blocksize(blockSize);
+        if (flags & InlineContent) {
+            std::uint64_t inlineSize = decoder.varint();
+            fileMeta->set_contentoffset(0);
+            fileMeta->set_inlinedata(decoder.take(inlineSize), inlineSize);
+            if (flags & HasChecksum)
+                fileMeta->set_checksum(decoder.fixed32());
+            continue;
+        }
+        fileMeta->set_contentoffset(unzigzag(decoder.varint(), nextContentOffset));
+        std::uint64_t blockCount = decoder.varint();
+        if (blockCount > size)
+            Decoder::broken();
+        std::uint64_t stored = 0;
+        for (std::uint64_t j = 0; j < blockCount; ++j) {
+            std::uint64_t sizeAndCodec = decoder.varint();
+            apb::PBContentBlock* block = fileMeta->add_blocks();
+            if (!apb::PBCodec_IsValid(sizeAndCodec & 3))
+                Decoder::broken();
+            block->set_codec((apb::PBCodec)(sizeAndCodec & 3));
+            if (sizeAndCodec >> 2 == 0 && block->codec() == apb::CODEC_RAW)
+                block->set_storedsize(rawBlockSize(fileMeta->contentsize(), fileMeta->blocksize(), j));
+            else
+                block->set_storedsize(sizeAndCodec >> 2);
+            if (flags & HasBlockChecksums)
+                block->set_checksum(decoder.fixed32());
+            stored += block->storedsize();
+        }
+        if (flags & SingleBlockChecksum) {
+            if (blockCount != 1 || !(flags & HasBlockChecksums))
+                Decoder::broken();
+            fileMeta->set_checksum(fileMeta->blocks(0).checksum());
+        } else if (flags & HasChecksum) {
+            fileMeta->set_checksum(decoder.fixed32());
+        }
+        if (flags & HasSignature)
+            decodeSignature(decoder, fileMeta->mutable_signature());
+        if (flags & DeltaContent)
+            decodeDelta(decoder, fileMeta->mutable_delta());
+        nextContentOffset = fileMeta->contentoffset() + stored;
+    }
+    decodeArchiveRecords(decoder, metaArchive);
+
+    if (!decoder.atEnd())
+        Decoder::broken();
+}
+
+void MetaCodec::parse(const char* data, std::uint64_t size, apb::PBArchiveMetaData & metaArchive,
+                      const Archiver::JobControl* control) {
+    if (isCompact(data, size)) {
+        decode(data, size, metaArchive, control);
+        return;
+    }
+    if (control)
+        control->checkCancelled();
+    if (!metaArchive.ParseFromArray(data, size))
+        throw Archiver::ArchiverException("Error with parse meta");
+    if (control)
+        control->checkCancelled();
+}
+
+void MetaCodec::parse(QFile & archive, std::uint64_t offset, std::uint64_t size, apb::PBArchiveMetaData & metaArchive,
+                      const Archiver::JobControl* control) {
+    if (size == 0) {
+        parse(NULL, 0, metaArchive, control);
+        return;
+    }
+    uchar* mapping = archive.map(offset, size);
+    if (mapping == NULL)
+        throw Archiver::ArchiverException("Cannot map meta of " + archive.fileName());
+    StatsRecorder::countMapping();
+    try {
+        parse(reinterpret_cast<const char*>(mapping), size, metaArchive, control);
+    } catch (...) {
+        archive.unmap(mapping);
+        throw;
+    }
+    archive.unmap(mapping);
+}
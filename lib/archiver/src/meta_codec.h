@@ -0,0 +1,36 @@
+#ifndef META_CODEC_H
+#define META_CODEC_H
+
+#include "archiver.h"
+#include <struct_serialization.pb.h>
+
+#include <QByteArray>
+#include <QFile>
+#include <cstdint>
+
+// Compact encoding of PBArchiveMetaData for shipping meta without content.
+// uid/gid/mode tuples are dictionary coded, timestamps are zigzag varint deltas from
+// the parent directory, names are front coded against the previous sibling and content
+// offsets are deltas from the end of the previous file's content. Inline content, delta signatures,
+// deltas and the base archive and encryption records are kept as they are.
+// childIxs of directories are not stored, the children are implied by parent indices.
+namespace MetaCodec {
+    // True if data starts with the magic of the compact encoding (protobuf meta never does), of any version.
+    // decode reads the current version only and rejects the others.
+    bool isCompact(const char* data, std::uint64_t size);
+
+    QByteArray encode(const ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive);
+    void decode(const char* data, std::uint64_t size, ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive,
+                const Archiver::JobControl* control = NULL);
+
+    // Decodes meta in either encoding, throws ArchiverException if it is broken.
+    // A cancelled control stops the compact decoding between entries, the protobuf one only before and after it.
+    void parse(const char* data, std::uint64_t size, ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive,
+               const Archiver::JobControl* control = NULL);
+    // Same, straight from a mapping of the meta in archive, without reading it into a buffer first.
+    void parse(QFile & archive, std::uint64_t offset, std::uint64_t size,
+               ArchiverUtils::protobufStructs::PBArchiveMetaData & metaArchive,
+               const Archiver::JobControl* control = NULL);
+}
+
+#endif // META_CODEC_H
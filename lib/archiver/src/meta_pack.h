@@ -13,15 +13,6 @@
 namespace apb = ArchiverUtils::protobufStructs;
 
 namespace details{
-    inline void init_stat(struct stat& stat, uid_t uid,
-            gid_t gid, time_t atime, time_t mtime, mode_t mode) {
-        stat.st_uid = uid;
-        stat.st_gid = gid;
-        stat.st_mtime = mtime;
-        stat.st_atime = atime;
-        stat.st_mode = mode;
-    }
-
     inline void pack_inode(const inode *inode,
             apb::PBDirEntMetaData *packed)
     {
@@ -50,25 +41,12 @@ namespace details{
 }
 
 inline void pack_regfile_inode(const regular_file_inode *inode,
-        apb::PBDirEntMetaData *packed, std::uint64_t & contentFreePosition)
+        apb::PBDirEntMetaData *packed)
 {
     details::pack_inode(&inode->inode, packed);
     packed->mutable_pbregfilemetadata()->set_contentsize(inode->inode.attrs.st_size);
-    packed->mutable_pbregfilemetadata()->set_contentoffset(contentFreePosition);
-
-    contentFreePosition += inode->inode.attrs.st_size;
-}
-
-inline void unpack_regfile_inode(const apb::PBDirEntMetaData *packed,
-                                 regular_file_inode *inode, std::vector<struct inode*> & indexToInodePointer,
-                                 std::uint64_t index)
-{
-    struct stat curStat;
-    details::init_stat(curStat, packed->uid(), packed->gid(), packed->atime(), packed->mtime(), packed->mode());
-    init_regular_file_inode_from_stat(inode, packed->name().c_str(),curStat,
-                                      indexToInodePointer[packed->parentix()]);
-    indexToInodePointer[index] = reinterpret_cast<struct inode*>(inode);
-    inode->inode.user_data = reinterpret_cast<void*>(index);
+    // real offset is known only when content is written
+    packed->mutable_pbregfilemetadata()->set_contentoffset(0);
 }
 
 inline void pack_dir_inode(const dir_inode *inode, apb::PBDirEntMetaData *packed,
@@ -84,15 +62,3 @@ inline void pack_dir_inode(const dir_inode *inode, apb::PBDirEntMetaData *packed
         metaArchive->mutable_pbdirentmetadata()->Mutable(childindex)->set_parentix(dirIndexInPBArchiveMetaData);
     }
 }
-
-inline void unpack_dir_inode(const apb::PBDirEntMetaData *packed,
-     dir_inode * inode, std::vector<struct inode*> & indexToInodePointer, std::uint64_t numberDirChildren,
-                             std::uint64_t index)
-{
-    struct stat curStat;
-    details::init_stat(curStat ,packed->uid(), packed->gid(), packed->atime(), packed->mtime(), packed->mode());
-    init_dir_inode_from_stat(inode, packed->name().c_str(), curStat,
-                             indexToInodePointer[packed->parentix()], numberDirChildren);
-    indexToInodePointer[index] = reinterpret_cast<struct inode*>(inode);
-    inode->inode.user_data = reinterpret_cast<void*>(index);
-}
@@ -0,0 +1,77 @@
+#include "archiver.h"
+#include "archiver_utils.h"
+#include "stats_recorder.h"
+#include "thread_shares.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+
+using ArchiverUtils::nowNs;
+
+Archiver::BatchOptions::BatchOptions()
+    :concurrentJobs(std::max(1u, std::thread::hardware_concurrency() / 2)) {}
+
+namespace {
+    void runJobs(const std::vector<Archiver::BatchJob> & jobs, const Archiver::PackOptions & batchOptions,
+                 ThreadShares & readerShares, ThreadShares & workerShares, std::atomic<std::size_t> & nextJob,
+                 std::vector<Archiver::BatchJobResult> & results) {
+        // jobs are taken one at a time, so a thread done with small sources moves on while others pack big ones
+        for (std::size_t jobIndex = nextJob++; jobIndex < jobs.size(); jobIndex = nextJob++) {
+            Archiver::BatchJobResult & result = results[jobIndex];
+            Archiver::PackOptions jobOptions = batchOptions;
+            jobOptions.readerThreads = readerShares.take();
+            jobOptions.workerThreads = workerShares.take();
+            std::uint64_t startNs = nowNs();
+            try {
+                Archiver::pack(jobs[jobIndex].srcPath, jobs[jobIndex].dstArchivePath, jobOptions, &result.stats);
+            } catch (Archiver::ArchiverException & e) {
+                result.error = e.whatQMsg();
+            } catch (std::exception & e) {
+                result.error = QString(e.what());
+            }
+            result.wallNs = nowNs() - startNs;
+            readerShares.giveBack(jobOptions.readerThreads);
+            workerShares.giveBack(jobOptions.workerThreads);
+        }
+    }
+}
+
+std::vector<Archiver::BatchJobResult> Archiver::packBatch(const std::vector<BatchJob> & jobs, const BatchOptions & options,
+                                                          OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "pack-batch");
+    recorder.phase("jobs");
+    std::vector<BatchJobResult> results;
+    for (std::size_t i = 0; i < jobs.size(); ++i)
+        results.push_back(BatchJobResult(jobs[i]));
+
+    unsigned runners = std::max(1u, std::min<unsigned>(options.concurrentJobs, jobs.size()));
+    // the totals go to the running jobs, the ones started after others have finished get what they left
+    ThreadShares readerShares(options.pack.readerThreads, runners, jobs.size());
+    ThreadShares workerShares(options.pack.workerThreads, runners, jobs.size());
+
+    std::atomic<std::size_t> nextJob(0);
+    std::vector<std::thread> threads;
+    try {
+        for (unsigned i = 0; i < runners; ++i)
+            threads.push_back(std::thread(runJobs, std::cref(jobs), std::cref(options.pack), std::ref(readerShares),
+                                          std::ref(workerShares), std::ref(nextJob), std::ref(results)));
+    } catch (...) {
+        nextJob = jobs.size();
+        for (std::size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        throw;
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    if (operationStats) {
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            operationStats->rawBytes += results[i].stats.rawBytes;
+            operationStats->storedBytes += results[i].stats.storedBytes;
+        }
+    }
+    recorder.finish();
+    return results;
+}
@@ -0,0 +1,243 @@
+#include "pack_checkpoint.h"
+#include "archiver.h"
+#include "archiver_utils.h"
+#include "checksum.h"
+#include "content_cipher.h"
+#include "content_codec.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    const std::uint64_t frameHeaderSize = 2 * sizeof(std::uint32_t);
+
+    void writeAll(int fd, const char* data, std::uint64_t size, const QString & path) {
+        std::uint64_t done = 0;
+        while (done < size) {
+            ssize_t result = write(fd, data + done, size - done);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                throw Archiver::ArchiverException(QString("Cannot write checkpoint: ") + path);
+            done += result;
+        }
+    }
+
+    // Decodes all blocks of a committed file and compares them with the checksums in its meta.
+    bool contentMatches(int archiveFd, const apb::PBRegFileMetaData & fileMeta, const ContentCipher * cipher,
+                        const QString & archivePath) {
+        // blocks of a delta encoded file hold only its literal bytes
+        std::uint64_t size = fileMeta.has_delta() ? fileMeta.delta().literalsize() : fileMeta.contentsize();
+        std::uint64_t blockSize = fileMeta.blocksize();
+        // sealed blocks carry no checksums, their tags check them
+        if (blockSize == 0 || blockSize > ContentCodec::defaultBlockSize || (!fileMeta.has_checksum() && !cipher))
+            return false;
+
+        std::vector<char> stored(ContentCodec::compressBound(blockSize) + (cipher ? ContentCipher::overhead : 0));
+        std::vector<char> raw(blockSize);
+        std::vector<char> scratch;
+        std::uint64_t archiveOffset = ArchiverUtils::contentOffsetInArchive + fileMeta.contentoffset();
+        std::uint64_t rawOffset = 0;
+        std::uint32_t fileChecksum = 0;
+        for (int i = 0; i < fileMeta.blocks_size(); ++i) {
+            const apb::PBContentBlock & block = fileMeta.blocks(i);
+            if (rawOffset >= size || block.storedsize() > stored.size())
+                return false;
+            std::uint64_t rawSize = std::min(blockSize, size - rawOffset);
+            ArchiverUtils::readFully(archiveFd, stored.data(), block.storedsize(), archiveOffset, archivePath);
+            const char* rawBlock = stored.data();
+            if (block.codec() != apb::CODEC_RAW || cipher) {
+                try {
+                    ContentCipher::decodeBlock(cipher, block.codec(),
+                                               archiveOffset - ArchiverUtils::contentOffsetInArchive,
+                                               stored.data(), block.storedsize(), raw.data(), rawSize, scratch);
+                } catch (Archiver::ArchiverException &) {
+                    return false;
+                }
+                rawBlock = raw.data();
+            }
+            std::uint32_t blockChecksum = Checksum::crc32c(0, rawBlock, rawSize);
+            if (block.has_checksum() && block.checksum() != blockChecksum)
+                return false;
+            fileChecksum = i == 0 ? blockChecksum : Checksum::crc32cCombine(fileChecksum, blockChecksum, rawSize);
+            archiveOffset += block.storedsize();
+            rawOffset += rawSize;
+        }
+        return rawOffset == size && (fileMeta.has_delta() || !fileMeta.has_checksum() || fileChecksum == fileMeta.checksum());
+    }
+}
+
+PackCheckpoint::PackCheckpoint(const QString & archivePath, std::uint64_t interval)
+    :path(archivePath + ".checkpoint")
+    ,interval(interval)
+    ,fd(-1)
+    ,loaded(false)
+    ,validLength(0)
+    ,committedEnd(0) {}
+
+PackCheckpoint::~PackCheckpoint() {
+    if (fd != -1)
+        close(fd);
+}
+
+bool PackCheckpoint::load(const QString & srcPath, const QByteArray & encryptionKey) {
+    QByteArray pathByteArray = path.toLocal8Bit();
+    int logFd = open(pathByteArray.data(), O_RDONLY);
+    if (logFd == -1)
+        return false;
+
+    std::vector<char> log;
+    struct stat logStat;
+    try {
+        if (fstat(logFd, &logStat) == -1)
+            throw Archiver::ArchiverException(QString("Cannot read checkpoint: ") + path);
+        log.resize(logStat.st_size);
+        ArchiverUtils::readFully(logFd, log.data(), log.size(), 0, path);
+    } catch (...) {
+        close(logFd);
+        throw;
+    }
+    close(logFd);
+
+    std::uint64_t offset = 0;
+    while (offset + frameHeaderSize <= log.size()) {
+        std::uint32_t recordSize;
+        std::uint32_t recordChecksum;
+        memcpy(&recordSize, log.data() + offset, sizeof(recordSize));
+        memcpy(&recordChecksum, log.data() + offset + sizeof(recordSize), sizeof(recordChecksum));
+        const char* data = log.data() + offset + frameHeaderSize;
+        if (recordSize > log.size() - offset - frameHeaderSize || Checksum::crc32c(0, data, recordSize) != recordChecksum)
+            break;
+        apb::PBCheckpointRecord record;
+        if (!record.ParseFromArray(data, recordSize))
+            break;
+
+        if (offset == 0) {
+            if (!record.has_srcpath() || QString::fromStdString(record.srcpath()) != srcPath)
+                return false;
+            if (record.has_encryption() != !encryptionKey.isEmpty()
+                    || (record.has_encryption() && !ContentCipher::keyMatches(record.encryption(), encryptionKey)))
+                return false;
+            encryptionRecord.CopyFrom(record.encryption());
+        }
+        if (record.contentend() < committedEnd)
+            break;
+        if (record.files_size() > 0)
+            lastRecordFiles.clear();
+        for (int i = 0; i < record.files_size(); ++i) {
+            QString filePath = QString::fromStdString(record.files(i).path());
+            committedFiles[filePath] = record.files(i);
+            lastRecordFiles.push_back(filePath);
+        }
+        committedEnd = record.contentend();
+        offset += frameHeaderSize + recordSize;
+        validLength = offset;
+        loaded = true;
+    }
+    return loaded;
+}
+
+bool PackCheckpoint::restore(const PackFileTask & task) const {
+    std::map<QString, apb::PBCheckpointFile>::const_iterator committed = committedFiles.find(task.path);
+    if (committed == committedFiles.end() || committed->second.mtime() != task.mtime)
+        return false;
+    const apb::PBRegFileMetaData & fileMeta = committed->second.meta();
+    if (fileMeta.contentsize() != task.fileMeta->contentsize() || (fileMeta.blocks_size() == 0 && !fileMeta.has_delta()))
+        return false;
+
+    std::uint64_t storedSize = 0;
+    for (int i = 0; i < fileMeta.blocks_size(); ++i)
+        storedSize += fileMeta.blocks(i).storedsize();
+    if (fileMeta.contentoffset() > committedEnd || storedSize > committedEnd - fileMeta.contentoffset())
+        return false;
+
+    task.fileMeta->CopyFrom(fileMeta);
+    return true;
+}
+
+bool PackCheckpoint::validate(QFile * archive, const ContentCipher * cipher) const {
+    if ((std::uint64_t)archive->size() < ArchiverUtils::contentOffsetInArchive + committedEnd)
+        return false;
+    for (std::size_t i = 0; i < lastRecordFiles.size(); ++i) {
+        const apb::PBRegFileMetaData & fileMeta = committedFiles.find(lastRecordFiles[i])->second.meta();
+        if (!contentMatches(archive->handle(), fileMeta, cipher, archive->fileName()))
+            return false;
+    }
+    return true;
+}
+
+void PackCheckpoint::discard() {
+    loaded = false;
+    validLength = 0;
+    committedEnd = 0;
+    committedFiles.clear();
+    lastRecordFiles.clear();
+    encryptionRecord.Clear();
+}
+
+void PackCheckpoint::start(const QString & srcPath, const apb::PBEncryption * encryption) {
+    if (interval == 0)
+        return;
+
+    QByteArray pathByteArray = path.toLocal8Bit();
+    if (loaded) {
+        fd = open(pathByteArray.data(), O_WRONLY);
+        // drop a torn record left by the crash
+        if (fd == -1 || ftruncate(fd, validLength) == -1 || lseek(fd, validLength, SEEK_SET) == -1)
+            throw Archiver::ArchiverException(QString("Cannot open checkpoint: ") + path);
+        return;
+    }
+
+    fd = open(pathByteArray.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw Archiver::ArchiverException(QString("Cannot open checkpoint: ") + path);
+    apb::PBCheckpointRecord record;
+    record.set_srcpath(srcPath.toStdString());
+    record.set_contentend(0);
+    if (encryption)
+        record.mutable_encryption()->CopyFrom(*encryption);
+    append(record);
+}
+
+void PackCheckpoint::fileWritten(QFile * archive, const PackFileTask & task, std::uint64_t contentEnd) {
+    apb::PBCheckpointFile* file = pending.add_files();
+    file->set_path(task.path.toStdString());
+    file->set_mtime(task.mtime);
+    file->mutable_meta()->CopyFrom(*task.fileMeta);
+    if (contentEnd - committedEnd >= interval)
+        commit(archive, contentEnd);
+}
+
+void PackCheckpoint::remove() {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    QByteArray pathByteArray = path.toLocal8Bit();
+    unlink(pathByteArray.data());
+}
+
+void PackCheckpoint::commit(QFile * archive, std::uint64_t contentEnd) {
+    if (!archive->flush() || fdatasync(archive->handle()) == -1)
+        throw Archiver::ArchiverException(QString("Cannot sync archive: ") + archive->fileName());
+    pending.set_contentend(contentEnd);
+    append(pending);
+    pending.Clear();
+    committedEnd = contentEnd;
+}
+
+void PackCheckpoint::append(const apb::PBCheckpointRecord & record) {
+    std::string data;
+    if (!record.SerializeToString(&data))
+        throw Archiver::ArchiverException(QString("Cannot serialize checkpoint: ") + path);
+    std::uint32_t frame[2] = {(std::uint32_t)data.size(), Checksum::crc32c(0, data.data(), data.size())};
+    writeAll(fd, reinterpret_cast<const char*>(frame), sizeof(frame), path);
+    writeAll(fd, data.data(), data.size(), path);
+    if (fdatasync(fd) == -1)
+        throw Archiver::ArchiverException(QString("Cannot sync checkpoint: ") + path);
+}
@@ -0,0 +1,73 @@
+#ifndef PACK_CHECKPOINT_H
+#define PACK_CHECKPOINT_H
+
+#include "pack_pipeline.h"
+#include <struct_serialization.pb.h>
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Log of the files whose content is fully written by an unfinished pack, kept next to the
+// archive as <archive>.checkpoint. Every record lists the files completed since the previous one
+// and the end of the content they occupy. A record is appended only after the archive is synced,
+// so after a crash all content up to contentEnd of the last whole record is valid.
+// Records are framed as [u32 size][u32 crc32c][PBCheckpointRecord], a torn last record is ignored.
+class ContentCipher;
+
+class PackCheckpoint {
+public:
+    // interval is the amount of content written between two records, 0 disables writing them.
+    PackCheckpoint(const QString & archivePath, std::uint64_t interval);
+    ~PackCheckpoint();
+
+    // Reads the log of an interrupted pack of srcPath. Returns false if there is no log or it is of another source
+    // or encryption: an encrypted pack continues only with the same key, empty encryptionKey stands for a plain pack.
+    bool load(const QString & srcPath, const QByteArray & encryptionKey);
+    bool isLoaded() const { return loaded; }
+    std::uint64_t contentEnd() const { return committedEnd; }
+    // Encryption of the content of the loaded log, NULL for plain content.
+    const ArchiverUtils::protobufStructs::PBEncryption * encryption() const {
+        return encryptionRecord.has_cipher() ? &encryptionRecord : NULL;
+    }
+
+    // Fills meta of task from the log if its file is committed and unchanged since.
+    bool restore(const PackFileTask & task) const;
+    // Checks the length of archive and the content of the files of the last record against their checksums.
+    // Returns false if the archive is not the one the log was written for.
+    bool validate(QFile * archive, const ContentCipher * cipher) const;
+    // Forgets the loaded log, start() begins a new one.
+    void discard();
+
+    // Opens the log for writing. A loaded log is continued, otherwise a new one is started
+    // and remembers encryption if it is not NULL.
+    void start(const QString & srcPath, const ArchiverUtils::protobufStructs::PBEncryption * encryption);
+    bool isActive() const { return fd != -1; }
+    // Called by the pack writer when the last block of task is written, contentEnd is the end of its content.
+    void fileWritten(QFile * archive, const PackFileTask & task, std::uint64_t contentEnd);
+    // Deletes the log once the archive is complete or before a pack starts over.
+    void remove();
+
+private:
+    PackCheckpoint(const PackCheckpoint &);
+    PackCheckpoint & operator=(const PackCheckpoint &);
+
+    void commit(QFile * archive, std::uint64_t contentEnd);
+    void append(const ArchiverUtils::protobufStructs::PBCheckpointRecord & record);
+
+    QString path;
+    std::uint64_t interval;
+    int fd;
+    bool loaded;
+    std::uint64_t validLength;
+    std::uint64_t committedEnd;
+    std::map<QString, ArchiverUtils::protobufStructs::PBCheckpointFile> committedFiles;
+    std::vector<QString> lastRecordFiles;
+    ArchiverUtils::protobufStructs::PBEncryption encryptionRecord;
+    ArchiverUtils::protobufStructs::PBCheckpointRecord pending;
+};
+
+#endif // PACK_CHECKPOINT_H
@@ -0,0 +1,186 @@
+#include "pack_delta.h"
+#include "checksum.h"
+#include "content_codec.h"
+#include "content_delta.h"
+#include "io_control.h"
+#include "pack_checkpoint.h"
+#include "stats_recorder.h"
+
+#include <algorithm>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    // Cuts the literal bytes of one file into content blocks and appends them to the archive.
+    class LiteralWriter {
+    public:
+        LiteralWriter(QFile * archive, apb::PBRegFileMetaData* fileMeta, const ContentCodec::CodecChoice & choice,
+                      const Archiver::IoOptions & io)
+            :archive(archive)
+            ,fileMeta(fileMeta)
+            ,choice(choice)
+            ,io(io)
+            ,blockSize(ContentCodec::defaultBlockSize)
+            ,compressed(ContentCodec::compressBound(blockSize))
+            ,storedBytes(0) {
+            buffer.reserve(blockSize);
+        }
+
+        void append(const char* data, std::uint64_t size) {
+            while (size > 0) {
+                std::uint64_t chunk = std::min(size, blockSize - buffer.size());
+                buffer.insert(buffer.end(), data, data + chunk);
+                data += chunk;
+                size -= chunk;
+                if (buffer.size() == blockSize)
+                    flush();
+            }
+        }
+
+        void flush() {
+            if (buffer.empty())
+                return;
+            std::uint32_t checksum = Checksum::crc32c(0, buffer.data(), buffer.size());
+            std::uint64_t storedSize = ContentCodec::compressBlock(choice, buffer.data(), buffer.size(),
+                                                                   compressed.data(), compressed.size());
+            apb::PBCodec codec = choice.codec;
+            const char* stored = compressed.data();
+            if (storedSize == 0) {
+                storedSize = buffer.size();
+                codec = apb::CODEC_RAW;
+                stored = buffer.data();
+            }
+            IoControl::acquire(io, storedSize);
+            if ((std::uint64_t)archive->write(stored, storedSize) < storedSize)
+                throw Archiver::ArchiverException(QString("Cannot write to archive content of file: ") + archive->fileName());
+
+            apb::PBContentBlock* block = fileMeta->add_blocks();
+            block->set_storedsize(storedSize);
+            block->set_codec(codec);
+            block->set_checksum(checksum);
+            storedBytes += storedSize;
+            buffer.clear();
+        }
+
+        std::uint64_t stored() const { return storedBytes; }
+
+    private:
+        QFile * archive;
+        apb::PBRegFileMetaData* fileMeta;
+        const ContentCodec::CodecChoice choice;
+        const Archiver::IoOptions & io;
+        const std::uint64_t blockSize;
+        std::vector<char> buffer;
+        std::vector<char> compressed;
+        std::uint64_t storedBytes;
+    };
+}
+
+PackDelta::PackDelta(const apb::PBArchiveMetaData & baseMeta, const ArchiveIndex::Reader & baseIndex,
+                     const QString & srcPath, const Archiver::PackOptions & options)
+    :baseMeta(baseMeta)
+    ,baseIndex(baseIndex)
+    ,srcPath(srcPath)
+    ,signatureThreshold(std::max<std::uint64_t>(options.signatureThreshold, ContentDelta::signatureBlockSize))
+    ,io(options.io) {}
+
+void PackDelta::takeTasks(std::vector<PackFileTask> & tasks) {
+    if (baseIndex.entryCount() == 0)
+        return;
+    // the roots of both archives are paired whatever their names are
+    QString baseRoot = baseIndex.name(baseIndex.entry(0));
+
+    std::vector<PackFileTask> rest;
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        const PackFileTask & task = tasks[i];
+        const apb::PBRegFileMetaData* baseFileMeta = NULL;
+        QString basePath;
+        if (task.fileMeta->contentsize() >= signatureThreshold) {
+            QString pathInArchive = task.path.mid(srcPath.size());
+            int rootEnd = pathInArchive.indexOf('/');
+            basePath = baseRoot + (rootEnd == -1 ? QString() : pathInArchive.mid(rootEnd));
+            std::uint64_t baseEntry = baseIndex.find(basePath);
+            if (baseEntry < (std::uint64_t)baseMeta.pbdirentmetadata_size()
+                    && baseMeta.pbdirentmetadata(baseEntry).has_pbregfilemetadata()) {
+                const apb::PBRegFileMetaData & candidate = baseMeta.pbdirentmetadata(baseEntry).pbregfilemetadata();
+                if (candidate.has_signature() && !candidate.has_inlinedata()
+                        && candidate.signature().blocksize() == ContentDelta::signatureBlockSize
+                        && candidate.signature().weak_size() == candidate.signature().strong_size()
+                        && candidate.signature().weak_size() > 0)
+                    baseFileMeta = &candidate;
+            }
+        }
+
+        if (baseFileMeta)
+            deltaTasks.push_back(DeltaTask(task, baseFileMeta, basePath.toStdString()));
+        else
+            rest.push_back(task);
+    }
+    tasks.swap(rest);
+}
+
+std::uint64_t PackDelta::write(QFile * archive, std::uint64_t contentStart, PackCheckpoint * checkpoint,
+                               Archiver::PipelineStats & stats) {
+    std::uint64_t contentFreePosition = contentStart;
+    for (std::size_t i = 0; i < deltaTasks.size(); ++i) {
+        contentFreePosition = writeTask(archive, deltaTasks[i], contentFreePosition, stats);
+        IoControl::advance(io, 1, deltaTasks[i].task.fileMeta->contentsize());
+        if (checkpoint)
+            checkpoint->fileWritten(archive, deltaTasks[i].task, contentFreePosition);
+    }
+    return contentFreePosition;
+}
+
+std::uint64_t PackDelta::writeTask(QFile * archive, const DeltaTask & deltaTask, std::uint64_t contentStart,
+                                   Archiver::PipelineStats & stats) {
+    const PackFileTask & task = deltaTask.task;
+    apb::PBRegFileMetaData* fileMeta = task.fileMeta;
+    std::uint64_t size = fileMeta->contentsize();
+
+    QFile source(task.path);
+    if (!source.open(QIODevice::ReadOnly))
+        throw Archiver::ArchiverException(QString("Cannot open file: ") + task.path);
+    if ((std::uint64_t)source.size() < size)
+        throw Archiver::ArchiverException(QString("File shrank while packing: ") + task.path);
+    uchar* mapping = source.map(0, size);
+    if (mapping == NULL)
+        throw Archiver::ArchiverException(QString("Cannot mapped file: ") + task.path);
+    StatsRecorder::countMapping();
+    const char* data = reinterpret_cast<const char*>(mapping);
+
+    fileMeta->set_contentoffset(contentStart);
+    fileMeta->set_blocksize(ContentCodec::defaultBlockSize);
+    fileMeta->clear_blocks();
+    fileMeta->clear_signature();
+    fileMeta->clear_delta();
+
+    LiteralWriter literals(archive, fileMeta, ContentCodec::probe(data, std::min(ContentCodec::probeSize, size)), io);
+    apb::PBDelta* delta = fileMeta->mutable_delta();
+    ContentDelta::encode(deltaTask.baseFileMeta->signature(), data, size, delta,
+                         [&](const char* literal, std::uint64_t literalSize) { literals.append(literal, literalSize); },
+                         io);
+    literals.flush();
+    // the encoding read the file under the limiter, the checksum and the signature find it cached
+    fileMeta->set_checksum(Checksum::crc32c(0, data, size));
+    delta->set_basepath(deltaTask.basePath);
+    // without a single match the literal blocks are the plain content of the file
+    if (delta->ops_size() == 1 && !delta->ops(0).has_baseoffset())
+        fileMeta->clear_delta();
+
+    apb::PBDeltaSignature* signature = fileMeta->mutable_signature();
+    signature->set_blocksize(ContentDelta::signatureBlockSize);
+    std::vector<std::uint32_t> weak;
+    std::vector<std::uint64_t> strong;
+    ContentDelta::sign(data, size, weak, strong);
+    for (std::size_t i = 0; i < weak.size(); ++i) {
+        signature->add_weak(weak[i]);
+        signature->add_strong(strong[i]);
+    }
+
+    if (!source.unmap(mapping))
+        throw Archiver::ArchiverException(QString("Cannot unmapped file: ") + task.path);
+
+    stats.rawBytes += size;
+    stats.storedBytes += literals.stored();
+    return contentStart + literals.stored();
+}
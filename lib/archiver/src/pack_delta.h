@@ -0,0 +1,54 @@
+#ifndef PACK_DELTA_H
+#define PACK_DELTA_H
+
+#include "archive_index.h"
+#include "pack_pipeline.h"
+#include <struct_serialization.pb.h>
+
+#include <QFile>
+#include <QString>
+#include <cstdint>
+#include <vector>
+
+class PackCheckpoint;
+
+// Packs large files that have a signed counterpart at the same path of a base archive
+// as a delta against it, see ContentDelta. Every file packed here is signed as well, so the archive
+// serves as the base of the next one and daily archives chain one delta after another.
+// Unpacking rebuilds a base file that is delta encoded itself from its own base in turn.
+class PackDelta {
+public:
+    // baseMeta and baseIndex describe the base archive, its content is never read.
+    // srcPath is the directory the packed root is in.
+    PackDelta(const ArchiverUtils::protobufStructs::PBArchiveMetaData & baseMeta,
+              const ArchiveIndex::Reader & baseIndex, const QString & srcPath, const Archiver::PackOptions & options);
+
+    // Moves the tasks that have a usable base file out of tasks.
+    void takeTasks(std::vector<PackFileTask> & tasks);
+    // Writes the content of the taken tasks at the current position of archive, which is contentStart
+    // bytes into the content region, and returns the end of the written content.
+    std::uint64_t write(QFile * archive, std::uint64_t contentStart, PackCheckpoint * checkpoint,
+                        Archiver::PipelineStats & stats);
+
+private:
+    struct DeltaTask {
+        PackFileTask task;
+        const ArchiverUtils::protobufStructs::PBRegFileMetaData* baseFileMeta;
+        std::string basePath;
+        DeltaTask(const PackFileTask & task, const ArchiverUtils::protobufStructs::PBRegFileMetaData* baseFileMeta,
+                  const std::string & basePath)
+            :task(task), baseFileMeta(baseFileMeta), basePath(basePath) {}
+    };
+
+    std::uint64_t writeTask(QFile * archive, const DeltaTask & deltaTask, std::uint64_t contentStart,
+                            Archiver::PipelineStats & stats);
+
+    const ArchiverUtils::protobufStructs::PBArchiveMetaData & baseMeta;
+    const ArchiveIndex::Reader & baseIndex;
+    const QString srcPath;
+    const std::uint64_t signatureThreshold;
+    const Archiver::IoOptions io;
+    std::vector<DeltaTask> deltaTasks;
+};
+
+#endif // PACK_DELTA_H
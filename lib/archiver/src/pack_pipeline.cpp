@@ -0,0 +1,379 @@
+#include "pack_pipeline.h"
+#include "archiver_utils.h"
+#include "checksum.h"
+#include "content_cipher.h"
+#include "content_codec.h"
+#include "content_delta.h"
+#include "io_control.h"
+#include "pack_checkpoint.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+using ArchiverUtils::nowNs;
+using ArchiverUtils::readFully;
+
+Archiver::PackOptions::PackOptions()
+    :readerThreads(2)
+    ,workerThreads(std::max(1u, std::thread::hardware_concurrency()))
+    ,bufferCount(0)
+    ,inlineThreshold(1024)
+    ,physicalOrder(false)
+    ,readaheadFiles(4)
+    ,dedup(true)
+    ,checkpointInterval(0)
+    ,resume(false)
+    ,signatureThreshold(16 << 20)
+    ,cipher(CipherNone) {}
+
+namespace {
+    // prefetch window for files ahead of the readers, the rest is left to sequential readahead
+    const std::uint64_t readaheadBytes = 8 << 20;
+
+    void readaheadFile(const PackFileTask & task) {
+        QByteArray pathByteArray = task.path.toLocal8Bit();
+        int fd = ::open(pathByteArray.data(), O_RDONLY);
+        if (fd == -1)
+            return; // the reader reports it when it gets to the file
+        posix_fadvise(fd, 0, std::min(readaheadBytes, task.fileMeta->contentsize()), POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+struct PackPipeline::SourceFile {
+    QString path;
+    apb::PBRegFileMetaData* fileMeta;
+    std::size_t taskIndex;
+    std::mutex openMutex;
+    int fd;
+    ContentCodec::CodecChoice choice;
+
+    SourceFile(const QString & path, apb::PBRegFileMetaData* fileMeta, std::size_t taskIndex)
+        :path(path)
+        ,fileMeta(fileMeta)
+        ,taskIndex(taskIndex)
+        ,fd(-1)
+        ,choice(apb::CODEC_RAW, 0) {}
+
+    ~SourceFile() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // The first reader of any block opens the file and probes its codec.
+    void open() {
+        std::lock_guard<std::mutex> lock(openMutex);
+        if (fd >= 0)
+            return;
+
+        QByteArray pathByteArray = path.toLocal8Bit();
+        int newFd = ::open(pathByteArray.data(), O_RDONLY);
+        if (newFd == -1)
+            throw Archiver::ArchiverException(QString("Cannot open file: ") + path);
+        posix_fadvise(newFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        try {
+            std::uint64_t probeSize = std::min(ContentCodec::probeSize, fileMeta->contentsize());
+            std::vector<char> probe(probeSize);
+            readFully(newFd, probe.data(), probeSize, 0, path);
+            choice = ContentCodec::probe(probe.data(), probeSize);
+        } catch (...) {
+            close(newFd);
+            throw;
+        }
+        fd = newFd;
+    }
+};
+
+struct PackPipeline::Slot {
+    std::vector<char> raw;
+    std::vector<char> compressed;
+    // holds the stored block when content is encrypted
+    std::vector<char> sealed;
+    std::shared_ptr<SourceFile> source;
+    std::uint64_t sequence;
+    std::uint64_t blockIndex;
+    std::uint64_t rawSize;
+    std::uint64_t storedSize;
+    apb::PBCodec codec;
+    std::uint32_t checksum;
+    // delta signature of the block, for files of at least the signature threshold
+    std::vector<std::uint32_t> weak;
+    std::vector<std::uint64_t> strong;
+
+    Slot(std::uint64_t blockSize, bool encrypted)
+        :raw(blockSize)
+        ,compressed(ContentCodec::compressBound(blockSize))
+        ,sealed(encrypted ? ContentCodec::compressBound(blockSize) + ContentCipher::overhead : 0)
+        ,sequence(0), blockIndex(0), rawSize(0), storedSize(0)
+        ,codec(apb::CODEC_RAW), checksum(0) {}
+
+    const char* stored() const {
+        if (!sealed.empty())
+            return sealed.data();
+        return codec == apb::CODEC_RAW ? raw.data() : compressed.data();
+    }
+};
+
+PackPipeline::PackPipeline(const std::vector<PackFileTask> & tasks, const Archiver::PackOptions & options,
+                           const ContentCipher * cipher)
+    :tasks(tasks)
+    ,blockSize(ContentCodec::defaultBlockSize)
+    ,readaheadFiles(options.readaheadFiles)
+    ,signatureThreshold(options.signatureThreshold)
+    ,cipher(cipher)
+    ,io(options.io)
+    ,readerThreads(std::max(1u, options.readerThreads))
+    ,workerThreads(std::max(1u, options.workerThreads))
+    ,slotCount(options.bufferCount ? options.bufferCount : 2 * (readerThreads + workerThreads))
+    ,freeSlots(slotCount)
+    ,readQueue(slotCount)
+    ,writeQueue(slotCount)
+    ,activeReaders(readerThreads)
+    ,activeWorkers(workerThreads)
+    ,abort(false)
+    ,nextTaskIndex(0)
+    ,nextReadaheadIndex(0)
+    ,nextBlockIndex(0)
+    ,nextSequence(0)
+    ,contentFreePosition(0) {
+    for (unsigned i = 0; i < slotCount; ++i) {
+        slotPool.push_back(std::unique_ptr<Slot>(new Slot(blockSize, cipher != NULL)));
+        freeSlots.tryPush(slotPool.back().get());
+    }
+}
+
+PackPipeline::~PackPipeline() {}
+
+std::uint64_t PackPipeline::run(QFile * archive, std::uint64_t contentStart, PackCheckpoint * checkpoint) {
+    contentFreePosition = contentStart;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks[i].fileMeta->set_contentoffset(0);
+        tasks[i].fileMeta->set_blocksize(blockSize);
+        tasks[i].fileMeta->clear_blocks();
+        if (cipher)
+            tasks[i].fileMeta->clear_checksum();
+        else
+            tasks[i].fileMeta->set_checksum(0);
+        tasks[i].fileMeta->clear_signature();
+        tasks[i].fileMeta->clear_delta();
+    }
+
+    std::vector<Archiver::PipelineStageStats> readerStats(readerThreads);
+    std::vector<Archiver::PipelineStageStats> workerStats(workerThreads);
+    std::vector<std::thread> threads;
+    std::uint64_t startNs = nowNs();
+
+    try {
+        for (unsigned i = 0; i < readerThreads; ++i)
+            threads.push_back(std::thread(&PackPipeline::readerLoop, this, std::ref(readerStats[i])));
+        for (unsigned i = 0; i < workerThreads; ++i)
+            threads.push_back(std::thread(&PackPipeline::workerLoop, this, std::ref(workerStats[i])));
+        writerLoop(archive, checkpoint, pipelineStats.writer);
+    } catch (...) {
+        fail();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    currentSource.reset();
+
+    pipelineStats.wallNs = nowNs() - startNs;
+    pipelineStats.writer.threads = 1;
+    for (size_t i = 0; i < readerStats.size(); ++i) {
+        pipelineStats.reader.busyNs += readerStats[i].busyNs;
+        pipelineStats.reader.waitNs += readerStats[i].waitNs;
+    }
+    pipelineStats.reader.threads = readerThreads;
+    for (size_t i = 0; i < workerStats.size(); ++i) {
+        pipelineStats.worker.busyNs += workerStats[i].busyNs;
+        pipelineStats.worker.waitNs += workerStats[i].waitNs;
+    }
+    pipelineStats.worker.threads = workerThreads;
+
+    if (error)
+        std::rethrow_exception(error);
+
+    return contentFreePosition;
+}
+
+// Besides the block, returns in readahead the range of tasks the caller should prefetch.
+bool PackPipeline::claimNextBlock(Slot * slot, std::pair<std::size_t, std::size_t> & readahead) {
+    std::lock_guard<std::mutex> lock(claimMutex);
+    while (!currentSource || nextBlockIndex * blockSize >= currentSource->fileMeta->contentsize()) {
+        if (nextTaskIndex >= tasks.size())
+            return false;
+        const PackFileTask & task = tasks[nextTaskIndex];
+        currentSource = std::make_shared<SourceFile>(task.path, task.fileMeta, nextTaskIndex);
+        ++nextTaskIndex;
+        nextBlockIndex = 0;
+
+        std::size_t readaheadEnd = std::min(tasks.size(), nextTaskIndex + readaheadFiles);
+        readahead = std::make_pair(std::max(nextReadaheadIndex, nextTaskIndex), readaheadEnd);
+        nextReadaheadIndex = std::max(nextReadaheadIndex, readaheadEnd);
+    }
+
+    slot->source = currentSource;
+    slot->blockIndex = nextBlockIndex++;
+    slot->sequence = nextSequence++;
+    return true;
+}
+
+void PackPipeline::readerLoop(Archiver::PipelineStageStats & stageStats) {
+    try {
+        for (;;) {
+            Slot* slot;
+            std::uint64_t waitStart = nowNs();
+            if (!freeSlots.pop(slot, abort))
+                break;
+            std::uint64_t busyStart = nowNs();
+            stageStats.waitNs += busyStart - waitStart;
+
+            std::pair<std::size_t, std::size_t> readahead(0, 0);
+            if (!claimNextBlock(slot, readahead)) {
+                freeSlots.tryPush(slot);
+                break;
+            }
+            for (std::size_t i = readahead.first; i < readahead.second; ++i)
+                readaheadFile(tasks[i]);
+
+            SourceFile & source = *slot->source;
+            source.open();
+            std::uint64_t offset = slot->blockIndex * blockSize;
+            slot->rawSize = std::min(blockSize, source.fileMeta->contentsize() - offset);
+            IoControl::acquire(io, slot->rawSize);
+            readFully(source.fd, slot->raw.data(), slot->rawSize, offset, source.path);
+
+            waitStart = nowNs();
+            stageStats.busyNs += waitStart - busyStart;
+            if (!readQueue.push(slot, abort))
+                break;
+            stageStats.waitNs += nowNs() - waitStart;
+        }
+    } catch (...) {
+        fail();
+    }
+
+    if (--activeReaders == 0)
+        readQueue.close();
+}
+
+void PackPipeline::workerLoop(Archiver::PipelineStageStats & stageStats) {
+    try {
+        for (;;) {
+            Slot* slot;
+            std::uint64_t waitStart = nowNs();
+            if (!readQueue.pop(slot, abort))
+                break;
+            std::uint64_t busyStart = nowNs();
+            stageStats.waitNs += busyStart - waitStart;
+
+            // the tag of a sealed block checks it already, a checksum of the plain text would only leak it
+            if (!cipher)
+                slot->checksum = Checksum::crc32c(0, slot->raw.data(), slot->rawSize);
+            slot->weak.clear();
+            slot->strong.clear();
+            if (signatureThreshold != 0 && slot->source->fileMeta->contentsize() >= signatureThreshold)
+                ContentDelta::sign(slot->raw.data(), slot->rawSize, slot->weak, slot->strong);
+
+            const ContentCodec::CodecChoice & choice = slot->source->choice;
+            slot->storedSize = ContentCodec::compressBlock(choice, slot->raw.data(), slot->rawSize,
+                                                           slot->compressed.data(), slot->compressed.size());
+            slot->codec = choice.codec;
+            if (slot->storedSize == 0) {
+                slot->storedSize = slot->rawSize;
+                slot->codec = apb::CODEC_RAW;
+            }
+
+            waitStart = nowNs();
+            stageStats.busyNs += waitStart - busyStart;
+            if (!writeQueue.push(slot, abort))
+                break;
+            stageStats.waitNs += nowNs() - waitStart;
+        }
+    } catch (...) {
+        fail();
+    }
+
+    if (--activeWorkers == 0)
+        writeQueue.close();
+}
+
+void PackPipeline::writerLoop(QFile * archive, PackCheckpoint * checkpoint, Archiver::PipelineStageStats & stageStats) {
+    // At most slotPool.size() blocks are in flight and they are claimed in sequence order,
+    // so a ring indexed by sequence is enough to restore the order.
+    std::vector<Slot*> pending(slotPool.size(), NULL);
+    std::uint64_t nextToWrite = 0;
+
+    for (;;) {
+        Slot* slot;
+        std::uint64_t waitStart = nowNs();
+        if (!writeQueue.pop(slot, abort))
+            break;
+        std::uint64_t busyStart = nowNs();
+        stageStats.waitNs += busyStart - waitStart;
+
+        pending[slot->sequence % pending.size()] = slot;
+        while ((slot = pending[nextToWrite % pending.size()]) != NULL && slot->sequence == nextToWrite) {
+            if (cipher) {
+                // the block is bound to its place in the content, known only here
+                const char* payload = slot->codec == apb::CODEC_RAW ? slot->raw.data() : slot->compressed.data();
+                cipher->seal(payload, slot->storedSize, slot->rawSize, slot->codec, contentFreePosition,
+                             slot->sealed.data());
+                slot->storedSize += ContentCipher::overhead;
+            }
+            IoControl::acquire(io, slot->storedSize);
+            if ((std::uint64_t)archive->write(slot->stored(), slot->storedSize) < slot->storedSize)
+                throw Archiver::ArchiverException(QString("Cannot write to archive content of file: ") + slot->source->path);
+
+            apb::PBRegFileMetaData* fileMeta = slot->source->fileMeta;
+            if (slot->blockIndex == 0)
+                fileMeta->set_contentoffset(contentFreePosition);
+            apb::PBContentBlock* block = fileMeta->add_blocks();
+            block->set_storedsize(slot->storedSize);
+            block->set_codec(slot->codec);
+            if (!cipher) {
+                if (slot->blockIndex == 0)
+                    fileMeta->set_checksum(slot->checksum);
+                else
+                    fileMeta->set_checksum(Checksum::crc32cCombine(fileMeta->checksum(), slot->checksum, slot->rawSize));
+                block->set_checksum(slot->checksum);
+            }
+            if (!slot->weak.empty()) {
+                apb::PBDeltaSignature* signature = fileMeta->mutable_signature();
+                signature->set_blocksize(ContentDelta::signatureBlockSize);
+                for (std::size_t i = 0; i < slot->weak.size(); ++i) {
+                    signature->add_weak(slot->weak[i]);
+                    signature->add_strong(slot->strong[i]);
+                }
+            }
+            contentFreePosition += slot->storedSize;
+            pipelineStats.rawBytes += slot->rawSize;
+            pipelineStats.storedBytes += slot->storedSize;
+            bool lastBlock = (slot->blockIndex + 1) * blockSize >= fileMeta->contentsize();
+            IoControl::advance(io, lastBlock ? 1 : 0, slot->rawSize);
+            if (checkpoint && lastBlock)
+                checkpoint->fileWritten(archive, tasks[slot->source->taskIndex], contentFreePosition);
+
+            pending[nextToWrite % pending.size()] = NULL;
+            slot->source.reset();
+            freeSlots.tryPush(slot);
+            ++nextToWrite;
+        }
+        stageStats.busyNs += nowNs() - busyStart;
+    }
+
+    if (!abort && nextToWrite != nextSequence)
+        throw Archiver::ArchiverException("Pack pipeline finished with unwritten blocks");
+}
+
+void PackPipeline::fail() {
+    std::lock_guard<std::mutex> lock(errorMutex);
+    if (!error)
+        error = std::current_exception();
+    abort = true;
+}
@@ -0,0 +1,88 @@
+#ifndef PACK_PIPELINE_H
+#define PACK_PIPELINE_H
+
+#include "archiver.h"
+#include "bounded_queue.h"
+#include <struct_serialization.pb.h>
+
+#include <QFile>
+#include <QString>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class ContentCipher;
+class PackCheckpoint;
+
+struct PackFileTask {
+    QString path;
+    ArchiverUtils::protobufStructs::PBRegFileMetaData* fileMeta;
+    std::uint64_t mtime;
+    PackFileTask(const QString & path, ArchiverUtils::protobufStructs::PBRegFileMetaData* fileMeta, std::uint64_t mtime)
+        :path(path), fileMeta(fileMeta), mtime(mtime) {}
+};
+
+// Copies content of regular files into the archive in three stages:
+// reader threads read blocks, workers checksum and compress them, one writer appends them
+// in task order and fills the block meta. Stages are connected by bounded lock-free queues and every block
+// travels in a slot taken from a fixed pool, so memory use is capped by the pool size.
+// With a cipher the writer encrypts every block before appending it, bound to its offset in the content.
+class PackPipeline {
+public:
+    PackPipeline(const std::vector<PackFileTask> & tasks, const Archiver::PackOptions & options,
+                 const ContentCipher * cipher = NULL);
+    ~PackPipeline();
+
+    // Writes content starting at the current position of archive, which is contentStart bytes
+    // into the content region, and returns the end of the written content. Completed files
+    // are reported to checkpoint if it is not NULL.
+    std::uint64_t run(QFile * archive, std::uint64_t contentStart = 0, PackCheckpoint * checkpoint = NULL);
+    const Archiver::PipelineStats & stats() const { return pipelineStats; }
+
+private:
+    struct SourceFile;
+    struct Slot;
+
+    void readerLoop(Archiver::PipelineStageStats & stageStats);
+    void workerLoop(Archiver::PipelineStageStats & stageStats);
+    void writerLoop(QFile * archive, PackCheckpoint * checkpoint, Archiver::PipelineStageStats & stageStats);
+    bool claimNextBlock(Slot * slot, std::pair<std::size_t, std::size_t> & readahead);
+    void fail();
+
+    const std::vector<PackFileTask> & tasks;
+    const std::uint64_t blockSize;
+    const std::size_t readaheadFiles;
+    const std::uint64_t signatureThreshold;
+    const ContentCipher * cipher;
+    const Archiver::IoOptions io;
+    unsigned readerThreads;
+    unsigned workerThreads;
+    unsigned slotCount;
+    std::vector<std::unique_ptr<Slot> > slotPool;
+
+    BoundedQueue<Slot*> freeSlots;
+    BoundedQueue<Slot*> readQueue;
+    BoundedQueue<Slot*> writeQueue;
+    std::atomic<unsigned> activeReaders;
+    std::atomic<unsigned> activeWorkers;
+    std::atomic<bool> abort;
+
+    std::mutex claimMutex;
+    std::size_t nextTaskIndex;
+    std::size_t nextReadaheadIndex;
+    std::uint64_t nextBlockIndex;
+    std::uint64_t nextSequence;
+    std::shared_ptr<SourceFile> currentSource;
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    std::uint64_t contentFreePosition;
+    Archiver::PipelineStats pipelineStats;
+};
+
+#endif // PACK_PIPELINE_H
@@ -0,0 +1,77 @@
+#include "physical_order.h"
+#include "archiver.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+namespace {
+    struct DiskLocation {
+        bool known;
+        std::uint64_t key;
+        std::size_t taskIndex;
+        bool operator<(const DiskLocation & other) const {
+            if (known != other.known)
+                return known;
+            if (key != other.key)
+                return key < other.key;
+            return taskIndex < other.taskIndex;
+        }
+    };
+
+    DiskLocation locate(const PackFileTask & task, std::size_t taskIndex) {
+        DiskLocation location;
+        location.known = false;
+        location.key = 0;
+        location.taskIndex = taskIndex;
+
+        QByteArray pathByteArray = task.path.toLocal8Bit();
+        int fileDescriptor = open(pathByteArray.data(), O_RDONLY);
+        if (fileDescriptor == -1)
+            throw Archiver::ArchiverException(QString("Cannot open file: ") + task.path);
+
+#ifdef FS_IOC_FIEMAP
+        // room for the header and the first extent only
+        std::uint64_t request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(std::uint64_t)];
+        memset(request, 0, sizeof(request));
+        struct fiemap* map = reinterpret_cast<struct fiemap*>(request);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+        if (ioctl(fileDescriptor, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0
+                && !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+            location.known = true;
+            location.key = map->fm_extents[0].fe_physical;
+        }
+#endif
+        if (!location.known) {
+            struct stat fileStat;
+            if (fstat(fileDescriptor, &fileStat) == 0)
+                location.key = fileStat.st_ino;
+        }
+        close(fileDescriptor);
+        return location;
+    }
+}
+
+void PhysicalOrder::sortByDiskLocation(std::vector<PackFileTask> & tasks) {
+    std::vector<DiskLocation> locations;
+    locations.reserve(tasks.size());
+    for (std::size_t i = 0; i < tasks.size(); ++i)
+        locations.push_back(locate(tasks[i], i));
+    std::sort(locations.begin(), locations.end());
+
+    std::vector<PackFileTask> sorted;
+    sorted.reserve(tasks.size());
+    for (std::size_t i = 0; i < locations.size(); ++i)
+        sorted.push_back(tasks[locations[i].taskIndex]);
+    tasks.swap(sorted);
+}
@@ -0,0 +1,15 @@
+#ifndef PHYSICAL_ORDER_H
+#define PHYSICAL_ORDER_H
+
+#include "pack_pipeline.h"
+
+#include <vector>
+
+namespace PhysicalOrder {
+    // Sorts tasks by the physical location of the first extent of each file (FIEMAP),
+    // so that reading them goes mostly forward on disk. Files whose extents are unknown
+    // (no FIEMAP on the filesystem, inline data) are ordered by inode number after them.
+    void sortByDiskLocation(std::vector<PackFileTask> & tasks);
+}
+
+#endif // PHYSICAL_ORDER_H
@@ -0,0 +1,108 @@
+#include "restore_sync.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+    // files whose write back is in flight before they are fsynced as a group
+    const std::size_t fileGroupSize = 256;
+
+    // Returns the index of a descriptor that failed to sync, fds.size() if all of them are synced.
+    // fsyncs wait for the device, more of them at once keep its queue full and share journal commits.
+    std::size_t syncInParallel(const std::vector<int> & fds, std::size_t syncThreads) {
+        std::atomic<std::size_t> next(0);
+        std::atomic<std::size_t> failed(fds.size());
+        std::function<void()> syncNext = [&]() {
+            for (std::size_t i = next++; i < fds.size(); i = next++) {
+                if (fsync(fds[i]) == -1)
+                    failed = i;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        std::size_t threadCount = std::min(syncThreads, fds.size());
+        for (std::size_t i = 1; i < threadCount; ++i) {
+            try {
+                threads.push_back(std::thread(syncNext));
+            } catch (...) {
+                // the threads that started and the calling one sync everything
+                break;
+            }
+        }
+        syncNext();
+        for (std::size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        return failed;
+    }
+}
+
+RestoreSync::RestoreSync(Archiver::Durability durability, unsigned syncThreads, const QString & dstPath)
+    :durability(durability), syncThreads(std::max(1u, syncThreads)), dstPath(dstPath) {}
+
+RestoreSync::~RestoreSync() {
+    for (std::size_t i = 0; i < pendingFds.size(); ++i)
+        close(pendingFds[i]);
+}
+
+void RestoreSync::fileRestored(int fd, const QString & path) {
+    if (durability != Archiver::DurabilitySyncFiles)
+        return;
+    // starts the write back without waiting for it, the fsync of the group waits
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    int pendingFd = dup(fd);
+    if (pendingFd == -1) {
+        if (fsync(fd) == -1)
+            fail("Cannot sync restored file: " + path);
+        return;
+    }
+    pendingFds.push_back(pendingFd);
+    pendingPaths.push_back(path);
+    if (pendingFds.size() >= fileGroupSize)
+        syncPendingFiles();
+}
+
+void RestoreSync::dirsRestored(const std::vector<int> & dirFds) {
+    if (durability != Archiver::DurabilitySyncFiles)
+        return;
+    if (syncInParallel(dirFds, syncThreads) != dirFds.size())
+        fail("Cannot sync restored directories in " + dstPath);
+}
+
+void RestoreSync::finish() {
+    if (durability == Archiver::DurabilitySyncFiles) {
+        syncPendingFiles();
+        // the entry of the restored root lives in the target directory
+        int fd = open(dstPath.toStdString().c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || fsync(fd) == -1)
+            fail("Cannot sync directory " + dstPath);
+        if (fd != -1)
+            close(fd);
+    } else if (durability == Archiver::DurabilitySyncFs) {
+        int fd = open(dstPath.toStdString().c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || syncfs(fd) == -1)
+            fail("Cannot sync file system of " + dstPath);
+        if (fd != -1)
+            close(fd);
+    }
+    if (!error.isEmpty())
+        throw Archiver::ArchiverException(error);
+}
+
+void RestoreSync::syncPendingFiles() {
+    std::size_t failed = syncInParallel(pendingFds, syncThreads);
+    if (failed != pendingFds.size())
+        fail("Cannot sync restored file: " + pendingPaths[failed]);
+    for (std::size_t i = 0; i < pendingFds.size(); ++i)
+        close(pendingFds[i]);
+    pendingFds.clear();
+    pendingPaths.clear();
+}
+
+void RestoreSync::fail(const QString & message) {
+    if (error.isEmpty())
+        error = message;
+}
@@ -0,0 +1,46 @@
+#ifndef RESTORE_SYNC_H
+#define RESTORE_SYNC_H
+
+#include "archiver.h"
+
+#include <QString>
+#include <vector>
+
+// Makes the entries restored by unpack and extract durable as IoOptions::durability asks,
+// so the operation returns only once they survive a crash.
+// DurabilitySyncFs flushes the file system of the target with one syncfs at the end.
+// DurabilitySyncFiles starts the write back of every file as soon as it is restored and fsyncs
+// the files in groups on several threads, by then most of their data is already written.
+// The directories and the target directory follow the same way at the end.
+class RestoreSync {
+public:
+    // dstPath is the directory the entries are restored into, syncThreads fsync at the same time.
+    RestoreSync(Archiver::Durability durability, unsigned syncThreads, const QString & dstPath);
+    // Closes files not synced yet, without syncing them.
+    ~RestoreSync();
+
+    // Called with every restored file before the restore closes it.
+    void fileRestored(int fd, const QString & path);
+    // Called with the descriptors of the restored directories once their times are set.
+    void dirsRestored(const std::vector<int> & dirFds);
+    // Syncs what is left, throws ArchiverException if anything restored is not durable.
+    void finish();
+
+private:
+    RestoreSync(const RestoreSync &);
+    RestoreSync & operator=(const RestoreSync &);
+
+    void syncPendingFiles();
+    void fail(const QString & message);
+
+    Archiver::Durability durability;
+    std::size_t syncThreads;
+    QString dstPath;
+    // duplicated descriptors of the files whose write back is started, with their paths for errors
+    std::vector<int> pendingFds;
+    std::vector<QString> pendingPaths;
+    // first failure, reported by finish so the restore runs to its end as without syncing
+    QString error;
+};
+
+#endif // RESTORE_SYNC_H
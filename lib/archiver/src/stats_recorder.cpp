@@ -0,0 +1,197 @@
+#include "stats_recorder.h"
+#include "archiver_utils.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <sys/resource.h>
+
+using ArchiverUtils::nowNs;
+
+namespace {
+    std::atomic<std::uint64_t> mappingCount(0);
+
+    std::uint64_t processCpuNs() {
+        timespec time;
+        if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) == -1)
+            return 0;
+        return (std::uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+    }
+
+    // Content of a small /proc file, empty if it is missing (/proc/self/io needs CONFIG_TASK_IO_ACCOUNTING).
+    std::string readProcFile(const char* path) {
+        std::string content;
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
+            return content;
+        char buffer[4096];
+        std::size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            content.append(buffer, size);
+        fclose(file);
+        return content;
+    }
+
+    // Value of the "name: value" line of content, 0 if there is none.
+    std::uint64_t procValue(const std::string & content, const char* name) {
+        std::string key = std::string(name) + ":";
+        std::size_t position = 0;
+        while ((position = content.find(key, position)) != std::string::npos) {
+            if (position == 0 || content[position - 1] == '\n')
+                return strtoull(content.c_str() + position + key.size(), NULL, 10);
+            position += key.size();
+        }
+        return 0;
+    }
+
+    std::uint64_t delta(std::uint64_t start, std::uint64_t end) {
+        return end > start ? end - start : 0;
+    }
+
+    QString milliseconds(std::uint64_t ns) {
+        return QString::number(ns / 1e6, 'f', 1) + " ms";
+    }
+}
+
+Archiver::OperationStats::OperationStats()
+    :wallNs(0), cpuNs(0), files(0), dirs(0), rawBytes(0), storedBytes(0)
+    ,readCallBytes(0), writeCallBytes(0), storageReadBytes(0), storageWriteBytes(0)
+    ,readCalls(0), writeCalls(0), mappings(0), minorFaults(0), majorFaults(0), peakRssBytes(0) {}
+
+QString Archiver::OperationStats::toText() const {
+    QString text = operation + ": " + milliseconds(wallNs) + " wall, " + milliseconds(cpuNs) + " cpu\n";
+    for (std::size_t i = 0; i < phases.size(); ++i)
+        text += "  " + phases[i].name + ": " + milliseconds(phases[i].wallNs) + " wall, "
+                + milliseconds(phases[i].cpuNs) + " cpu\n";
+    text += "files " + QString::number(files) + ", dirs " + QString::number(dirs)
+            + ", content " + QString::number(rawBytes) + " bytes raw, " + QString::number(storedBytes) + " bytes stored\n";
+    text += "read calls " + QString::number(readCalls) + " (" + QString::number(readCallBytes) + " bytes), write calls "
+            + QString::number(writeCalls) + " (" + QString::number(writeCallBytes) + " bytes)\n";
+    text += "storage read " + QString::number(storageReadBytes) + " bytes, storage write "
+            + QString::number(storageWriteBytes) + " bytes\n";
+    text += "mappings " + QString::number(mappings) + ", page faults " + QString::number(minorFaults) + " minor "
+            + QString::number(majorFaults) + " major, peak rss " + QString::number(peakRssBytes) + " bytes\n";
+    return text;
+}
+
+QString Archiver::OperationStats::toJson() const {
+    QJsonArray phaseArray;
+    for (std::size_t i = 0; i < phases.size(); ++i) {
+        QJsonObject phase;
+        phase.insert("name", phases[i].name);
+        phase.insert("wallNs", qint64(phases[i].wallNs));
+        phase.insert("cpuNs", qint64(phases[i].cpuNs));
+        phaseArray.append(phase);
+    }
+    QJsonObject json;
+    json.insert("operation", operation);
+    json.insert("wallNs", qint64(wallNs));
+    json.insert("cpuNs", qint64(cpuNs));
+    json.insert("phases", phaseArray);
+    json.insert("files", qint64(files));
+    json.insert("dirs", qint64(dirs));
+    json.insert("rawBytes", qint64(rawBytes));
+    json.insert("storedBytes", qint64(storedBytes));
+    json.insert("readCallBytes", qint64(readCallBytes));
+    json.insert("writeCallBytes", qint64(writeCallBytes));
+    json.insert("storageReadBytes", qint64(storageReadBytes));
+    json.insert("storageWriteBytes", qint64(storageWriteBytes));
+    json.insert("readCalls", qint64(readCalls));
+    json.insert("writeCalls", qint64(writeCalls));
+    json.insert("mappings", qint64(mappings));
+    json.insert("minorFaults", qint64(minorFaults));
+    json.insert("majorFaults", qint64(majorFaults));
+    json.insert("peakRssBytes", qint64(peakRssBytes));
+    return QString::fromUtf8(QJsonDocument(json).toJson(QJsonDocument::Compact));
+}
+
+StatsRecorder::StatsRecorder(Archiver::OperationStats * stats, const QString & operation)
+    :operationStats(stats)
+    ,phaseStartNs(0)
+    ,phaseStartCpuNs(0)
+    ,inPhase(false)
+    ,finished(false) {
+    memset(&start, 0, sizeof(start));
+    if (operationStats == NULL)
+        return;
+    *operationStats = Archiver::OperationStats();
+    operationStats->operation = operation;
+    start = sample();
+}
+
+StatsRecorder::~StatsRecorder() {
+    // runs while the operation unwinds, a failing last sample must not terminate the process
+    try {
+        finish();
+    } catch (...) {
+    }
+}
+
+void StatsRecorder::phase(const QString & name) {
+    if (operationStats == NULL)
+        return;
+    endPhase();
+    operationStats->phases.push_back(Archiver::PhaseStats(name));
+    phaseStartNs = nowNs();
+    phaseStartCpuNs = processCpuNs();
+    inPhase = true;
+}
+
+void StatsRecorder::finish() {
+    if (operationStats == NULL || finished)
+        return;
+    finished = true;
+    endPhase();
+    Counters end = sample();
+    operationStats->wallNs = delta(start.wallNs, end.wallNs);
+    operationStats->cpuNs = delta(start.cpuNs, end.cpuNs);
+    operationStats->readCallBytes = delta(start.readCallBytes, end.readCallBytes);
+    operationStats->writeCallBytes = delta(start.writeCallBytes, end.writeCallBytes);
+    operationStats->storageReadBytes = delta(start.storageReadBytes, end.storageReadBytes);
+    operationStats->storageWriteBytes = delta(start.storageWriteBytes, end.storageWriteBytes);
+    operationStats->readCalls = delta(start.readCalls, end.readCalls);
+    operationStats->writeCalls = delta(start.writeCalls, end.writeCalls);
+    operationStats->mappings = delta(start.mappings, end.mappings);
+    operationStats->minorFaults = delta(start.minorFaults, end.minorFaults);
+    operationStats->majorFaults = delta(start.majorFaults, end.majorFaults);
+    operationStats->peakRssBytes = procValue(readProcFile("/proc/self/status"), "VmHWM") * 1024;
+}
+
+void StatsRecorder::countMapping() {
+    ++mappingCount;
+}
+
+StatsRecorder::Counters StatsRecorder::sample() {
+    Counters counters;
+    counters.wallNs = nowNs();
+    counters.cpuNs = processCpuNs();
+    std::string io = readProcFile("/proc/self/io");
+    counters.readCallBytes = procValue(io, "rchar");
+    counters.writeCallBytes = procValue(io, "wchar");
+    counters.storageReadBytes = procValue(io, "read_bytes");
+    counters.storageWriteBytes = procValue(io, "write_bytes");
+    counters.readCalls = procValue(io, "syscr");
+    counters.writeCalls = procValue(io, "syscw");
+    counters.mappings = mappingCount;
+    rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    counters.minorFaults = usage.ru_minflt;
+    counters.majorFaults = usage.ru_majflt;
+    return counters;
+}
+
+void StatsRecorder::endPhase() {
+    if (!inPhase)
+        return;
+    Archiver::PhaseStats & current = operationStats->phases.back();
+    current.wallNs = nowNs() - phaseStartNs;
+    current.cpuNs = delta(phaseStartCpuNs, processCpuNs());
+    inPhase = false;
+}
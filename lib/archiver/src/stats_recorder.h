@@ -0,0 +1,57 @@
+#ifndef STATS_RECORDER_H
+#define STATS_RECORDER_H
+
+#include "archiver.h"
+
+#include <QString>
+#include <cstdint>
+
+// Fills the Archiver::OperationStats of one operation. Phases are timed on the calling thread,
+// the counters of the process are sampled when the recorder is created and when it finishes.
+// A recorder of NULL stats records nothing, so operations use one unconditionally.
+class StatsRecorder {
+public:
+    StatsRecorder(Archiver::OperationStats * stats, const QString & operation);
+    // Finishes the stats of an operation that ends with an exception, errors of that are dropped.
+    ~StatsRecorder();
+
+    // Ends the running phase, if any, and starts the next one.
+    void phase(const QString & name);
+    // Ends the last phase and takes the counters of the operation, only the first call counts.
+    void finish();
+    // NULL if nothing is recorded.
+    Archiver::OperationStats * stats() const { return operationStats; }
+
+    // Called after every successful mapping of a file by the archiver.
+    static void countMapping();
+
+private:
+    struct Counters {
+        std::uint64_t wallNs;
+        std::uint64_t cpuNs;
+        std::uint64_t readCallBytes;
+        std::uint64_t writeCallBytes;
+        std::uint64_t storageReadBytes;
+        std::uint64_t storageWriteBytes;
+        std::uint64_t readCalls;
+        std::uint64_t writeCalls;
+        std::uint64_t mappings;
+        std::uint64_t minorFaults;
+        std::uint64_t majorFaults;
+    };
+
+    StatsRecorder(const StatsRecorder &);
+    StatsRecorder & operator=(const StatsRecorder &);
+
+    static Counters sample();
+    void endPhase();
+
+    Archiver::OperationStats * operationStats;
+    Counters start;
+    std::uint64_t phaseStartNs;
+    std::uint64_t phaseStartCpuNs;
+    bool inPhase;
+    bool finished;
+};
+
+#endif // STATS_RECORDER_H
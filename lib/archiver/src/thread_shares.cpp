@@ -0,0 +1,24 @@
+#include "thread_shares.h"
+
+#include <algorithm>
+
+ThreadShares::ThreadShares(unsigned threads, unsigned runners, std::size_t jobs)
+    :freeThreads(std::max(1u, threads)), runners(std::max(1u, runners)), waitingJobs(jobs), runningJobs(0) {}
+
+unsigned ThreadShares::take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (waitingJobs > 0)
+        --waitingJobs;
+    // jobs that will be running together with this one and have not taken their part yet
+    std::size_t starting = std::min<std::size_t>(runners, runningJobs + 1 + waitingJobs) - runningJobs;
+    unsigned threads = freeThreads > 0 ? std::max<long>(1, freeThreads / static_cast<long>(starting)) : 1;
+    freeThreads -= threads;
+    ++runningJobs;
+    return threads;
+}
+
+void ThreadShares::giveBack(unsigned threads) {
+    std::lock_guard<std::mutex> lock(mutex);
+    freeThreads += threads;
+    --runningJobs;
+}
@@ -0,0 +1,31 @@
+#ifndef THREAD_SHARES_H
+#define THREAD_SHARES_H
+
+#include <cstddef>
+#include <mutex>
+
+// Threads of one kind shared by the jobs of a batch that run on a fixed number of runners.
+// A job takes its part of the free threads when it starts and gives them back when it ends,
+// so once the runners go idle at the tail of the batch the last jobs start with the threads
+// the finished ones left. Every job gets at least one thread, even if the others hold all of them.
+class ThreadShares {
+public:
+    ThreadShares(unsigned threads, unsigned runners, std::size_t jobs);
+
+    // Called by every job once, before it starts.
+    unsigned take();
+    void giveBack(unsigned threads);
+
+private:
+    ThreadShares(const ThreadShares &);
+    ThreadShares & operator=(const ThreadShares &);
+
+    std::mutex mutex;
+    // below zero while the jobs hold more than the total, as every one of them gets a thread
+    long freeThreads;
+    const unsigned runners;
+    std::size_t waitingJobs;
+    std::size_t runningJobs;
+};
+
+#endif // THREAD_SHARES_H
@@ -0,0 +1,111 @@
+#include "archiver.h"
+#include "archiver_utils.h"
+#include "stats_recorder.h"
+#include "thread_shares.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <set>
+#include <thread>
+
+using ArchiverUtils::nowNs;
+
+Archiver::UnpackBatchOptions::UnpackBatchOptions()
+    :concurrentJobs(std::max(1u, std::thread::hardware_concurrency())) {}
+
+namespace {
+    void runJobs(const std::vector<Archiver::UnpackBatchJob> & jobs, const std::vector<std::size_t> & order,
+                 const Archiver::IoOptions & batchIo, ThreadShares & syncShares, std::uint64_t batchStartNs,
+                 std::atomic<std::size_t> & nextJob, std::vector<Archiver::UnpackBatchJobResult> & results) {
+        // jobs are taken one at a time in the order of archive size, a thread done with a small archive
+        // moves on to the next small one while the others restore big ones
+        for (std::size_t next = nextJob++; next < order.size(); next = nextJob++) {
+            std::size_t jobIndex = order[next];
+            Archiver::UnpackBatchJobResult & result = results[jobIndex];
+            Archiver::IoOptions jobIo = batchIo;
+            jobIo.syncThreads = syncShares.take();
+            std::uint64_t startNs = nowNs();
+            try {
+                Archiver::unpack(jobs[jobIndex].srcArchivePath, jobs[jobIndex].dstPath, jobIo,
+                                 jobs[jobIndex].baseArchivePath, &result.stats);
+            } catch (Archiver::ArchiverException & e) {
+                result.error = e.whatQMsg();
+            } catch (std::exception & e) {
+                result.error = QString(e.what());
+            }
+            std::uint64_t endNs = nowNs();
+            result.wallNs = endNs - startNs;
+            result.finishedNs = endNs - batchStartNs;
+            syncShares.giveBack(jobIo.syncThreads);
+        }
+    }
+
+    QString targetKey(const QString & dstPath) {
+        QFileInfo target(dstPath);
+        QString canonical = target.canonicalFilePath();
+        return canonical.isEmpty() ? QDir::cleanPath(target.absoluteFilePath()) : canonical;
+    }
+}
+
+std::vector<Archiver::UnpackBatchJobResult> Archiver::unpackBatch(const std::vector<UnpackBatchJob> & jobs,
+                                                                  const UnpackBatchOptions & options,
+                                                                  OperationStats * operationStats) {
+    StatsRecorder recorder(operationStats, "unpack-batch");
+    recorder.phase("jobs");
+    std::uint64_t batchStartNs = nowNs();
+    std::vector<UnpackBatchJobResult> results;
+    std::vector<std::size_t> order;
+    std::vector<std::uint64_t> archiveSizes;
+    // jobs restoring into one directory would overwrite each other's entries, the later ones are not run
+    std::set<QString> targets;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        results.push_back(UnpackBatchJobResult(jobs[i]));
+        if (!targets.insert(targetKey(jobs[i].dstPath)).second) {
+            results[i].error = "Target " + jobs[i].dstPath + " is restored by another job of the batch";
+            archiveSizes.push_back(0);
+            continue;
+        }
+        order.push_back(i);
+        // a missing archive counts as empty, its job fails first
+        archiveSizes.push_back(QFileInfo(jobs[i].srcArchivePath).size());
+    }
+    std::stable_sort(order.begin(), order.end(), [&archiveSizes](std::size_t left, std::size_t right) {
+        return archiveSizes[left] < archiveSizes[right];
+    });
+
+    unsigned runners = std::max(1u, std::min<unsigned>(options.concurrentJobs, order.size()));
+    IoOptions jobIo = options.io;
+    // the progress of one job would overwrite the totals of the others
+    jobIo.control = NULL;
+    // with fsync every job waits for the device on threads of its own, they come out of one total
+    ThreadShares syncShares(options.io.syncThreads, runners, order.size());
+
+    std::atomic<std::size_t> nextJob(0);
+    std::vector<std::thread> threads;
+    try {
+        for (unsigned i = 0; i < runners; ++i)
+            threads.push_back(std::thread(runJobs, std::cref(jobs), std::cref(order), std::cref(jobIo),
+                                          std::ref(syncShares), batchStartNs, std::ref(nextJob), std::ref(results)));
+    } catch (...) {
+        nextJob = jobs.size();
+        for (std::size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        throw;
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    if (operationStats) {
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            operationStats->files += results[i].stats.files;
+            operationStats->dirs += results[i].stats.dirs;
+            operationStats->rawBytes += results[i].stats.rawBytes;
+            operationStats->storedBytes += results[i].stats.storedBytes;
+        }
+    }
+    recorder.finish();
+    return results;
+}
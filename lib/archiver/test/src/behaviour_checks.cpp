@@ -0,0 +1,1013 @@
+#include "behaviour_checks.h"
+
+#include <archiver.h>
+#include "archive_index.h"
+#include "archiver_utils.h"
+#include "checksum.h"
+#include "content_cipher.h"
+#include "content_codec.h"
+#include "content_delta.h"
+#include "meta_codec.h"
+#include "struct_serialization.pb.h"
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace apb = ArchiverUtils::protobufStructs;
+
+namespace {
+    void expect(bool condition, const QString & what) {
+        if (!condition)
+            throw Archiver::ArchiverException(what);
+    }
+
+    // Fails unless action throws ArchiverException.
+    void expectRejected(const std::function<void()> & action, const QString & what) {
+        try {
+            action();
+        } catch (Archiver::ArchiverException &) {
+            return;
+        }
+        throw Archiver::ArchiverException(what);
+    }
+
+    std::string randomBytes(std::uint64_t size, unsigned seed) {
+        std::mt19937 generator(seed);
+        std::string data(size, 0);
+        for (std::uint64_t i = 0; i < size; ++i)
+            data[i] = (char)(generator() & 0xff);
+        return data;
+    }
+
+    // Compressible bytes made of a few words.
+    std::string textBytes(std::uint64_t size, unsigned seed) {
+        static const char* words[] = {"archive ", "content ", "block ", "meta ", "index ", "delta ", "cipher ", "\n"};
+        std::mt19937 generator(seed);
+        std::string data;
+        while (data.size() < size)
+            data += words[generator() % 8];
+        data.resize(size);
+        return data;
+    }
+
+    void writeFile(const QString & path, const std::string & content) {
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+                || file.write(content.data(), content.size()) != (qint64)content.size())
+            throw Archiver::ArchiverException("Cannot write " + path);
+    }
+
+    std::string readFile(const QString & path) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            throw Archiver::ArchiverException("Cannot read " + path);
+        QByteArray content = file.readAll();
+        return std::string(content.constData(), content.size());
+    }
+
+    QString makeDir(const QString & path) {
+        QDir(path).removeRecursively();
+        if (!QDir().mkpath(path))
+            throw Archiver::ArchiverException("Cannot create " + path);
+        return path;
+    }
+
+    std::uint64_t fileSize(const QString & path) {
+        return QFile(path).size();
+    }
+
+    // Unpacks archivePath into a new directory dstDir and compares the restored tree with srcPath.
+    void expectRestored(const QString & archivePath, const QString & srcPath, const QString & dstDir,
+                        const Archiver::IoOptions & io = Archiver::IoOptions()) {
+        makeDir(dstDir);
+        Archiver::unpack(archivePath, dstDir + "/", io);
+        expect(sameTrees(srcPath, dstDir + "/" + QDir(srcPath).dirName()), "Unpacked tree differs from " + srcPath);
+    }
+
+    void expectUnpackRejected(const QString & archivePath, const QString & dstDir, const Archiver::IoOptions & io,
+                              const QString & what) {
+        makeDir(dstDir);
+        expectRejected([&]() { Archiver::unpack(archivePath, dstDir + "/", io); }, what);
+    }
+
+    // Tree of text, random and tiny (inlined) files in two levels.
+    void makeTree(const QString & path, unsigned seed) {
+        makeDir(path + "/dir/deeper");
+        writeFile(path + "/alpha.txt", textBytes(3 * ContentCodec::defaultBlockSize / 2, seed));
+        writeFile(path + "/random.bin", randomBytes(ContentCodec::defaultBlockSize + 4321, seed + 1));
+        writeFile(path + "/tiny.txt", "tiny\n");
+        writeFile(path + "/empty", "");
+        writeFile(path + "/dir/beta.txt", textBytes(70000, seed + 2));
+        writeFile(path + "/dir/deeper/gamma.bin", randomBytes(5000, seed + 3));
+    }
+
+    // Changes one byte of the content of archivePath at offset from the start of the content.
+    void flipContentByte(const QString & archivePath, std::uint64_t offset) {
+        std::string content = readFile(archivePath);
+        expect(ArchiverUtils::contentOffsetInArchive + offset < content.size(), "Archive is too short");
+        content[ArchiverUtils::contentOffsetInArchive + offset] ^= 1;
+        writeFile(archivePath, content);
+    }
+
+    void readSizes(QFile & archive, std::uint64_t & metaSize, std::uint64_t & contentSize) {
+        std::uint64_t sizes[2];
+        archive.seek(ArchiverUtils::archiveHeaderSize - sizeof(sizes));
+        expect(archive.read(reinterpret_cast<char*>(sizes), sizeof(sizes)) == sizeof(sizes), "Cannot read header");
+        metaSize = sizes[0];
+        contentSize = sizes[1];
+    }
+
+    QByteArray testKey(char first) {
+        QByteArray key;
+        for (int i = 0; i < (int)ContentCipher::keySize; ++i)
+            key.append((char)(first + i));
+        return key;
+    }
+
+    void checkBlockCodec(const QString &) {
+        std::string text = textBytes(ContentCodec::defaultBlockSize, 1);
+        std::string noise = randomBytes(ContentCodec::defaultBlockSize, 2);
+        expect(ContentCodec::probe(text.data(), ContentCodec::probeSize).codec != apb::CODEC_RAW, "Text probed as raw");
+        expect(ContentCodec::probe(noise.data(), ContentCodec::probeSize).codec == apb::CODEC_RAW, "Random data probed as compressible");
+
+        const ContentCodec::CodecChoice choices[] = {ContentCodec::CodecChoice(apb::CODEC_LZ4, 0),
+                                                     ContentCodec::CodecChoice(apb::CODEC_ZSTD, 1),
+                                                     ContentCodec::CodecChoice(apb::CODEC_ZSTD, 3)};
+        std::vector<char> stored(ContentCodec::compressBound(text.size()));
+        std::vector<char> raw(text.size());
+        for (const ContentCodec::CodecChoice & choice : choices) {
+            std::uint64_t storedSize = ContentCodec::compressBlock(choice, text.data(), text.size(), stored.data(), stored.size());
+            expect(storedSize > 0 && storedSize < text.size(), "Text block did not shrink");
+            ContentCodec::decompressBlock(choice.codec, stored.data(), storedSize, raw.data(), raw.size());
+            expect(memcmp(raw.data(), text.data(), text.size()) == 0, "Block changed by compression");
+            expectRejected([&]() {
+                ContentCodec::decompressBlock(choice.codec, stored.data(), storedSize / 2, raw.data(), raw.size());
+            }, "Cut block decompressed");
+            expect(ContentCodec::compressBlock(choice, noise.data(), noise.size(), stored.data(), stored.size()) == 0,
+                   "Random block shrank");
+        }
+        expectRejected([&]() {
+            ContentCodec::decompressBlock(apb::CODEC_RAW, noise.data(), noise.size() - 1, raw.data(), raw.size());
+        }, "Raw block of wrong size accepted");
+    }
+
+    void checkHeader(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 5);
+        Archiver::pack(tree, dir + "/tree.pck");
+        std::string archive = readFile(dir + "/tree.pck");
+        expect(archive.compare(0, sizeof(ArchiverUtils::archiveMagic), ArchiverUtils::archiveMagic,
+                               sizeof(ArchiverUtils::archiveMagic)) == 0, "Archive does not start with the magic");
+        expectRestored(dir + "/tree.pck", tree, dir + "/out");
+
+        // the same sizes and sections without the magic and the format version in front of them
+        writeFile(dir + "/legacy.pck", archive.substr(ArchiverUtils::archiveHeaderSize - 2 * ArchiverUtils::byteSizeOfNumber));
+        expectUnpackRejected(dir + "/legacy.pck", dir + "/out-legacy", Archiver::IoOptions(),
+                             "Archive without a format version unpacked");
+        std::string later = archive;
+        later[sizeof(ArchiverUtils::archiveMagic)] = 2;
+        writeFile(dir + "/later.pck", later);
+        expectUnpackRejected(dir + "/later.pck", dir + "/out-later", Archiver::IoOptions(), "Later format version unpacked");
+        writeFile(dir + "/junk.pck", randomBytes(4096, 6));
+        expectUnpackRejected(dir + "/junk.pck", dir + "/out-junk", Archiver::IoOptions(), "Junk unpacked");
+        writeFile(dir + "/short.pck", archive.substr(0, ArchiverUtils::archiveHeaderSize - 1));
+        expectUnpackRejected(dir + "/short.pck", dir + "/out-short", Archiver::IoOptions(), "Cut header unpacked");
+    }
+
+    void checkCrc32c(const QString & dir) {
+        expect(Checksum::crc32c(0, "123456789", 9) == 0xe3069283, "Wrong crc32c of the check string");
+        std::string data = randomBytes((3 << 20) + 12345, 3);
+        std::uint32_t whole = Checksum::crc32c(0, data.data(), data.size());
+        const std::uint64_t splits[] = {0, 1, 7, 4096, 1 << 20, data.size() - 3, data.size()};
+        for (std::uint64_t split : splits) {
+            std::uint32_t first = Checksum::crc32c(0, data.data(), split);
+            std::uint32_t second = Checksum::crc32c(0, data.data() + split, data.size() - split);
+            expect(Checksum::crc32c(first, data.data() + split, data.size() - split) == whole,
+                   "Continued crc32c differs at " + QString::number(split));
+            expect(Checksum::crc32cCombine(first, second, data.size() - split) == whole,
+                   "Combined crc32c differs at " + QString::number(split));
+        }
+
+        QString tree = dir + "/tree";
+        makeTree(tree, 7);
+        Archiver::pack(tree, dir + "/tree.pck");
+        flipContentByte(dir + "/tree.pck", 100);
+        expectUnpackRejected(dir + "/tree.pck", dir + "/out", Archiver::IoOptions(), "Altered content unpacked");
+    }
+
+    void checkVerify(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 8);
+        Archiver::pack(tree, dir + "/tree.pck");
+        Archiver::VerifyReport report = Archiver::verify(dir + "/tree.pck");
+        expect(report.badEntries.empty(), "Verify found errors in an intact archive");
+        // tiny.txt is inlined and has no blocks
+        expect(report.files == 6 && report.rawBytes == 3 * ContentCodec::defaultBlockSize / 2
+                   + ContentCodec::defaultBlockSize + 4321 + 70000 + 5000, "Verify went through other files");
+
+        Archiver::VerifyOptions options;
+        options.threads = 1;
+        const std::uint64_t offsets[] = {0, 100000, 1000000};
+        for (std::uint64_t offset : offsets) {
+            QFile::remove(dir + "/altered.pck");
+            QFile::copy(dir + "/tree.pck", dir + "/altered.pck");
+            flipContentByte(dir + "/altered.pck", offset);
+            expect(Archiver::verify(dir + "/altered.pck", options).badEntries.size() == 1,
+                   "Verify missed altered content at " + QString::number(offset));
+        }
+
+        // the meta is checked before any content
+        std::string archive = readFile(dir + "/tree.pck");
+        writeFile(dir + "/cut.pck", archive.substr(0, archive.size() - 10));
+        expectRejected([&]() { Archiver::verify(dir + "/cut.pck"); }, "Verify accepted a cut archive");
+    }
+
+    void checkDedup(const QString & dir) {
+        QString tree = makeDir(dir + "/tree");
+        makeDir(tree + "/copies");
+        std::string big = randomBytes(3 * ContentCodec::defaultBlockSize / 2, 20);
+        writeFile(tree + "/big.bin", big);
+        writeFile(tree + "/copies/big.bin", big);
+        writeFile(tree + "/copies/big2.bin", big);
+        // same size, other content
+        big[big.size() / 2] ^= 1;
+        writeFile(tree + "/near.bin", big);
+        writeFile(tree + "/small.txt", textBytes(3000, 21));
+        writeFile(tree + "/copies/small.txt", textBytes(3000, 21));
+
+        Archiver::pack(tree, dir + "/dedup.pck");
+        Archiver::PackOptions options;
+        options.dedup = false;
+        Archiver::pack(tree, dir + "/plain.pck", options);
+        // the copies of big.bin take no content of their own, near.bin does
+        expect(fileSize(dir + "/dedup.pck") + 2 * big.size() < fileSize(dir + "/plain.pck") + 4096,
+               "Duplicates are stored twice");
+        expect(fileSize(dir + "/dedup.pck") > 2 * big.size(), "Files of same size but other content are shared");
+        expectRestored(dir + "/dedup.pck", tree, dir + "/out-dedup");
+        expectRestored(dir + "/plain.pck", tree, dir + "/out-plain");
+    }
+
+    void checkIndex(const QString & dir) {
+        makeTree(dir + "/tree", 10);
+        Archiver::pack(dir + "/tree", dir + "/tree.pck");
+
+        QFile archive(dir + "/tree.pck");
+        expect(archive.open(QIODevice::ReadOnly), "Cannot open " + archive.fileName());
+        std::uint64_t metaSize = 0;
+        std::uint64_t contentSize = 0;
+        readSizes(archive, metaSize, contentSize);
+        ArchiveIndex::Reader index(archive, metaSize, contentSize);
+        expect(index.isMapped(), "Archive has no stored index");
+        expect(index.entryCount() == 9, "Index has " + QString::number(index.entryCount()) + " entries");
+        expect(!index.encryption(NULL), "Plain archive has an encryption record");
+
+        for (std::uint64_t i = 0; i < index.entryCount(); ++i) {
+            const ArchiveIndex::Entry & entry = index.entry(i);
+            QString path = index.path(i);
+            expect(index.find(path) == i, "Entry not found by its path " + path);
+            if (i != 0)
+                expect(entry.parent < i && index.entry(entry.parent).childCount > 0, "Broken parent of " + path);
+            if (!entry.isRegularFile())
+                continue;
+            std::string content = readFile(dir + "/" + path);
+            expect(entry.contentSize == content.size(), "Size of " + path + " differs");
+            if (entry.flags & ArchiveIndex::InlineContent)
+                expect(content.compare(0, content.size(), index.inlineContent(entry), entry.contentSize) == 0,
+                       "Inlined content of " + path + " differs");
+            else if (!content.empty())
+                expect(entry.blockCount == (content.size() + entry.blockSize - 1) / entry.blockSize, "Blocks of " + path + " differ");
+        }
+        expect(index.find("tree/missing") == index.entryCount(), "Missing path found");
+        expect(index.find("tree/dir/deeper/gamma.bin") != index.entryCount(), "Nested path not found");
+
+        const ArchiveIndex::Entry & root = index.entry(0);
+        for (std::uint64_t i = 1; i < root.childCount; ++i) {
+            const ArchiveIndex::Entry & previous = index.entry(index.sortedChild(root, i - 1));
+            const ArchiveIndex::Entry & next = index.entry(index.sortedChild(root, i));
+            expect(ArchiveIndex::compareNames(index.nameData(previous), previous.nameSize,
+                                              index.nameData(next), next.nameSize) < 0, "Children are not sorted by name");
+        }
+    }
+
+    // Every entry shares one attribute tuple and no file has an inlined content, a custom block size,
+    // a signature or a delta.
+    apb::PBArchiveMetaData plainMeta() {
+        apb::PBArchiveMetaData meta;
+        const char* names[] = {"root", "alpha.txt", "alpha.txz", "dir", "inner.bin"};
+        const std::uint64_t parents[] = {0, 0, 0, 0, 3};
+        std::uint64_t contentOffset = 0;
+        for (int i = 0; i < 5; ++i) {
+            apb::PBDirEntMetaData* dirent = meta.add_pbdirentmetadata();
+            dirent->set_uid(1000);
+            dirent->set_gid(1000);
+            dirent->set_mode(0100644);
+            dirent->set_mtime(1700000000 + i * 7);
+            dirent->set_atime(1700000100 - i);
+            dirent->set_name(names[i]);
+            dirent->set_parentix(parents[i]);
+            if (i == 0 || i == 3)
+                continue;
+            apb::PBRegFileMetaData* fileMeta = dirent->mutable_pbregfilemetadata();
+            std::uint64_t size = (i + 1) * ContentCodec::defaultBlockSize / 2 + i;
+            fileMeta->set_contentsize(size);
+            fileMeta->set_contentoffset(contentOffset);
+            fileMeta->set_blocksize(ContentCodec::defaultBlockSize);
+            for (std::uint64_t rawOffset = 0; rawOffset < size; rawOffset += ContentCodec::defaultBlockSize) {
+                apb::PBContentBlock* block = fileMeta->add_blocks();
+                block->set_codec(i == 2 ? apb::CODEC_RAW : apb::CODEC_ZSTD);
+                block->set_storedsize(i == 2 ? std::min(ContentCodec::defaultBlockSize, size - rawOffset) : 1000 + rawOffset / 1000);
+                block->set_checksum(0x1000 * i + rawOffset);
+                contentOffset += block->storedsize();
+            }
+            fileMeta->set_checksum(0xabc0 + i);
+        }
+        return meta;
+    }
+
+    // plainMeta with more tuples, inlined content, a single block file, a custom block size,
+    // a signature, a delta and the archive records.
+    apb::PBArchiveMetaData richMeta() {
+        apb::PBArchiveMetaData meta = plainMeta();
+        meta.mutable_pbdirentmetadata(0)->set_mode(040755);
+        meta.mutable_pbdirentmetadata(3)->set_mode(040700);
+        meta.mutable_pbdirentmetadata(3)->set_uid(0);
+
+        apb::PBRegFileMetaData* signedFile = meta.mutable_pbdirentmetadata(1)->mutable_pbregfilemetadata();
+        signedFile->mutable_signature()->set_blocksize(64 << 10);
+        for (int i = 0; i < 3; ++i) {
+            signedFile->mutable_signature()->add_weak(0x10000 * i + 7);
+            signedFile->mutable_signature()->add_strong(0x123456789ULL * (i + 1));
+        }
+
+        apb::PBRegFileMetaData* deltaFile = meta.mutable_pbdirentmetadata(4)->mutable_pbregfilemetadata();
+        apb::PBDelta* delta = deltaFile->mutable_delta();
+        delta->set_basepath("root/dir/inner.bin");
+        delta->set_literalsize(12345);
+        delta->add_ops()->set_size(64 << 10);
+        delta->mutable_ops(0)->set_baseoffset(64 << 10);
+        delta->add_ops()->set_size(12345);
+        delta->add_ops()->set_size(64 << 10);
+        delta->mutable_ops(2)->set_baseoffset(0);
+
+        apb::PBDirEntMetaData* tiny = meta.add_pbdirentmetadata();
+        tiny->CopyFrom(meta.pbdirentmetadata(4));
+        tiny->set_name("tiny");
+        tiny->set_mode(0100600);
+        tiny->mutable_pbregfilemetadata()->Clear();
+        tiny->mutable_pbregfilemetadata()->set_contentsize(5);
+        tiny->mutable_pbregfilemetadata()->set_contentoffset(0);
+        tiny->mutable_pbregfilemetadata()->set_blocksize(ContentCodec::defaultBlockSize);
+        tiny->mutable_pbregfilemetadata()->set_inlinedata("tiny\n");
+        tiny->mutable_pbregfilemetadata()->set_checksum(Checksum::crc32c(0, "tiny\n", 5));
+
+        apb::PBDirEntMetaData* single = meta.add_pbdirentmetadata();
+        single->CopyFrom(*tiny);
+        single->set_name("tinz");
+        apb::PBRegFileMetaData* singleFile = single->mutable_pbregfilemetadata();
+        singleFile->Clear();
+        singleFile->set_contentsize(300);
+        singleFile->set_contentoffset(1 << 30);
+        singleFile->set_blocksize(4096);
+        singleFile->add_blocks()->set_storedsize(200);
+        singleFile->mutable_blocks(0)->set_codec(apb::CODEC_LZ4);
+        singleFile->mutable_blocks(0)->set_checksum(0x5555);
+        singleFile->set_checksum(0x5555);
+
+        meta.mutable_basearchive()->set_path("/archives/base.pck");
+        meta.mutable_basearchive()->set_metasize(4096);
+        meta.mutable_basearchive()->set_contentsize(1 << 20);
+        meta.mutable_encryption()->set_cipher(apb::CIPHER_CHACHA20_POLY1305);
+        meta.mutable_encryption()->set_salt(std::string(16, 's'));
+        meta.mutable_encryption()->set_keycheck(std::string(32, 'k'));
+        meta.mutable_encryption()->set_metatag(std::string(32, 't'));
+        return meta;
+    }
+
+    void expectDecodedAs(const QByteArray & encoded, const apb::PBArchiveMetaData & meta, const QString & what) {
+        apb::PBArchiveMetaData decoded;
+        MetaCodec::parse(encoded.constData(), encoded.size(), decoded);
+        expect(decoded.SerializeAsString() == meta.SerializeAsString(), what);
+    }
+
+    void checkMetaCodec(const QString &) {
+        apb::PBArchiveMetaData plain = plainMeta();
+        QByteArray current = MetaCodec::encode(plain);
+        expect(MetaCodec::isCompact(current.constData(), current.size()), "Compact meta not recognized");
+        expectDecodedAs(current, plain, "Meta changed by the compact encoding");
+
+        const int versionOffset = 7;
+        QByteArray other = current;
+        other[versionOffset] = 2;
+        expectRejected([&]() {
+            apb::PBArchiveMetaData decoded;
+            MetaCodec::decode(other.constData(), other.size(), decoded);
+        }, "Compact meta of another version accepted");
+
+        apb::PBArchiveMetaData rich = richMeta();
+        QByteArray encoded = MetaCodec::encode(rich);
+        expectDecodedAs(encoded, rich, "Meta with signatures, deltas and archive records changed by the compact encoding");
+        std::string protobuf = rich.SerializeAsString();
+        expectDecodedAs(QByteArray(protobuf.data(), protobuf.size()), rich, "Protobuf meta parsed wrongly");
+        for (int size = 0; size < encoded.size(); size += 1 + size / 3) {
+            expectRejected([&]() {
+                apb::PBArchiveMetaData decoded;
+                MetaCodec::decode(encoded.constData(), size, decoded);
+            }, "Cut compact meta of " + QString::number(size) + " bytes accepted");
+        }
+    }
+
+    void checkExtract(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 15);
+        Archiver::pack(tree, dir + "/tree.pck");
+
+        QString out = makeDir(dir + "/out");
+        Archiver::extract(dir + "/tree.pck", "tree/dir", out + "/");
+        expect(sameTrees(tree + "/dir", out + "/dir"), "Extracted subtree differs");
+        Archiver::extract(dir + "/tree.pck", "tree/random.bin", out + "/");
+        Archiver::extract(dir + "/tree.pck", "tree/tiny.txt", out + "/");
+        expect(readFile(out + "/random.bin") == readFile(tree + "/random.bin")
+               && readFile(out + "/tiny.txt") == readFile(tree + "/tiny.txt"), "Extracted file differs");
+        expect(!QFile::exists(out + "/alpha.txt") && !QFile::exists(out + "/empty"), "Extract restored more than its path");
+
+        QString whole = makeDir(dir + "/out-whole");
+        Archiver::extract(dir + "/tree.pck", "tree", whole + "/");
+        expect(sameTrees(tree, whole + "/tree"), "Extracted root differs");
+        expectRejected([&]() { Archiver::extract(dir + "/tree.pck", "tree/missing", out + "/"); }, "Missing path extracted");
+        expectRejected([&]() { Archiver::extract(dir + "/tree.pck", "dir", out + "/"); }, "Path without the root name extracted");
+    }
+
+    Archiver::PackOptions checkpointOptions() {
+        Archiver::PackOptions options;
+        options.checkpointInterval = 256 << 10;
+        // every file has the same size, dedup would hash all of them under the limiter first
+        options.dedup = false;
+        options.readerThreads = 1;
+        options.workerThreads = 2;
+        return options;
+    }
+
+    // Cancels a slowed down pack with checkpoints once two thirds of the content are read,
+    // which leaves the archive and its log as a crash would.
+    void interruptPack(const QString & srcPath, const QString & archivePath, std::uint64_t contentSize) {
+        Archiver::IoLimiter limiter(16 << 20);
+        Archiver::JobControl control;
+        Archiver::PackOptions options = checkpointOptions();
+        options.io.limiter = &limiter;
+        options.io.control = &control;
+        std::atomic<bool> finished(false);
+        std::thread canceller([&]() {
+            while (!finished && control.bytesDone() < contentSize * 2 / 3)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            control.cancel();
+        });
+        try {
+            Archiver::pack(srcPath, archivePath, options);
+        } catch (Archiver::ArchiverException &) {
+        }
+        finished = true;
+        canceller.join();
+        expect(QFile::exists(archivePath + ".checkpoint"), "Interrupted pack left no checkpoint");
+    }
+
+    void checkCheckpoint(const QString & dir) {
+        QString tree = makeDir(dir + "/tree");
+        const unsigned fileCount = 24;
+        const std::uint64_t size = 512 << 10;
+        for (unsigned i = 0; i < fileCount; ++i)
+            writeFile(tree + "/file" + QString::number(i), i % 2 ? randomBytes(size, 50 + i) : textBytes(size, 50 + i));
+        std::uint64_t contentSize = fileCount * size;
+
+        interruptPack(tree, dir + "/resumed.pck", contentSize);
+        Archiver::PackOptions options = checkpointOptions();
+        options.resume = true;
+        Archiver::PipelineStats stats;
+        Archiver::pack(tree, dir + "/resumed.pck", options, &stats);
+        expect(stats.rawBytes < contentSize, "Resumed pack packed everything again");
+        expect(!QFile::exists(dir + "/resumed.pck.checkpoint"), "Checkpoint left after the pack");
+        expectRestored(dir + "/resumed.pck", tree, dir + "/out-resumed");
+
+        // an archive shorter than its log is packed again from the start
+        interruptPack(tree, dir + "/cut.pck", contentSize);
+        {
+            QFile archive(dir + "/cut.pck");
+            expect(archive.resize(archive.size() / 2), "Cannot cut archive");
+        }
+        stats = Archiver::PipelineStats();
+        Archiver::pack(tree, dir + "/cut.pck", options, &stats);
+        expect(stats.rawBytes == contentSize, "Pack resumed from a cut archive");
+        expectRestored(dir + "/cut.pck", tree, dir + "/out-cut");
+
+        // as is an archive whose last committed files do not match their checksums
+        interruptPack(tree, dir + "/altered.pck", contentSize);
+        {
+            std::string content = readFile(dir + "/altered.pck");
+            for (std::size_t i = ArchiverUtils::contentOffsetInArchive; i < content.size(); i += 4096)
+                content[i] ^= 1;
+            writeFile(dir + "/altered.pck", content);
+        }
+        stats = Archiver::PipelineStats();
+        Archiver::pack(tree, dir + "/altered.pck", options, &stats);
+        expect(stats.rawBytes == contentSize, "Pack resumed from an altered archive");
+        expectRestored(dir + "/altered.pck", tree, dir + "/out-altered");
+    }
+
+    void checkPackBatch(const QString & dir) {
+        std::vector<Archiver::BatchJob> jobs;
+        for (unsigned i = 0; i < 4; ++i) {
+            QString tree = dir + "/tree" + QString::number(i);
+            makeTree(tree, 25 + i);
+            jobs.push_back(Archiver::BatchJob(tree, dir + "/tree" + QString::number(i) + ".pck"));
+        }
+        // a failing job between the others
+        jobs.insert(jobs.begin() + 1, Archiver::BatchJob(dir + "/missing", dir + "/missing.pck"));
+
+        Archiver::BatchOptions options;
+        options.concurrentJobs = 2;
+        options.pack.readerThreads = 3;
+        options.pack.workerThreads = 3;
+        std::vector<Archiver::BatchJobResult> results = Archiver::packBatch(jobs, options);
+        expect(results.size() == jobs.size(), "Batch returned " + QString::number(results.size()) + " results");
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            expect(results[i].job.srcPath == jobs[i].srcPath, "Results are not in the order of jobs");
+            if (i == 1) {
+                expect(!results[i].error.isEmpty(), "Job of a missing source succeeded");
+                continue;
+            }
+            expect(results[i].error.isEmpty(), "Batch job failed: " + results[i].error);
+            expectRestored(jobs[i].dstArchivePath, jobs[i].srcPath, dir + "/out" + QString::number(i));
+        }
+    }
+
+    // Paths of the entries archivePath prints for query.
+    QStringList queryPaths(const QString & archivePath, const Archiver::ListQuery & query) {
+        QString output;
+        {
+            QTextStream stream(&output);
+            Archiver::queryArchive(archivePath, query, stream);
+        }
+        QStringList paths;
+        for (const QString & line : output.split('\n')) {
+            if (!line.isEmpty())
+                paths.append(line.split('\t').at(2));
+        }
+        return paths;
+    }
+
+    void expectQueried(const QString & archivePath, const Archiver::ListQuery & query, const QStringList & paths,
+                       const QString & what) {
+        QStringList queried = queryPaths(archivePath, query);
+        expect(queried == paths, what + " printed " + queried.join(" "));
+    }
+
+    void checkQuery(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 35);
+        Archiver::pack(tree, dir + "/tree.pck");
+        QString archive = dir + "/tree.pck";
+
+        Archiver::ListQuery query;
+        query.sortKey = Archiver::ListQuery::SortPath;
+        expect(queryPaths(archive, query).size() == 9, "Query without filters printed other entries");
+        query.pathGlob = "*";
+        expectQueried(archive, query, QStringList() << "tree/", "Path * ");
+        query.pathGlob = "*/*";
+        expectQueried(archive, query, QStringList() << "tree/alpha.txt" << "tree/dir/" << "tree/empty"
+                      << "tree/random.bin" << "tree/tiny.txt", "Path */* ");
+        query.pathGlob = "tree/*/*";
+        expectQueried(archive, query, QStringList() << "tree/dir/beta.txt" << "tree/dir/deeper/", "Path tree/*/* ");
+
+        query.pathGlob = QString();
+        query.nameGlob = "*.txt";
+        query.type = Archiver::ListQuery::FilesOnly;
+        expectQueried(archive, query, QStringList() << "tree/alpha.txt" << "tree/dir/beta.txt" << "tree/tiny.txt",
+                      "Name *.txt ");
+        query.nameGlob = QString();
+        query.type = Archiver::ListQuery::DirsOnly;
+        expectQueried(archive, query, QStringList() << "tree/" << "tree/dir/" << "tree/dir/deeper/", "Directories ");
+
+        query.type = Archiver::ListQuery::AnyEntry;
+        query.minSize = 6000;
+        query.sortKey = Archiver::ListQuery::SortSize;
+        query.descending = true;
+        query.limit = 2;
+        expectQueried(archive, query, QStringList() << "tree/alpha.txt" << "tree/random.bin", "Two largest files ");
+        query.du = true;
+        expectQueried(archive, query, QStringList() << "tree/" << "tree/alpha.txt", "Two largest subtrees ");
+    }
+
+    const Archiver::Difference * findDifference(const Archiver::CompareReport & report, const QString & path) {
+        for (std::size_t i = 0; i < report.differences.size(); ++i) {
+            if (report.differences[i].path == path)
+                return &report.differences[i];
+        }
+        return NULL;
+    }
+
+    void checkCompare(const QString & dir) {
+        QString tree = makeDir(dir + "/tree");
+        makeDir(tree + "/dir");
+        writeFile(tree + "/keep.txt", textBytes(5000, 60));
+        writeFile(tree + "/change.txt", textBytes(5000, 61));
+        writeFile(tree + "/gone.txt", textBytes(5000, 62));
+        writeFile(tree + "/dir/sub.txt", textBytes(5000, 63));
+        Archiver::pack(tree, dir + "/old.pck");
+
+        // same size, so only the checksums tell the change
+        writeFile(tree + "/change.txt", textBytes(5000, 64));
+        QFile::remove(tree + "/gone.txt");
+        writeFile(tree + "/dir/new.txt", textBytes(100, 65));
+        Archiver::pack(tree, dir + "/new.pck");
+
+        Archiver::CompareReport report = Archiver::compare(dir + "/old.pck", dir + "/new.pck");
+        expect(report.oldEntries == 6 && report.newEntries == 6, "Wrong entry counts");
+        expect(report.added == 1 && report.removed == 1, "Wrong counts of added and removed entries");
+        const Archiver::Difference * added = findDifference(report, "tree/dir/new.txt");
+        const Archiver::Difference * removed = findDifference(report, "tree/gone.txt");
+        const Archiver::Difference * changed = findDifference(report, "tree/change.txt");
+        expect(added && added->kinds == Archiver::Difference::Added, "Added file not reported");
+        expect(removed && removed->kinds == Archiver::Difference::Removed, "Removed file not reported");
+        expect(changed && (changed->kinds & Archiver::Difference::ContentChanged), "Changed content not reported");
+        expect(!findDifference(report, "tree/keep.txt") && !findDifference(report, "tree/dir/sub.txt"),
+               "Unchanged files reported");
+
+        report = Archiver::compare(dir + "/new.pck", dir + "/new.pck");
+        expect(report.differences.empty() && report.unchanged == 6, "Archive differs from itself");
+    }
+
+    void checkDelta(const QString & dir) {
+        std::string base = randomBytes(ContentCodec::defaultBlockSize + 300, 30);
+        std::string changed = base.substr(0, 300000) + textBytes(1000, 31) + base.substr(300000);
+        changed[800000] ^= 0x55;
+
+        std::vector<std::uint32_t> weak;
+        std::vector<std::uint64_t> strong;
+        ContentDelta::sign(base.data(), base.size(), weak, strong);
+        expect(weak.size() == base.size() / ContentDelta::signatureBlockSize && strong.size() == weak.size(),
+               "Signature does not cover every full block");
+        apb::PBDeltaSignature signature;
+        signature.set_blocksize(ContentDelta::signatureBlockSize);
+        for (std::size_t i = 0; i < weak.size(); ++i) {
+            signature.add_weak(weak[i]);
+            signature.add_strong(strong[i]);
+        }
+
+        apb::PBDelta delta;
+        std::string literals;
+        ContentDelta::encode(signature, changed.data(), changed.size(), &delta,
+                             [&literals](const char* data, std::uint64_t size) { literals.append(data, size); },
+                             Archiver::IoOptions());
+        expect(delta.literalsize() == literals.size(), "Literal size of delta differs from its literals");
+        expect(literals.size() < 3 * ContentDelta::signatureBlockSize, "Delta copies too little of its base");
+
+        std::vector<char> rebuilt(changed.size());
+        ContentDelta::MemoryReader baseReader(base.data(), base.size(), "base");
+        ContentDelta::MemoryReader literalReader(literals.data(), literals.size(), "literals");
+        ContentDelta::apply(delta, baseReader, literalReader, rebuilt.data(), rebuilt.size(), "changed", Archiver::IoOptions());
+        expect(memcmp(rebuilt.data(), changed.data(), changed.size()) == 0, "Delta rebuilt other content");
+
+        // the same through archives, the second one packed against the first
+        QString tree = makeDir(dir + "/tree");
+        writeFile(tree + "/large.bin", base + base);
+        writeFile(tree + "/small.txt", textBytes(2000, 32));
+        Archiver::PackOptions options;
+        options.signatureThreshold = ContentCodec::defaultBlockSize;
+        Archiver::pack(tree, dir + "/base.pck", options);
+        writeFile(tree + "/large.bin", changed + base);
+        options.baseArchivePath = dir + "/base.pck";
+        Archiver::pack(tree, dir + "/delta.pck", options);
+        expect(fileSize(dir + "/delta.pck") < fileSize(dir + "/base.pck") / 4, "Changed file is not delta encoded");
+        expectRestored(dir + "/delta.pck", tree, dir + "/out");
+        QFile::remove(dir + "/base.pck");
+        expectUnpackRejected(dir + "/delta.pck", dir + "/out-without-base", Archiver::IoOptions(),
+                             "Delta restored without its base");
+    }
+
+    // Swaps the stored bytes of the first two blocks of fileName, which are of the same size.
+    void swapBlocks(const QString & archivePath, const QString & fileName) {
+        QFile archive(archivePath);
+        expect(archive.open(QIODevice::ReadWrite), "Cannot open " + archivePath);
+        std::uint64_t metaSize = 0;
+        std::uint64_t contentSize = 0;
+        readSizes(archive, metaSize, contentSize);
+        ArchiveIndex::Reader index(archive, metaSize, contentSize);
+        const ArchiveIndex::Entry & entry = index.entry(index.find(fileName));
+        std::uint64_t storedSize = index.block(entry, 0).storedSize;
+        expect(entry.blockCount >= 2 && index.block(entry, 1).storedSize == storedSize, "Blocks of " + fileName + " differ in size");
+        std::vector<char> blocks(2 * storedSize);
+        std::uint64_t offset = ArchiverUtils::contentOffsetInArchive + entry.contentOffset;
+        ArchiverUtils::readFully(archive.handle(), blocks.data(), blocks.size(), offset, archivePath);
+        ArchiverUtils::writeFully(archive.handle(), blocks.data() + storedSize, storedSize, offset, archivePath);
+        ArchiverUtils::writeFully(archive.handle(), blocks.data(), storedSize, offset + storedSize, archivePath);
+    }
+
+    // Changes one byte of the first occurrence of text at or after from.
+    void alterArchive(const QString & archivePath, const std::string & text, std::uint64_t from) {
+        std::string content = readFile(archivePath);
+        std::size_t position = content.find(text, from);
+        expect(position != std::string::npos, "No " + QString::fromStdString(text) + " in " + archivePath);
+        content[position] ^= 1;
+        writeFile(archivePath, content);
+    }
+
+    void checkCipher(const QString & dir) {
+        QByteArray key = testKey('a');
+        const apb::PBCipher ciphers[] = {apb::CIPHER_AES_256_GCM, apb::CIPHER_CHACHA20_POLY1305};
+        for (apb::PBCipher cipherKind : ciphers) {
+            apb::PBEncryption record;
+            ContentCipher::createRecord(cipherKind, key, &record);
+            expect(ContentCipher::keyMatches(record, key) && !ContentCipher::keyMatches(record, testKey('b')),
+                   "Key check of the record is wrong");
+            expectRejected([&]() { ContentCipher wrong(record, testKey('b')); }, "Cipher created with a wrong key");
+            ContentCipher cipher(record, key);
+
+            std::string payload = textBytes(100000, 40);
+            const std::uint64_t offset = 4096;
+            std::vector<char> sealed(payload.size() + ContentCipher::overhead);
+            std::vector<char> opened(payload.size());
+            cipher.seal(payload.data(), payload.size(), payload.size(), apb::CODEC_RAW, offset, sealed.data());
+            expect(cipher.open(sealed.data(), sealed.size(), payload.size(), apb::CODEC_RAW, offset, opened.data()) == payload.size()
+                   && memcmp(opened.data(), payload.data(), payload.size()) == 0, "Block changed by sealing");
+
+            expectRejected([&]() { cipher.open(sealed.data(), sealed.size(), payload.size(), apb::CODEC_RAW, offset + sealed.size(), opened.data()); },
+                           "Block opened at another offset");
+            expectRejected([&]() { cipher.open(sealed.data(), sealed.size(), payload.size(), apb::CODEC_LZ4, offset, opened.data()); },
+                           "Block opened with another codec");
+            expectRejected([&]() { cipher.open(sealed.data(), sealed.size(), payload.size() - 1, apb::CODEC_RAW, offset, opened.data()); },
+                           "Block opened with another raw size");
+            const std::uint64_t flips[] = {0, ContentCipher::nonceSize + 10, sealed.size() - 1};
+            for (std::uint64_t flip : flips) {
+                sealed[flip] ^= 1;
+                expectRejected([&]() { cipher.open(sealed.data(), sealed.size(), payload.size(), apb::CODEC_RAW, offset, opened.data()); },
+                               "Altered block opened, byte " + QString::number(flip));
+                sealed[flip] ^= 1;
+            }
+
+            apb::PBArchiveMetaData meta = plainMeta();
+            meta.mutable_encryption()->CopyFrom(record);
+            meta.mutable_encryption()->set_metatag(cipher.metaTag(meta));
+            expect(cipher.metaTagMatches(meta), "Tag of meta does not match");
+            QByteArray compact = MetaCodec::encode(meta);
+            apb::PBArchiveMetaData decoded;
+            MetaCodec::decode(compact.constData(), compact.size(), decoded);
+            expect(cipher.metaTagMatches(decoded), "Tag of meta does not match after the compact encoding");
+            decoded.mutable_pbdirentmetadata(2)->set_name("alpha.txy");
+            expect(!cipher.metaTagMatches(decoded), "Tag matches a renamed entry");
+            decoded.CopyFrom(meta);
+            decoded.mutable_pbdirentmetadata(1)->mutable_pbregfilemetadata()->mutable_blocks(0)->set_storedsize(999);
+            expect(!cipher.metaTagMatches(decoded), "Tag matches an altered block table");
+        }
+
+        QString tree = dir + "/tree";
+        makeTree(tree, 41);
+        writeFile(tree + "/twice.bin", randomBytes(2 * ContentCodec::defaultBlockSize, 42));
+        Archiver::PackOptions options;
+        options.cipher = Archiver::CipherChaCha20Poly1305;
+        options.io.encryptionKey = key;
+        Archiver::pack(tree, dir + "/sealed.pck", options);
+        expectRestored(dir + "/sealed.pck", tree, dir + "/out", options.io);
+        expectUnpackRejected(dir + "/sealed.pck", dir + "/out-without-key", Archiver::IoOptions(), "Unpacked without key");
+        Archiver::IoOptions wrongKey;
+        wrongKey.encryptionKey = testKey('b');
+        expectUnpackRejected(dir + "/sealed.pck", dir + "/out-wrong-key", wrongKey, "Unpacked with a wrong key");
+
+        std::uint64_t metaSize = 0;
+        std::uint64_t contentSize = 0;
+        {
+            QFile archive(dir + "/sealed.pck");
+            expect(archive.open(QIODevice::ReadOnly), "Cannot open sealed.pck");
+            readSizes(archive, metaSize, contentSize);
+            ArchiveIndex::Reader index(archive, metaSize, contentSize);
+            apb::PBEncryption record;
+            expect(index.encryption(&record) && ContentCipher::keyMatches(record, key), "Index lost the encryption record");
+        }
+
+        QFile::copy(dir + "/sealed.pck", dir + "/swapped.pck");
+        swapBlocks(dir + "/swapped.pck", "tree/twice.bin");
+        expectUnpackRejected(dir + "/swapped.pck", dir + "/out-swapped", options.io, "Unpacked swapped blocks");
+        Archiver::VerifyOptions verifyOptions;
+        verifyOptions.encryptionKey = key;
+        expect(!Archiver::verify(dir + "/swapped.pck", verifyOptions).badEntries.empty(), "Verify missed swapped blocks");
+
+        QFile::copy(dir + "/sealed.pck", dir + "/renamed.pck");
+        alterArchive(dir + "/renamed.pck", "alpha.txt", ArchiverUtils::contentOffsetInArchive + contentSize);
+        expectUnpackRejected(dir + "/renamed.pck", dir + "/out-renamed", options.io, "Unpacked altered meta");
+    }
+
+    // Final states the callback of a job reported, the last one is reported once the job has ended.
+    class StateLog {
+    public:
+        Archiver::ProgressCallback callback() {
+            return [this](const Archiver::Progress & progress) {
+                std::lock_guard<std::mutex> lock(mutex);
+                states.push_back(progress.state);
+            };
+        }
+        Archiver::Progress::State last() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return states.empty() ? Archiver::Progress::Running : states.back();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<Archiver::Progress::State> states;
+    };
+
+    // Cancels job once it has done some content and waits for its end.
+    void cancelJob(Archiver::Job & job, StateLog & log, const QString & what) {
+        while (!job.isFinished() && job.progress().bytesDone == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        job.cancel();
+        expectRejected([&]() { job.wait(); }, what + " ended without an error");
+        expect(job.progress().state == Archiver::Progress::Cancelled, what + " is not cancelled");
+        expect(log.last() == Archiver::Progress::Cancelled, what + " reported no cancel");
+    }
+
+    void finishJob(Archiver::Job & job, StateLog & log, const QString & what) {
+        job.wait();
+        Archiver::Progress progress = job.progress();
+        expect(progress.state == Archiver::Progress::Finished && log.last() == Archiver::Progress::Finished,
+               what + " did not finish");
+        expect(progress.entriesDone == progress.entriesTotal && progress.bytesDone == progress.bytesTotal,
+               what + " finished with work left");
+    }
+
+    void checkJobs(const QString & dir) {
+        QString tree = makeDir(dir + "/tree");
+        for (unsigned i = 0; i < 16; ++i)
+            writeFile(tree + "/file" + QString::number(i), i % 2 ? randomBytes(512 << 10, 45 + i) : textBytes(512 << 10, 45 + i));
+
+        Archiver::IoLimiter limiter(4 << 20);
+        Archiver::PackOptions options;
+        options.io.limiter = &limiter;
+        {
+            StateLog log;
+            std::unique_ptr<Archiver::Job> job = Archiver::startPack(tree, dir + "/cancelled.pck", options, log.callback(), 10);
+            cancelJob(*job, log, "Pack");
+        }
+        {
+            StateLog log;
+            std::unique_ptr<Archiver::Job> job = Archiver::startPack(tree, dir + "/tree.pck", Archiver::PackOptions(),
+                                                                     log.callback(), 10);
+            finishJob(*job, log, "Pack");
+        }
+        {
+            StateLog log;
+            makeDir(dir + "/out-cancelled");
+            std::unique_ptr<Archiver::Job> job = Archiver::startUnpack(dir + "/tree.pck", dir + "/out-cancelled/", options.io,
+                                                                       log.callback(), 10);
+            cancelJob(*job, log, "Unpack");
+        }
+        {
+            StateLog log;
+            makeDir(dir + "/out");
+            std::unique_ptr<Archiver::Job> job = Archiver::startUnpack(dir + "/tree.pck", dir + "/out/", Archiver::IoOptions(),
+                                                                       log.callback(), 10);
+            finishJob(*job, log, "Unpack");
+            expect(sameTrees(tree, dir + "/out/tree"), "Unpack job restored another tree");
+        }
+        {
+            // an error is not a cancel
+            StateLog log;
+            std::unique_ptr<Archiver::Job> job = Archiver::startPack(dir + "/missing", dir + "/missing.pck",
+                                                                     Archiver::PackOptions(), log.callback(), 10);
+            expectRejected([&]() { job->wait(); }, "Pack of a missing source succeeded");
+            Archiver::Progress progress = job->progress();
+            expect(progress.state == Archiver::Progress::Failed && !progress.error.isEmpty()
+                   && log.last() == Archiver::Progress::Failed, "Failed pack is not reported with its error");
+        }
+    }
+
+    void checkRestoreModes(const QString & dir) {
+        QString tree = makeDir(dir + "/tree");
+        std::string shared = randomBytes(ContentCodec::defaultBlockSize + 100, 75);
+        struct {
+            const char* name;
+            std::string content;
+            mode_t mode;
+        } files[] = {
+            {"group.bin", shared, 0664},
+            {"owner.bin", randomBytes(70000, 76), 0700},
+            // a duplicate of group.bin, restored by copy
+            {"other.bin", shared, 0604},
+            // inlined
+            {"tiny.txt", "tiny\n", 0640},
+            {"open.txt", textBytes(20000, 77), 0666}
+        };
+        for (auto & file : files) {
+            writeFile(tree + "/" + file.name, file.content);
+            expect(chmod((tree + "/" + file.name).toLocal8Bit().constData(), file.mode) == 0, "Cannot change mode of " + QString(file.name));
+        }
+        Archiver::pack(tree, dir + "/tree.pck");
+        expectRestored(dir + "/tree.pck", tree, dir + "/out");
+
+        // restoring over existing files replaces their content and mode
+        for (auto & file : files) {
+            QString path = dir + "/out/tree/" + file.name;
+            writeFile(path, "stale content of other size");
+            expect(chmod(path.toLocal8Bit().constData(), 0600) == 0, "Cannot change mode of " + path);
+        }
+        Archiver::unpack(dir + "/tree.pck", dir + "/out/");
+        expect(sameTrees(tree, dir + "/out/tree"), "Restore over existing files differs");
+    }
+
+    void checkDurability(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 70);
+        Archiver::pack(tree, dir + "/tree.pck");
+
+        Archiver::IoOptions io;
+        io.durability = Archiver::DurabilitySyncFs;
+        expectRestored(dir + "/tree.pck", tree, dir + "/out-syncfs", io);
+        io.durability = Archiver::DurabilitySyncFiles;
+        io.syncThreads = 1;
+        expectRestored(dir + "/tree.pck", tree, dir + "/out-fsync", io);
+        io.syncThreads = 4;
+        expectRestored(dir + "/tree.pck", tree, dir + "/out-fsync-parallel", io);
+    }
+
+    void checkUnpackBatch(const QString & dir) {
+        QString tree = dir + "/tree";
+        makeTree(tree, 71);
+        Archiver::pack(tree, dir + "/tree.pck");
+        makeTree(dir + "/small", 72);
+        QFile::remove(dir + "/small/alpha.txt");
+        QFile::remove(dir + "/small/random.bin");
+        Archiver::pack(dir + "/small", dir + "/small.pck");
+
+        // jobs of a batch share the sync threads, the second job restoring into one target is rejected
+        std::vector<Archiver::UnpackBatchJob> jobs;
+        jobs.push_back(Archiver::UnpackBatchJob(dir + "/tree.pck", makeDir(dir + "/batch-1") + "/"));
+        jobs.push_back(Archiver::UnpackBatchJob(dir + "/tree.pck", makeDir(dir + "/batch-2") + "/"));
+        jobs.push_back(Archiver::UnpackBatchJob(dir + "/tree.pck", dir + "/batch-1/"));
+        jobs.push_back(Archiver::UnpackBatchJob(dir + "/small.pck", makeDir(dir + "/batch-3") + "/"));
+        jobs.push_back(Archiver::UnpackBatchJob(dir + "/missing.pck", makeDir(dir + "/batch-4") + "/"));
+        Archiver::UnpackBatchOptions options;
+        options.concurrentJobs = 2;
+        options.io.durability = Archiver::DurabilitySyncFiles;
+        options.io.syncThreads = 4;
+        std::vector<Archiver::UnpackBatchJobResult> results = Archiver::unpackBatch(jobs, options);
+        expect(results.size() == jobs.size(), "Batch returned " + QString::number(results.size()) + " results");
+        expect(results[0].error.isEmpty() && results[1].error.isEmpty() && results[3].error.isEmpty(), "Batch job failed");
+        expect(!results[2].error.isEmpty(), "Second job of one target was run");
+        expect(!results[4].error.isEmpty(), "Job of a missing archive succeeded");
+        expect(sameTrees(tree, dir + "/batch-1/tree") && sameTrees(tree, dir + "/batch-2/tree")
+               && sameTrees(dir + "/small", dir + "/batch-3/small"), "Batch restored other trees");
+    }
+
+    struct Check {
+        const char* name;
+        void (*run)(const QString & dir);
+    };
+
+    const Check checks[] = {
+        {"block-codec", checkBlockCodec},
+        {"header", checkHeader},
+        {"crc32c", checkCrc32c},
+        {"verify", checkVerify},
+        {"dedup", checkDedup},
+        {"index", checkIndex},
+        {"meta-codec", checkMetaCodec},
+        {"extract", checkExtract},
+        {"checkpoint", checkCheckpoint},
+        {"pack-batch", checkPackBatch},
+        {"query", checkQuery},
+        {"compare", checkCompare},
+        {"delta", checkDelta},
+        {"cipher", checkCipher},
+        {"jobs", checkJobs},
+        {"restore-modes", checkRestoreModes},
+        {"durability", checkDurability},
+        {"unpack-batch", checkUnpackBatch}
+    };
+}
+
+int runBehaviourChecks(const QString & workDir) {
+    QString root = QDir(workDir).absolutePath();
+    int failed = 0;
+    for (const Check & check : checks) {
+        std::cout << check.name << ": " << std::flush;
+        try {
+            check.run(makeDir(root + "/" + check.name));
+            std::cout << "Ok!" << std::endl;
+        } catch (Archiver::ArchiverException & e) {
+            std::cout << "Bad archiver... " << e.whatQMsg().toStdString() << std::endl;
+            ++failed;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,14 @@
+#ifndef BEHAVIOUR_CHECKS_H
+#define BEHAVIOUR_CHECKS_H
+
+#include <QString>
+
+// Round trips and tamper cases of the parts of the archiver.
+// Every check works in its own directory under workDir and prints "<name>: Ok!" or the reason it failed.
+// Returns the number of failed checks.
+int runBehaviourChecks(const QString & workDir);
+
+// True if both trees have the same entries, attributes and content (main.cpp).
+bool sameTrees(QString dir1, QString dir2);
+
+#endif // BEHAVIOUR_CHECKS_H
@@ -11,16 +11,25 @@
 #include "struct_serialization.pb.h"
 #include "archiver_utils.h"
 #include <fs_tree.h>
+#include "behaviour_checks.h"
 
 void checkArchiver(QString dir1, QString dir2);
 
 int main(int argc, char *argv[]) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
+    if (argc == 3 && !strcmp("-t", argv[1])) {
+        qDebug() << QString("START BEHAVIOUR CHECKS: ") + argv[2] << "\n";
+        int failed = runBehaviourChecks(argv[2]);
+        google::protobuf::ShutdownProtobufLibrary();
+        return failed == 0 ? 0 : 1;
+    }
+
     if (argc != 4) {
         std::cerr << "Incorrect number of arguments in cmd!\nPlease print one of:\n\"-p sourcePath outputFileArchive\" to pack sourcePath to outputFileArchive" << std::endl <<
                      "\"-u inputFileArchive outputPath\" to unpack inputFileArchive to outputPath" << std::endl <<
-                     "\"-c sourcePath outputPath\" to check archiver's work for sourcePath and outputPath " << std::endl;
+                     "\"-c sourcePath outputPath\" to check archiver's work for sourcePath and outputPath " << std::endl <<
+                     "\"-t workPath\" to run the behaviour checks in workPath" << std::endl;
         return -1;
     }
 
@@ -39,7 +48,8 @@ int main(int argc, char *argv[]) {
                 } else {
                     std::cerr << "Unknown first argument in cmd!\nPlease print one of:\n\"-p sourcePath outputFileArchive\" to pack sourcePath to outputFileArchive" << std::endl <<
                                  "\"-u inputFileArchive outputPath\" to unpack inputFileArchive to outputPath" << std::endl <<
-                                 "\"-c sourcePath outputPath\" to check archiver's work for sourcePath and outputPath " << std::endl;
+                                 "\"-c sourcePath outputPath\" to check archiver's work for sourcePath and outputPath " << std::endl <<
+                                 "\"-t workPath\" to run the behaviour checks in workPath" << std::endl;
                     return -1;
                 }
     } catch (Archiver::ArchiverException e) {
@@ -82,6 +92,9 @@ bool checkInode(inode* first, inode* second, const QString & dir1, const QString
             qCritical() << dir1 + name1 << ": different size" << '\n';
             return false;
         }
+        // empty files cannot be mapped
+        if (first->attrs.st_size == 0)
+            return true;
 
         QFile file1(dir1 + name1);
         file1.open(QIODevice::ReadOnly);
@@ -120,14 +133,20 @@ bool checkInode(inode* first, inode* second, const QString & dir1, const QString
     return true;
 }
 
-void checkArchiver(QString dir1, QString dir2) {
+bool sameTrees(QString dir1, QString dir2) {
     fs_tree* tree1 = fs_tree_collect(dir1.toStdString().c_str());
     fs_tree* tree2 = fs_tree_collect(dir2.toStdString().c_str());
+    bool same = tree1 && tree2 && checkInode(tree1->head, tree2->head, ArchiverUtils::getDirAbsPath(dir1),
+                                             ArchiverUtils::getDirAbsPath(dir2));
+    if (tree1)
+        fs_tree_destroy(tree1);
+    if (tree2)
+        fs_tree_destroy(tree2);
+    return same;
+}
 
-    dir1 = ArchiverUtils::getDirAbsPath(dir1);
-    dir2 = ArchiverUtils::getDirAbsPath(dir2);
-
-    if (checkInode(tree1->head, tree2->head, dir1, dir2))
+void checkArchiver(QString dir1, QString dir2) {
+    if (sameTrees(dir1, dir2))
         std::cout << "Ok!" << std::endl;
     else
         std::cout << "Bad archiver..." << std::endl;
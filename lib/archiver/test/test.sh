@@ -22,3 +22,4 @@ cd ./bin
 ./test_archiver -u ../tests/archives/4.pck ../tests/unpacked/
 ./test_archiver -c ../tests/4 ../tests/unpacked/4 
 
+./test_archiver -t ../tests/checks
@@ -13,7 +13,10 @@ CONFIG += c++11
 
 TEMPLATE = app
 
-SOURCES += src/main.cpp
+SOURCES += src/main.cpp \
+    src/behaviour_checks.cpp
+
+HEADERS += src/behaviour_checks.h
 
 INCLUDEPATH += ../src
 
@@ -87,6 +87,9 @@ int main(int argc, char* argv[]) {
 
 	tree1 = fs_tree_collect(argv[1]);
 	tree2 = fs_tree_collect(argv[2]);
+	if(!tree1 || !tree2) {
+		exit(1);
+	}
 	if(strlen(tree1->head->name) !=
 			strlen(tree2->head->name)) {
 		fprintf(stderr, "Err:lengths of the given directories should be equal :3");
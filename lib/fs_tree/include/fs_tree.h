@@ -34,8 +34,12 @@ struct fs_tree {
 };
 
 typedef int (*fs_tree_inode_visitor)(struct inode* inode, void* data);
+typedef int (*fs_tree_cancel_check)(void* data);
 
+// Returns NULL if any entry under path cannot be read, with errno set and the error printed to stderr.
 struct fs_tree* fs_tree_collect(const char* path);
+// Same, but calls cancelled(data) before every entry and gives up with errno ECANCELED once it returns nonzero.
+struct fs_tree* fs_tree_collect_cancellable(const char* path, fs_tree_cancel_check cancelled, void* data);
 void fs_tree_destroy(struct fs_tree* tree);
 void fs_tree_print(const struct fs_tree *tree);
 void fs_tree_bfs(struct fs_tree* fs_tree, fs_tree_inode_visitor visitor, void* data);
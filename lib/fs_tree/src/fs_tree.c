@@ -1,41 +1,74 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <inodes.h>
 #include <fs_tree.h>
 
 
 struct fs_tree* fs_tree_collect(const char* path) {
-	struct fs_tree* tree = (struct fs_tree*)malloc(sizeof(struct fs_tree));
+	return fs_tree_collect_cancellable(path, NULL, NULL);
+}
+
+struct fs_tree* fs_tree_collect_cancellable(const char* path, fs_tree_cancel_check cancelled, void* data) {
+	struct cancel_check cancel = {cancelled, data};
+	struct fs_tree* tree;
 	struct regular_file_inode* reg_file_tmp;
 	struct dir_inode* dir_tmp; //tmp_to_get_tree_head = (struct dir_inode*)malloc(sizeof(struct dir_inode));
 	struct stat buf = {};
+	int error;
 
 	if(stat(path, &buf) < 0) {
-		perror("Error: failed to get file statistics\n");
-		exit(1);
+		report_error("failed to get file statistics of", path);
+		return NULL;
+	}
+	if(!S_ISDIR(buf.st_mode) && !S_ISREG(buf.st_mode)) {
+		errno = EINVAL;
+		report_error("neither a directory nor a regular file", path);
+		return NULL;
+	}
+
+	tree = (struct fs_tree*)malloc(sizeof(struct fs_tree));
+	if(!tree) {
+		perror("Error: failed to allocate memory");
+		return NULL;
 	}
 
 	if(S_ISDIR(buf.st_mode)) {
 		dir_tmp = (struct dir_inode*)malloc(sizeof(struct dir_inode));
  		if(!dir_tmp) {
 			perror("Error: failed to allocate memory");
-			exit(1);
+			free(tree);
+			return NULL;
 		}
 
-		init_dir_inode(dir_tmp, path, NULL);
+		if(init_dir_inode(dir_tmp, path, NULL) < 0) {
+			free(dir_tmp);
+			free(tree);
+			return NULL;
+		}
 		tree->head = &(dir_tmp->inode);
-		build_file_tree((struct dir_inode*)(tree->head));
+		if(build_file_tree((struct dir_inode*)(tree->head), &cancel) < 0) {
+			error = errno;
+			fs_tree_destroy(tree);
+			errno = error;
+			return NULL;
+		}
 	}
-	else if(S_ISREG(buf.st_mode)) {
+	else {
 		reg_file_tmp = (struct regular_file_inode*)malloc(sizeof(struct regular_file_inode));
 		if(!reg_file_tmp) {
-			perror("Error: failed to allocate memory\n");
-			exit(1);
+			perror("Error: failed to allocate memory");
+			free(tree);
+			return NULL;
 		}
 
-		init_reg_file_inode(reg_file_tmp, path, NULL);
+		if(init_reg_file_inode(reg_file_tmp, path, NULL) < 0) {
+			free(reg_file_tmp);
+			free(tree);
+			return NULL;
+		}
 		tree->head = &(reg_file_tmp->inode);
 	}
 
@@ -7,6 +7,7 @@
 #include <fs_tree.h>
 #include <inodes.h>
 #include <string.h>
+#include <errno.h>
 
 #define ANSI_COLOR_RED "\x1b[31m"
 #define ANSI_COLOR_GREEN "\x1b[32m"
@@ -16,12 +17,19 @@
 #define ANSI_COLOR_CYAN "\x1b[36m"
 #define ANSI_COLOR_RESET "\x1b[0m" 
 
-void open_dir(char* name, DIR** dest) {
+void report_error(const char* message, const char* path) {
+	int error = errno;
+	fprintf(stderr, "Error: %s %s: %s\n", message, path, strerror(error));
+	errno = error;
+}
+
+int open_dir(char* name, DIR** dest) {
 	(*dest) = opendir(name);
 	if(!(*dest)) {
-		perror("Error: couldn't open the directory");
-		exit(1);
+		report_error("couldn't open the directory", name);
+		return -1;
 	}
+	return 0;
 }
 
 int get_length_of_name(struct inode* source) {
@@ -49,97 +57,121 @@ void get_name(char* res, struct inode* source) {
 	return;
 }
 
-void init_inode(struct inode* dest, enum inode_type type, const char* name, struct inode* parent) {
+int init_inode(struct inode* dest, enum inode_type type, const char* name, struct inode* parent) {
 	size_t len = strlen(name) + 1;//+1 for terminating null-byte
 	dest->type = type;
 
 	dest->name = (char*)malloc(len * sizeof(char));
 	if(!dest->name) {
 		perror("Error: unable to allocate memory");
-		exit(1);
+		return -1;
 	}
 	strcpy(dest->name, name);
 	
 	dest->parent = parent;
+	return 0;
 }
 
 void deinit_inode(struct inode* dest) {
 	free(dest->name);
 }
 
-void init_reg_file_inode(struct regular_file_inode* dest, const char* source_name, struct inode* parent_dir) {
-	char* tmp_name;
-
-	init_inode(&(dest->inode), INODE_REG_FILE, source_name, parent_dir);
-
-	tmp_name = (char*)malloc(get_length_of_name(&(dest->inode)) * sizeof(char));
-	get_name(tmp_name, &(dest->inode));
-	
+// on failure the name is released, the inode itself belongs to the caller
+int stat_inode(struct inode* dest) {
+	char* tmp_name = (char*)malloc(get_length_of_name(dest) * sizeof(char));
+	if(!tmp_name) {
+		perror("Error: unable to allocate memory");
+		deinit_inode(dest);
+		return -1;
+	}
+	get_name(tmp_name, dest);
 	
-	if(stat(tmp_name, &(dest->inode.attrs)) < 0) {
-		perror("Error: failed to get regular file statistics");
-		exit(1);
+	if(stat(tmp_name, &(dest->attrs)) < 0) {
+		report_error("failed to get file statistics of", tmp_name);
+		free(tmp_name);
+		deinit_inode(dest);
+		return -1;
 	}
-	dest->inode.user_data = NULL;
+	dest->user_data = NULL;
 	
 	free(tmp_name);
+	return 0;
 }
 
-void init_dir_inode(struct dir_inode* dest, const char* dir_name, struct inode* parent_dir) {
-	char* tmp_name;
-
-	init_inode(&(dest->inode), INODE_DIR, dir_name, parent_dir);
+int init_reg_file_inode(struct regular_file_inode* dest, const char* source_name, struct inode* parent_dir) {
+	if(init_inode(&(dest->inode), INODE_REG_FILE, source_name, parent_dir) < 0) {
+		return -1;
+	}
+	return stat_inode(&(dest->inode));
+}
 
-	tmp_name = (char*)malloc(get_length_of_name(&(dest->inode)) * sizeof(char));
-	get_name(tmp_name, &(dest->inode));
-	
-	
-	if(stat(tmp_name, &(dest->inode.attrs)) < 0) {
-		perror("Error: failed to get regular file statistics");
-		exit(1);
+int init_dir_inode(struct dir_inode* dest, const char* dir_name, struct inode* parent_dir) {
+	if(init_inode(&(dest->inode), INODE_DIR, dir_name, parent_dir) < 0) {
+		return -1;
 	}
-	dest->inode.user_data = NULL;
 	dest->num_children = 0;
 	dest->children = NULL;
-	free(tmp_name);
+	return stat_inode(&(dest->inode));
 }
 
-void one_step_bfs_dir(DIR* dir, void (*f)(struct dirent*, void*), void* data) {
-	struct dirent* dir_content = readdir(dir);	
+int one_step_bfs_dir(DIR* dir, int (*f)(struct dirent*, void*), void* data) {
+	struct dirent* dir_content;
+	errno = 0;
+	dir_content = readdir(dir);
 	while(dir_content != NULL) {
-		f(dir_content, data);
+		if(f(dir_content, data) < 0) {
+			return -1;
+		}
+		errno = 0;
 		dir_content = readdir(dir);
 	}
+	if(errno) {
+		perror("Error: failed to read the directory");
+		return -1;
+	}
+	return 0;
 }
 
-void implement_number_of_files_in_the_directory(struct dirent* dir_content, void* data) {
+int implement_number_of_files_in_the_directory(struct dirent* dir_content, void* data) {
 	size_t* cnt = (size_t*)data;
 	++(*cnt);
+	return 0;
 }
 
-size_t count_files_in_the_directory(DIR* dir) {
-	size_t res = 0;
-	one_step_bfs_dir(dir, implement_number_of_files_in_the_directory, (void*)&res);
-	return res;
+int count_files_in_the_directory(DIR* dir, size_t* count) {
+	*count = 0;
+	return one_step_bfs_dir(dir, implement_number_of_files_in_the_directory, (void*)count);
 }
 
-void process_dir_child(struct dirent* dir_content, void* data) {
+// A child that fails is freed here, the ones added before it are freed with the parent.
+int process_dir_child(struct dirent* dir_content, void* data) {
 	struct regular_file_inode* tmp_reg_file;
 	struct dir_inode* tmp_dir;
 	
-	struct dir_inode* parent = (struct dir_inode*)data;
+	struct dir_parent* parent = (struct dir_parent*)data;
 	
+	if(parent->cancel->cancelled && parent->cancel->cancelled(parent->cancel->data)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	if(parent->dir->num_children == parent->capacity) {
+		// the entries added after the directory was counted are left out as if they came later
+		return 0;
+	}
 	switch(dir_content->d_type) {
 		case DT_REG:
 
             tmp_reg_file = (struct regular_file_inode*)malloc(sizeof(struct regular_file_inode));
 			if(!tmp_reg_file) {
 				perror("Error: failed to allocate memory");
-				exit(1);
+				return -1;
 			}
 
-			init_reg_file_inode(tmp_reg_file, dir_content->d_name, &(parent->inode));			
-			parent->children[parent->num_children++] = &(tmp_reg_file->inode);
+			if(init_reg_file_inode(tmp_reg_file, dir_content->d_name, &(parent->dir->inode)) < 0) {
+				free(tmp_reg_file);
+				return -1;
+			}
+			parent->dir->children[parent->dir->num_children++] = &(tmp_reg_file->inode);
 			break;
 		case DT_DIR:
 			if(strcmp(dir_content->d_name, ".") != 0 && strcmp(dir_content->d_name, "..") != 0) {
@@ -147,46 +179,65 @@ void process_dir_child(struct dirent* dir_content, void* data) {
 				tmp_dir = (struct dir_inode*)malloc(sizeof(struct dir_inode));
 				if(!tmp_dir) {
 					perror("Error: failed to allocate memory");
-					exit(1);
+					return -1;
 				}
 				
-				init_dir_inode(tmp_dir, dir_content->d_name, &(parent->inode));
-				parent->children[parent->num_children++] = &(tmp_dir->inode);
-				build_file_tree(tmp_dir);
+				if(init_dir_inode(tmp_dir, dir_content->d_name, &(parent->dir->inode)) < 0) {
+					free(tmp_dir);
+					return -1;
+				}
+				parent->dir->children[parent->dir->num_children++] = &(tmp_dir->inode);
+				return build_file_tree(tmp_dir, parent->cancel);
 			}
 			break;
 		default:
 			break;
 	}
+	return 0;
 }
 
-void process_dir(DIR* dir, struct dir_inode* parent) {
-	one_step_bfs_dir(dir, process_dir_child, (void*)parent);
+int process_dir(DIR* dir, struct dir_parent* parent) {
+	return one_step_bfs_dir(dir, process_dir_child, (void*)parent);
 }
 
-void init_parent(DIR* dir, struct dir_inode* parent) {
-	size_t size = count_files_in_the_directory(dir);
+int init_parent(DIR* dir, struct dir_inode* parent, const struct cancel_check* cancel) {
+	struct dir_parent dir_parent;
+	if(count_files_in_the_directory(dir, &(dir_parent.capacity)) < 0) {
+		return -1;
+	}
 	rewinddir(dir);
 	
-	parent->children = (struct inode**)malloc(size * sizeof(struct inode*));
-	process_dir(dir, parent);
+	parent->children = (struct inode**)malloc(dir_parent.capacity * sizeof(struct inode*));
+	if(!parent->children && dir_parent.capacity) {
+		perror("Error: failed to allocate memory");
+		return -1;
+	}
+	dir_parent.dir = parent;
+	dir_parent.cancel = cancel;
+	return process_dir(dir, &dir_parent);
 }
 
-void build_file_tree(struct dir_inode* parent) {
+int build_file_tree(struct dir_inode* parent, const struct cancel_check* cancel) {
 	char* tmp_name;
+	int result;
 
 	DIR* current_dir;//is the directory which parent describes
 	
 	tmp_name = (char*)malloc(get_length_of_name(&(parent->inode)) * sizeof(char));
+	if(!tmp_name) {
+		perror("Error: failed to allocate memory");
+		return -1;
+	}
 	get_name(tmp_name, &(parent->inode));
-	open_dir(tmp_name, &current_dir);
-	init_parent(current_dir, parent);
-
-	if(closedir(current_dir) < 0) {
-		perror("Error: problem while closing the directory\n");
-		exit(1);
+	if(open_dir(tmp_name, &current_dir) < 0) {
+		free(tmp_name);
+		return -1;
 	}
+	result = init_parent(current_dir, parent, cancel);
+
+	closedir(current_dir);
 	free(tmp_name);
+	return result;
 }
 
 void print_tree(struct inode* node, int space) {
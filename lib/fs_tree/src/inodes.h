@@ -10,18 +10,34 @@
 #include <fs_tree.h>
 
 
-void open_dir(char* name, DIR** dest);
+// asked before every entry whether the collection is to be given up, cancelled may be NULL
+struct cancel_check {
+	fs_tree_cancel_check cancelled;
+	void* data;
+};
+
+// a directory being filled, children has room for capacity entries
+struct dir_parent {
+	struct dir_inode* dir;
+	size_t capacity;
+	const struct cancel_check* cancel;
+};
+
+// Functions returning int give 0 on success, -1 on failure with errno set and the error printed.
+void report_error(const char* message, const char* path);
+int open_dir(char* name, DIR** dest);
 int get_length_of_name(struct inode* source);
 void get_name(char* res, struct inode* source);
-void init_reg_file_inode(struct regular_file_inode* dest, const char* source_name, struct inode* parent_dir);
-void init_dir_inode(struct dir_inode* dest, const char* dir_name, struct inode* parent_dir);
-void one_step_bfs_dir(DIR* dir, void (*f)(struct dirent*, void*), void* data);
-void implement_number_of_files_in_the_directory(struct dirent* dir_content, void* data);
-size_t count_files_in_the_directory(DIR* dir);
-void process_dir_child(struct dirent* dir_content, void* data);
-void process_dir(DIR* dir, struct dir_inode* parent);
-void init_parent(DIR* , struct dir_inode* parent);
-void build_file_tree(struct dir_inode* parent);
+int stat_inode(struct inode* dest);
+int init_reg_file_inode(struct regular_file_inode* dest, const char* source_name, struct inode* parent_dir);
+int init_dir_inode(struct dir_inode* dest, const char* dir_name, struct inode* parent_dir);
+int one_step_bfs_dir(DIR* dir, int (*f)(struct dirent*, void*), void* data);
+int implement_number_of_files_in_the_directory(struct dirent* dir_content, void* data);
+int count_files_in_the_directory(DIR* dir, size_t* count);
+int process_dir_child(struct dirent* dir_content, void* data);
+int process_dir(DIR* dir, struct dir_parent* parent);
+int init_parent(DIR* , struct dir_inode* parent, const struct cancel_check* cancel);
+int build_file_tree(struct dir_inode* parent, const struct cancel_check* cancel);
 void print_tree(struct inode* node, int space);
 
 
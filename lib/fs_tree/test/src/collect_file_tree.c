@@ -11,6 +11,9 @@ int main(int argc, char* argv[]) {
 	}
 
 	tree = fs_tree_collect(argv[1]);
+	if(!tree) {
+		exit(1);
+	}
 	fs_tree_print(tree);
 	fs_tree_destroy(tree);
 	return 0;
@@ -35,6 +35,9 @@ int main(int argc, char* argv[]) {
 	}
 
 	tree = fs_tree_collect(argv[1]);
+	if(!tree) {
+		exit(1);
+	}
 	fs_tree_dfs(tree, dfs_visitor, &a);
 	a = 0;
 	fs_tree_bfs(tree, bfs_visitor, &a);
@@ -28,6 +28,8 @@ ClientSession::ClientSession(NetworkStream* networkStream, ConsoleStream* consol
     connect(networkStream,  &NetworkStream::newNetMessage, this, &ClientSession::onNetworkInput);
     connect(this, &ClientSession::sigWriteToNetwork, networkStream, &NetworkStream::sendNetMessage);
     connect(networkStream, &NetworkStream::connected, this, &ClientSession::onStart);
+    qRegisterMetaType<Archiver::Progress>("Archiver::Progress");
+    connect(this, &ClientSession::sigBackupProgress, this, &ClientSession::onBackupProgress, Qt::QueuedConnection);
 }
 
 void ClientSession::onConsoleInput(const std::string& message) {
@@ -45,6 +47,18 @@ void ClientSession::onConsoleInput(const std::string& message) {
         return;
     }
 
+    if (mClientState == PACKING_BACKUP && message == "cancel") {
+        backupJob->cancel();
+        return;
+    }
+
+    if (mClientState == PACKING_BACKUP && message == "exit") {
+        // the pack thread would go on using protobuf while exit tears it down,
+        // resetting the job cancels it and waits for the thread
+        backupJob.reset();
+        exit(0);
+    }
+
     if (mClientState != WAIT_USER_INPUT) {
         emit sigWriteToConsole("Busy. Try later.");
         return;
@@ -57,7 +71,8 @@ void ClientSession::onConsoleInput(const std::string& message) {
         emit sigWriteToConsole("Commands:\n"
                                "ls [backupId] -- list all backups shortly or all info about one backup.\n"
                                "restore backupId path -- download backup by backupId and restore it in path.\n"
-                               "backup path -- make backup.");
+                               "backup path -- make backup.\n"
+                               "cancel -- stop packing of the backup being made.");
 
     }
 
@@ -213,17 +228,52 @@ void ClientSession::makeRestoreRequest(const std::string& command) {
 }
 
 void ClientSession::makeBackup(const std::string& command) {
+    backupPath = command;
+    mClientState = PACKING_BACKUP;
+    backupJob = Archiver::startPack(command.c_str(), "curpack.pck", Archiver::PackOptions(),
+                                    [this](const Archiver::Progress & progress) { emit sigBackupProgress(progress); },
+                                    1000);
+}
+
+void ClientSession::onBackupProgress(const Archiver::Progress & progress) {
+    if (mClientState != PACKING_BACKUP)
+        return;
+    const double megabyte = 1 << 20;
+    switch (progress.state) {
+    case Archiver::Progress::Running:
+        emit sigWriteToConsole("Packing: " + std::to_string(progress.entriesDone) + "/" + std::to_string(progress.entriesTotal)
+                               + " files, " + std::to_string((int)(progress.bytesDone / megabyte)) + "/"
+                               + std::to_string((int)(progress.bytesTotal / megabyte)) + " MB, "
+                               + std::to_string((int)(progress.bytesPerSecond / megabyte)) + " MB/s, "
+                               + std::to_string(progress.etaNs / 1000000000) + " s left.");
+        return;
+    case Archiver::Progress::Finished:
+        backupJob.reset();
+        sendBackupRequest();
+        return;
+    case Archiver::Progress::Cancelled:
+        emit sigWriteToConsole("Backup was cancelled.");
+        break;
+    case Archiver::Progress::Failed:
+        emit sigWriteToConsole("Backup wasn't packed: " + progress.error.toStdString());
+        break;
+    }
+    backupJob.reset();
+    mClientState = WAIT_USER_INPUT;
+}
+
+void ClientSession::sendBackupRequest() {
     networkUtils::protobufStructs::ClientBackupRequest backupRequest;
-    Archiver::pack(command.c_str(), "curpack.pck");
     QFile archive("curpack.pck");
     archive.open(QIODevice::ReadOnly);
     QByteArray archiveByte = archive.readAll();
     backupRequest.set_archive(archiveByte.data(), archiveByte.size());
-    backupRequest.set_path(command);
+    backupRequest.set_path(backupPath);
 
     std::string serializatedBackupRequest;
     if (!backupRequest.SerializeToString(&serializatedBackupRequest)) {
         std::cerr << "Error with serialization backup request cmd." << std::endl;
+        mClientState = WAIT_USER_INPUT;
         return;
     }
     sendSerializatedMessage(serializatedBackupRequest, utils::backup, backupRequest.ByteSize());
@@ -403,13 +453,17 @@ void ClientSession::procServerError(const char *buffer, uint64_t bufferSize) {
     networkUtils::protobufStructs::ServerError serverError;
     serverError.ParseFromArray(buffer, bufferSize);
     emit sigWriteToConsole("Server error: " + serverError.errormessage());
-    mClientState = WAIT_USER_INPUT;
+    // the backup being packed reports its own end
+    if (mClientState != PACKING_BACKUP)
+        mClientState = WAIT_USER_INPUT;
 }
 
 void ClientSession::procServerExit(const char *buffer, uint64_t bufferSize) {
     networkUtils::protobufStructs::ServerError serverError;
     serverError.ParseFromArray(buffer, bufferSize);
     emit sigWriteToConsole("Server error: " + serverError.errormessage() + "\nState is aborted.");
+    // nothing packed can be sent any more
+    backupJob.reset();
     mClientState = ABORTED;
 }
 
@@ -2,6 +2,8 @@
 #define CLIENTLOGIC_H
 
 #include <QObject>
+#include <archiver.h>
+#include <memory>
 #include "protocol.h"
 #include "networkMsgStructs.pb.h"
 #include <networkstream.h>
@@ -12,6 +14,8 @@ class ClientSession : public QObject {
 public:
     explicit ClientSession(NetworkStream* networkStream, ConsoleStream* consoleStream, QObject *parent = 0);
     ~ClientSession() {
+        // a running pack still uses protobuf
+        backupJob.reset();
         // TODO move protobuf lib deinitialization to the end of main
         google::protobuf::ShutdownProtobufLibrary();
     }
@@ -19,6 +23,8 @@ public:
 signals:
     void sigWriteToConsole(const std::string& message);
     void sigWriteToNetwork(const QByteArray & message);
+    // emitted from the thread of the backup job
+    void sigBackupProgress(const Archiver::Progress & progress);
 
 private:
     enum ClientState {
@@ -28,6 +34,7 @@ private:
         WAIT_USER_INPUT,
         WAIT_LS_RESULT,
         WAIT_RESTORE_RESULT,
+        PACKING_BACKUP,
         WAIT_BACKUP_RESULT,
         ABORTED,
         FINISHED
@@ -40,6 +47,7 @@ private:
     void askLs(const std::string& command);
     void makeRestoreRequest(const std::string& command);
     void makeBackup(const std::string& command);
+    void sendBackupRequest();
     void sendLsFromClient(networkUtils::protobufStructs::LsClientRequest ls);
     void sendRestoreResult(bool restoreResult);
     void sendSerializatedMessage(const std::string& binaryMessage, utils::commandType cmdType, int messageSize);
@@ -57,12 +65,16 @@ private:
 
 
     std::string restorePath;
+    std::string backupPath;
+    // pack runs off the event loop, so network and console are served meanwhile
+    std::unique_ptr<Archiver::Job> backupJob;
 
 
 private slots:
     void onConsoleInput(const std::string& message);
     void onNetworkInput(const QByteArray & message);
     void onStart();
+    void onBackupProgress(const Archiver::Progress & progress);
 
 };
 